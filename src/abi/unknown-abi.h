@@ -23,12 +23,19 @@ namespace riscv {
 		abi_syscall_exit = 93,
 		abi_syscall_exit_group = 94,
 		abi_syscall_set_tid_address = 96,
+		abi_syscall_futex = 98,
+		abi_syscall_set_robust_list = 99,
 		abi_syscall_clock_gettime = 113,
+		abi_syscall_sched_yield = 124,
+		abi_syscall_rt_sigprocmask = 135,
 		abi_syscall_uname = 160,
 		abi_syscall_gettimeofday = 169,
+		abi_syscall_gettid = 178,
 		abi_syscall_brk = 214,
 		abi_syscall_munmap = 215,
+		abi_syscall_clone = 220,
 		abi_syscall_mmap = 222,
+		abi_syscall_mprotect = 226,
 		abi_syscall_madvise = 233,
 		abi_syscall_open = 1024,
 		abi_syscall_unlink = 1026,
@@ -36,6 +43,11 @@ namespace riscv {
 		abi_syscall_chown = 1039,
 	};
 
+	/* tid of the thread that loads the program, rv-jit numbers the threads it clones from 2 */
+	enum {
+		abi_main_tid = 1
+	};
+
 	enum {
 		abi_mmap_PROT_READ = 1,
 		abi_mmap_PROT_WRITE = 2,
@@ -316,7 +328,7 @@ namespace riscv {
 	template <typename P> void abi_sys_set_tid_address(P &proc)
 	{
 		proc.clear_child_tid = *(int*)(uintptr_t)proc.ireg[rv_ireg_a0].r.xu.val;
-		proc.ireg[rv_ireg_a0].r.xu.val = 1; /* tid is 1 for now */
+		proc.ireg[rv_ireg_a0].r.xu.val = abi_main_tid;
 	}
 
 	template <typename P> void abi_sys_clock_gettime(P &proc)
@@ -429,11 +441,50 @@ namespace riscv {
 			prot, flags, proc.ireg[rv_ireg_a4], proc.ireg[rv_ireg_a5]);
 	}
 
+	template <typename P> void abi_sys_mprotect(P &proc)
+	{
+		int prot = 0, abi_prot = proc.ireg[rv_ireg_a2];
+		prot  |= (abi_prot  & abi_mmap_PROT_READ)   ? PROT_READ   : 0;
+		prot  |= (abi_prot  & abi_mmap_PROT_WRITE)  ? PROT_WRITE  : 0;
+		prot  |= (abi_prot  & abi_mmap_PROT_EXEC)   ? PROT_EXEC   : 0;
+		int ret = mprotect((void*)(uintptr_t)proc.ireg[rv_ireg_a0], proc.ireg[rv_ireg_a1], prot);
+		proc.ireg[rv_ireg_a0] = ret >= 0 ? ret : -errno;
+	}
+
 	template <typename P> void abi_sys_madvise(P &proc)
 	{
 		proc.ireg[rv_ireg_a0] = 0; /* nop */
 	}
 
+	template <typename P> void abi_sys_sched_yield(P &proc)
+	{
+		int ret = sched_yield();
+		proc.ireg[rv_ireg_a0] = ret >= 0 ? ret : -errno;
+	}
+
+	template <typename P> void abi_sys_gettid(P &proc)
+	{
+		proc.ireg[rv_ireg_a0] = abi_main_tid;
+	}
+
+	template <typename P> void abi_sys_set_robust_list(P &proc)
+	{
+		proc.ireg[rv_ireg_a0] = 0; /* nop */
+	}
+
+	template <typename P> void abi_sys_rt_sigprocmask(P &proc)
+	{
+		/* signals are not delivered to the guest so the old mask is empty */
+		void *oldset = (void*)(uintptr_t)proc.ireg[rv_ireg_a2];
+		size_t sigsetsize = proc.ireg[rv_ireg_a3];
+		if (sigsetsize > 128) {
+			proc.ireg[rv_ireg_a0] = -EINVAL;
+			return;
+		}
+		if (oldset) memset(oldset, 0, sigsetsize);
+		proc.ireg[rv_ireg_a0] = 0;
+	}
+
 	template <typename P> void proxy_syscall(P &proc)
 	{
 		switch (proc.ireg[rv_ireg_a7]) {
@@ -451,12 +502,17 @@ namespace riscv {
 			case abi_syscall_exit:            abi_sys_exit(proc); break;
 			case abi_syscall_exit_group:      abi_sys_exit(proc); break;
 			case abi_syscall_set_tid_address: abi_sys_set_tid_address(proc); break;
+			case abi_syscall_set_robust_list: abi_sys_set_robust_list(proc); break;
 			case abi_syscall_clock_gettime:   abi_sys_clock_gettime(proc); break;
+			case abi_syscall_sched_yield:     abi_sys_sched_yield(proc); break;
+			case abi_syscall_rt_sigprocmask:  abi_sys_rt_sigprocmask(proc); break;
 			case abi_syscall_uname:           abi_sys_uname(proc); break;
 			case abi_syscall_gettimeofday:    abi_sys_gettimeofday(proc);break;
+			case abi_syscall_gettid:          abi_sys_gettid(proc); break;
 			case abi_syscall_brk:             abi_sys_brk(proc); break;
 			case abi_syscall_munmap:          abi_sys_munmap(proc); break;
 			case abi_syscall_mmap:            abi_sys_mmap(proc); break;
+			case abi_syscall_mprotect:        abi_sys_mprotect(proc); break;
 			case abi_syscall_madvise:         abi_sys_madvise(proc); break;
 			case abi_syscall_open:            abi_sys_open(proc); break;
 			case abi_syscall_unlink:          abi_sys_unlink(proc); break;
@@ -0,0 +1,249 @@
+//
+//  rv-aot.cc
+//
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cinttypes>
+#include <cstdarg>
+#include <cerrno>
+#include <functional>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "host-endian.h"
+#include "types.h"
+#include "bits.h"
+#include "sha512.h"
+#include "format.h"
+#include "meta.h"
+#include "util.h"
+#include "cmdline.h"
+#include "codec.h"
+#include "continuation.h"
+#include "elf.h"
+#include "elf-file.h"
+
+#include "jit-decode.h"
+#include "jit-cachefile.h"
+
+using namespace riscv;
+
+/*
+ * Ahead-of-time translation
+ *
+ * Block starts are found with the continuation scan shared with
+ * rv-dump, using jump, call and branch targets and the instructions
+ * after jumps and branches, plus function symbols and the entry
+ * point. Each block is decoded up to its first control transfer and
+ * saved in a sidecar that rv-jit indexes at startup and emits the
+ * first time the block is looked up. Emitted code embeds host
+ * addresses so the sidecar holds decoded instructions rather than
+ * machine code.
+ */
+
+struct rv_aot_text
+{
+	addr_t start;
+	addr_t end;
+	addr_t bias;                                       /* host buffer minus guest address */
+};
+
+struct rv_aot
+{
+	enum {
+		page_size = 4096,
+		max_block_length = 256
+	};
+
+	elf_file elf;
+	std::string filename;
+	std::string aot_filename;
+	std::vector<rv_aot_text> text;
+	std::set<addr_t> starts;
+	jit_cachefile<jit_decode> aotfile;
+	size_t insts = 0;
+
+	bool verbose = false;
+	bool help_or_error = false;
+
+	bool rv32() { return elf.ei_class == ELFCLASS32; }
+
+	/* decode as the proxy processors do, compressed instructions are kept */
+	void decode(jit_decode &dec, inst_t inst)
+	{
+		if (rv32()) {
+			decode_inst<jit_decode,/*rv32*/true,/*rv64*/false,/*rv128*/false,
+				/*I*/true,/*M*/true,/*A*/true,/*S*/true,/*F*/true,/*D*/true,/*Q*/false,/*C*/true>(dec, inst);
+		} else {
+			decode_inst<jit_decode,/*rv32*/false,/*rv64*/true,/*rv128*/false,
+				/*I*/true,/*M*/true,/*A*/true,/*S*/true,/*F*/true,/*D*/true,/*Q*/false,/*C*/true>(dec, inst);
+		}
+	}
+
+	/* decompressed copy for control flow analysis */
+	jit_decode expand(jit_decode dec)
+	{
+		if (rv32()) {
+			decompress_inst_rv32(dec);
+		} else {
+			decompress_inst_rv64(dec);
+		}
+		return dec;
+	}
+
+	static bool is_transfer(const jit_decode &dec)
+	{
+		return dec.op == rv_op_jal || dec.op == rv_op_jalr || dec.codec == rv_codec_sb;
+	}
+
+	rv_aot_text* find_text(addr_t pc)
+	{
+		for (auto &t : text) {
+			if (pc >= t.start && pc < t.end) return &t;
+		}
+		return nullptr;
+	}
+
+	void add_start(addr_t pc)
+	{
+		if (!(pc & 1) && find_text(pc)) starts.insert(pc);
+	}
+
+	void scan_continuations(rv_aot_text &t)
+	{
+		riscv::scan_continuations<jit_decode>(t.start + t.bias, t.end + t.bias, t.bias,
+			[&](jit_decode &dec, inst_t inst) { decode(dec, inst); dec = expand(dec); },
+			[&](addr_t addr, continuation_kind kind) { add_start(addr); });
+	}
+
+	/* decode from a block start to its first control transfer */
+	bool decode_block(addr_t pc, std::vector<jit_decode> &block)
+	{
+		block.clear();
+		rv_aot_text *t = find_text(pc);
+		addr_t pc_offset;
+		while (t && pc < t->end && block.size() < max_block_length) {
+			jit_decode dec;
+			dec.pc = pc;
+			dec.inst = inst_fetch(pc + t->bias, pc_offset);
+			if (pc_offset == 0 || pc + pc_offset > t->end) break;
+			decode(dec, dec.inst);
+			if (dec.op == rv_op_illegal) break;
+			block.push_back(dec);
+			if (is_transfer(expand(dec))) break;
+			pc += pc_offset;
+		}
+		return block.size() > 0;
+	}
+
+	/* the proxy image base is the page of the first loaded segment */
+	addr_t load_addr()
+	{
+		for (auto &phdr : elf.phdrs) {
+			if (phdr.p_type == PT_LOAD) {
+				return phdr.p_vaddr - (phdr.p_offset & (page_size - 1));
+			}
+		}
+		return 0;
+	}
+
+	void parse_commandline(int argc, const char *argv[])
+	{
+		cmdline_option options[] =
+		{
+			{ "-o", "--output", cmdline_arg_type_string,
+				"Output file (default <elf_file>.aot)",
+				[&](std::string s) { aot_filename = s; return true; } },
+			{ "-v", "--verbose", cmdline_arg_type_none,
+				"Print each block",
+				[&](std::string s) { return (verbose = true); } },
+			{ "-h", "--help", cmdline_arg_type_none,
+				"Show help",
+				[&](std::string s) { return (help_or_error = true); } },
+			{ nullptr, nullptr, cmdline_arg_type_none,   nullptr, nullptr }
+		};
+
+		auto result = cmdline_option::process_options(options, argc, argv);
+		if (!result.second) {
+			help_or_error = true;
+		} else if (result.first.size() != 1 && !help_or_error) {
+			printf("%s: wrong number of arguments\n", argv[0]);
+			help_or_error = true;
+		}
+
+		if (help_or_error)
+		{
+			printf("usage: %s [<options>] <elf_file>\n", argv[0]);
+			cmdline_option::print_options(options);
+			exit(9);
+		}
+
+		filename = result.first[0];
+		if (aot_filename.size() == 0) {
+			aot_filename = filename + ".aot";
+		}
+	}
+
+	int run()
+	{
+		elf.load(filename);
+		if (elf.ehdr.e_machine != EM_RISCV) {
+			fprintf(stderr, "%s: not a RISC-V ELF image\n", filename.c_str());
+			return 1;
+		}
+
+		/* find block starts in the executable sections */
+		for (size_t i = 0; i < elf.shdrs.size(); i++) {
+			Elf64_Shdr &shdr = elf.shdrs[i];
+			if ((shdr.sh_flags & SHF_EXECINSTR) && shdr.sh_type == SHT_PROGBITS) {
+				text.push_back(rv_aot_text{ addr_t(shdr.sh_addr), addr_t(shdr.sh_addr + shdr.sh_size),
+					addr_t(elf.sections[i].buf.data()) - addr_t(shdr.sh_addr) });
+			}
+		}
+		add_start(addr_t(elf.ehdr.e_entry));
+		for (auto &sym : elf.symbols) {
+			if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC) {
+				add_start(addr_t(sym.st_value));
+			}
+		}
+		for (auto &t : text) {
+			scan_continuations(t);
+		}
+
+		/* write the decoded blocks */
+		if (!aotfile.open_aot(aot_filename, filename, elf, rv32() ? 32 : 64, load_addr()) || !aotfile.create()) {
+			fprintf(stderr, "%s: can't write %s\n", filename.c_str(), aot_filename.c_str());
+			return 1;
+		}
+		std::vector<jit_decode> block;
+		size_t blocks = 0;
+		for (addr_t pc : starts) {
+			if (!decode_block(pc, block)) continue;
+			if (verbose) {
+				printf("0x%016llx %zu\n", (u64)pc, block.size());
+			}
+			aotfile.save(pc, block);
+			insts += block.size();
+			blocks++;
+		}
+		aotfile.close();
+		printf("%s: %zu blocks, %zu instructions\n", aot_filename.c_str(), blocks, insts);
+		return 0;
+	}
+};
+
+int rv_aot_main(int argc, const char *argv[])
+{
+	rv_aot aot;
+	aot.parse_commandline(argc, argv);
+	return aot.run();
+}
@@ -24,6 +24,7 @@ typedef int(*rv_cmd_fn)(int argc, const char **argv);
 int rv_dump_main(int argc, const char **argv);
 int rv_histogram_main(int argc, const char **argv);
 int rv_pte_main(int argc, const char **argv);
+int rv_aot_main(int argc, const char **argv);
 
 struct rv_cmd {
 	const char* name;
@@ -34,6 +35,7 @@ static rv_cmd cmds[] = {
 	{ "dump",      rv_dump_main },
 	{ "histogram", rv_histogram_main },
 	{ "pte",       rv_pte_main },
+	{ "aot",       rv_aot_main },
 	{ nullptr,     nullptr },
 };
 
@@ -30,6 +30,7 @@
 #include "cmdline.h"
 #include "color.h"
 #include "codec.h"
+#include "continuation.h"
 #include "strings.h"
 #include "disasm.h"
 #include "elf.h"
@@ -113,39 +114,15 @@ struct rv_parse_elf
 
 	void scan_continuations(addr_t start, addr_t end, addr_t pc_bias)
 	{
-		disasm dec;
-		addr_t pc = start;
-		addr_t pc_offset;
-		addr_t addr = 0;
-		while (pc < end) {
-			dec.pc = pc;
-			dec.inst = inst_fetch(pc, pc_offset);
-			decode_inst_rv64(dec, dec.inst);
-			switch (dec.op) {
-				case rv_op_jal:
-				case rv_op_jalr:
-					if (pc + pc_offset < end) {
-						addr = pc - pc_bias + pc_offset;
-						if (continuations.find(addr) == continuations.end()) {
-							continuations.insert(std::pair<addr_t,uint32_t>(addr, continuation_num++));
-						}
-					}
-					break;
-				default:
-					break;
-			}
-			switch (dec.codec) {
-				case rv_codec_sb:
-					addr = pc - pc_bias + dec.imm;
-					if (continuations.find(addr) == continuations.end()) {
-						continuations.insert(std::pair<addr_t,uint32_t>(addr, continuation_num++));
-					}
-					break;
-				default:
-					break;
-			}
-			pc += pc_offset;
-		}
+		/* label the return points of jumps and the targets of branches */
+		riscv::scan_continuations<disasm>(start, end, pc_bias,
+			[](disasm &dec, inst_t inst) { decode_inst_rv64(dec, inst); },
+			[&](addr_t addr, continuation_kind kind) {
+				if (kind != continuation_link && kind != continuation_branch) return;
+				if (continuations.find(addr) == continuations.end()) {
+					continuations.insert(std::pair<addr_t,uint32_t>(addr, continuation_num++));
+				}
+			});
 	}
 
 	void print_disassembly(addr_t start, addr_t end, addr_t pc_bias, addr_t gp)
@@ -26,7 +26,10 @@
 #include <random>
 #include <deque>
 #include <map>
+#include <set>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <type_traits>
 
@@ -42,6 +45,9 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/futex.h>
 
 #include "host-endian.h"
 #include "types.h"
@@ -82,6 +88,12 @@
 #include "jit-emitter-rv64.h"
 #include "jit-fusion.h"
 #include "jit-tracer.h"
+#include "jit-optimize.h"
+#include "jit-cachefile.h"
+#include "jit-arena.h"
+#include "jit-perfmap.h"
+#include "jit-native.h"
+#include "jit-threads.h"
 #include "jit-runloop.h"
 
 using namespace riscv;
@@ -147,9 +159,27 @@ struct rv_jit
 	bool disable_fusion = false;
 	bool memory_registers = false;
 	bool update_instret = false;
+	bool async_compile = false;
+	size_t code_cache_size = 0;
+	size_t trace_l1_size = 0;
+	size_t trace_l2_size = 0;
+	bool code_protect = true;
+	bool trace_opt = true;
+	bool trace_trees = true;
+	int trace_tiers = jit_tier_traces;
+	int exit_ratio = 90;
+	size_t code_arena_size = 256 << 20;
+	bool code_huge_pages = false;
+	bool code_wx = false;
+	bool perf_map = false;
+	bool perf_jitdump = false;
+	bool native_libc = true;
+	bool native_audit = false;
 	bool help_or_error = false;
 	std::string elf_filename;
 	std::string stats_dirname;
+	std::string cache_dirname;
+	std::string aot_filename;
 
 	std::vector<std::string> host_cmdline;
 	std::vector<std::string> host_env;
@@ -211,6 +241,66 @@ struct rv_jit
 			{ "-a", "--audit", cmdline_arg_type_none,
 				"Enable JIT audit",
 				[&](std::string s) { mode = jit_mode_audit; return true; } },
+			{ "-c", "--async-compile", cmdline_arg_type_none,
+				"Compile JIT traces on a background thread",
+				[&](std::string s) { return (async_compile = true); } },
+			{ "-S", "--code-cache-size", cmdline_arg_type_string,
+				"JIT code cache size in MiB (default unbounded)",
+				[&](std::string s) { code_cache_size = strtoull(s.c_str(), nullptr, 10) << 20; return true; } },
+			{ "-L", "--trace-l1-size", cmdline_arg_type_string,
+				"JIT trace lookup L1 entries (default 1024)",
+				[&](std::string s) { trace_l1_size = strtoull(s.c_str(), nullptr, 10); return trace_l1_size > 0; } },
+			{ "-K", "--trace-l2-size", cmdline_arg_type_string,
+				"JIT trace lookup L2 entries (default 16384)",
+				[&](std::string s) { trace_l2_size = strtoull(s.c_str(), nullptr, 10); return trace_l2_size > 0; } },
+			{ "-O", "--no-optimize", cmdline_arg_type_none,
+				"Disable the JIT trace optimizer",
+				[&](std::string s) { trace_opt = false; return true; } },
+			{ "-G", "--no-trace-trees", cmdline_arg_type_none,
+				"Disable growing JIT side exits into trace trees",
+				[&](std::string s) { trace_trees = false; return true; } },
+			{ "-B", "--tier-policy", cmdline_arg_type_string,
+				"JIT tier policy: traces, tiered or blocks (default traces)",
+				[&](std::string s) {
+					if (s == "traces") trace_tiers = jit_tier_traces;
+					else if (s == "tiered") trace_tiers = jit_tier_tiered;
+					else if (s == "blocks") trace_tiers = jit_tier_blocks;
+					else return false;
+					return true;
+				} },
+			{ "-Q", "--retranslate-ratio", cmdline_arg_type_string,
+				"Side exit percentage that retranslates a JIT trace (default 90, 0 disables)",
+				[&](std::string s) { exit_ratio = strtoull(s.c_str(), nullptr, 10); return exit_ratio >= 0 && exit_ratio <= 100; } },
+			{ "-A", "--code-arena-size", cmdline_arg_type_string,
+				"JIT code arena reservation in MiB (default 256, 0 disables)",
+				[&](std::string s) { code_arena_size = strtoull(s.c_str(), nullptr, 10) << 20; return true; } },
+			{ "-H", "--huge-pages", cmdline_arg_type_none,
+				"Back the JIT code arena with MAP_HUGETLB pages",
+				[&](std::string s) { return (code_huge_pages = true); } },
+			{ "-W", "--code-wx", cmdline_arg_type_none,
+				"Map JIT code writable or executable but never both",
+				[&](std::string s) { return (code_wx = true); } },
+			{ "-F", "--perf-map", cmdline_arg_type_none,
+				"Write JIT trace symbols to /tmp/perf-<pid>.map",
+				[&](std::string s) { return (perf_map = true); } },
+			{ "-J", "--jitdump", cmdline_arg_type_none,
+				"Write JIT traces to jit-<pid>.dump for perf inject",
+				[&](std::string s) { return (perf_jitdump = true); } },
+			{ "-n", "--no-native-libc", cmdline_arg_type_none,
+				"Translate guest libc routines instead of calling the host",
+				[&](std::string s) { native_libc = false; return true; } },
+			{ "-V", "--native-audit", cmdline_arg_type_none,
+				"Compare host libc routines with the guest routines",
+				[&](std::string s) { return (native_audit = true); } },
+			{ "-X", "--no-smc-detect", cmdline_arg_type_none,
+				"Disable JIT self-modifying code detection",
+				[&](std::string s) { code_protect = false; return true; } },
+			{ "-C", "--trace-cache", cmdline_arg_type_string,
+				"Persistent JIT translation cache directory",
+				[&](std::string s) { cache_dirname = s; return true; } },
+			{ "-Z", "--aot", cmdline_arg_type_string,
+				"Ahead-of-time translation from rv-bin aot (default <elf_file>.aot if present)",
+				[&](std::string s) { aot_filename = s; return true; } },
 			{ "-I", "--trace-iters", cmdline_arg_type_string,
 				"Trace iterations",
 				[&](std::string s) { trace_iters = strtoull(s.c_str(), nullptr, 10); return true; } },
@@ -248,8 +338,9 @@ struct rv_jit
 			}
 		}
 
-		/* load ELF (headers only) */
-		elf.load(elf_filename, true);
+		/* load ELF (headers only unless symbols are needed) */
+		bool symbolicate = mode == jit_mode_trace && (native_libc || perf_map || perf_jitdump);
+		elf.load(elf_filename, !symbolicate);
 	}
 
 	/* Start the execuatable with the given proxy processor template */
@@ -264,7 +355,7 @@ struct rv_jit
 			case jit_mode_none:
 				break;
 			case jit_mode_trace:
-				proc_logs |= proc_log_hist_pc | proc_log_jit_trap;
+				proc_logs |= proc_log_jit_trap;
 				break;
 			case jit_mode_audit:
 				proc_logs |= proc_log_jit_audit;
@@ -280,6 +371,21 @@ struct rv_jit
 		proc.trace_iters = trace_iters;
 		proc.update_instret = update_instret;
 		proc.memory_registers = memory_registers;
+		proc.async_compile = async_compile && mode == jit_mode_trace;
+		proc.code_cache_size = code_cache_size;
+		proc.code_protect = code_protect && mode == jit_mode_trace;
+		proc.trace_opt = trace_opt;
+		proc.trace_trees = trace_trees;
+		proc.trace_tiers = trace_tiers;
+		proc.exit_ratio = exit_ratio;
+		proc.code_arena_size = code_arena_size;
+		proc.code_huge_pages = code_huge_pages;
+		proc.code_wx = code_wx;
+		proc.proxy_threads = mode != jit_mode_audit;
+		if (trace_l1_size || trace_l2_size) {
+			proc.alloc_trace_tables(trace_l1_size ? trace_l1_size : P::trace_l1_size,
+				trace_l2_size ? trace_l2_size : P::trace_l2_size);
+		}
 
 		/* Find the ELF executable PT_LOAD segments and mmap them into user memory */
 		for (size_t i = 0; i < elf.phdrs.size(); i++) {
@@ -287,6 +393,10 @@ struct rv_jit
 			if (phdr.p_flags & (PT_LOAD | PT_DYNAMIC)) {
 				proc.map_load_segment_user(elf_filename.c_str(), phdr);
 			}
+			if (phdr.p_type == PT_LOAD && !(phdr.p_flags & PF_W)) {
+				proc.text_segments.push_back(std::pair<addr_t,addr_t>(
+					phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz));
+			}
 		}
 
 		/* Map a stack and set the stack pointer */
@@ -294,6 +404,33 @@ struct rv_jit
 		proc.map_proxy_stack(P::mmu_type::memory_top, stack_size);
 		proc.setup_proxy_stack(elf, cpu, host_cmdline, host_env, P::mmu_type::memory_top, stack_size);
 
+		/* Open the translation cache for this image */
+		if (mode == jit_mode_trace && cache_dirname.size() > 0) {
+			proc.cachefile.open(cache_dirname, elf_filename, elf, P::xlen, proc.imagebase);
+		}
+
+		/* Index the blocks translated ahead of time by rv-bin aot */
+		if (mode == jit_mode_trace) {
+			std::string aot = aot_filename.size() > 0 ? aot_filename : elf_filename + ".aot";
+			struct stat aot_stat;
+			if (aot_filename.size() > 0 || stat(aot.c_str(), &aot_stat) == 0) {
+				proc.aotfile.open_aot(aot, elf_filename, elf, P::xlen, proc.imagebase);
+			}
+		}
+
+		/* Describe translated code to perf */
+		if (mode == jit_mode_trace && (perf_map || perf_jitdump)) {
+			proc.perfmap.elf = &elf;
+			if (perf_map) proc.perfmap.open_map();
+			if (perf_jitdump) proc.perfmap.open_dump();
+		}
+
+		/* Call host libc for recognised guest routines */
+		if (mode == jit_mode_trace && native_libc) {
+			proc.native.audit = native_audit;
+			proc.native.scan(elf);
+		}
+
 		/* Initialize interpreter */
 		proc.init();
 
@@ -25,6 +25,7 @@
 #include <random>
 #include <deque>
 #include <map>
+#include <set>
 #include <thread>
 #include <mutex>
 #include <chrono>
@@ -38,9 +39,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/futex.h>
 
 #include "host-endian.h"
 #include "types.h"
@@ -72,6 +79,7 @@
 #include "mmu-soft.h"
 #include "interp.h"
 #include "processor-model.h"
+#include "unknown-abi.h"
 #include "queue.h"
 #include "console.h"
 #include "device-rom-boot.h"
@@ -91,6 +99,21 @@
 #include "debug-cli.h"
 #include "processor-runloop.h"
 
+#include "asmjit.h"
+
+#include "jit-decode.h"
+#include "jit-emitter-rv32.h"
+#include "jit-emitter-rv64.h"
+#include "jit-fusion.h"
+#include "jit-tracer.h"
+#include "jit-optimize.h"
+#include "jit-cachefile.h"
+#include "jit-arena.h"
+#include "jit-perfmap.h"
+#include "jit-native.h"
+#include "jit-threads.h"
+#include "jit-runloop.h"
+
 #if defined (ENABLE_GPERFTOOL)
 #include "gperftools/profiler.h"
 #endif
@@ -102,6 +125,22 @@ using namespace riscv;
 using priv_emulator_rv32imafdc = processor_runloop<processor_privileged<processor_rv32imafdc_model<decode,processor_priv_rv32imafd,mmu_soft_rv32>>>;
 using priv_emulator_rv64imafdc = processor_runloop<processor_privileged<processor_rv64imafdc_model<decode,processor_priv_rv64imafd,mmu_soft_rv64>>>;
 
+/* Parameterized privileged soft-mmu JIT processor models */
+
+using priv_model_rv32imafdc = processor_rv32imafdc_model<
+	jit_decode, processor_priv_rv32imafd, mmu_soft_rv32>;
+using priv_model_rv64imafdc = processor_rv64imafdc_model<
+	jit_decode, processor_priv_rv64imafd, mmu_soft_rv64>;
+
+using priv_jit_rv32imafdc = jit_runloop<
+	processor_privileged<priv_model_rv32imafdc>,
+	jit_fusion<jit_tracer<priv_model_rv32imafdc,jit_isa_rv32>>,
+	jit_emitter_rv32<priv_model_rv32imafdc>>;
+using priv_jit_rv64imafdc = jit_runloop<
+	processor_privileged<priv_model_rv64imafdc>,
+	jit_fusion<jit_tracer<priv_model_rv64imafdc,jit_isa_rv64>>,
+	jit_emitter_rv64<priv_model_rv64imafdc>>;
+
 
 /* environment variables */
 
@@ -144,6 +183,7 @@ struct rv_emulator
 	host_cpu &cpu;
 	int proc_logs = 0;
 	bool help_or_error = false;
+	bool jit = false;
 	addr_t map_physical = 0;
 	s64 ram_boot = 0;
 	uint64_t initial_seed = 0;
@@ -271,6 +311,9 @@ struct rv_emulator
 			{ "-s", "--seed", cmdline_arg_type_string,
 				"Random seed",
 				[&](std::string s) { initial_seed = strtoull(s.c_str(), nullptr, 10); return true; } },
+			{ "-j", "--jit", cmdline_arg_type_none,
+				"Translate hot traces to native code",
+				[&](std::string s) { return (jit = true); } },
 			{ "-h", "--help", cmdline_arg_type_none,
 				"Show help",
 				[&](std::string s) { return (help_or_error = true); } },
@@ -323,6 +366,15 @@ struct rv_emulator
 		proc.mmu.mem->log = (proc.log & proc_log_memory);
 		proc.stats_dirname = stats_dirname;
 
+		/* translated loads and stores go through the soft-mmu and traces return for interrupts */
+		if (jit) {
+			proc.log |= proc_log_jit_trap;
+			proc.trace_iters = 100;
+			proc.update_instret = true;
+			proc.trace_mmu = true;
+			proc.trace_budget = true;
+		}
+
 		/* randomise integer register state with 512 bits of entropy */
 		proc.seed_registers(cpu, initial_seed, 512);
 
@@ -419,21 +471,24 @@ struct rv_emulator
 		#endif
 
 		/* execute */
+		int xlen = ram_boot;
 		if (ram_boot == 0) {
 			switch (elf.ei_class) {
-				case ELFCLASS32:
-					start_priv<priv_emulator_rv32imafdc>(); break;
-				case ELFCLASS64:
-					start_priv<priv_emulator_rv64imafdc>(); break;
+				case ELFCLASS32: xlen = 32; break;
+				case ELFCLASS64: xlen = 64; break;
 			}
 		}
-		else if (ram_boot == 32) {
-			start_priv<priv_emulator_rv32imafdc>();
-		}
-		else if (ram_boot == 64) {
-			start_priv<priv_emulator_rv64imafdc>();
-		} else {
-			panic("--boot option must be 32 or 64");
+		switch (xlen) {
+			case 32:
+				if (jit) start_priv<priv_jit_rv32imafdc>();
+				else start_priv<priv_emulator_rv32imafdc>();
+				break;
+			case 64:
+				if (jit) start_priv<priv_jit_rv64imafdc>();
+				else start_priv<priv_emulator_rv64imafdc>();
+				break;
+			default:
+				panic("--boot option must be 32 or 64");
 		}
 	}
 };
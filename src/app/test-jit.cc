@@ -26,7 +26,10 @@
 #include <random>
 #include <deque>
 #include <map>
+#include <set>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <type_traits>
 
@@ -42,6 +45,9 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/futex.h>
 
 #include "host-endian.h"
 #include "types.h"
@@ -82,6 +88,12 @@
 #include "jit-emitter-rv64.h"
 #include "jit-fusion.h"
 #include "jit-tracer.h"
+#include "jit-optimize.h"
+#include "jit-cachefile.h"
+#include "jit-arena.h"
+#include "jit-perfmap.h"
+#include "jit-native.h"
+#include "jit-threads.h"
 #include "jit-runloop.h"
 
 #include "assembler.h"
@@ -112,12 +124,24 @@ struct rv_test_jit
 
 	rv_test_jit() : total_tests(0), tests_passed(0) {}
 
+	void clear_registers(P &proc)
+	{
+		for (size_t i = 0; i < P::ireg_count; i++) {
+			proc.ireg[i] = typename P::ireg_t();
+		}
+		for (size_t i = 0; i < P::freg_count; i++) {
+			proc.freg[i] = typename P::freg_t();
+		}
+	}
+
 	void run_test(const char* test_name, P &proc, addr_t pc, size_t step)
 	{
 		printf("\n=========================================================\n");
 		printf("TEST: %s\n", test_name);
 		typename P::ireg_t save_regs[P::ireg_count];
+		typename P::freg_t save_fregs[P::freg_count];
 		size_t regfile_size = sizeof(typename P::ireg_t) * P::ireg_count;
+		size_t fregfile_size = sizeof(typename P::freg_t) * P::freg_count;
 
 		/* create 256MB RAM at 256MB */
 		proc.mmu.mem->brk = proc.mmu.mem->heap_begin = proc.mmu.mem->heap_end = 0x10000000;
@@ -125,7 +149,7 @@ struct rv_test_jit
 		abi_sys_brk(proc);
 
 		/* clear registers */
-		memset(&proc.ireg[0], 0, regfile_size);
+		clear_registers(proc);
 
 		/* step the interpreter */
 		printf("\n--[ interp ]---------------\n");
@@ -135,17 +159,18 @@ struct rv_test_jit
 
 		/* save and reset registers */
 		memcpy(&save_regs[0], &proc.ireg[0], regfile_size);
-		memset(&proc.ireg[0], 0, regfile_size);
+		memcpy(&save_fregs[0], &proc.freg[0], fregfile_size);
+		clear_registers(proc);
 
 		/* compile the program buffer trace */
 		printf("\n--[ jit ]------------------\n");
 		proc.memory_registers = memory_registers;
 		proc.log = proc_log_jit_trace;
 		proc.pc = pc;
-		proc.jit_trace();
+		proc.jit_trace(2);
 
 		/* reset registers */
-		memset(&proc.ireg[0], 0, regfile_size);
+		clear_registers(proc);
 
 		/* run compiled trace */
 		proc.jit_exec(proc, pc);
@@ -161,6 +186,14 @@ struct rv_test_jit
 					rv_ireg_name_sym[i], proc.ireg[i].r.xu.val);
 			}
 		}
+		for (size_t i = 0; i < P::freg_count; i++) {
+			if (save_fregs[i].r.xu.val != proc.freg[i].r.xu.val) {
+				pass = false;
+				printf("ERROR interp-%s=0x%016llx jit-%s=0x%016llx\n",
+					rv_freg_name_sym[i], save_fregs[i].r.xu.val,
+					rv_freg_name_sym[i], proc.freg[i].r.xu.val);
+			}
+		}
 		printf("%s\n", pass ? "PASS" : "FAIL");
 		if (pass) tests_passed++;
 		total_tests++;
@@ -1022,6 +1055,28 @@ struct rv_test_jit
 		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 3);
 	}
 
+	void test_rotd_1()
+	{
+		P proc;
+		assembler as;
+
+		/* rotates by 1..3 must not be taken for a shifted add */
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, -0x6dd);
+		asm_slli(as, rv_ireg_a1, rv_ireg_a0, 1);
+		asm_srli(as, rv_ireg_a2, rv_ireg_a0, 63);
+		asm_or(as, rv_ireg_a1, rv_ireg_a1, rv_ireg_a2);
+		asm_slli(as, rv_ireg_a3, rv_ireg_a0, 2);
+		asm_srli(as, rv_ireg_a4, rv_ireg_a0, 62);
+		asm_or(as, rv_ireg_a3, rv_ireg_a4, rv_ireg_a3);
+		asm_slli(as, rv_ireg_a5, rv_ireg_a0, 3);
+		asm_srli(as, rv_ireg_a6, rv_ireg_a0, 61);
+		asm_or(as, rv_ireg_a6, rv_ireg_a5, rv_ireg_a6);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
 
 	void test_addiw_1()
 	{
@@ -1908,6 +1963,444 @@ struct rv_test_jit
 		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 5);
 	}
 
+	void test_fadd_d_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 3);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, -5);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_d_l(as, rv_freg_f1, rv_ireg_a1, rv_rm_dyn);
+		asm_fadd_d(as, rv_freg_f2, rv_freg_f0, rv_freg_f1, rv_rm_dyn);
+		asm_fsub_d(as, rv_freg_f3, rv_freg_f0, rv_freg_f1, rv_rm_dyn);
+		asm_fmul_d(as, rv_freg_f4, rv_freg_f3, rv_freg_f1, rv_rm_dyn);
+		asm_fdiv_d(as, rv_freg_f1, rv_freg_f0, rv_freg_f1, rv_rm_dyn);
+		asm_fcvt_l_d(as, rv_ireg_a2, rv_freg_f4, rv_rm_dyn);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_fadd_s_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 7);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 3);
+		asm_fcvt_s_w(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_s_w(as, rv_freg_f1, rv_ireg_a1, rv_rm_dyn);
+		asm_fdiv_s(as, rv_freg_f2, rv_freg_f0, rv_freg_f1, rv_rm_dyn);
+		asm_fadd_s(as, rv_freg_f2, rv_freg_f2, rv_freg_f1, rv_rm_dyn);
+		asm_fsqrt_s(as, rv_freg_f3, rv_freg_f2, rv_rm_dyn);
+		asm_fmv_x_s(as, rv_ireg_a2, rv_freg_f3);
+		asm_fcvt_w_s(as, rv_ireg_a3, rv_freg_f2, rv_rm_dyn);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_fmadd_d_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 3);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 5);
+		asm_addi(as, rv_ireg_a2, rv_ireg_zero, -7);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_d_l(as, rv_freg_f1, rv_ireg_a1, rv_rm_dyn);
+		asm_fcvt_d_l(as, rv_freg_f2, rv_ireg_a2, rv_rm_dyn);
+		asm_fmadd_d(as, rv_freg_f3, rv_freg_f0, rv_freg_f1, rv_freg_f2, rv_rm_dyn);
+		asm_fmsub_d(as, rv_freg_f4, rv_freg_f0, rv_freg_f1, rv_freg_f2, rv_rm_dyn);
+		asm_fnmsub_d(as, rv_freg_f5, rv_freg_f0, rv_freg_f1, rv_freg_f2, rv_rm_dyn);
+		asm_fnmadd_d(as, rv_freg_f6, rv_freg_f0, rv_freg_f1, rv_freg_f2, rv_rm_dyn);
+		asm_fmadd_d(as, rv_freg_f0, rv_freg_f0, rv_freg_f0, rv_freg_f0, rv_rm_dyn);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 12);
+	}
+
+	void test_fsgnj_d_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 3);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, -5);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_d_l(as, rv_freg_f1, rv_ireg_a1, rv_rm_dyn);
+		asm_fsgnj_d(as, rv_freg_f2, rv_freg_f0, rv_freg_f1);
+		asm_fsgnjn_d(as, rv_freg_f3, rv_freg_f0, rv_freg_f1);
+		asm_fsgnjx_d(as, rv_freg_f4, rv_freg_f1, rv_freg_f1);
+		asm_fsgnjn_s(as, rv_freg_f5, rv_freg_f0, rv_freg_f0);
+		asm_fmv_x_d(as, rv_ireg_a2, rv_freg_f3);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_feq_d_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 3);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 5);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_d_l(as, rv_freg_f1, rv_ireg_a1, rv_rm_dyn);
+		asm_feq_d(as, rv_ireg_a2, rv_freg_f0, rv_freg_f0);
+		asm_feq_d(as, rv_ireg_a3, rv_freg_f0, rv_freg_f1);
+		asm_flt_d(as, rv_ireg_a4, rv_freg_f0, rv_freg_f1);
+		asm_flt_d(as, rv_ireg_a5, rv_freg_f1, rv_freg_f0);
+		asm_fle_d(as, rv_ireg_a6, rv_freg_f0, rv_freg_f0);
+		asm_fle_d(as, rv_ireg_a7, rv_freg_f1, rv_freg_f0);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 11);
+	}
+
+	void test_fcvt_w_d_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, -1);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fsqrt_d(as, rv_freg_f1, rv_freg_f0, rv_rm_dyn);
+		asm_fcvt_w_d(as, rv_ireg_a1, rv_freg_f1, rv_rm_dyn);
+		asm_fmv_x_d(as, rv_ireg_a2, rv_freg_f1);
+		asm_fcvt_d_wu(as, rv_freg_f2, rv_ireg_a0, rv_rm_dyn);
+		asm_fcvt_w_d(as, rv_ireg_a3, rv_freg_f2, rv_rm_dyn);
+		asm_fcvt_l_d(as, rv_ireg_a4, rv_freg_f2, rv_rm_dyn);
+		asm_fcvt_s_d(as, rv_freg_f3, rv_freg_f2, rv_rm_dyn);
+		asm_fcvt_d_s(as, rv_freg_f4, rv_freg_f3, rv_rm_dyn);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 11);
+	}
+
+	void test_fsd_fld_1()
+	{
+		P proc;
+		assembler as;
+
+		as.load_imm(rv_ireg_s0, 0x10000000);
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 7);
+		asm_fcvt_d_l(as, rv_freg_f0, rv_ireg_a0, rv_rm_dyn);
+		asm_fsd(as, rv_ireg_s0, rv_freg_f0, 0);
+		asm_fld(as, rv_freg_f1, rv_ireg_s0, 0);
+		asm_fmv_s_x(as, rv_freg_f2, rv_ireg_a0);
+		asm_fsw(as, rv_ireg_s0, rv_freg_f2, 8);
+		asm_flw(as, rv_freg_f3, rv_ireg_s0, 8);
+		asm_ld(as, rv_ireg_a1, rv_ireg_s0, 0);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_amoadd_w_1()
+	{
+		P proc;
+		assembler as;
+
+		as.load_imm(rv_ireg_a0, 0x10000000);
+		as.load_imm(rv_ireg_a1, -1);
+		asm_addi(as, rv_ireg_a2, rv_ireg_zero, 5);
+		asm_sw(as, rv_ireg_a0, rv_ireg_a1, 0);
+		asm_amoadd_w(as, rv_ireg_a3, rv_ireg_a0, rv_ireg_a2, 0, 0);
+		asm_amoswap_w(as, rv_ireg_a4, rv_ireg_a0, rv_ireg_a1, 0, 0);
+		asm_lw(as, rv_ireg_a5, rv_ireg_a0, 0);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 8);
+	}
+
+	void test_amomin_d_1()
+	{
+		P proc;
+		assembler as;
+
+		as.load_imm(rv_ireg_s0, 0x10000000);
+		as.load_imm(rv_ireg_s1, -1);
+		asm_addi(as, rv_ireg_a2, rv_ireg_zero, 5);
+		asm_sd(as, rv_ireg_s0, rv_ireg_a2, 0);
+		asm_amomin_d(as, rv_ireg_a3, rv_ireg_s0, rv_ireg_s1, 0, 0);
+		asm_amomaxu_d(as, rv_ireg_a4, rv_ireg_s0, rv_ireg_a2, 0, 0);
+		asm_amoor_d(as, rv_ireg_s2, rv_ireg_s0, rv_ireg_a2, 0, 0);
+		asm_amoand_d(as, rv_ireg_zero, rv_ireg_s0, rv_ireg_zero, 0, 0);
+		asm_ld(as, rv_ireg_a5, rv_ireg_s0, 0);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_lr_sc_1()
+	{
+		P proc;
+		assembler as;
+
+		as.load_imm(rv_ireg_a0, 0x10000000);
+		as.load_imm(rv_ireg_s0, 0x10000008);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 7);
+		asm_sd(as, rv_ireg_a0, rv_ireg_a1, 0);
+		asm_lr_d(as, rv_ireg_a2, rv_ireg_a0, 0, 0);
+		asm_addi(as, rv_ireg_a2, rv_ireg_a2, 1);
+		asm_sc_d(as, rv_ireg_a3, rv_ireg_a0, rv_ireg_a2, 0, 0);
+		asm_sc_w(as, rv_ireg_a4, rv_ireg_s0, rv_ireg_a2, 0, 0);
+		asm_ld(as, rv_ireg_a5, rv_ireg_a0, 0);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 10);
+	}
+
+	void test_regalloc_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_s1, rv_ireg_zero, 1);
+		asm_addi(as, rv_ireg_s2, rv_ireg_zero, 2);
+		asm_addi(as, rv_ireg_s3, rv_ireg_zero, 3);
+		asm_addi(as, rv_ireg_s4, rv_ireg_zero, 4);
+		asm_addi(as, rv_ireg_s5, rv_ireg_zero, 5);
+		asm_addi(as, rv_ireg_s6, rv_ireg_zero, 6);
+		asm_addi(as, rv_ireg_s7, rv_ireg_zero, 7);
+		asm_addi(as, rv_ireg_t2, rv_ireg_zero, 8);
+		asm_addi(as, rv_ireg_t3, rv_ireg_zero, 9);
+		asm_addi(as, rv_ireg_t4, rv_ireg_zero, 10);
+		asm_addi(as, rv_ireg_t5, rv_ireg_zero, 11);
+		asm_addi(as, rv_ireg_t6, rv_ireg_zero, 12);
+		asm_addi(as, rv_ireg_gp, rv_ireg_zero, 13);
+		asm_addi(as, rv_ireg_tp, rv_ireg_zero, 14);
+		asm_add(as, rv_ireg_s1, rv_ireg_s1, rv_ireg_s2);
+		asm_add(as, rv_ireg_s1, rv_ireg_s1, rv_ireg_s3);
+		asm_add(as, rv_ireg_s3, rv_ireg_s4, rv_ireg_s5);
+		asm_add(as, rv_ireg_s6, rv_ireg_s6, rv_ireg_s7);
+		asm_add(as, rv_ireg_t2, rv_ireg_t2, rv_ireg_t3);
+		asm_add(as, rv_ireg_t4, rv_ireg_t5, rv_ireg_t6);
+		asm_add(as, rv_ireg_gp, rv_ireg_gp, rv_ireg_tp);
+		asm_add(as, rv_ireg_s1, rv_ireg_s1, rv_ireg_gp);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 22);
+	}
+
+	void test_optimize_1()
+	{
+		P proc;
+		assembler as;
+
+		as.load_imm(rv_ireg_a0, 0x10000000);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 100);
+		asm_addi(as, rv_ireg_a2, rv_ireg_a1, 23);
+		asm_add(as, rv_ireg_a3, rv_ireg_a0, rv_ireg_a2);
+		asm_add(as, rv_ireg_a4, rv_ireg_a0, rv_ireg_a2);
+		asm_sd(as, rv_ireg_a3, rv_ireg_a4, 8);
+		asm_ld(as, rv_ireg_a5, rv_ireg_a3, 8);
+		asm_ld(as, rv_ireg_s1, rv_ireg_a4, 8);
+		asm_addi(as, rv_ireg_s2, rv_ireg_zero, 1);
+		asm_addi(as, rv_ireg_s2, rv_ireg_s1, 1);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 11);
+	}
+
+	void test_optimize_2()
+	{
+		P proc;
+		assembler as;
+
+		printf("\n=========================================================\n");
+		printf("TEST: %s\n", __func__);
+
+		/* a fence orders the load after it against other threads' stores */
+		asm_lw(as, rv_ireg_a1, rv_ireg_a0, 0);
+		asm_lw(as, rv_ireg_a2, rv_ireg_a0, 4);
+		asm_fence(as, 2, 2);
+		asm_lw(as, rv_ireg_a3, rv_ireg_a0, 0);
+		asm_lw(as, rv_ireg_a4, rv_ireg_a0, 0);
+		as.link();
+
+		std::vector<typename P::decode_type> trace;
+		auto &buf = as.get_section(".text")->buf;
+		for (size_t i = 0; i < buf.size(); i += 4) {
+			typename P::decode_type dec;
+			addr_t pc = addr_t(buf.data() + i), pc_offset;
+			dec.inst = inst_fetch(pc, pc_offset);
+			proc.inst_decode(dec, dec.inst);
+			dec.pc = pc;
+			trace.push_back(dec);
+		}
+
+		/* loads that may reach a device through the MMU are never reused */
+		std::vector<typename P::decode_type> ram = trace, mmio = trace;
+		jit_optimizer<P> ram_opt, mmio_opt(false);
+		ram_opt.optimize(ram);
+		mmio_opt.optimize(mmio);
+
+		printf("\n--[ result ]---------------\n");
+		bool pass = ram[3].op == rv_op_lw && ram[4].op == rv_op_addi && ram[4].rs1 == rv_ireg_a3 &&
+			ram_opt.rle == 1 && mmio[4].op == rv_op_lw && mmio_opt.rle == 0;
+		printf("ram rle=%zu mmio rle=%zu\n", ram_opt.rle, mmio_opt.rle);
+		printf("%s\n", pass ? "PASS" : "FAIL");
+		if (pass) tests_passed++;
+		total_tests++;
+	}
+
+	void test_loop_1()
+	{
+		P proc;
+		assembler as;
+
+		asm_addi(as, rv_ireg_a0, rv_ireg_zero, 0);
+		asm_addi(as, rv_ireg_a1, rv_ireg_zero, 10);
+		asm_lui(as, rv_ireg_a2, 0x12345000);
+		asm_add(as, rv_ireg_a0, rv_ireg_a0, rv_ireg_a2);
+		asm_addi(as, rv_ireg_a1, rv_ireg_a1, -1);
+		asm_bne(as, rv_ireg_a1, rv_ireg_zero, -12);
+		asm_ebreak(as);
+		as.link();
+
+		run_test(__func__, proc, (addr_t)as.get_section(".text")->buf.data(), 42);
+	}
+
+	void test_evict_1()
+	{
+		P proc;
+		assembler as;
+		const int cold_blocks = 512;
+
+		printf("\n=========================================================\n");
+		printf("TEST: %s\n", __func__);
+
+		/* a hot loop that calls a new cold block each iteration */
+		asm_addi(as, rv_ireg_s1, rv_ireg_zero, cold_blocks);
+		asm_auipc(as, rv_ireg_s2, 0);
+		asm_addi(as, rv_ireg_s2, rv_ireg_s2, 44);
+		asm_addi(as, rv_ireg_t0, rv_ireg_zero, 100);
+		asm_addi(as, rv_ireg_a0, rv_ireg_a0, 1);
+		asm_addi(as, rv_ireg_t0, rv_ireg_t0, -1);
+		asm_bne(as, rv_ireg_t0, rv_ireg_zero, -8);
+		asm_jalr(as, rv_ireg_ra, rv_ireg_s2, 0);
+		asm_addi(as, rv_ireg_s2, rv_ireg_s2, 8);
+		asm_addi(as, rv_ireg_s1, rv_ireg_s1, -1);
+		asm_bne(as, rv_ireg_s1, rv_ireg_zero, -28);
+		asm_ebreak(as);
+		for (int i = 0; i < cold_blocks; i++) {
+			asm_addi(as, rv_ireg_a1, rv_ireg_a1, 1);
+			asm_jalr(as, rv_ireg_zero, rv_ireg_ra, 0);
+		}
+		as.link();
+
+		/* create 256MB RAM at 256MB */
+		proc.mmu.mem->brk = proc.mmu.mem->heap_begin = proc.mmu.mem->heap_end = 0x10000000;
+		proc.ireg[rv_ireg_a0] = 0x20000000;
+		abi_sys_brk(proc);
+		clear_registers(proc);
+
+		/* translate blocks into a cache that holds a fraction of them */
+		proc.log = proc_log_jit_trap;
+		proc.memory_registers = memory_registers;
+		proc.trace_tiers = jit_tier_blocks;
+		proc.code_cache_size = 8192;
+		proc.pc = (addr_t)as.get_section(".text")->buf.data();
+		proc.init();
+		proc.run();
+
+		/* linked hot blocks are referenced on every entry and are not retranslated */
+		printf("\n--[ result ]---------------\n");
+		bool pass = proc.code_cache_evictions > 0 &&
+			proc.stat_traces < size_t(cold_blocks + 16) &&
+			proc.ireg[rv_ireg_a0].r.xu.val == u64(100 * cold_blocks) &&
+			proc.ireg[rv_ireg_a1].r.xu.val == u64(cold_blocks);
+		printf("evictions=%zu traces=%zu a0=%lld a1=%lld\n",
+			proc.code_cache_evictions, proc.stat_traces,
+			proc.ireg[rv_ireg_a0].r.xu.val, proc.ireg[rv_ireg_a1].r.xu.val);
+		printf("%s\n", pass ? "PASS" : "FAIL");
+		if (pass) tests_passed++;
+		total_tests++;
+	}
+
+	void test_native_1()
+	{
+		P proc;
+		assembler as;
+		const int calls = 200;
+
+		printf("\n=========================================================\n");
+		printf("TEST: %s\n", __func__);
+
+		/* a loop calling a guest memcpy registered as a library routine */
+		asm_lui(as, rv_ireg_s0, 0x10000000);
+		asm_addi(as, rv_ireg_s1, rv_ireg_s0, 256);
+		asm_addi(as, rv_ireg_s2, rv_ireg_zero, calls);
+		asm_addi(as, rv_ireg_a0, rv_ireg_s1, 0);
+		asm_addi(as, rv_ireg_a1, rv_ireg_s0, 0);
+		asm_addi(as, rv_ireg_a2, rv_ireg_zero, 64);
+		asm_jal(as, rv_ireg_ra, 16);
+		asm_addi(as, rv_ireg_s2, rv_ireg_s2, -1);
+		asm_bne(as, rv_ireg_s2, rv_ireg_zero, -20);
+		asm_ebreak(as);
+		asm_addi(as, rv_ireg_t0, rv_ireg_a0, 0);
+		asm_beq(as, rv_ireg_a2, rv_ireg_zero, 28);
+		asm_lbu(as, rv_ireg_t1, rv_ireg_a1, 0);
+		asm_sb(as, rv_ireg_t0, rv_ireg_t1, 0);
+		asm_addi(as, rv_ireg_a1, rv_ireg_a1, 1);
+		asm_addi(as, rv_ireg_t0, rv_ireg_t0, 1);
+		asm_addi(as, rv_ireg_a2, rv_ireg_a2, -1);
+		asm_jal(as, rv_ireg_zero, -24);
+		asm_jalr(as, rv_ireg_zero, rv_ireg_ra, 0);
+		as.link();
+
+		/* create 256MB RAM at 256MB */
+		proc.mmu.mem->brk = proc.mmu.mem->heap_begin = proc.mmu.mem->heap_end = 0x10000000;
+		proc.ireg[rv_ireg_a0] = 0x20000000;
+		abi_sys_brk(proc);
+		clear_registers(proc);
+		u8 *src = (u8*)addr_t(0x10000000), *dst = src + 256;
+		for (size_t i = 0; i < 64; i++) src[i] = u8(i * 7 + 1);
+
+		/* the routine is audited against the guest code on each call */
+		addr_t text = (addr_t)as.get_section(".text")->buf.data();
+		addr_t entry = text + 40;
+		proc.native.audit = true;
+		proc.native.entries[entry] = 0;
+		proc.native.routines.push_back(jit_native_routine{ "memcpy", jit_native_memcpy,
+			entry, 36, jit_native::hash(entry, 36), false, 0, 0 });
+
+		proc.log = proc_log_jit_trap;
+		proc.memory_registers = memory_registers;
+		proc.trace_iters = 8;
+		proc.pc = text;
+		proc.init();
+		proc.run();
+
+		/* the call in the loop trace is not inlined and reaches the host routine */
+		printf("\n--[ result ]---------------\n");
+		auto &r = proc.native.routines[0];
+		bool pass = r.calls > size_t(calls / 2) && r.mismatches == 0 &&
+			memcmp(src, dst, 64) == 0 &&
+			proc.ireg[rv_ireg_a0].r.xu.val == u64(addr_t(dst));
+		printf("calls=%zu mismatches=%zu traces=%zu\n", r.calls, r.mismatches, proc.stat_traces);
+		printf("%s\n", pass ? "PASS" : "FAIL");
+		if (pass) tests_passed++;
+		total_tests++;
+	}
+
 	void print_summary()
 	{
 		printf("\n%d/%d tests successful\n", tests_passed, total_tests);
@@ -1971,6 +2464,7 @@ void test(T &test)
 	test.test_srai_2();
 	test.test_srai_3();
 	test.test_srai_4();
+	test.test_rotd_1();
 	test.test_addiw_1();
 	test.test_addiw_2();
 	test.test_addiw_3();
@@ -2031,6 +2525,22 @@ void test(T &test)
 	test.test_sb_lbu_2();
 	test.test_sb_lbu_3();
 	test.test_sb_lbu_4();
+	test.test_fadd_d_1();
+	test.test_fadd_s_1();
+	test.test_fmadd_d_1();
+	test.test_fsgnj_d_1();
+	test.test_feq_d_1();
+	test.test_fcvt_w_d_1();
+	test.test_fsd_fld_1();
+	test.test_amoadd_w_1();
+	test.test_amomin_d_1();
+	test.test_lr_sc_1();
+	test.test_regalloc_1();
+	test.test_optimize_1();
+	test.test_optimize_2();
+	test.test_loop_1();
+	test.test_evict_1();
+	test.test_native_1();
 	test.print_summary();
 }
 
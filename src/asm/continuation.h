@@ -0,0 +1,75 @@
+//
+//  continuation.h
+//
+
+#ifndef rv_continuation_h
+#define rv_continuation_h
+
+namespace riscv {
+
+	/*
+	 * Continuation scan
+	 *
+	 * Scans a range of code for the addresses that start basic blocks
+	 * and passes each one to add with the kind of control transfer
+	 * that reaches it. Code is read from host addresses start to end
+	 * and guest addresses are the host address minus pc_bias. The
+	 * decode function fills in a decompressed instruction. Links
+	 * after jumps are only reported inside the range, targets are
+	 * reported wherever they are.
+	 */
+
+	enum continuation_kind
+	{
+		continuation_link,          /* instruction after jal or jalr */
+		continuation_jump,          /* jal target */
+		continuation_call,          /* auipc and jalr target */
+		continuation_branch,        /* branch target */
+		continuation_fall_through   /* instruction after a branch */
+	};
+
+	template <typename T, typename D, typename F>
+	void scan_continuations(addr_t start, addr_t end, addr_t pc_bias, D decode, F add)
+	{
+		T dec, prev;
+		addr_t pc = start;
+		addr_t pc_offset;
+		while (pc < end) {
+			dec = T();
+			dec.pc = pc - pc_bias;
+			dec.inst = inst_fetch(pc, pc_offset);
+			if (pc_offset == 0) {
+				pc += 2;
+				continue;
+			}
+			decode(dec, dec.inst);
+			switch (dec.op) {
+				case rv_op_jal:
+					add(dec.pc + dec.imm, continuation_jump);
+					if (pc + pc_offset < end) add(dec.pc + pc_offset, continuation_link);
+					break;
+				case rv_op_jalr:
+					if (prev.op == rv_op_auipc && prev.rd == dec.rs1 && dec.rs1 != rv_ireg_zero) {
+						add(prev.pc + prev.imm + dec.imm, continuation_call);
+					}
+					if (pc + pc_offset < end) add(dec.pc + pc_offset, continuation_link);
+					break;
+				default:
+					break;
+			}
+			switch (dec.codec) {
+				case rv_codec_sb:
+					add(dec.pc + dec.imm, continuation_branch);
+					add(dec.pc + pc_offset, continuation_fall_through);
+					break;
+				default:
+					break;
+			}
+			prev = dec;
+			pc += pc_offset;
+		}
+	}
+
+}
+
+#endif
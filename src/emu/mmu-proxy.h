@@ -50,18 +50,7 @@ namespace riscv {
 		{
 			/* record pc histogram using machine physical address */
 			if (proc.log & proc_log_hist_pc) {
-				size_t iters = proc.histogram_add_pc(pc);
-				if (proc.log & proc_log_jit_trap) {
-					switch (iters) {
-						case P::hostspot_trace_skip:
-							break;
-						default:
-							if (iters >= proc.trace_iters) {
-								proc.raise(P::internal_cause_hotspot, pc);
-							}
-							break;
-					}
-				}
+				proc.histogram_add_pc(pc);
 			}
 			return riscv::inst_fetch(pc, pc_offset);
 		}
@@ -71,9 +60,13 @@ namespace riscv {
 		template <typename P, typename T>
 		void amo(P &proc, const amo_op a_op, UX va, T &val1, T val2)
 		{
-			val1 = UX(*(T*)addr_t(va & (memory_top - 1)));
-			val2 = amo_fn<UX>(a_op, val1, val2);
-			*((T*)addr_t(va & (memory_top - 1))) = val2;
+			/* guest threads may update the same word, retry until it is unchanged */
+			T *p = (T*)addr_t(va & (memory_top - 1));
+			T old = __atomic_load_n(p, __ATOMIC_RELAXED), val;
+			do {
+				val1 = UX(old);
+				val = amo_fn<UX>(a_op, val1, val2);
+			} while (!__atomic_compare_exchange_n(p, &old, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 		}
 
 		template <typename P, typename T> void load(P &proc, UX va, T &val)
@@ -423,9 +423,9 @@ namespace riscv {
 			}
 
 			switch (op) {
-				case op_fetch: proc.raise(rv_cause_fault_fetch, va);
-				case op_load:  proc.raise(rv_cause_fault_load, va);
-				case op_store: proc.raise(rv_cause_fault_store, va);
+				case op_fetch: proc.raise(rv_cause_fault_fetch, va); break;
+				case op_load:  proc.raise(rv_cause_fault_load, va);  break;
+				case op_store: proc.raise(rv_cause_fault_store, va); break;
 			}
 
 			return 0;
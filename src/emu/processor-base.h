@@ -149,7 +149,26 @@ namespace riscv {
 			xlen = sizeof(ux) << 3,   /* Size of integer register in bits */
 			ireg_count = IREG_COUNT,  /* Number of integer registers  */
 			freg_count = FREG_COUNT,  /* Number of floating point registers */
-			trace_l1_size = 1024
+			trace_l1_size = 1024,     /* Default trace lookup L1 entries */
+			trace_l2_size = 16384,    /* Default trace lookup L2 entries */
+			trace_l2_ways = 4,        /* Trace lookup L2 set associativity */
+			trace_l2_hash = 0x45d9f3b, /* Trace lookup L2 hash multiplier */
+			trace_l2_shift = 16,      /* Trace lookup L2 hash shift */
+			trace_tlb_size = 256,     /* Trace data TLB entries */
+			trace_rstack_size = 64    /* Shadow return stack entries */
+		};
+
+		/* counters updated by translated code */
+
+		enum {
+			trace_stat_lookups,       /* Trace lookup stub entries */
+			trace_stat_l1_misses,     /* Trace lookup L1 misses */
+			trace_stat_l2_misses,     /* Trace lookup L2 misses */
+			trace_stat_exit_tramp,    /* Side exits to the emulator */
+			trace_stat_jmp_tramp,     /* Jumps to untranslated targets */
+			trace_stat_trace_end,     /* Trace ends, unsupported instruction or length limit */
+			trace_stat_budget,        /* Instruction budget exits */
+			trace_stat_count
 		};
 
 		/* Registers */
@@ -164,6 +183,7 @@ namespace riscv {
 		u16 hart_id;                  /* Hardware Thread Identifier */
 		u32 log;                      /* Log flags */
 		SX lr;                        /* Load Reservation (TODO - global) */
+		SX lr_val;                    /* Load Reservation value (JIT) */
 		SX cause;                     /* Fault cause */
 		SX badaddr;                   /* Fault address */
 		jmp_buf env;                  /* Fault handler */
@@ -173,11 +193,23 @@ namespace riscv {
 		UX exceptions       : 1;      /* Trap on exceptions */
 		UX update_instret   : 1;      /* Update instret (JIT) */
 		UX memory_registers : 1;      /* Memory backed registers (JIT) */
+		UX trace_mmu        : 1;      /* Loads and stores call the MMU (JIT) */
+		UX trace_budget     : 1;      /* Return to the emulator at trace_stop (JIT) */
 		UX breakpoint;                /* Breakpoint */
 		UX trace_iters;               /* Trace iterations (JIT) */
 
-		u64 trace_pc[trace_l1_size];
-		u64 trace_fn[trace_l1_size];
+		u64 *trace_l1;                /* Trace lookup L1, direct mapped pc fn pairs (JIT) */
+		u64 trace_l1_mask;            /* Trace lookup L1 index mask (JIT) */
+		u64 *trace_l2;                /* Trace lookup L2, cache line sets of pc fn pairs (JIT) */
+		u64 trace_l2_mask;            /* Trace lookup L2 set index mask (JIT) */
+		u64 trace_ctx;                /* Translation context xored into trace pcs (JIT) */
+		u64 trace_stop;               /* Instret at which traces return (JIT) */
+		u64 *trace_tlb;               /* Trace data TLB, load tag, store tag, host page (JIT) */
+		u64 *trace_rstack;            /* Shadow return stack, link pc and return stub pairs (JIT) */
+		u64 trace_rsp;                /* Shadow return stack top entry offset (JIT) */
+		u64 trace_tier_up;            /* Baseline block at pc requests promotion (JIT) */
+		u64 trace_exit_key;           /* Trace whose exit ratio should be checked (JIT) */
+		u64 trace_stat[trace_stat_count]; /* Lookup and exit counters (JIT) */
 
 		/* Base ISA Control and Status Registers */
 
@@ -188,8 +220,11 @@ namespace riscv {
 		processor_base() : pc(0), ireg(), freg(),
 			node_id(0), hart_id(0), log(0), lr(0), cause(0), badaddr(0), env(),
 			running(true), debugging(false), exceptions(true),
-			update_instret(false), memory_registers(false),
-			breakpoint(0), trace_iters(0), trace_pc(), trace_fn(),
+			update_instret(false), memory_registers(false), trace_mmu(false), trace_budget(false),
+			breakpoint(0), trace_iters(0),
+			trace_l1(nullptr), trace_l1_mask(0), trace_l2(nullptr), trace_l2_mask(0),
+			trace_ctx(0), trace_stop(0), trace_tlb(nullptr),
+			trace_rstack(nullptr), trace_rsp(0), trace_tier_up(0), trace_exit_key(0), trace_stat(),
 			time(0), instret(0), fcsr(0) {}
 
 		/* Internal setjmp/longjump causes */
@@ -200,8 +235,7 @@ namespace riscv {
 			internal_cause_reset    = 0x1000,
 			internal_cause_cli      = 0x1001,
 			internal_cause_poweroff = 0x1002,
-			internal_cause_fatal    = 0x1003,
-			internal_cause_hotspot  = 0x1004
+			internal_cause_fatal    = 0x1003
 		};
 
 		/* program counter histogram sentinels */
@@ -785,6 +785,88 @@ core {
 			return -1; /* illegal instruction */
 		}
 
+		/*
+		 * JIT translation context
+		 *
+		 * Traces are keyed by virtual pc xored with the privilege mode
+		 * (canonical virtual addresses leave the top byte free) and
+		 * their code pages are revalidated against the physical pages
+		 * recorded at install time when the address space changes.
+		 */
+
+		u64 trace_context()
+		{
+			return u64(P::mode) << 56;
+		}
+
+		u64 trace_space()
+		{
+			return (u64(P::mstatus.r.vm) << 56) ^ u64(P::sptbr);
+		}
+
+		/* translate a code page without raising, returns 0 if not executable */
+		addr_t trace_code_page(addr_t va, u64 ctx)
+		{
+			typename P::mmu_type::tlb_type::tlb_entry_t* tlb_ent = nullptr;
+			typename P::ux mode = P::mode;
+			typename P::sx cause = P::cause, badaddr = P::badaddr;
+			bool exceptions = P::exceptions;
+			P::mode = ctx >> 56;
+			P::exceptions = false;
+			P::cause = 0;
+			addr_t mpa = P::mmu.template translate_addr<processor_privileged,P::mmu_type::op_fetch>
+				(*this, va, tlb_ent);
+			if (P::cause || P::mmu.fetch_access_fault(*this, P::mode, tlb_ent)) mpa = 0;
+			P::mode = mode;
+			P::exceptions = exceptions;
+			P::cause = cause;
+			P::badaddr = badaddr;
+			return mpa;
+		}
+
+		/* privilege state that affects data translation and permissions */
+		u64 trace_data_space()
+		{
+			return u64(P::mode) | (u64(P::mstatus.xu.val) & ((1ULL << mprv_shift) |
+				(u64(mpp_mask) << mpp_shift) | (1ULL << pum_shift) | (1ULL << mxr_shift) |
+				(u64(vm_mask) << vm_shift))) << 2;
+		}
+
+		/* translate a data page without raising, returns the host page or 0 */
+		addr_t trace_data_page(addr_t va, bool store)
+		{
+			typename P::mmu_type::tlb_type::tlb_entry_t* tlb_ent = nullptr;
+			typename P::sx cause = P::cause, badaddr = P::badaddr;
+			bool exceptions = P::exceptions;
+			memory_segment<typename P::ux> *seg = nullptr;
+			addr_t page = va & ~addr_t(page_size - 1), mpa, uva = 0;
+			P::exceptions = false;
+			P::cause = 0;
+			if (store) {
+				mpa = P::mmu.template translate_addr<processor_privileged,P::mmu_type::op_store>
+					(*this, page, tlb_ent);
+				if (P::cause || P::mmu.store_access_fault(*this, P::mode, tlb_ent)) mpa = 0;
+			} else {
+				mpa = P::mmu.template translate_addr<processor_privileged,P::mmu_type::op_load>
+					(*this, page, tlb_ent);
+				if (P::cause || P::mmu.load_access_fault(*this, P::mode, tlb_ent)) mpa = 0;
+			}
+			if (mpa) {
+				uva = P::mmu.mem->mpa_to_uva(seg, mpa);
+			}
+			/* only whole pages of host mapped RAM, devices have no uva and take the slow path */
+			if (!seg || seg->uva == 0 || !(seg->flags & pma_type_main) ||
+				!(seg->flags & (store ? pma_prot_write : pma_prot_read)) ||
+				mpa + page_size > addr_t(seg->mpa) + seg->size)
+			{
+				uva = 0;
+			}
+			P::exceptions = exceptions;
+			P::cause = cause;
+			P::badaddr = badaddr;
+			return uva;
+		}
+
 		void strap(typename P::ux cause, bool interrupt)
 		{
 			P::sepc = P::pc;
@@ -48,7 +48,7 @@ namespace riscv {
 				P::print_csr_registers();
 
 				/* print program counter histogram */
-				if ((P::log & proc_log_hist_pc) && !(P::log & proc_log_jit_trap)) {
+				if (P::log & proc_log_hist_pc) {
 					printf("\n");
 					printf("program counter histogram\n");
 					printf("~~~~~~~~~~~~~~~~~~~~~~~~~\n");
@@ -301,6 +301,13 @@ namespace riscv {
 		void debug_enter() {}
 		void debug_leave() {}
 
+		/* proxy code runs in one address space at guest virtual addresses */
+		u64 trace_context() { return 0; }
+		u64 trace_space() { return 0; }
+		addr_t trace_code_page(addr_t va, u64 ctx) { return va; }
+		u64 trace_data_space() { return 0; }
+		addr_t trace_data_page(addr_t va, bool store) { return 0; }
+
 		void trap(typename P::decode_type &dec, int cause)
 		{
 			/* proxy processor unconditionally exits on trap */
@@ -0,0 +1,400 @@
+//
+//  jit-arena.h
+//
+
+#ifndef rv_jit_arena_h
+#define rv_jit_arena_h
+
+namespace riscv {
+
+	/*
+	 * Code arena
+	 *
+	 * Translated code is allocated from one contiguous reservation so
+	 * traces share few iTLB entries. The reservation is aligned to the
+	 * huge page size and backed by transparent huge pages, or with
+	 * huge_tlb set by MAP_HUGETLB pages when the kernel has them.
+	 * Optimized traces are placed from the bottom of the arena and
+	 * baseline code from the top so hot code stays together; freed
+	 * ranges become holes that are coalesced and reused first fit
+	 * from the same end. Allocations are cache line aligned.
+	 *
+	 * With wx set no page of the arena is both writable and executable.
+	 * The arena is a memfd mapped twice, an executable view where code
+	 * runs and a writable view at another address; write_begin returns
+	 * the writable alias of a code address so running code keeps its
+	 * mappings. Without memfd the arena has one executable view and
+	 * write_begin and write_end make only the written pages writable
+	 * for the duration of the write. Translated code must not write to
+	 * its own pages.
+	 */
+
+	struct jit_code_arena
+	{
+		enum {
+			align = 64,
+			huge_page_size = 2 << 20
+		};
+
+		u8 *base;
+		u8 *wbase;                               /* writable view with wx */
+		size_t size;
+		size_t map_size;
+		bool wx;
+		bool huge_tlb;
+		bool huge_thp;
+		size_t hot_top;                          /* end of the hot extent */
+		size_t cold_bottom;                      /* start of the cold extent */
+		size_t used;
+		size_t peak;
+		size_t allocs;
+		size_t failed;
+		std::map<size_t,size_t> holes;           /* offset and length of free ranges */
+		std::map<size_t,size_t> blocks;          /* offset and length of allocations */
+		std::mutex lock;
+
+		jit_code_arena() : base(nullptr), wbase(nullptr), size(0), map_size(0), wx(false),
+			huge_tlb(false), huge_thp(false), hot_top(0), cold_bottom(0),
+			used(0), peak(0), allocs(0), failed(0) {}
+		~jit_code_arena() { destroy(); }
+
+		jit_code_arena(const jit_code_arena&) = delete;
+		jit_code_arena& operator=(const jit_code_arena&) = delete;
+
+		bool is_open() { return base != nullptr; }
+
+		bool contains(const void *p)
+		{
+			return base && (const u8*)p >= base && (const u8*)p < base + size;
+		}
+
+		int prot()
+		{
+			return wx ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE | PROT_EXEC;
+		}
+
+		/* over reserve then trim to a huge page aligned range */
+		u8 *reserve(int prot)
+		{
+			map_size = size + huge_page_size;
+			void *p = mmap(nullptr, map_size, prot,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (p == MAP_FAILED) {
+				debug("jit-arena: error: mmap: %s", strerror(errno));
+				map_size = 0;
+				return nullptr;
+			}
+			uintptr_t start = uintptr_t(p);
+			uintptr_t aligned = (start + huge_page_size - 1) & ~uintptr_t(huge_page_size - 1);
+			if (aligned > start) munmap(p, aligned - start);
+			if (start + map_size > aligned + size) {
+				munmap((void*)(aligned + size), start + map_size - (aligned + size));
+			}
+			map_size = size;
+			return (u8*)aligned;
+		}
+
+		/* map a memfd at an executable and a writable address */
+		bool create_dual(bool use_huge_tlb)
+		{
+#if defined (MFD_CLOEXEC)
+			int fd = -1;
+#if defined (MFD_HUGETLB)
+			if (use_huge_tlb) {
+				fd = memfd_create("rv8-jit-arena", MFD_CLOEXEC | MFD_HUGETLB);
+				if (fd >= 0 && ftruncate(fd, size) < 0) {
+					close(fd);
+					fd = -1;
+				}
+				if (fd < 0) {
+					debug("jit-arena: MFD_HUGETLB unavailable: %s", strerror(errno));
+				}
+				huge_tlb = fd >= 0;
+			}
+#endif
+			if (fd < 0) {
+				fd = memfd_create("rv8-jit-arena", MFD_CLOEXEC);
+				if (fd >= 0 && ftruncate(fd, size) < 0) {
+					close(fd);
+					fd = -1;
+				}
+			}
+			if (fd < 0) {
+				debug("jit-arena: memfd unavailable: %s", strerror(errno));
+				huge_tlb = false;
+				return false;
+			}
+			u8 *p = reserve(PROT_NONE);
+			if (p && mmap(p, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+				debug("jit-arena: error: mmap: %s", strerror(errno));
+				munmap(p, size);
+				p = nullptr;
+			}
+			void *w = p ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+			close(fd);
+			if (w == MAP_FAILED) {
+				if (p) munmap(p, size);
+				map_size = 0;
+				huge_tlb = false;
+				return false;
+			}
+			base = p;
+			wbase = (u8*)w;
+#if defined (MADV_HUGEPAGE)
+			if (!huge_tlb) {
+				huge_thp = madvise(base, size, MADV_HUGEPAGE) == 0;
+			}
+#endif
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		/* reserve the arena, size is rounded up to whole huge pages */
+		bool create(size_t arena_size, bool use_huge_tlb, bool use_wx)
+		{
+			destroy();
+			wx = use_wx;
+			size = (arena_size + huge_page_size - 1) & ~size_t(huge_page_size - 1);
+			if (size == 0) return false;
+			if (wx && create_dual(use_huge_tlb)) {
+				hot_top = 0;
+				cold_bottom = size;
+				return true;
+			}
+			void *p = MAP_FAILED;
+#if defined (MAP_HUGETLB)
+			if (use_huge_tlb) {
+				p = mmap(nullptr, size, prot(),
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+				if (p != MAP_FAILED) {
+					huge_tlb = true;
+					map_size = size;
+					base = (u8*)p;
+				} else {
+					debug("jit-arena: MAP_HUGETLB unavailable: %s", strerror(errno));
+				}
+			}
+#endif
+			if (!base) {
+				base = reserve(prot());
+				if (!base) {
+					size = 0;
+					return false;
+				}
+#if defined (MADV_HUGEPAGE)
+				huge_thp = madvise(base, size, MADV_HUGEPAGE) == 0;
+#endif
+			}
+			hot_top = 0;
+			cold_bottom = size;
+			return true;
+		}
+
+		void destroy()
+		{
+			if (base) {
+				munmap(base, map_size);
+				base = nullptr;
+			}
+			if (wbase) {
+				munmap(wbase, map_size);
+				wbase = nullptr;
+			}
+			holes.clear();
+			blocks.clear();
+			size = map_size = used = peak = 0;
+			huge_tlb = huge_thp = false;
+		}
+
+		/* change the protection of the pages holding a range */
+		void protect(void *p, size_t len, int prot)
+		{
+			uintptr_t page_mask = (huge_tlb ? huge_page_size : sysconf(_SC_PAGESIZE)) - 1;
+			uintptr_t start = uintptr_t(p) & ~page_mask;
+			uintptr_t end = (uintptr_t(p) + len + page_mask) & ~page_mask;
+			if (mprotect((void*)start, end - start, prot) < 0) {
+				panic("jit-arena: mprotect: %s", strerror(errno));
+			}
+		}
+
+		/* returns the address to write code at p through */
+		u8 *write_begin(void *p, size_t len)
+		{
+			if (!wx || !contains(p)) return (u8*)p;
+			if (wbase) return wbase + ((u8*)p - base);
+			protect(p, len, PROT_READ | PROT_WRITE);
+			return (u8*)p;
+		}
+
+		void write_end(void *p, size_t len)
+		{
+			if (wx && !wbase && contains(p)) {
+				protect(p, len, prot());
+			}
+		}
+
+		/* store a value to code memory */
+		template <typename V>
+		void store(void *p, V val)
+		{
+			u8 *w = write_begin(p, sizeof(V));
+			memcpy(w, &val, sizeof(V));
+			write_end(p, sizeof(V));
+		}
+
+		size_t fit_hot(size_t len)
+		{
+			for (auto hi = holes.begin(); hi != holes.end() && hi->first < hot_top; hi++) {
+				if (hi->second >= len) return take_hole(hi, hi->first, len);
+			}
+			if (hot_top + len > cold_bottom) return size_t(-1);
+			size_t offset = hot_top;
+			hot_top += len;
+			return offset;
+		}
+
+		size_t fit_cold(size_t len)
+		{
+			for (auto hi = holes.rbegin(); hi != holes.rend() && hi->first >= cold_bottom; hi++) {
+				if (hi->second >= len) {
+					return take_hole(std::prev(hi.base()), hi->first + hi->second - len, len);
+				}
+			}
+			if (cold_bottom < hot_top + len) return size_t(-1);
+			cold_bottom -= len;
+			return cold_bottom;
+		}
+
+		size_t take_hole(std::map<size_t,size_t>::iterator hi, size_t offset, size_t len)
+		{
+			/* split the hole around the allocation */
+			size_t hole_start = hi->first, hole_end = hi->first + hi->second;
+			holes.erase(hi);
+			if (offset > hole_start) holes[hole_start] = offset - hole_start;
+			if (offset + len < hole_end) holes[offset + len] = hole_end - (offset + len);
+			return offset;
+		}
+
+		void *alloc(size_t len, bool hot)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			len = (len + align - 1) & ~size_t(align - 1);
+			size_t offset = hot ? fit_hot(len) : fit_cold(len);
+			if (offset == size_t(-1)) {
+				failed++;
+				return nullptr;
+			}
+			blocks[offset] = len;
+			used += len;
+			peak = std::max(peak, used);
+			allocs++;
+			return base + offset;
+		}
+
+		void release(void *p)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto bi = blocks.find(size_t((u8*)p - base));
+			if (bi == blocks.end()) return;
+			size_t offset = bi->first, len = bi->second;
+			blocks.erase(bi);
+			used -= len;
+
+			/* coalesce with neighbouring holes */
+			auto next = holes.find(offset + len);
+			if (next != holes.end()) {
+				len += next->second;
+				holes.erase(next);
+			}
+			auto prev = holes.lower_bound(offset);
+			if (prev != holes.begin() && (--prev)->first + prev->second == offset) {
+				offset = prev->first;
+				len += prev->second;
+				holes.erase(prev);
+			}
+
+			/* return holes at the end of an extent to the free middle */
+			if (offset + len == hot_top) {
+				hot_top = offset;
+			} else if (offset == cold_bottom) {
+				cold_bottom += len;
+			} else {
+				holes[offset] = len;
+			}
+		}
+
+		/* relocate and copy assembled code into the arena */
+		Error add(TraceFunc *fn, CodeHolder *code, bool hot)
+		{
+			size_t len = code->getCodeSize();
+			void *p = alloc(len, hot);
+			if (!p) return kErrorNoVirtualMemory;
+			u8 *w = write_begin(p, len);
+			size_t reloc_size = code->relocate(w, uint64_t(uintptr_t(p)));
+			write_end(p, len);
+			if (reloc_size == 0) {
+				release(p);
+				return kErrorInvalidState;
+			}
+			__builtin___clear_cache((char*)p, (char*)p + reloc_size);
+			*fn = (TraceFunc)p;
+			return kErrorOk;
+		}
+
+		/* relocate code for an arena address without writing to the arena */
+		void *relocate(std::vector<u8> &image, CodeHolder *code, bool hot)
+		{
+			size_t len = code->getCodeSize();
+			void *p = alloc(len, hot);
+			if (!p) return nullptr;
+			image.resize(len);
+			size_t reloc_size = code->relocate(image.data(), uint64_t(uintptr_t(p)));
+			if (reloc_size == 0) {
+				release(p);
+				return nullptr;
+			}
+			image.resize(reloc_size);
+			return p;
+		}
+
+		void install(void *p, std::vector<u8> &image)
+		{
+			u8 *w = write_begin(p, image.size());
+			memcpy(w, image.data(), image.size());
+			write_end(p, image.size());
+			__builtin___clear_cache((char*)p, (char*)p + image.size());
+		}
+
+		void print_stats()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			size_t hole_bytes = 0, largest = 0;
+			for (auto &hole : holes) {
+				hole_bytes += hole.second;
+				largest = std::max(largest, hole.second);
+			}
+			size_t extent = hot_top + (size - cold_bottom);
+			printf("\n");
+			printf("jit code arena\n");
+			printf("~~~~~~~~~~~~~~\n");
+			printf("reserved       : %zu\n", size);
+			printf("pages          : %s\n", huge_tlb ? "hugetlb" : huge_thp ? "thp" : "base");
+			printf("wx             : %s\n", !wx ? "off" : wbase ? "dual mapped" : "page protect");
+			printf("used           : %zu\n", used);
+			printf("peak           : %zu\n", peak);
+			printf("hot extent     : %zu\n", hot_top);
+			printf("cold extent    : %zu\n", size - cold_bottom);
+			printf("allocations    : %zu\n", allocs);
+			printf("failed         : %zu\n", failed);
+			printf("holes          : %zu\n", holes.size());
+			printf("hole bytes     : %zu\n", hole_bytes);
+			printf("largest hole   : %zu\n", largest);
+			printf("fragmentation  : %.1f%%\n", extent ? hole_bytes * 100.0 / extent : 0.0);
+		}
+	};
+
+}
+
+#endif
@@ -0,0 +1,318 @@
+//
+//  jit-cachefile.h
+//
+
+#ifndef rv_jit_cachefile_h
+#define rv_jit_cachefile_h
+
+namespace riscv {
+
+	/*
+	 * Persistent translation cache
+	 *
+	 * Traces are saved as their decoded instruction streams which are
+	 * independent of host code addresses. Emitted code embeds absolute
+	 * addresses of the lookup stub, load store thunks and linked traces
+	 * so traces are re-emitted at startup and linked with the normal
+	 * jump fixups. The cache file is keyed by the ELF content hash, load
+	 * address and a hash of the opcode tables and is appended to as new
+	 * traces are translated. Records with out of range fields are
+	 * skipped and each trace carries a hash of the guest code it was
+	 * translated from, which the loader compares with guest memory.
+	 * The version is bumped when the meaning of a jit op changes.
+	 *
+	 * An ahead-of-time sidecar written by `rv-bin aot` uses the same
+	 * records with its own magic. It holds the basic blocks found by
+	 * a static scan of the image, which are emitted as baseline blocks
+	 * at startup and promoted to traces when hot.
+	 */
+
+	struct jit_cachefile_header
+	{
+		char   magic[8];                           /* "rv8-jitc" or "rv8-aotc" */
+		u32    version;                            /* file format version */
+		u32    xlen;                               /* guest register width */
+		u64    load_addr;                          /* ELF load address */
+		u64    op_table;                           /* opcode table hash */
+		u8     elf_hash[SHA512_OUTPUT_BYTES];      /* ELF content hash */
+	};
+
+	struct jit_cachefile_trace
+	{
+		u64    pc;                                 /* trace entry program counter */
+		u32    count;                              /* number of instructions */
+		u32    code_hash;                          /* hash of the guest code */
+	};
+
+	struct jit_cachefile_inst
+	{
+		u64    pc;
+		u64    inst;
+		s32    imm;
+		u16    op;
+		u8     codec;
+		u8     rd;
+		u8     rs1;
+		u8     rs2;
+		u8     rs3;
+		u8     rm;
+		u8     fence;                              /* pred:4 succ:4 */
+		u8     flags;                              /* aq:1 rl:1 brt:1 brc:1 sz:4 */
+		u8     ext;                                /* seg:1 */
+		u8     reserved;
+	};
+
+	template <typename D>
+	struct jit_cachefile
+	{
+		typedef D decode_type;
+
+		enum {
+			version = 3,
+			max_trace_length = 65536,
+			max_rv_op = rv_op_fsflagsi,
+			max_jit_op = jit_op_native,
+			max_codec = rv_codec_css_sqsp
+		};
+
+		std::string filename;
+		jit_cachefile_header header;
+		std::vector<std::pair<addr_t,addr_t>> text;
+		FILE *file;
+
+		jit_cachefile() : header(), file(nullptr) {}
+		~jit_cachefile() { close(); }
+
+		jit_cachefile(const jit_cachefile&) = delete;
+		jit_cachefile& operator=(const jit_cachefile&) = delete;
+
+		bool is_open() { return file != nullptr; }
+
+		static bool hash_file(std::string path, u8 hash[SHA512_OUTPUT_BYTES])
+		{
+			sha512_ctx_t ctx;
+			u8 buf[65536];
+			ssize_t len;
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+			sha512_init(&ctx);
+			while ((len = ::read(fd, buf, sizeof(buf))) > 0) {
+				sha512_update(&ctx, buf, len);
+			}
+			::close(fd);
+			if (len < 0) return false;
+			sha512_final(&ctx, hash);
+			return true;
+		}
+
+		/* opcode and codec numbering the saved records depend on */
+		static u64 op_table_hash()
+		{
+			sha512_ctx_t ctx;
+			u8 hash[SHA512_OUTPUT_BYTES];
+			u32 limits[] = { max_rv_op, max_jit_op, max_codec, u32(sizeof(jit_cachefile_inst)) };
+			sha512_init(&ctx);
+			sha512_update(&ctx, (const u8*)limits, sizeof(limits));
+			for (size_t op = 0; op <= max_rv_op; op++) {
+				u8 codec = u8(rv_inst_codec[op]);
+				sha512_update(&ctx, (const u8*)rv_inst_format[op], strlen(rv_inst_format[op]));
+				sha512_update(&ctx, &codec, 1);
+			}
+			sha512_final(&ctx, hash);
+			u64 id;
+			memcpy(&id, hash, sizeof(id));
+			return id;
+		}
+
+		/* set the header for an ELF image and collect its text ranges */
+		bool init(const char *magic, std::string elf_filename, elf_file &elf, u32 xlen, addr_t load_addr)
+		{
+			close();
+			memcpy(header.magic, magic, sizeof(header.magic));
+			header.version = version;
+			header.xlen = xlen;
+			header.load_addr = load_addr;
+			header.op_table = op_table_hash();
+			if (!hash_file(elf_filename, header.elf_hash)) {
+				debug("jit-cache: error: can't hash %s: %s", elf_filename.c_str(), strerror(errno));
+				return false;
+			}
+			text.clear();
+			for (auto &phdr : elf.phdrs) {
+				if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+					text.push_back(std::pair<addr_t,addr_t>(phdr.p_vaddr, phdr.p_vaddr + phdr.p_filesz));
+				}
+			}
+			return true;
+		}
+
+		/* open the cache file for an ELF image in the cache directory */
+		bool open(std::string dirname, std::string elf_filename, elf_file &elf, u32 xlen, addr_t load_addr)
+		{
+			if (!init("rv8-jitc", elf_filename, elf, xlen, load_addr)) return false;
+			if (mkdir(dirname.c_str(), 0755) < 0 && errno != EEXIST) {
+				debug("jit-cache: error: mkdir: %s: %s", dirname.c_str(), strerror(errno));
+				return false;
+			}
+			std::string key;
+			for (size_t i = 0; i < 16; i++) {
+				key += format_string("%02x", header.elf_hash[i]);
+			}
+			filename = dirname + "/" + key + format_string("-%llx.jit", (u64)load_addr);
+			return true;
+		}
+
+		/* open an ahead-of-time sidecar for an ELF image */
+		bool open_aot(std::string aot_filename, std::string elf_filename, elf_file &elf, u32 xlen, addr_t load_addr)
+		{
+			if (!init("rv8-aotc", elf_filename, elf, xlen, load_addr)) return false;
+			filename = aot_filename;
+			return true;
+		}
+
+		static void encode(jit_cachefile_inst &ent, decode_type &dec)
+		{
+			memset(&ent, 0, sizeof(ent));
+			ent.pc = dec.pc;
+			ent.inst = dec.inst;
+			ent.imm = dec.imm;
+			ent.op = dec.op;
+			ent.codec = dec.codec;
+			ent.rd = dec.rd;
+			ent.rs1 = dec.rs1;
+			ent.rs2 = dec.rs2;
+			ent.rs3 = dec.rs3;
+			ent.rm = dec.rm;
+			ent.fence = (dec.pred << 4) | dec.succ;
+			ent.flags = dec.aq | (dec.rl << 1) | (dec.brt << 2) | (dec.brc << 3) | (dec.sz << 4);
+			ent.ext = dec.seg;
+		}
+
+		/* a corrupt record must not index the emitter's tables out of range */
+		static bool valid_inst(jit_cachefile_inst &ent)
+		{
+			bool op = ent.op <= max_rv_op || (ent.op >= jit_op_la && ent.op <= max_jit_op);
+			return op && ent.codec <= max_codec && ent.rd < 32 && ent.rs1 < 32 &&
+				ent.rs2 < 32 && ent.rs3 < 32 && ent.rm < 8 && (ent.ext & ~1) == 0;
+		}
+
+		static void decode(decode_type &dec, jit_cachefile_inst &ent)
+		{
+			dec.pc = ent.pc;
+			dec.inst = ent.inst;
+			dec.imm = ent.imm;
+			dec.op = ent.op;
+			dec.codec = ent.codec;
+			dec.rd = ent.rd;
+			dec.rs1 = ent.rs1;
+			dec.rs2 = ent.rs2;
+			dec.rs3 = ent.rs3;
+			dec.rm = ent.rm;
+			dec.pred = ent.fence >> 4;
+			dec.succ = ent.fence & 0xf;
+			dec.aq = ent.flags & 1;
+			dec.rl = (ent.flags >> 1) & 1;
+			dec.brt = (ent.flags >> 2) & 1;
+			dec.brc = (ent.flags >> 3) & 1;
+			dec.sz = ent.flags >> 4;
+			dec.seg = ent.ext & 1;
+		}
+
+		/* read saved traces then reopen the file for appending unless read only */
+		template <typename F>
+		size_t load(F fn, bool append = true)
+		{
+			size_t count = 0;
+			jit_cachefile_header hdr;
+			FILE *in = fopen(filename.c_str(), "rb");
+			bool valid = in && fread(&hdr, sizeof(hdr), 1, in) == 1 &&
+				memcmp(&hdr, &header, sizeof(hdr)) == 0;
+			if (valid) {
+				jit_cachefile_trace ent;
+				std::vector<jit_cachefile_inst> insts;
+				while (fread(&ent, sizeof(ent), 1, in) == 1) {
+					if (ent.count == 0 || ent.count > max_trace_length) break;
+					insts.resize(ent.count);
+					if (fread(insts.data(), sizeof(jit_cachefile_inst), ent.count, in) != ent.count) break;
+					std::vector<decode_type> trace(ent.count);
+					bool ok = true;
+					for (size_t i = 0; i < ent.count && ok; i++) {
+						ok = valid_inst(insts[i]);
+						decode(trace[i], insts[i]);
+					}
+					if (!ok) {
+						debug("jit-cache: %s: skipping invalid trace at 0x%llx", filename.c_str(), (u64)ent.pc);
+						continue;
+					}
+					fn(addr_t(ent.pc), trace, ent.code_hash);
+					count++;
+				}
+			}
+			if (in) fclose(in);
+			if (!append) {
+				if (!valid) {
+					debug("jit-cache: %s is missing or does not match this image", filename.c_str());
+				}
+				return count;
+			}
+			file = fopen(filename.c_str(), valid ? "ab" : "wb");
+			if (!file) {
+				debug("jit-cache: error: fopen: %s: %s", filename.c_str(), strerror(errno));
+			} else if (!valid) {
+				fwrite(&header, sizeof(header), 1, file);
+				fflush(file);
+			}
+			return count;
+		}
+
+		/* truncate the file and write the header */
+		bool create()
+		{
+			close();
+			file = fopen(filename.c_str(), "wb");
+			if (!file) {
+				debug("jit-cache: error: fopen: %s: %s", filename.c_str(), strerror(errno));
+				return false;
+			}
+			fwrite(&header, sizeof(header), 1, file);
+			fflush(file);
+			return true;
+		}
+
+		bool in_text(addr_t pc)
+		{
+			for (auto &r : text) {
+				if (pc >= r.first && pc < r.second) return true;
+			}
+			return false;
+		}
+
+		/* append a trace if all of its instructions come from the ELF image */
+		void save(addr_t pc, std::vector<decode_type> &trace, u32 code_hash = 0)
+		{
+			if (!file || trace.size() == 0 || trace.size() > max_trace_length) return;
+			for (auto &dec : trace) {
+				if (!in_text(dec.pc)) return;
+			}
+			jit_cachefile_trace ent = { u64(pc), u32(trace.size()), code_hash };
+			std::vector<jit_cachefile_inst> insts(trace.size());
+			for (size_t i = 0; i < trace.size(); i++) {
+				encode(insts[i], trace[i]);
+			}
+			fwrite(&ent, sizeof(ent), 1, file);
+			fwrite(insts.data(), sizeof(jit_cachefile_inst), insts.size(), file);
+			fflush(file);
+		}
+
+		void close()
+		{
+			if (file) {
+				fclose(file);
+				file = nullptr;
+			}
+		}
+	};
+
+}
+
+#endif
@@ -27,22 +27,23 @@ namespace riscv {
 		u8     brt  : 1;     /* branch target */
 		u8     brc  : 1;     /* branch condition */
 		u8     sz   : 4;     /* fused instruction size */
+		u8     seg  : 1;     /* trace tree segment entry */
 
 		jit_decode()
 			: pc(0), inst(0), imm(0), op(0), codec(0), rd(0), rs1(0), rs2(0), rs3(0),
-			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0) {}
+			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0), seg(0) {}
 
 		jit_decode(addr_t pc, u64 inst, u16 op, u8 rd, s32 imm)
 			: pc(pc), inst(inst), imm(imm), op(op), codec(0), rd(rd), rs1(0), rs2(0), rs3(0),
-			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0) {}
+			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0), seg(0) {}
 
 		jit_decode(addr_t pc, u64 inst, u16 op, u8 rd, u8 rs1, s32 imm)
 			: pc(pc), inst(inst), imm(imm), op(op), codec(0), rd(rd), rs1(rs1), rs2(0), rs3(0),
-			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0) {}
+			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0), seg(0) {}
 
 		jit_decode(addr_t pc, u64 inst, u16 op, u8 rd, u8 rs1, u8 rs2, s32 imm)
 			: pc(pc), inst(inst), imm(imm), op(op), codec(0), rd(rd), rs1(rs1), rs2(rs2), rs3(0),
-			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0) {}
+			  rm(0), pred(0), succ(0), aq(0), rl(0), brt(0), brc(0), sz(0), seg(0) {}
 	};
 
 	enum jit_op {
@@ -55,7 +56,21 @@ namespace riscv {
 		jit_op_rordi_rr = 1030,
 		jit_op_rordi_lr = 1031,
 		jit_op_auipc_lw = 1032,
-		jit_op_auipc_ld = 1033
+		jit_op_auipc_ld = 1033,
+		jit_op_li = 1034,
+		jit_op_li_slli = 1035,
+		jit_op_slt_bnez = 1036,
+		jit_op_slt_beqz = 1037,
+		jit_op_sltu_bnez = 1038,
+		jit_op_sltu_beqz = 1039,
+		jit_op_mulh_mul = 1040,
+		jit_op_mulhu_mul = 1041,
+		jit_op_div_rem = 1042,
+		jit_op_divu_remu = 1043,
+		jit_op_lea = 1044,
+		jit_op_load_pair = 1045,
+		jit_op_store_pair = 1046,
+		jit_op_native = 1047
 	};
 
 	typedef void (*TraceFunc)(void*);
@@ -94,6 +109,38 @@ namespace riscv {
 		sw_fn sw;
 		sd_fn sd;
 	};
+
+	/*
+	 * Indirect jump inline cache, kept in the trace data of the trace
+	 * holding the jump. Ways are filled by the runloop with the targets
+	 * seen by the site and empty ways hold an odd pc which no jump
+	 * target can match. Translated code counts the hits of each way;
+	 * once all ways are filled the runloop counts misses and votes for
+	 * the most frequent missing target, and reviews the site every
+	 * jit_ic_review misses.
+	 */
+
+	enum {
+		jit_ic_ways = 4,                /* targets cached per site */
+		jit_ic_empty = 1,               /* pc of an empty way */
+		jit_ic_review = 64              /* misses with all ways filled between reviews */
+	};
+
+	struct jit_ic_ent
+	{
+		u64 pc;                         /* guest target */
+		u64 entry;                      /* trace entry address */
+	};
+
+	struct jit_ic_site
+	{
+		jit_ic_ent ent[jit_ic_ways];
+		u64 hits[jit_ic_ways];          /* entries through each way, halved at each review */
+		u64 miss;                       /* miss path, IC lookup stub or trace lookup stub */
+		u64 misses;                     /* misses since the last review */
+		u64 candidate;                  /* missing target winning the majority vote */
+		u64 votes;                      /* votes held by the candidate */
+	};
 }
 
 #endif
@@ -90,6 +90,92 @@ namespace riscv {
 				jit_op_rordi_lr,
 				jit_op_auipc_lw,
 				jit_op_auipc_ld,
+				jit_op_li,
+				jit_op_li_slli,
+				jit_op_slt_bnez,
+				jit_op_slt_beqz,
+				jit_op_sltu_bnez,
+				jit_op_sltu_beqz,
+				jit_op_mulh_mul,
+				jit_op_mulhu_mul,
+				jit_op_div_rem,
+				jit_op_divu_remu,
+				jit_op_lea,
+				jit_op_load_pair,
+				jit_op_store_pair,
+				jit_op_native,
+				rv_op_flw,
+				rv_op_fsw,
+				rv_op_fmadd_s,
+				rv_op_fmsub_s,
+				rv_op_fnmsub_s,
+				rv_op_fnmadd_s,
+				rv_op_fadd_s,
+				rv_op_fsub_s,
+				rv_op_fmul_s,
+				rv_op_fdiv_s,
+				rv_op_fsgnj_s,
+				rv_op_fsgnjn_s,
+				rv_op_fsgnjx_s,
+				rv_op_fsqrt_s,
+				rv_op_fle_s,
+				rv_op_flt_s,
+				rv_op_feq_s,
+				rv_op_fcvt_w_s,
+				rv_op_fcvt_s_w,
+				rv_op_fcvt_s_wu,
+				rv_op_fmv_x_s,
+				rv_op_fmv_s_x,
+				rv_op_fcvt_l_s,
+				rv_op_fcvt_s_l,
+				rv_op_fld,
+				rv_op_fsd,
+				rv_op_fmadd_d,
+				rv_op_fmsub_d,
+				rv_op_fnmsub_d,
+				rv_op_fnmadd_d,
+				rv_op_fadd_d,
+				rv_op_fsub_d,
+				rv_op_fmul_d,
+				rv_op_fdiv_d,
+				rv_op_fsgnj_d,
+				rv_op_fsgnjn_d,
+				rv_op_fsgnjx_d,
+				rv_op_fcvt_s_d,
+				rv_op_fcvt_d_s,
+				rv_op_fsqrt_d,
+				rv_op_fle_d,
+				rv_op_flt_d,
+				rv_op_feq_d,
+				rv_op_fcvt_w_d,
+				rv_op_fcvt_d_w,
+				rv_op_fcvt_d_wu,
+				rv_op_fcvt_l_d,
+				rv_op_fmv_x_d,
+				rv_op_fcvt_d_l,
+				rv_op_fmv_d_x,
+				rv_op_lr_w,
+				rv_op_sc_w,
+				rv_op_amoswap_w,
+				rv_op_amoadd_w,
+				rv_op_amoxor_w,
+				rv_op_amoor_w,
+				rv_op_amoand_w,
+				rv_op_amomin_w,
+				rv_op_amomax_w,
+				rv_op_amominu_w,
+				rv_op_amomaxu_w,
+				rv_op_lr_d,
+				rv_op_sc_d,
+				rv_op_amoswap_d,
+				rv_op_amoadd_d,
+				rv_op_amoxor_d,
+				rv_op_amoor_d,
+				rv_op_amoand_d,
+				rv_op_amomin_d,
+				rv_op_amomax_d,
+				rv_op_amominu_d,
+				rv_op_amomaxu_d,
 				rv_op_illegal
 			};
 			const int *op = ops;
@@ -97,6 +183,10 @@ namespace riscv {
 		}
 	};
 
+	/* processor models derived from processor_base are not standard layout */
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+
 	template <typename P>
 	struct jit_emitter_rv64
 	{
@@ -105,6 +195,27 @@ namespace riscv {
 
 		#define proc_offset(member) offsetof(typename P::processor_type, member)
 
+		enum fp_kind {
+			fp_kind_s = 1,   /* single precision value in low 32 bits */
+			fp_kind_d = 2    /* double precision value in low 64 bits */
+		};
+
+		enum {
+			fp_cache_regs = 14,   /* xmm0 - xmm13 cache guest freg, xmm14 - xmm15 scratch */
+		};
+
+		enum {
+			x86_reg_count = 16,   /* rax and rcx are scratch, rsp and rbp are reserved */
+		};
+
+		struct fp_cache_ent
+		{
+			s8 xmm;      /* host xmm register or -1 */
+			u8 kind;     /* fp_kind */
+			u8 dirty;    /* xmm holds a value not yet written to the freg file */
+			u8 lock;     /* operand of the instruction being emitted */
+		};
+
 		P &proc;
 		X86Assembler as;
 		CodeHolder &code;
@@ -112,21 +223,66 @@ namespace riscv {
 		TraceLookup lookup_trace_slow;
 		TraceLookup lookup_trace_fast;
 		std::map<addr_t,Label> labels;
+		std::map<addr_t,Label> segment_labels;
 		std::map<addr_t,Label> jmp_tramp_labels;
 		std::map<addr_t,Label> exit_tramp_labels;
 		std::map<addr_t,std::vector<Label>> jmp_fixup_labels;
+		std::map<addr_t,Label> link_stub_labels;
+		std::map<std::pair<addr_t,int>,Label> retire_tramp_labels;
+		std::map<addr_t,Label> budget_tramp_labels;
 		std::vector<addr_t> callstack;
+		s8 ireg_x86[P::ireg_count];
+		s8 x86_ireg[x86_reg_count];
+		u32 ireg_def;
+		fp_cache_ent fp_cache[P::freg_count];
+		s8 xmm_freg[fp_cache_regs];
+		int fp_victim;
 		u64 term_pc;
 		int instret;
+		int instret_base;
 		bool use_mmu;
-		Label start, term;
+		addr_t entry_pc;
+		Label start, term, leave, entry_exit;
+		bool link_term;
+		u32 tier_iters;
+		Label tier_up, tier_count;
+		bool ref_mark;
+		size_t ref_offset;
+		bool exit_prof;
+		bool exit_check;
+		addr_t exit_key;
+		std::map<addr_t,Label> exit_count_labels;
+		std::vector<addr_t> exit_pcs;
+		Label exit_counts;
+		size_t exit_counts_offset;
+		bool pc_map;
+		uintptr_t native_call;
+		std::vector<std::pair<addr_t,Label>> pc_labels;
+		std::vector<size_t> ic_sites;
+		std::map<addr_t,Label> ret_stub_labels;
+		std::set<addr_t> rstack_calls;
+		std::vector<u8> data;
+		std::vector<std::pair<Label,size_t>> data_slots;
+		u8 *data_block;
 
 		jit_emitter_rv64(P &proc, CodeHolder &code, mmu_ops &ops, TraceLookup lookup_trace_slow, TraceLookup lookup_trace_fast)
 			: proc(proc), as(&code), code(code), ops(ops),
 			  lookup_trace_slow(lookup_trace_slow),
 			  lookup_trace_fast(lookup_trace_fast),
-			  term_pc(0), instret(0), use_mmu(false)
-		{}
+			  fp_victim(0), term_pc(0), instret(0), instret_base(0),
+			  use_mmu(proc.trace_mmu), entry_pc(-1), link_term(false), tier_iters(0),
+			  ref_mark(false), ref_offset(0),
+			  exit_prof(false), exit_check(false), exit_key(0), exit_counts_offset(0), pc_map(false),
+			  native_call(0), data_block(nullptr)
+		{
+			alloc_fixed();
+			fp_release_all();
+		}
+
+		~jit_emitter_rv64()
+		{
+			free(data_block);
+		}
 
 		void log_trace(const char* fmt, ...)
 		{
@@ -145,27 +301,166 @@ namespace riscv {
 			return false;
 		}
 
+		/*
+		 * Guest integer registers are assigned to host registers per trace.
+		 * Between traces all guest registers live in the register file so
+		 * linked traces, the trace lookup stub and the emulator agree on
+		 * the state. Traces load their assigned registers at the start
+		 * label and store the registers they write at every exit.
+		 */
+
+		void alloc_reset()
+		{
+			for (size_t i = 0; i < P::ireg_count; i++) {
+				ireg_x86[i] = -1;
+			}
+			for (size_t i = 0; i < x86_reg_count; i++) {
+				x86_ireg[i] = -1;
+			}
+		}
+
+		void alloc_reg(int reg, int x)
+		{
+			ireg_x86[reg] = x;
+			x86_ireg[x] = reg;
+		}
+
+		void alloc_fixed()
+		{
+			alloc_reset();
+			alloc_reg(rv_ireg_ra, 2);  /* rdx */
+			alloc_reg(rv_ireg_sp, 3);  /* rbx */
+			alloc_reg(rv_ireg_t0, 6);  /* rsi */
+			alloc_reg(rv_ireg_t1, 7);  /* rdi */
+			alloc_reg(rv_ireg_a0, 8);  /* r8  */
+			alloc_reg(rv_ireg_a1, 9);  /* r9  */
+			alloc_reg(rv_ireg_a2, 10); /* r10 */
+			alloc_reg(rv_ireg_a3, 11); /* r11 */
+			alloc_reg(rv_ireg_a4, 12); /* r12 */
+			alloc_reg(rv_ireg_a5, 13); /* r13 */
+			alloc_reg(rv_ireg_a6, 14); /* r14 */
+			alloc_reg(rv_ireg_a7, 15); /* r15 */
+			ireg_def = ~0U;
+		}
+
+		std::vector<u32> loop_weights(std::vector<decode_type> &trace)
+		{
+			/* operands in the body of a backward branch or jump count 8x per loop depth */
+			std::vector<u32> weight(trace.size(), 1);
+			std::map<addr_t,size_t> index;
+			for (size_t i = 0; i < trace.size(); i++) {
+				index.insert(std::pair<addr_t,size_t>(trace[i].pc, i));
+			}
+			for (size_t j = 0; j < trace.size(); j++) {
+				auto &dec = trace[j];
+				switch (dec.op) {
+					case rv_op_beq: case rv_op_bne: case rv_op_blt:
+					case rv_op_bge: case rv_op_bltu: case rv_op_bgeu:
+					case rv_op_jal:
+					case jit_op_slt_bnez: case jit_op_slt_beqz:
+					case jit_op_sltu_bnez: case jit_op_sltu_beqz:
+						break;
+					default:
+						continue;
+				}
+				auto ii = index.find(dec.pc + dec.imm);
+				if (ii == index.end() || ii->second > j) continue;
+				for (size_t k = ii->second; k <= j; k++) {
+					weight[k] = std::min(weight[k] * 8, 4096U);
+				}
+			}
+			return weight;
+		}
+
+		void alloc_regs(std::vector<decode_type> &trace)
+		{
+			/*
+			 * ra stays in rdx as the mulh and div sequences use its slot
+			 * to preserve rdx. The remaining host registers are given to
+			 * the guest registers with the highest operand counts, with
+			 * operands in loop bodies weighted so loop carried registers
+			 * stay in host registers across iterations.
+			 */
+			static const int x86_alloc[] = { 3, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+			static const char* x86_reg_name[] = {
+				"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+				"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+			};
+			u32 count[P::ireg_count] = { 0 };
+			ireg_def = 1U << rv_ireg_ra;
+			std::vector<u32> weight = loop_weights(trace);
+			for (size_t i = 0; i < trace.size(); i++) {
+				auto &dec = trace[i];
+				u32 w = weight[i];
+				if (dec.op >= jit_op_la) {
+					/* fused pseudo ops use rd and rs1 to rs3 directly, any but rs1 may be written */
+					count[dec.rd] += w;
+					count[dec.rs1] += w;
+					count[dec.rs2] += w;
+					count[dec.rs3] += w;
+					ireg_def |= (1U << dec.rd) | (1U << dec.rs2) | (1U << dec.rs3);
+					continue;
+				}
+				const rv_operand_data *od = rv_inst_operand_data[dec.op];
+				for (; od && od->operand_name != rv_operand_name_none; od++) {
+					switch (od->operand_name) {
+						case rv_operand_name_rd:
+							count[dec.rd] += w;
+							ireg_def |= 1U << dec.rd;
+							break;
+						case rv_operand_name_rs1: count[dec.rs1] += w; break;
+						case rv_operand_name_rs2: count[dec.rs2] += w; break;
+						default: break;
+					}
+				}
+			}
+			std::vector<int> order;
+			for (int i = 1; i < (int)P::ireg_count; i++) {
+				if (i != rv_ireg_ra && count[i] > 0) order.push_back(i);
+			}
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+				return count[a] > count[b];
+			});
+			alloc_reset();
+			alloc_reg(rv_ireg_ra, 2); /* rdx */
+			for (size_t i = 0; i < order.size() && i < sizeof(x86_alloc) / sizeof(int); i++) {
+				alloc_reg(order[i], x86_alloc[i]);
+			}
+			if (proc.log & proc_log_jit_trace) {
+				for (size_t i = 0; i < x86_reg_count; i++) {
+					if (x86_ireg[i] < 0) continue;
+					log_trace("\t# %s -> %s", rv_ireg_name_sym[x86_ireg[i]], x86_reg_name[i]);
+				}
+			}
+		}
+
+		void emit_load_regs()
+		{
+			if (proc.memory_registers) return;
+			for (size_t i = 0; i < x86_reg_count; i++) {
+				if (x86_ireg[i] < 0) continue;
+				as.mov(x86::gpq(i), rbp_reg_q(x86_ireg[i]));
+			}
+		}
+
+		void emit_store_regs()
+		{
+			if (proc.memory_registers) return;
+			for (size_t i = 0; i < x86_reg_count; i++) {
+				if (x86_ireg[i] < 0 || !(ireg_def & (1U << x86_ireg[i]))) continue;
+				as.mov(rbp_reg_q(x86_ireg[i]), x86::gpq(i));
+			}
+		}
+
 		int x86_reg(int rd)
 		{
 			if (proc.memory_registers) {
 				return -1; /* all registers are memory backed */
 			}
-			switch (rd) {
-				case rv_ireg_zero: return 0;
-				case rv_ireg_ra: return 2;  /* rdx */
-				case rv_ireg_sp: return 3;  /* rbx */
-				case rv_ireg_t0: return 6;  /* rsi */
-				case rv_ireg_t1: return 7;  /* rdi */
-				case rv_ireg_a0: return 8;  /* r8  */
-				case rv_ireg_a1: return 9;  /* r9  */
-				case rv_ireg_a2: return 10; /* r10 */
-				case rv_ireg_a3: return 11; /* r11 */
-				case rv_ireg_a4: return 12; /* r12 */
-				case rv_ireg_a5: return 13; /* r13 */
-				case rv_ireg_a6: return 14; /* r14 */
-				case rv_ireg_a7: return 15; /* r15 */
+			if (rd == rv_ireg_zero) {
+				return 0;
 			}
-			return -1;
+			return ireg_x86[rd];
 		}
 
 		const char* rbp_reg_str_d(int reg)
@@ -192,6 +487,138 @@ namespace riscv {
 			return x86::qword_ptr(x86::rbp, proc_offset(ireg) + reg * (P::xlen >> 3));
 		}
 
+		const X86Mem rbp_freg_s(int reg)
+		{
+			return x86::dword_ptr(x86::rbp, proc_offset(freg) + reg * sizeof(typename P::freg_t));
+		}
+
+		const X86Mem rbp_freg_d(int reg)
+		{
+			return x86::qword_ptr(x86::rbp, proc_offset(freg) + reg * sizeof(typename P::freg_t));
+		}
+
+		/*
+		 * Guest floating point registers are cached in xmm0 - xmm13 within
+		 * a basic block. Dirty registers are written back before any control
+		 * transfer out of the block and the cache is emptied at branch
+		 * targets so every label sees the freg file in memory.
+		 */
+
+		void fp_writeback(int freg)
+		{
+			fp_cache_ent &ent = fp_cache[freg];
+			if (ent.xmm < 0 || !ent.dirty) return;
+			if (ent.kind == fp_kind_s) {
+				as.movss(rbp_freg_s(freg), x86::xmm(ent.xmm));
+			} else {
+				as.movsd(rbp_freg_d(freg), x86::xmm(ent.xmm));
+			}
+			ent.dirty = 0;
+		}
+
+		void fp_release(int freg)
+		{
+			fp_cache_ent &ent = fp_cache[freg];
+			if (ent.xmm >= 0) {
+				xmm_freg[(int)ent.xmm] = -1;
+			}
+			ent.xmm = -1;
+			ent.kind = 0;
+			ent.dirty = 0;
+			ent.lock = 0;
+		}
+
+		void fp_release_all()
+		{
+			for (size_t i = 0; i < P::freg_count; i++) {
+				fp_cache[i].xmm = -1;
+				fp_cache[i].kind = 0;
+				fp_cache[i].dirty = 0;
+				fp_cache[i].lock = 0;
+			}
+			for (size_t i = 0; i < fp_cache_regs; i++) {
+				xmm_freg[i] = -1;
+			}
+		}
+
+		void fp_flush()
+		{
+			for (size_t i = 0; i < P::freg_count; i++) {
+				fp_writeback(i);
+			}
+		}
+
+		void fp_sync()
+		{
+			fp_flush();
+			fp_release_all();
+		}
+
+		void fp_unlock()
+		{
+			for (size_t i = 0; i < P::freg_count; i++) {
+				fp_cache[i].lock = 0;
+			}
+		}
+
+		int fp_alloc()
+		{
+			for (int i = 0; i < fp_cache_regs; i++) {
+				if (xmm_freg[i] < 0) return i;
+			}
+			for (int n = 0; n < fp_cache_regs; n++) {
+				int i = fp_victim;
+				fp_victim = (fp_victim + 1) % fp_cache_regs;
+				int freg = xmm_freg[i];
+				if (fp_cache[freg].lock) continue;
+				fp_writeback(freg);
+				fp_release(freg);
+				return i;
+			}
+			panic("fp_alloc: no xmm register available");
+		}
+
+		int fp_use(int freg, int kind)
+		{
+			fp_cache_ent &ent = fp_cache[freg];
+			if (ent.xmm >= 0 && ent.kind != kind) {
+				fp_writeback(freg);
+				fp_release(freg);
+			}
+			if (ent.xmm < 0) {
+				int x = fp_alloc();
+				if (kind == fp_kind_s) {
+					as.movss(x86::xmm(x), rbp_freg_s(freg));
+				} else {
+					as.movsd(x86::xmm(x), rbp_freg_d(freg));
+				}
+				xmm_freg[x] = freg;
+				ent.xmm = x;
+				ent.kind = kind;
+				ent.dirty = 0;
+			}
+			ent.lock = 1;
+			return ent.xmm;
+		}
+
+		int fp_def(int freg, int kind)
+		{
+			fp_cache_ent &ent = fp_cache[freg];
+			if (ent.xmm >= 0 && ent.kind != kind) {
+				fp_writeback(freg);
+				fp_release(freg);
+			}
+			if (ent.xmm < 0) {
+				int x = fp_alloc();
+				xmm_freg[x] = freg;
+				ent.xmm = x;
+				ent.kind = kind;
+			}
+			ent.dirty = 1;
+			ent.lock = 1;
+			return ent.xmm;
+		}
+
 		void commit_instret()
 		{
 			if (proc.update_instret && instret > 0) {
@@ -211,42 +638,12 @@ namespace riscv {
 			}
 			as.push(x86::rbp);
 			as.mov(x86::rbp, x86::rdi);
-			if (!proc.memory_registers) {
-				as.mov(x86::rdx, rbp_reg_q(rv_ireg_ra));
-				as.mov(x86::rbx, rbp_reg_q(rv_ireg_sp));
-				as.mov(x86::rsi, rbp_reg_q(rv_ireg_t0));
-				as.mov(x86::rdi, rbp_reg_q(rv_ireg_t1));
-				as.mov(x86::r8,  rbp_reg_q(rv_ireg_a0));
-				as.mov(x86::r9,  rbp_reg_q(rv_ireg_a1));
-				as.mov(x86::r10, rbp_reg_q(rv_ireg_a2));
-				as.mov(x86::r11, rbp_reg_q(rv_ireg_a3));
-				as.mov(x86::r12, rbp_reg_q(rv_ireg_a4));
-				as.mov(x86::r13, rbp_reg_q(rv_ireg_a5));
-				as.mov(x86::r14, rbp_reg_q(rv_ireg_a6));
-				as.mov(x86::r15, rbp_reg_q(rv_ireg_a7));
-			}
 
 			instret = 0;
 		}
 
-		void emit_epilog()
+		void emit_return()
 		{
-			commit_instret();
-
-			if (!proc.memory_registers) {
-				as.mov(rbp_reg_q(rv_ireg_ra), x86::rdx);
-				as.mov(rbp_reg_q(rv_ireg_sp), x86::rbx);
-				as.mov(rbp_reg_q(rv_ireg_t0), x86::rsi);
-				as.mov(rbp_reg_q(rv_ireg_t1), x86::rdi);
-				as.mov(rbp_reg_q(rv_ireg_a0), x86::r8);
-				as.mov(rbp_reg_q(rv_ireg_a1), x86::r9);
-				as.mov(rbp_reg_q(rv_ireg_a2), x86::r10);
-				as.mov(rbp_reg_q(rv_ireg_a3), x86::r11);
-				as.mov(rbp_reg_q(rv_ireg_a4), x86::r12);
-				as.mov(rbp_reg_q(rv_ireg_a5), x86::r13);
-				as.mov(rbp_reg_q(rv_ireg_a6), x86::r14);
-				as.mov(rbp_reg_q(rv_ireg_a7), x86::r15);
-			}
 			as.pop(x86::rbp);
 			if (!proc.memory_registers) {
 				as.pop(x86::rbx);
@@ -256,113 +653,214 @@ namespace riscv {
 				as.pop(x86::r12);
 			}
 			as.ret();
+		}
+
+		void emit_epilog()
+		{
+			commit_instret();
+			as.bind(leave);
+			emit_store_regs();
+			emit_return();
+
+			/* counted branch exits continue to their link stub */
+			for (auto &ecl : exit_count_labels) {
+				as.bind(ecl.second);
+				emit_exit_count(ecl.first);
+				as.jmp(create_link_stub(ecl.first)->second);
+			}
+
+			for (auto &lsl : link_stub_labels) {
+				as.bind(lsl.second);
+				emit_store_regs();
+				emit_link(lsl.first);
+			}
 
 			for (auto &jtl : jmp_tramp_labels) {
 				as.bind(jtl.second);
+				emit_stat(P::trace_stat_jmp_tramp);
 				emit_pc(jtl.first);
 				as.jmp(Imm(func_address(lookup_trace_fast)));
 			}
 
 			for (auto &jtl : exit_tramp_labels) {
 				as.bind(jtl.second);
+				if (exit_prof) {
+					emit_exit_count(jtl.first);
+				}
+				emit_stat(P::trace_stat_exit_tramp);
 				emit_pc(jtl.first);
 				as.jmp(term);
 			}
+
+			/* returns through the shadow stack, registers are already stored */
+			for (auto &rsl : ret_stub_labels) {
+				as.bind(rsl.second);
+				emit_link(rsl.first);
+			}
+
+			/* faults retire the instructions before pc */
+			for (auto &rtl : retire_tramp_labels) {
+				as.bind(rtl.second);
+				if (rtl.first.second > 0) {
+					as.add(x86::qword_ptr(x86::rbp, proc_offset(instret)), Imm(rtl.first.second));
+				}
+				emit_pc(rtl.first.first);
+				as.jmp(leave);
+			}
+
+			/* loops that spent the budget, instructions before pc are retired */
+			for (auto &btl : budget_tramp_labels) {
+				as.bind(btl.second);
+				emit_stat(P::trace_stat_budget);
+				emit_pc(btl.first);
+				as.jmp(leave);
+			}
+
+			/* budget exhausted on entry, registers have not been loaded */
+			if (proc.trace_budget) {
+				as.bind(entry_exit);
+				emit_stat(P::trace_stat_budget);
+				emit_pc(entry_pc);
+				emit_return();
+			}
+
+			/* promotion requested on entry, registers have not been loaded */
+			if (tier_iters) {
+				as.bind(tier_up);
+				emit_pc(entry_pc);
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(trace_tier_up)), Imm(1));
+				emit_return();
+			}
+
+			/* trace entries followed by the count of each exit */
+			if (exit_prof) {
+				std::vector<u64> counts(exit_pcs.size() + 1);
+				exit_counts_offset = data_alloc(counts.data(), counts.size() * sizeof(u64), 8);
+				data_slots.push_back(std::pair<Label,size_t>(exit_counts, exit_counts_offset));
+			}
+
+			emit_data_slots();
 		}
 
 		TraceLookup create_trace_lookup(JitRuntime &rt)
 		{
+			auto lookup_l2 = as.newLabel();
 			auto lookup_slow = as.newLabel();
+			auto lookup_fill = as.newLabel();
 			auto lookup_fail = as.newLabel();
-
-			u32 mask = (P::trace_l1_size - 1) << 1;
-
-			/* fast path lookup cache pc -> trace fn */
-			as.mov(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(pc)));
-			as.mov(x86::rax, x86::rcx);
-			as.and_(x86::rcx, Imm(mask));
-			as.cmp(x86::rax, x86::qword_ptr(x86::rbp, x86::rcx, 4, proc_offset(trace_pc)));
-			as.jne(lookup_slow);
-			as.jmp(x86::qword_ptr(x86::rbp, x86::rcx, 4, proc_offset(trace_fn)));
+			Label l2_hit[P::trace_l2_ways];
+
+			/* L1 lookup, direct mapped pc -> trace fn, keyed by the translation context */
+			emit_stat(P::trace_stat_lookups);
+			as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(pc)));
+			as.xor_(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(trace_ctx)));
+			as.mov(x86::rcx, x86::rax);
+			as.shr(x86::rcx, Imm(1));
+			as.and_(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l1_mask)));
+			as.shl(x86::rcx, Imm(4));
+			as.add(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l1)));
+			as.cmp(x86::rax, x86::qword_ptr(x86::rcx));
+			as.jne(lookup_l2);
+			as.jmp(x86::qword_ptr(x86::rcx, 8));
+
+			/* L2 lookup, probe each way of the hashed cache line set */
+			as.bind(lookup_l2);
+			emit_stat(P::trace_stat_l1_misses);
+			as.imul(x86::rcx, x86::rax, Imm(P::trace_l2_hash));
+			as.shr(x86::rcx, Imm(P::trace_l2_shift));
+			as.and_(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l2_mask)));
+			as.shl(x86::rcx, Imm(6));
+			as.add(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l2)));
+			for (size_t i = 0; i < P::trace_l2_ways; i++) {
+				l2_hit[i] = as.newLabel();
+				as.cmp(x86::rax, x86::qword_ptr(x86::rcx, i * 16));
+				as.je(l2_hit[i]);
+			}
+			as.jmp(lookup_slow);
+			for (size_t i = 0; i < P::trace_l2_ways; i++) {
+				as.bind(l2_hit[i]);
+				as.mov(x86::rdx, x86::qword_ptr(x86::rcx, i * 16 + 8));
+				as.test(x86::rdx, x86::rdx);
+				as.jnz(lookup_fill);
+			}
 
 			/* slow path lookup cache pc -> trace fn */
 			as.bind(lookup_slow);
-			if (!proc.memory_registers) {
-				as.mov(rbp_reg_q(rv_ireg_ra), x86::rdx);
-				as.mov(rbp_reg_q(rv_ireg_sp), x86::rbx);
-				as.mov(rbp_reg_q(rv_ireg_t0), x86::rsi);
-				as.mov(rbp_reg_q(rv_ireg_t1), x86::rdi);
-				as.mov(rbp_reg_q(rv_ireg_a0), x86::r8);
-				as.mov(rbp_reg_q(rv_ireg_a1), x86::r9);
-				as.mov(rbp_reg_q(rv_ireg_a2), x86::r10);
-				as.mov(rbp_reg_q(rv_ireg_a3), x86::r11);
-			}
+			emit_stat(P::trace_stat_l2_misses);
 			as.mov(x86::rdi, x86::rax);
 			as.call(Imm(func_address(lookup_trace_slow)));
 			as.test(x86::rax, x86::rax);
 			as.jz(lookup_fail);
-			as.mov(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(pc)));
-			as.mov(x86::rdx, x86::rcx);
-			as.and_(x86::rcx, Imm(mask));
-			as.mov(x86::qword_ptr(x86::rbp, x86::rcx, 4, proc_offset(trace_fn)), x86::rax);
-			as.mov(x86::qword_ptr(x86::rbp, x86::rcx, 4, proc_offset(trace_pc)), x86::rdx);
-			if (!proc.memory_registers) {
-				as.mov(x86::rdx, rbp_reg_q(rv_ireg_ra));
-				as.mov(x86::rbx, rbp_reg_q(rv_ireg_sp));
-				as.mov(x86::rsi, rbp_reg_q(rv_ireg_t0));
-				as.mov(x86::rdi, rbp_reg_q(rv_ireg_t1));
-				as.mov(x86::r8,  rbp_reg_q(rv_ireg_a0));
-				as.mov(x86::r9,  rbp_reg_q(rv_ireg_a1));
-				as.mov(x86::r10, rbp_reg_q(rv_ireg_a2));
-				as.mov(x86::r11, rbp_reg_q(rv_ireg_a3));
-			}
-			as.jmp(x86::rax);
+			as.mov(x86::rdx, x86::rax);
+			as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(pc)));
+			as.xor_(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(trace_ctx)));
+
+			/* fill the L1 entry and enter the trace */
+			as.bind(lookup_fill);
+			as.mov(x86::rcx, x86::rax);
+			as.shr(x86::rcx, Imm(1));
+			as.and_(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l1_mask)));
+			as.shl(x86::rcx, Imm(4));
+			as.add(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_l1)));
+			as.mov(x86::qword_ptr(x86::rcx), x86::rax);
+			as.mov(x86::qword_ptr(x86::rcx, 8), x86::rdx);
+			as.jmp(x86::rdx);
 
 			/* fail path, return to emulator */
 			as.bind(lookup_fail);
-			if (!proc.memory_registers) {
-				as.mov(rbp_reg_q(rv_ireg_a4), x86::r12);
-				as.mov(rbp_reg_q(rv_ireg_a5), x86::r13);
-				as.mov(rbp_reg_q(rv_ireg_a6), x86::r14);
-				as.mov(rbp_reg_q(rv_ireg_a7), x86::r15);
-			}
-			as.pop(x86::rbp);
-			if (!proc.memory_registers) {
-				as.pop(x86::rbx);
-				as.pop(x86::r15);
-				as.pop(x86::r14);
-				as.pop(x86::r13);
-				as.pop(x86::r12);
-			}
-			as.ret();
+			emit_return();
 
 			Error err = rt.add(&lookup_trace_fast, &code);
 			if (err) panic("failed to create trace lookup function");
 			return lookup_trace_fast;
 		}
 
+		TraceLookup create_trace_lookup_ic(JitRuntime &rt)
+		{
+			TraceLookup lookup_trace_ic = nullptr;
+			auto lookup_fail = as.newLabel();
+
+			/* inline cache miss, rcx points to the site, record the target and enter its trace */
+			as.mov(x86::rdi, x86::rcx);
+			as.call(Imm(func_address(lookup_trace_slow)));
+			as.test(x86::rax, x86::rax);
+			as.jz(lookup_fail);
+			as.jmp(x86::rax);
+
+			/* fail path, return to emulator */
+			as.bind(lookup_fail);
+			emit_return();
+
+			Error err = rt.add(&lookup_trace_ic, &code);
+			if (err) panic("failed to create inline cache lookup function");
+			return lookup_trace_ic;
+		}
+
 		void save_volatile()
 		{
+			/* the helpers are shared by all traces so save by host register */
 			if (proc.memory_registers) return;
-			as.mov(rbp_reg_q(rv_ireg_ra), x86::rdx);
-			as.mov(rbp_reg_q(rv_ireg_t0), x86::rsi);
-			as.mov(rbp_reg_q(rv_ireg_t1), x86::rdi);
-			as.mov(rbp_reg_q(rv_ireg_a0), x86::r8);
-			as.mov(rbp_reg_q(rv_ireg_a1), x86::r9);
-			as.mov(rbp_reg_q(rv_ireg_a2), x86::r10);
-			as.mov(rbp_reg_q(rv_ireg_a3), x86::r11);
+			as.push(x86::rdx);
+			as.push(x86::rsi);
+			as.push(x86::rdi);
+			as.push(x86::r8);
+			as.push(x86::r9);
+			as.push(x86::r10);
+			as.push(x86::r11);
+			as.sub(x86::rsp, Imm(8));
 		}
 
 		void restore_volatile()
 		{
 			if (proc.memory_registers) return;
-			as.mov(x86::rdx, rbp_reg_q(rv_ireg_ra));
-			as.mov(x86::rsi, rbp_reg_q(rv_ireg_t0));
-			as.mov(x86::rdi, rbp_reg_q(rv_ireg_t1));
-			as.mov(x86::r8, rbp_reg_q(rv_ireg_a0));
-			as.mov(x86::r9, rbp_reg_q(rv_ireg_a1));
-			as.mov(x86::r10, rbp_reg_q(rv_ireg_a2));
-			as.mov(x86::r11, rbp_reg_q(rv_ireg_a3));
+			as.add(x86::rsp, Imm(8));
+			as.pop(x86::r11);
+			as.pop(x86::r10);
+			as.pop(x86::r9);
+			as.pop(x86::r8);
+			as.pop(x86::rdi);
+			as.pop(x86::rsi);
+			as.pop(x86::rdx);
 		}
 
 		mmu_ops create_load_store(JitRuntime &rt)
@@ -465,18 +963,177 @@ namespace riscv {
 		{
 			term = as.newLabel();
 			start = as.newLabel();
+			leave = as.newLabel();
+			entry_exit = as.newLabel();
+			as.align(kAlignCode, 16);
 			as.bind(start);
+			if (proc.trace_budget) {
+				/* linked traces enter here so chains return when the budget is spent */
+				emit_budget_check(entry_exit);
+			}
+			if (ref_mark) {
+				/* every entry path sets the reference byte read by the eviction sweep */
+				u8 referenced = 1;
+				ref_offset = data_alloc(&referenced, sizeof(referenced), 1);
+				as.mov(x86::rcx, x86::qword_ptr(data_slot(ref_offset)));
+				as.mov(x86::byte_ptr(x86::rcx), Imm(1));
+			}
+			if (tier_iters) {
+				emit_tier_count();
+			}
+			if (exit_prof) {
+				exit_counts = as.newLabel();
+				as.mov(x86::rcx, x86::qword_ptr(exit_counts));
+				as.add(x86::qword_ptr(x86::rcx), Imm(1));
+			}
+			emit_load_regs();
 		}
 
 		void end()
 		{
+			/* loops closed by the trace end jump back to their label, blocks link their exit */
+			if (segment_labels.size() > 0 || (term_pc && (link_term || labels.find(term_pc) != labels.end()))) {
+				end_segment();
+			}
+			fp_sync();
 			if (term_pc) {
+				emit_stat(P::trace_stat_trace_end);
 				emit_pc(term_pc);
 				log_trace("\t# 0x%016llx", term_pc);
 			}
 			as.bind(term);
 		}
 
+		/* label the host code of each guest instruction for profiler symbol maps */
+		void mark_pc(addr_t pc)
+		{
+			if (!pc_map) return;
+			Label label = as.newLabel();
+			as.bind(label);
+			pc_labels.push_back(std::pair<addr_t,Label>(pc, label));
+		}
+
+		/*
+		 * Trace trees
+		 *
+		 * Hot side exits are grown into segments appended to the trace.
+		 * Segment entries are labelled before emission so side exits and
+		 * segment ends jump within the compiled unit, keeping the guest
+		 * registers in their host registers.
+		 */
+
+		void label_segments(std::vector<decode_type> &trace)
+		{
+			for (auto &dec : trace) {
+				if (dec.seg) segment_labels[dec.pc] = as.newLabel();
+			}
+		}
+
+		/*
+		 * Shadow return stack
+		 *
+		 * Calls whose return is not inlined in the trace push the link
+		 * address and a return stub in the calling trace. Returns that
+		 * leave their trace pop the top entry and jump to its stub when
+		 * the link address matches, otherwise they use the lookup stub.
+		 * Return stubs link to the trace at the link address like side
+		 * exits. The stack wraps so overflow only causes mispredictions.
+		 */
+
+		enum { rstack_mask = (P::trace_rstack_size - 1) * 16 };
+
+		void label_calls(std::vector<decode_type> &trace)
+		{
+			std::vector<addr_t> calls;
+			for (auto &dec : trace) {
+				if (dec.seg) {
+					rstack_calls.insert(calls.begin(), calls.end());
+					calls.clear();
+				}
+				switch (dec.op) {
+					case rv_op_jal:
+						if (dec.rd == rv_ireg_ra) calls.push_back(dec.pc);
+						break;
+					case rv_op_jalr:
+						if (dec.rd == rv_ireg_zero && dec.rs1 == rv_ireg_ra && calls.size() > 0) {
+							calls.pop_back();
+						} else if (dec.rd == rv_ireg_ra) {
+							calls.push_back(dec.pc);
+						}
+						break;
+					case jit_op_call:
+						calls.push_back(dec.pc);
+						break;
+					default: break;
+				}
+			}
+			rstack_calls.insert(calls.begin(), calls.end());
+		}
+
+		void emit_rstack_push(decode_type &dec, addr_t link_addr)
+		{
+			if (rstack_calls.find(dec.pc) == rstack_calls.end()) return;
+			auto rsl = ret_stub_labels.find(link_addr);
+			if (rsl == ret_stub_labels.end()) {
+				rsl = ret_stub_labels.insert(ret_stub_labels.end(),
+					std::pair<addr_t,Label>(link_addr, as.newLabel()));
+			}
+			as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(trace_rsp)));
+			as.add(x86::eax, Imm(16));
+			as.and_(x86::eax, Imm(rstack_mask));
+			as.mov(x86::qword_ptr(x86::rbp, proc_offset(trace_rsp)), x86::rax);
+			as.add(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(trace_rstack)));
+			as.mov(x86::rcx, Imm(link_addr));
+			as.mov(x86::qword_ptr(x86::rax), x86::rcx);
+			as.lea(x86::rcx, x86::ptr(rsl->second));
+			as.mov(x86::qword_ptr(x86::rax, 8), x86::rcx);
+		}
+
+		/* return to the target pc in rax, registers are stored */
+		void emit_rstack_pop()
+		{
+			auto miss = as.newLabel();
+			as.mov(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_rsp)));
+			as.lea(x86::edx, x86::dword_ptr(x86::rcx, -16));
+			as.and_(x86::edx, Imm(rstack_mask));
+			as.mov(x86::qword_ptr(x86::rbp, proc_offset(trace_rsp)), x86::rdx);
+			as.add(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_rstack)));
+			as.cmp(x86::rax, x86::qword_ptr(x86::rcx));
+			as.jne(miss);
+			as.jmp(x86::qword_ptr(x86::rcx, 8));
+			as.bind(miss);
+			as.jmp(Imm(func_address(lookup_trace_fast)));
+		}
+
+		Label side_exit(addr_t pc)
+		{
+			auto sli = segment_labels.find(pc);
+			return sli != segment_labels.end() ? sli->second : create_link_stub(pc)->second;
+		}
+
+		void emit_side_exit(addr_t pc)
+		{
+			auto sli = segment_labels.find(pc);
+			if (sli != segment_labels.end()) {
+				as.jmp(sli->second);
+			} else {
+				emit_store_regs();
+				emit_link(pc);
+			}
+		}
+
+		void end_segment()
+		{
+			commit_instret();
+			fp_sync();
+			if (term_pc) {
+				auto li = labels.find(term_pc);
+				as.jmp(li != labels.end() ? li->second : side_exit(term_pc));
+				log_trace("\t# 0x%016llx", term_pc);
+				term_pc = 0;
+			}
+		}
+
 		void emit_pc(uintptr_t new_pc)
 		{
 			if (new_pc < std::numeric_limits<u32>::max()) {
@@ -2983,101 +3640,349 @@ namespace riscv {
 			jfl->second.push_back(label);
 		}
 
-		bool emit_branch(decode_type &dec, bool cond, x86::Cond bf, x86::Cond ibf)
+		inline auto create_retire_tramp(addr_t pc, int n)
 		{
-			addr_t branch_pc = dec.pc + dec.imm;
-			addr_t cont_pc = dec.pc + inst_length(dec.inst);
-			auto branch_i = labels.find(branch_pc);
-			auto cont_i = labels.find(cont_pc);
+			auto key = std::pair<addr_t,int>(pc, n);
+			auto rtl = retire_tramp_labels.find(key);
+			if (rtl == retire_tramp_labels.end()) {
+				rtl = retire_tramp_labels.insert(retire_tramp_labels.end(),
+					std::pair<std::pair<addr_t,int>,Label>(key, as.newLabel()));
+			}
+			return rtl;
+		}
 
-			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+		Label budget_exit(addr_t pc)
+		{
+			auto btl = budget_tramp_labels.find(pc);
+			if (btl == budget_tramp_labels.end()) {
+				btl = budget_tramp_labels.insert(budget_tramp_labels.end(),
+					std::pair<addr_t,Label>(pc, as.newLabel()));
+			}
+			return btl->second;
+		}
 
-			commit_instret();
+		Label fault_exit(decode_type &dec)
+		{
+			/* retire the instructions before dec and return with pc at dec */
+			return create_retire_tramp(dec.pc, proc.update_instret ? instret_base : 0)->second;
+		}
 
-			emit_cmp(dec);
+		void emit_mmu_check(decode_type &dec)
+		{
+			as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
+			as.jne(fault_exit(dec));
+		}
 
-			if (branch_i != labels.end() && cont_i != labels.end()) {
-				as.j(bf, branch_i->second);
-				as.jmp(cont_i->second);
-			}
-			else if (cond && branch_i != labels.end()) {
-				as.j(bf, branch_i->second);
-				uintptr_t cont_addr = lookup_trace_slow(cont_pc);
-				if (cont_addr) {
-					as.jmp(Imm(cont_addr));
-				} else {
-					emit_jump_fixup(cont_pc);
-				}
-				term_pc = 0;
-			}
-			else if (!cond && cont_i != labels.end()) {
-				as.j(ibf, cont_i->second);
-				uintptr_t branch_addr = lookup_trace_slow(branch_pc);
-				if (branch_addr) {
-					as.jmp(Imm(branch_addr));
-				} else {
-					emit_jump_fixup(branch_pc);
-				}
-				term_pc = 0;
-			} else if (cond) {
-				uintptr_t cont_addr = lookup_trace_slow(cont_pc);
-				if (cont_addr) {
-					as.j(ibf, Imm(cont_addr));
-				} else {
-					emit_branch_fixup(ibf, cont_pc);
-				}
-				term_pc = branch_pc;
-			} else {
-				uintptr_t branch_addr = lookup_trace_slow(branch_pc);
-				if (branch_addr) {
-					as.j(bf, Imm(branch_addr));
-				} else {
-					emit_branch_fixup(bf, branch_pc);
-				}
-				term_pc = cont_pc;
-			}
-			return true;
+		/* probe the data TLB with the guest address in rax, a hit leaves the host address in rax */
+		void emit_tlb_lookup(bool store, int size, Label miss)
+		{
+			as.mov(x86::rcx, x86::rax);
+			as.shr(x86::rcx, Imm(page_shift));
+			as.and_(x86::ecx, Imm(P::trace_tlb_size - 1));
+			as.shl(x86::ecx, Imm(5));
+			as.add(x86::rcx, x86::qword_ptr(x86::rbp, proc_offset(trace_tlb)));
+			as.xor_(x86::rax, x86::qword_ptr(x86::rcx, store ? 8 : 0));
+			as.test(x86::rax, Imm(~(page_size - 1) | (size - 1)));
+			as.jnz(miss);
+			as.add(x86::rax, x86::qword_ptr(x86::rcx, 16));
 		}
 
-		bool emit_bne(decode_type &dec)
+		/* load zero extended into rax from the guest address in rax */
+		void emit_mmu_load(decode_type &dec, int size, uintptr_t helper)
 		{
-			return emit_branch(dec, dec.brc, x86::kCondNE, x86::kCondE);
+			auto miss = as.newLabel();
+			auto done = as.newLabel();
+			emit_tlb_lookup(false, size, miss);
+			switch (size) {
+				case 1: as.movzx(x86::eax, x86::byte_ptr(x86::rax)); break;
+				case 2: as.movzx(x86::eax, x86::word_ptr(x86::rax)); break;
+				case 4: as.mov(x86::eax, x86::dword_ptr(x86::rax)); break;
+				case 8: as.mov(x86::rax, x86::qword_ptr(x86::rax)); break;
+			}
+			as.jmp(done);
+			as.bind(miss);
+			as.xor_(x86::rax, x86::qword_ptr(x86::rcx, 0));
+			as.call(Imm(helper));
+			emit_mmu_check(dec);
+			as.bind(done);
 		}
 
-		bool emit_beq(decode_type &dec)
+		/* store to the guest address in rax, load_value puts the value in rcx */
+		template <typename F>
+		void emit_mmu_store(decode_type &dec, int size, uintptr_t helper, F load_value)
 		{
-			return emit_branch(dec, dec.brc, x86::kCondE, x86::kCondNE);
+			auto miss = as.newLabel();
+			auto done = as.newLabel();
+			emit_tlb_lookup(true, size, miss);
+			load_value();
+			switch (size) {
+				case 1: as.mov(x86::byte_ptr(x86::rax), x86::cl); break;
+				case 2: as.mov(x86::word_ptr(x86::rax), x86::cx); break;
+				case 4: as.mov(x86::dword_ptr(x86::rax), x86::ecx); break;
+				case 8: as.mov(x86::qword_ptr(x86::rax), x86::rcx); break;
+			}
+			as.jmp(done);
+			as.bind(miss);
+			as.xor_(x86::rax, x86::qword_ptr(x86::rcx, 8));
+			load_value();
+			as.call(Imm(helper));
+			emit_mmu_check(dec);
+			as.bind(done);
 		}
 
-		bool emit_blt(decode_type &dec)
+		/* compare the target pc in rax with the site's cached targets, registers are stored */
+		void emit_jump_ic()
 		{
-			return emit_branch(dec, dec.brc, x86::kCondL, x86::kCondGE);
+			/* inline caches start empty and miss to the lookup stub until installed */
+			jit_ic_site data;
+			for (size_t i = 0; i < jit_ic_ways; i++) {
+				data.ent[i].pc = jit_ic_empty;
+				data.ent[i].entry = 0;
+				data.hits[i] = 0;
+			}
+			data.miss = func_address(lookup_trace_fast);
+			data.misses = data.candidate = data.votes = 0;
+			size_t offset = data_alloc(&data, sizeof(data), 64);
+			ic_sites.push_back(offset);
+			as.mov(x86::rcx, x86::qword_ptr(data_slot(offset)));
+			for (size_t i = 0; i < jit_ic_ways; i++) {
+				Label next = as.newLabel();
+				as.cmp(x86::rax, x86::qword_ptr(x86::rcx, i * sizeof(jit_ic_ent)));
+				as.jne(next);
+				as.add(x86::qword_ptr(x86::rcx, offsetof(jit_ic_site, hits) + i * sizeof(u64)), Imm(1));
+				as.jmp(x86::qword_ptr(x86::rcx, i * sizeof(jit_ic_ent) + offsetof(jit_ic_ent, entry)));
+				as.bind(next);
+			}
+			as.jmp(x86::qword_ptr(x86::rcx, offsetof(jit_ic_site, miss)));
 		}
 
-		bool emit_bge(decode_type &dec)
+		void emit_budget_check(Label exit)
 		{
-			return emit_branch(dec, dec.brc, x86::kCondGE, x86::kCondL);
+			as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(instret)));
+			as.cmp(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(trace_stop)));
+			as.jae(exit);
 		}
 
-		bool emit_bltu(decode_type &dec)
+		/* counters live in the processor so they survive trace removal */
+		void emit_stat(int stat)
 		{
-			return emit_branch(dec, dec.brc, x86::kCondB, x86::kCondAE);
+			as.add(x86::qword_ptr(x86::rbp, proc_offset(trace_stat) + stat * sizeof(u64)), Imm(1));
 		}
 
-		bool emit_bgeu(decode_type &dec)
+		/*
+		 * Trace data
+		 *
+		 * Counters and inline caches written by translated code are kept
+		 * out of code memory so writing them does not dirty code pages
+		 * and code can stay mapped without write permission. Each trace
+		 * gets a data block allocated when it is emitted; code loads the
+		 * address of a data item from a slot embedded after the trace.
+		 * The runloop takes the block with take_data and frees it with
+		 * the trace.
+		 */
+
+		size_t data_alloc(const void *init, size_t len, size_t align)
 		{
-			return emit_branch(dec, dec.brc, x86::kCondAE, x86::kCondB);
+			size_t offset = (data.size() + align - 1) & ~(align - 1);
+			data.resize(offset + len);
+			memcpy(data.data() + offset, init, len);
+			return offset;
 		}
 
-		bool emit_ld(decode_type &dec)
+		Label data_slot(size_t offset)
 		{
-			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
-			term_pc = dec.pc + inst_length(dec.inst);
-			int rdx = x86_reg(dec.rd), rs1x = x86_reg(dec.rs1);
-			if (dec.rd == rv_ireg_zero) {
-				// nop
-			}
-			else {
+			Label slot = as.newLabel();
+			data_slots.push_back(std::pair<Label,size_t>(slot, offset));
+			return slot;
+		}
+
+		void emit_data_slots()
+		{
+			if (data.size() == 0) return;
+			void *block = nullptr;
+			if (posix_memalign(&block, 64, data.size()) != 0) {
+				panic("can't allocate trace data: %s", strerror(errno));
+			}
+			memcpy(block, data.data(), data.size());
+			free(data_block);
+			data_block = (u8*)block;
+			as.align(kAlignData, 8);
+			for (auto &slot : data_slots) {
+				u64 addr = u64(uintptr_t(data_block + slot.second));
+				as.bind(slot.first);
+				as.embed(&addr, sizeof(addr));
+			}
+		}
+
+		u8* take_data()
+		{
+			u8 *block = data_block;
+			data_block = nullptr;
+			return block;
+		}
+
+		/*
+		 * Tiered translation
+		 *
+		 * Baseline blocks count their entries down from tier_iters in a
+		 * counter in their trace data. When it reaches zero the
+		 * block returns to the emulator with trace_tier_up set so an
+		 * optimized trace is recorded from the block entry.
+		 */
+
+		void emit_tier_count()
+		{
+			tier_up = as.newLabel();
+			tier_count = data_slot(data_alloc(&tier_iters, sizeof(tier_iters), 4));
+			as.mov(x86::rcx, x86::qword_ptr(tier_count));
+			as.sub(x86::dword_ptr(x86::rcx), Imm(1));
+			as.jz(tier_up);
+		}
+
+		/*
+		 * Side exit profiling
+		 *
+		 * Optimized traces count their entries and each branch and return
+		 * exit that leaves the compiled unit in a table in their trace
+		 * data. Loop exits and exits into tree segments are not
+		 * counted. With exit_check set, every exit_check_period exits of
+		 * a site store exit_key in trace_exit_key so the emulator can
+		 * compare the exit ratio against the retranslation threshold.
+		 */
+
+		enum { exit_check_period = 256 };
+
+		Label branch_exit(addr_t pc)
+		{
+			if (!exit_prof || segment_labels.find(pc) != segment_labels.end()) {
+				return side_exit(pc);
+			}
+			auto ecl = exit_count_labels.find(pc);
+			if (ecl == exit_count_labels.end()) {
+				ecl = exit_count_labels.insert(exit_count_labels.end(),
+					std::pair<addr_t,Label>(pc, as.newLabel()));
+			}
+			return ecl->second;
+		}
+
+		void emit_exit_count(addr_t pc)
+		{
+			auto skip = as.newLabel();
+			int disp = int((exit_pcs.size() + 1) * sizeof(u64));
+			exit_pcs.push_back(pc);
+			as.mov(x86::rcx, x86::qword_ptr(exit_counts));
+			as.mov(x86::rax, x86::qword_ptr(x86::rcx, disp));
+			as.add(x86::rax, Imm(1));
+			as.mov(x86::qword_ptr(x86::rcx, disp), x86::rax);
+			if (exit_check) {
+				as.test(x86::eax, Imm(exit_check_period - 1));
+				as.jnz(skip);
+				as.mov(x86::rax, Imm(exit_key));
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(trace_exit_key)), x86::rax);
+				as.bind(skip);
+			}
+		}
+
+		inline auto create_link_stub(addr_t pc)
+		{
+			auto lsl = link_stub_labels.find(pc);
+			if (lsl == link_stub_labels.end()) {
+				lsl = link_stub_labels.insert(link_stub_labels.end(),
+					std::pair<addr_t,Label>(pc, as.newLabel()));
+			}
+			return lsl;
+		}
+
+		void emit_link(addr_t pc)
+		{
+			/* registers must already be stored */
+			uintptr_t addr = lookup_trace_slow(pc ^ addr_t(proc.trace_ctx));
+			if (addr) {
+				as.jmp(Imm(addr));
+			} else {
+				emit_jump_fixup(pc);
+			}
+		}
+
+		bool emit_branch_jump(addr_t branch_pc, addr_t cont_pc, bool cond, x86::Cond bf, x86::Cond ibf)
+		{
+			auto branch_i = labels.find(branch_pc);
+			auto cont_i = labels.find(cont_pc);
+
+			if (branch_i != labels.end() && cont_i != labels.end()) {
+				as.j(bf, branch_i->second);
+				as.jmp(cont_i->second);
+			}
+			else if (cond && branch_i != labels.end()) {
+				as.j(bf, branch_i->second);
+				emit_side_exit(cont_pc);
+				term_pc = 0;
+			}
+			else if (!cond && cont_i != labels.end()) {
+				as.j(ibf, cont_i->second);
+				emit_side_exit(branch_pc);
+				term_pc = 0;
+			} else if (cond) {
+				as.j(ibf, branch_exit(cont_pc));
+				term_pc = branch_pc;
+			} else {
+				as.j(bf, branch_exit(branch_pc));
+				term_pc = cont_pc;
+			}
+			return true;
+		}
+
+		bool emit_branch(decode_type &dec, bool cond, x86::Cond bf, x86::Cond ibf)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+
+			commit_instret();
+			fp_flush();
+
+			emit_cmp(dec);
+
+			return emit_branch_jump(dec.pc + dec.imm, dec.pc + inst_length(dec.inst), cond, bf, ibf);
+		}
+
+		bool emit_bne(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondNE, x86::kCondE);
+		}
+
+		bool emit_beq(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondE, x86::kCondNE);
+		}
+
+		bool emit_blt(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondL, x86::kCondGE);
+		}
+
+		bool emit_bge(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondGE, x86::kCondL);
+		}
+
+		bool emit_bltu(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondB, x86::kCondAE);
+		}
+
+		bool emit_bgeu(decode_type &dec)
+		{
+			return emit_branch(dec, dec.brc, x86::kCondAE, x86::kCondB);
+		}
+
+		bool emit_ld(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rdx = x86_reg(dec.rd), rs1x = x86_reg(dec.rs1);
+			if (dec.rd == rv_ireg_zero) {
+				// nop
+			}
+			else {
 				if (use_mmu) {
 					if (dec.rs1 == rv_ireg_zero) {
 						as.mov(x86::rax, Imm(dec.imm));
@@ -3089,13 +3994,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.ld)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 8, func_address(ops.ld));
 					if (rdx > 0) {
 						as.mov(x86::gpq(rdx), x86::rax);
 					} else {
@@ -3143,13 +4042,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lw)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 4, func_address(ops.lw));
 					if (rdx > 0) {
 						as.movsxd(x86::gpq(rdx), x86::eax);
 					} else {
@@ -3198,13 +4091,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lw)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 4, func_address(ops.lw));
 					if (rdx > 0) {
 						as.mov(x86::gpd(rdx), x86::eax);
 					} else {
@@ -3252,13 +4139,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lh)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 2, func_address(ops.lh));
 					if (rdx > 0) {
 						as.movsx(x86::gpq(rdx), x86::ax);
 					} else {
@@ -3307,13 +4188,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lh)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 2, func_address(ops.lh));
 					if (rdx > 0) {
 						as.mov(x86::gpd(rdx), x86::eax);
 					} else {
@@ -3361,13 +4236,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lb)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 1, func_address(ops.lb));
 					if (rdx > 0) {
 						as.movsx(x86::gpq(rdx), x86::al);
 					} else {
@@ -3416,13 +4285,7 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.call(Imm(func_address(ops.lb)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 1, func_address(ops.lb));
 					if (rdx > 0) {
 						as.mov(x86::gpd(rdx), x86::eax);
 					} else {
@@ -3463,14 +4326,9 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.xor_(x86::ecx, x86::ecx);
-					as.call(Imm(func_address(ops.sd)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 8, func_address(ops.sd), [&] {
+						as.xor_(x86::ecx, x86::ecx);
+					});
 				}
 				else if (rs1x > 0) {
 					as.mov(x86::qword_ptr(x86::gpq(rs1x), dec.imm), Imm(0));
@@ -3487,18 +4345,13 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					if (rs2x > 0) {
-						as.mov(x86::rcx, x86::gpq(rs2x));
-					} else {
-						as.mov(x86::rcx, rbp_reg_q(dec.rs2));
-					}
-					as.call(Imm(func_address(ops.sd)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 8, func_address(ops.sd), [&] {
+						if (rs2x > 0) {
+							as.mov(x86::rcx, x86::gpq(rs2x));
+						} else {
+							as.mov(x86::rcx, rbp_reg_q(dec.rs2));
+						}
+					});
 				}
 				else if (rs2x > 0) {
 					if (rs1x > 0) {
@@ -3535,14 +4388,9 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.xor_(x86::ecx, x86::ecx);
-					as.call(Imm(func_address(ops.sw)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 4, func_address(ops.sw), [&] {
+						as.xor_(x86::ecx, x86::ecx);
+					});
 				}
 				else if (rs1x > 0) {
 					as.mov(x86::dword_ptr(x86::gpq(rs1x), dec.imm), Imm(0));
@@ -3559,18 +4407,13 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					if (rs2x > 0) {
-						as.mov(x86::ecx, x86::gpd(rs2x));
-					} else {
-						as.mov(x86::ecx, rbp_reg_d(dec.rs2));
-					}
-					as.call(Imm(func_address(ops.sw)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 4, func_address(ops.sw), [&] {
+						if (rs2x > 0) {
+							as.mov(x86::ecx, x86::gpd(rs2x));
+						} else {
+							as.mov(x86::ecx, rbp_reg_d(dec.rs2));
+						}
+					});
 				}
 				else if (rs2x > 0) {
 					if (rs1x > 0) {
@@ -3606,14 +4449,9 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.xor_(x86::ecx, x86::ecx);
-					as.call(Imm(func_address(ops.sh)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 2, func_address(ops.sh), [&] {
+						as.xor_(x86::ecx, x86::ecx);
+					});
 				}
 				else if (rs1x > 0) {
 					as.mov(x86::word_ptr(x86::gpq(rs1x), dec.imm), Imm(0));
@@ -3631,18 +4469,13 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					if (rs2x > 0) {
-						as.mov(x86::ecx, x86::gpd(rs2x));
-					} else {
-						as.mov(x86::ecx, rbp_reg_d(dec.rs2));
-					}
-					as.call(Imm(func_address(ops.sh)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 2, func_address(ops.sh), [&] {
+						if (rs2x > 0) {
+							as.mov(x86::ecx, x86::gpd(rs2x));
+						} else {
+							as.mov(x86::ecx, rbp_reg_d(dec.rs2));
+						}
+					});
 				}
 				else if (rs2x > 0) {
 					if (rs1x > 0) {
@@ -3678,14 +4511,9 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					as.xor_(x86::ecx, x86::ecx);
-					as.call(Imm(func_address(ops.sb)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 1, func_address(ops.sb), [&] {
+						as.xor_(x86::ecx, x86::ecx);
+					});
 				}
 				else if (rs1x > 0) {
 					as.mov(x86::byte_ptr(x86::gpq(rs1x), dec.imm), Imm(0));
@@ -3703,18 +4531,13 @@ namespace riscv {
 						as.mov(x86::rcx, rbp_reg_q(dec.rs1));
 						as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
 					}
-					if (rs2x > 0) {
-						as.mov(x86::ecx, x86::gpd(rs2x));
-					} else {
-						as.mov(x86::ecx, rbp_reg_d(dec.rs2));
-					}
-					as.call(Imm(func_address(ops.sb)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_store(dec, 1, func_address(ops.sb), [&] {
+						if (rs2x > 0) {
+							as.mov(x86::ecx, x86::gpd(rs2x));
+						} else {
+							as.mov(x86::ecx, rbp_reg_d(dec.rs2));
+						}
+					});
 				}
 				else if (rs2x > 0) {
 					if (rs1x > 0) {
@@ -3766,6 +4589,7 @@ namespace riscv {
 
 				if (dec.rd == rv_ireg_ra) {
 					callstack.push_back(link_addr);
+					emit_rstack_push(dec, link_addr);
 				}
 
 				if (dec.rd == rv_ireg_zero) {
@@ -3787,6 +4611,7 @@ namespace riscv {
 			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
 			term_pc = 0;
 			int rdx = x86_reg(dec.rd), rs1x = x86_reg(dec.rs1);
+			fp_flush();
 			if (dec.rd == rv_ireg_zero && dec.rs1 == rv_ireg_ra && callstack.size() > 0) {
 				addr_t link_addr = callstack.back();
 				callstack.pop_back();
@@ -3813,26 +4638,22 @@ namespace riscv {
 
 				if (dec.rd == rv_ireg_ra) {
 					callstack.push_back(link_addr);
+					emit_rstack_push(dec, link_addr);
 				}
 
+				/* the target has its low bit cleared as in the interpreter */
 				if (dec.rs1 == rv_ireg_zero) {
-					if (dec.imm == 0) {
-						as.xor_(x86::eax, x86::eax);
-					} else {
-						as.mov(x86::eax, Imm(dec.imm));
-					}
-				} else if (rs1x > 0) {
-					if (dec.imm == 0) {
-						as.mov(x86::qword_ptr(x86::rbp, proc_offset(pc)), x86::gpq(rs1x));
-					} else {
+					as.mov(x86::rax, Imm(dec.imm & ~1));
+				} else {
+					if (rs1x > 0) {
 						as.lea(x86::rax, x86::qword_ptr(x86::gpq(rs1x), dec.imm));
-						as.mov(x86::qword_ptr(x86::rbp, proc_offset(pc)), x86::rax);
+					} else {
+						as.mov(x86::rax, rbp_reg_q(dec.rs1));
+						as.add(x86::rax, dec.imm);
 					}
-				} else {
-					as.mov(x86::rax, rbp_reg_q(dec.rs1));
-					as.add(x86::rax, dec.imm);
-					as.mov(x86::qword_ptr(x86::rbp, proc_offset(pc)), x86::rax);
+					as.and_(x86::rax, Imm(-2));
 				}
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(pc)), x86::rax);
 
 				if (dec.rd == rv_ireg_zero) {
 					// ret
@@ -3844,7 +4665,13 @@ namespace riscv {
 					as.mov(rbp_reg_q(dec.rd), x86::rax);
 				}
 
-				as.jmp(Imm(func_address(lookup_trace_fast)));
+				emit_store_regs();
+				as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(pc)));
+				if (dec.rd == rv_ireg_zero && dec.rs1 == rv_ireg_ra) {
+					emit_rstack_pop();
+				} else {
+					emit_jump_ic();
+				}
 
 				return false;
 			}
@@ -3878,6 +4705,7 @@ namespace riscv {
 			int rdx = x86_reg(rv_ireg_ra), rs1x = x86_reg(dec.rd);
 			addr_t link_addr = dec.pc + dec.sz;
 			callstack.push_back(link_addr);
+			emit_rstack_push(dec, link_addr);
 
 			if (dec.rd == rv_ireg_ra) {
 				// nop
@@ -4235,13 +5063,7 @@ namespace riscv {
 				u64 addr = dec.pc + dec.imm;
 				if (use_mmu) {
 					as.mov(x86::rax, Imm(addr));
-					as.call(Imm(func_address(ops.lw)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 4, func_address(ops.lw));
 					if (rdx > 0) {
 						as.movsxd(x86::gpq(rdx), x86::eax);
 					} else {
@@ -4289,13 +5111,7 @@ namespace riscv {
 				u64 addr = dec.pc + dec.imm;
 				if (use_mmu) {
 					as.mov(x86::rax, Imm(addr));
-					as.call(Imm(func_address(ops.ld)));
-					auto okay = as.newLabel();
-					as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
-					as.je(okay);
-					emit_pc(dec.pc);
-					as.jmp(term);
-					as.bind(okay);
+					emit_mmu_load(dec, 8, func_address(ops.ld));
 					if (rdx > 0) {
 						as.mov(x86::gpq(rdx), x86::rax);
 					} else {
@@ -4326,95 +5142,1281 @@ namespace riscv {
 			return true;
 		}
 
-		bool emit(decode_type &dec)
+		void emit_li_rd(decode_type &dec, s64 val)
 		{
-			auto li = labels.find(dec.pc);
-			if (li != labels.end()) {
-				return false; /* trace complete */
-			}
-			if (dec.brt) {
-				commit_instret();
-				Label l = as.newLabel();
-				labels[dec.pc] = l;
-				as.bind(l);
-			}
-			switch(dec.op) {
-				case rv_op_auipc:     instret++;    return emit_auipc(dec);
-				case rv_op_add:       instret++;    return emit_add(dec);
-				case rv_op_sub:       instret++;    return emit_sub(dec);
-				case rv_op_mul:       instret++;    return emit_mul(dec);
-				case rv_op_mulh:      instret++;    return emit_mulh(dec);
-				case rv_op_mulhu:     instret++;    return emit_mulhu(dec);
-				case rv_op_mulhsu:    instret++;    return emit_mulhsu(dec);
-				case rv_op_div:       instret++;    return emit_div(dec);
-				case rv_op_rem:       instret++;    return emit_rem(dec);
-				case rv_op_divu:      instret++;    return emit_divu(dec);
-				case rv_op_remu:      instret++;    return emit_remu(dec);
-				case rv_op_slt:       instret++;    return emit_slt(dec);
-				case rv_op_sltu:      instret++;    return emit_sltu(dec);
-				case rv_op_and:       instret++;    return emit_and(dec);
-				case rv_op_or:        instret++;    return emit_or(dec);
-				case rv_op_xor:       instret++;    return emit_xor(dec);
-				case rv_op_sll:       instret++;    return emit_sll(dec);
-				case rv_op_srl:       instret++;    return emit_srl(dec);
-				case rv_op_sra:       instret++;    return emit_sra(dec);
-				case rv_op_addw:      instret++;    return emit_addw(dec);
-				case rv_op_subw:      instret++;    return emit_subw(dec);
-				case rv_op_mulw:      instret++;    return emit_mulw(dec);
-				case rv_op_divw:      instret++;    return emit_divw(dec);
-				case rv_op_remw:      instret++;    return emit_remw(dec);
-				case rv_op_divuw:     instret++;    return emit_divuw(dec);
-				case rv_op_remuw:     instret++;    return emit_remuw(dec);
-				case rv_op_sllw:      instret++;    return emit_sllw(dec);
-				case rv_op_srlw:      instret++;    return emit_srlw(dec);
-				case rv_op_sraw:      instret++;    return emit_sraw(dec);
-				case rv_op_addi:      instret++;    return emit_addi(dec);
-				case rv_op_slti:      instret++;    return emit_slti(dec);
-				case rv_op_sltiu:     instret++;    return emit_sltiu(dec);
-				case rv_op_andi:      instret++;    return emit_andi(dec);
-				case rv_op_ori:       instret++;    return emit_ori(dec);
-				case rv_op_xori:      instret++;    return emit_xori(dec);
-				case rv_op_slli:      instret++;    return emit_slli(dec);
-				case rv_op_srli:      instret++;    return emit_srli(dec);
-				case rv_op_srai:      instret++;    return emit_srai(dec);
-				case rv_op_addiw:     instret++;    return emit_addiw(dec);
-				case rv_op_slliw:     instret++;    return emit_slliw(dec);
-				case rv_op_srliw:     instret++;    return emit_srliw(dec);
-				case rv_op_sraiw:     instret++;    return emit_sraiw(dec);
-				case rv_op_bne:       instret++;    return emit_bne(dec);
-				case rv_op_beq:       instret++;    return emit_beq(dec);
-				case rv_op_blt:       instret++;    return emit_blt(dec);
-				case rv_op_bge:       instret++;    return emit_bge(dec);
-				case rv_op_bltu:      instret++;    return emit_bltu(dec);
-				case rv_op_bgeu:      instret++;    return emit_bgeu(dec);
-				case rv_op_ld:        instret++;    return emit_ld(dec);
-				case rv_op_lw:        instret++;    return emit_lw(dec);
-				case rv_op_lwu:       instret++;    return emit_lwu(dec);
-				case rv_op_lh:        instret++;    return emit_lh(dec);
-				case rv_op_lhu:       instret++;    return emit_lhu(dec);
-				case rv_op_lb:        instret++;    return emit_lb(dec);
-				case rv_op_lbu:       instret++;    return emit_lbu(dec);
-				case rv_op_sd:        instret++;    return emit_sd(dec);
-				case rv_op_sw:        instret++;    return emit_sw(dec);
-				case rv_op_sh:        instret++;    return emit_sh(dec);
-				case rv_op_sb:        instret++;    return emit_sb(dec);
-				case rv_op_lui:       instret++;    return emit_lui(dec);
-				case rv_op_jal:       instret++;    return emit_jal(dec);
-				case rv_op_jalr:      instret++;    return emit_jalr(dec);
-				case jit_op_la:       instret += 2; return emit_la(dec);
-				case jit_op_call:     instret += 2; return emit_call(dec);
-				case jit_op_zextw:    instret += 2; return emit_zextw(dec);
-				case jit_op_addiwz:   instret += 3; return emit_addiwz(dec);
-				case jit_op_rorwi_rr: instret += 3; return emit_rorwi_rr(dec);
-				case jit_op_rorwi_lr: instret += 3; return emit_rorwi_lr(dec);
-				case jit_op_rordi_rr: instret += 3; return emit_rordi_rr(dec);
-				case jit_op_rordi_lr: instret += 3; return emit_rordi_lr(dec);
-				case jit_op_auipc_lw: instret += 2; return emit_auipc_lw(dec);
-				case jit_op_auipc_ld: instret += 2; return emit_auipc_ld(dec);
+			int rdx = x86_reg(dec.rd);
+			if (dec.rd == rv_ireg_zero) {
+				// nop
+			} else if (rdx > 0) {
+				as.mov(x86::gpq(rdx), Imm(val));
+			} else if (val == s64(s32(val))) {
+				as.mov(rbp_reg_q(dec.rd), Imm(val));
+			} else {
+				as.mov(x86::rax, Imm(val));
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
 			}
-			return false;
 		}
-	};
+
+		bool emit_li(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\tli          %s, %d", dec.pc, rv_ireg_name_sym[dec.rd], dec.imm);
+			term_pc = dec.pc + dec.sz;
+			emit_li_rd(dec, dec.imm);
+			return true;
+		}
+
+		bool emit_li_slli(decode_type &dec)
+		{
+			s64 val = s64(u64(s64(dec.imm)) << dec.rm);
+			log_trace("\t# 0x%016llx\tli          %s, 0x%llx", dec.pc, rv_ireg_name_sym[dec.rd], (u64)val);
+			term_pc = dec.pc + dec.sz;
+			emit_li_rd(dec, val);
+			return true;
+		}
+
+		bool emit_slt_branch(decode_type &dec, x86::Cond sc, x86::Cond bf, x86::Cond ibf)
+		{
+			log_trace("\t# 0x%016llx\tslt.br      %s, %s, %s, 0x%016llx", dec.pc, rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs1], rv_ireg_name_sym[dec.rs2], dec.pc + dec.imm);
+
+			commit_instret();
+			fp_flush();
+
+			/* the set result is written and the branch uses the compare flags */
+			int rdx = x86_reg(dec.rd);
+			emit_cmp(dec);
+			if (sc == x86::kCondL) {
+				as.setl(x86::al);
+			} else {
+				as.setb(x86::al);
+			}
+			if (rdx > 0) {
+				as.movzx(x86::gpd(rdx), x86::al);
+			} else {
+				as.movzx(x86::eax, x86::al);
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+			return emit_branch_jump(dec.pc + dec.imm, dec.pc + dec.sz, dec.brc, bf, ibf);
+		}
+
+		bool emit_mulh_mul(decode_type &dec, bool sign)
+		{
+			log_trace("\t# 0x%016llx\t%s %s, %s, %s, %s", dec.pc, sign ? "mulh.mul   " : "mulhu.mul  ",
+				rv_ireg_name_sym[dec.rs3], rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs1], rv_ireg_name_sym[dec.rs2]);
+			term_pc = dec.pc + dec.sz;
+			int rdx = x86_reg(dec.rd), rs2x = x86_reg(dec.rs2), rs3x = x86_reg(dec.rs3);
+
+			/* one widening multiply produces the high and low halves */
+			if (!proc.memory_registers) {
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(ireg[rv_ireg_ra])), x86::rdx);
+			}
+			emit_mv_rax_rs1(dec);
+			if (rs2x > 0) {
+				if (sign) {
+					as.imul(x86::gpq(rs2x));
+				} else {
+					as.mul(x86::gpq(rs2x));
+				}
+			} else {
+				as.mov(x86::rcx, rbp_reg_q(dec.rs2));
+				if (sign) {
+					as.imul(x86::rcx);
+				} else {
+					as.mul(x86::rcx);
+				}
+			}
+			if (rs3x > 0) {
+				as.mov(x86::gpq(rs3x), x86::rdx);
+			} else {
+				as.mov(rbp_reg_q(dec.rs3), x86::rdx);
+			}
+			if (rdx > 0) {
+				as.mov(x86::gpq(rdx), x86::rax);
+			} else {
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+			if (!proc.memory_registers) {
+				as.mov(x86::rdx, x86::qword_ptr(x86::rbp, proc_offset(ireg[rv_ireg_ra])));
+			}
+			return true;
+		}
+
+		void emit_div_rem_store(decode_type &dec)
+		{
+			int rdx = x86_reg(dec.rd), rs3x = x86_reg(dec.rs3);
+			if (rdx > 0) {
+				as.mov(x86::gpq(rdx), x86::rax);
+			} else {
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+			if (rs3x > 0) {
+				as.mov(x86::gpq(rs3x), x86::rdx);
+			} else {
+				as.mov(rbp_reg_q(dec.rs3), x86::rdx);
+			}
+			as.mov(x86::rdx, x86::rcx);
+		}
+
+		bool emit_div_rem(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\tdiv.rem     %s, %s, %s, %s", dec.pc, rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs3], rv_ireg_name_sym[dec.rs1], rv_ireg_name_sym[dec.rs2]);
+			term_pc = dec.pc + dec.sz;
+			int rs1x = x86_reg(dec.rs1), rs2x = x86_reg(dec.rs2);
+
+			/* one divide produces the quotient and remainder */
+			Label out = as.newLabel();
+			Label div1 = as.newLabel();
+			Label div2 = as.newLabel();
+
+			as.mov(x86::rcx, x86::rdx);
+			as.mov(x86::rax, std::numeric_limits<int64_t>::min());
+			if (rs1x > 0) {
+				as.cmp(x86::gpq(rs1x), x86::rax);
+			} else {
+				as.cmp(rbp_reg_q(dec.rs1), x86::rax);
+			}
+			as.jne(div1);
+			if (rs2x > 0) {
+				as.cmp(x86::gpq(rs2x), Imm(-1));
+			} else {
+				as.cmp(rbp_reg_q(dec.rs2), Imm(-1));
+			}
+			as.jne(div1);
+			as.xor_(x86::edx, x86::edx);
+			as.jmp(out);
+
+			as.bind(div1);
+			emit_mv_rax_rs1(dec);
+			if (rs2x > 0) {
+				as.test(x86::gpq(rs2x), x86::gpq(rs2x));
+			} else {
+				as.cmp(rbp_reg_q(dec.rs2), Imm(0));
+			}
+			as.jne(div2);
+			as.mov(x86::rdx, x86::rax);
+			as.mov(x86::rax, Imm(-1));
+			as.jmp(out);
+
+			as.bind(div2);
+			as.cqo();
+			if (rs2x > 0) {
+				as.idiv(x86::gpq(rs2x));
+			} else {
+				as.idiv(rbp_reg_q(dec.rs2));
+			}
+
+			as.bind(out);
+			emit_div_rem_store(dec);
+			return true;
+		}
+
+		bool emit_divu_remu(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\tdivu.remu   %s, %s, %s, %s", dec.pc, rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs3], rv_ireg_name_sym[dec.rs1], rv_ireg_name_sym[dec.rs2]);
+			term_pc = dec.pc + dec.sz;
+			int rs2x = x86_reg(dec.rs2);
+
+			Label out = as.newLabel();
+			Label div1 = as.newLabel();
+
+			as.mov(x86::rcx, x86::rdx);
+			emit_mv_rax_rs1(dec);
+			if (rs2x > 0) {
+				as.test(x86::gpq(rs2x), x86::gpq(rs2x));
+			} else {
+				as.cmp(rbp_reg_q(dec.rs2), Imm(0));
+			}
+			as.jne(div1);
+			as.mov(x86::rdx, x86::rax);
+			as.mov(x86::rax, Imm(-1));
+			as.jmp(out);
+
+			as.bind(div1);
+			as.xor_(x86::edx, x86::edx);
+			if (rs2x > 0) {
+				as.div(x86::gpq(rs2x));
+			} else {
+				as.div(rbp_reg_q(dec.rs2));
+			}
+
+			as.bind(out);
+			emit_div_rem_store(dec);
+			return true;
+		}
+
+		bool emit_lea(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\tlea         %s, %s, %s, %d", dec.pc, rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs2], rv_ireg_name_sym[dec.rs1], dec.rm);
+			term_pc = dec.pc + dec.sz;
+			int rdx = x86_reg(dec.rd), rs1x = x86_reg(dec.rs1), rs2x = x86_reg(dec.rs2);
+
+			/* rd = rs2 + (rs1 << rm) */
+			X86Gp index = rs1x > 0 ? x86::gpq(rs1x) : x86::rax;
+			X86Gp base = rs2x > 0 ? x86::gpq(rs2x) : x86::rcx;
+			if (rs1x <= 0) {
+				as.mov(x86::rax, rbp_reg_q(dec.rs1));
+			}
+			if (rs2x <= 0) {
+				as.mov(x86::rcx, rbp_reg_q(dec.rs2));
+			}
+			if (rdx > 0) {
+				as.lea(x86::gpq(rdx), x86::qword_ptr(base, index, dec.rm));
+			} else {
+				as.lea(x86::rax, x86::qword_ptr(base, index, dec.rm));
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+			return true;
+		}
+
+		X86Gp emit_pair_base(decode_type &dec)
+		{
+			int rs1x = x86_reg(dec.rs1);
+			if (rs1x > 0) return x86::gpq(rs1x);
+			as.mov(x86::rcx, rbp_reg_q(dec.rs1));
+			return x86::rcx;
+		}
+
+		bool emit_load_pair(decode_type &dec)
+		{
+			if (use_mmu) {
+				/* each access is translated, the first load is idempotent if the second faults */
+				decode_type first = dec, second = dec;
+				first.op = second.op = rv_op_ld;
+				second.rd = dec.rs2;
+				second.imm = dec.imm + 8;
+				emit_ld(first);
+				emit_ld(second);
+				term_pc = dec.pc + dec.sz;
+				return true;
+			}
+			log_trace("\t# 0x%016llx\tld.pair     %s, %s, %d(%s)", dec.pc, rv_ireg_name_sym[dec.rd],
+				rv_ireg_name_sym[dec.rs2], dec.imm, rv_ireg_name_sym[dec.rs1]);
+			term_pc = dec.pc + dec.sz;
+			int rdx = x86_reg(dec.rd), rd2x = x86_reg(dec.rs2);
+
+			/* the base is loaded once for both accesses */
+			X86Gp base = emit_pair_base(dec);
+			if (rdx > 0) {
+				as.mov(x86::gpq(rdx), x86::qword_ptr(base, dec.imm));
+			} else {
+				as.mov(x86::rax, x86::qword_ptr(base, dec.imm));
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+			if (rd2x > 0) {
+				as.mov(x86::gpq(rd2x), x86::qword_ptr(base, dec.imm + 8));
+			} else {
+				as.mov(x86::rax, x86::qword_ptr(base, dec.imm + 8));
+				as.mov(rbp_reg_q(dec.rs2), x86::rax);
+			}
+			return true;
+		}
+
+		void emit_store_pair_src(X86Gp base, int src, s32 offset)
+		{
+			int srcx = x86_reg(src);
+			if (src == rv_ireg_zero) {
+				as.mov(x86::qword_ptr(base, offset), Imm(0));
+			} else if (srcx > 0) {
+				as.mov(x86::qword_ptr(base, offset), x86::gpq(srcx));
+			} else {
+				as.mov(x86::rax, rbp_reg_q(src));
+				as.mov(x86::qword_ptr(base, offset), x86::rax);
+			}
+		}
+
+		bool emit_store_pair(decode_type &dec)
+		{
+			if (use_mmu) {
+				/* each access is translated, the first store is idempotent if the second faults */
+				decode_type first = dec, second = dec;
+				first.op = second.op = rv_op_sd;
+				second.rs2 = dec.rs3;
+				second.imm = dec.imm + 8;
+				emit_sd(first);
+				emit_sd(second);
+				term_pc = dec.pc + dec.sz;
+				return true;
+			}
+			log_trace("\t# 0x%016llx\tsd.pair     %s, %s, %d(%s)", dec.pc, rv_ireg_name_sym[dec.rs2],
+				rv_ireg_name_sym[dec.rs3], dec.imm, rv_ireg_name_sym[dec.rs1]);
+			term_pc = dec.pc + dec.sz;
+			X86Gp base = emit_pair_base(dec);
+			emit_store_pair_src(base, dec.rs2, dec.imm);
+			emit_store_pair_src(base, dec.rs3, dec.imm + 8);
+			return true;
+		}
+
+		/*
+		 * Native library routines
+		 *
+		 * The routine reads its arguments from and writes its result to
+		 * the register file so the guest registers are stored around the
+		 * call. dec.imm selects the routine.
+		 */
+		bool emit_native(decode_type &dec)
+		{
+			log_trace("\t# 0x%016llx\tnative      %d", dec.pc, dec.imm);
+			commit_instret();
+			emit_store_regs();
+			if (!proc.memory_registers) {
+				/* the prolog leaves the stack 8 bytes below 16 byte alignment */
+				as.sub(x86::rsp, Imm(8));
+			}
+			as.mov(x86::rdi, Imm(dec.imm));
+			as.call(Imm(native_call));
+			if (!proc.memory_registers) {
+				as.add(x86::rsp, Imm(8));
+			}
+			emit_load_regs();
+			return true;
+		}
+
+		bool mmu_call_op(decode_type &dec)
+		{
+			switch (dec.op) {
+				case rv_op_ld:
+				case rv_op_lw:
+				case rv_op_lwu:
+				case rv_op_lh:
+				case rv_op_lhu:
+				case rv_op_lb:
+				case rv_op_lbu:
+				case rv_op_sd:
+				case rv_op_sw:
+				case rv_op_sh:
+				case rv_op_sb:
+				case rv_op_flw:
+				case rv_op_fsw:
+				case rv_op_fld:
+				case rv_op_fsd:
+				case jit_op_auipc_lw:
+				case jit_op_auipc_ld:
+				case jit_op_load_pair:
+				case jit_op_store_pair:
+				case rv_op_lr_w:
+				case rv_op_sc_w:
+				case rv_op_amoswap_w:
+				case rv_op_amoadd_w:
+				case rv_op_amoxor_w:
+				case rv_op_amoor_w:
+				case rv_op_amoand_w:
+				case rv_op_amomin_w:
+				case rv_op_amomax_w:
+				case rv_op_amominu_w:
+				case rv_op_amomaxu_w:
+				case rv_op_lr_d:
+				case rv_op_sc_d:
+				case rv_op_amoswap_d:
+				case rv_op_amoadd_d:
+				case rv_op_amoxor_d:
+				case rv_op_amoor_d:
+				case rv_op_amoand_d:
+				case rv_op_amomin_d:
+				case rv_op_amomax_d:
+				case rv_op_amominu_d:
+				case rv_op_amomaxu_d:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		enum fp_arith {
+			fp_arith_add,
+			fp_arith_sub,
+			fp_arith_mul,
+			fp_arith_div
+		};
+
+		enum fp_cmp {
+			fp_cmp_eq,
+			fp_cmp_lt,
+			fp_cmp_le
+		};
+
+		enum fp_sgnj {
+			fp_sgnj_j,
+			fp_sgnj_jn,
+			fp_sgnj_jx
+		};
+
+		void emit_fp_arith(int arith, int kind, const X86Xmm &d, const X86Xmm &s)
+		{
+			if (kind == fp_kind_s) {
+				switch (arith) {
+					case fp_arith_add: as.addss(d, s); break;
+					case fp_arith_sub: as.subss(d, s); break;
+					case fp_arith_mul: as.mulss(d, s); break;
+					case fp_arith_div: as.divss(d, s); break;
+				}
+			} else {
+				switch (arith) {
+					case fp_arith_add: as.addsd(d, s); break;
+					case fp_arith_sub: as.subsd(d, s); break;
+					case fp_arith_mul: as.mulsd(d, s); break;
+					case fp_arith_div: as.divsd(d, s); break;
+				}
+			}
+		}
+
+		void emit_fp_addr_rax(decode_type &dec)
+		{
+			int rs1x = x86_reg(dec.rs1);
+			if (dec.rs1 == rv_ireg_zero) {
+				as.mov(x86::rax, Imm(dec.imm));
+			}
+			else if (rs1x > 0) {
+				as.lea(x86::rax, x86::qword_ptr(x86::gpq(rs1x), dec.imm));
+			}
+			else {
+				as.mov(x86::rcx, rbp_reg_q(dec.rs1));
+				as.lea(x86::rax, x86::qword_ptr(x86::rcx, dec.imm));
+			}
+		}
+
+		X86Mem emit_fp_mem(decode_type &dec, int kind)
+		{
+			int rs1x = x86_reg(dec.rs1);
+			if (rs1x > 0) {
+				return kind == fp_kind_s
+					? x86::dword_ptr(x86::gpq(rs1x), dec.imm)
+					: x86::qword_ptr(x86::gpq(rs1x), dec.imm);
+			}
+			as.mov(x86::rax, rbp_reg_q(dec.rs1));
+			return kind == fp_kind_s
+				? x86::dword_ptr(x86::rax, dec.imm)
+				: x86::qword_ptr(x86::rax, dec.imm);
+		}
+
+		bool emit_fp_load(decode_type &dec, int kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (use_mmu) {
+				emit_fp_addr_rax(dec);
+				if (kind == fp_kind_s) {
+					emit_mmu_load(dec, 4, func_address(ops.lw));
+				} else {
+					emit_mmu_load(dec, 8, func_address(ops.ld));
+				}
+				int rdx = fp_def(dec.rd, kind);
+				if (kind == fp_kind_s) {
+					as.movd(x86::xmm(rdx), x86::eax);
+				} else {
+					as.movq(x86::xmm(rdx), x86::rax);
+				}
+			} else {
+				X86Mem mem = emit_fp_mem(dec, kind);
+				int rdx = fp_def(dec.rd, kind);
+				if (kind == fp_kind_s) {
+					as.movss(x86::xmm(rdx), mem);
+				} else {
+					as.movsd(x86::xmm(rdx), mem);
+				}
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_store(decode_type &dec, int kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (use_mmu) {
+				emit_fp_addr_rax(dec);
+				if (kind == fp_kind_s) {
+					emit_mmu_store(dec, 4, func_address(ops.sw), [&] {
+						as.mov(x86::ecx, rbp_freg_s(dec.rs2));
+					});
+				} else {
+					emit_mmu_store(dec, 8, func_address(ops.sd), [&] {
+						as.mov(x86::rcx, rbp_freg_d(dec.rs2));
+					});
+				}
+			} else {
+				int rs2x = fp_use(dec.rs2, kind);
+				X86Mem mem = emit_fp_mem(dec, kind);
+				if (kind == fp_kind_s) {
+					as.movss(mem, x86::xmm(rs2x));
+				} else {
+					as.movsd(mem, x86::xmm(rs2x));
+				}
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_binop(decode_type &dec, int kind, int arith)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = fp_use(dec.rs1, kind), rs2x = fp_use(dec.rs2, kind);
+			int rdx = fp_def(dec.rd, kind);
+			if (rdx == rs1x) {
+				emit_fp_arith(arith, kind, x86::xmm(rdx), x86::xmm(rs2x));
+			}
+			else if (rdx != rs2x) {
+				as.movaps(x86::xmm(rdx), x86::xmm(rs1x));
+				emit_fp_arith(arith, kind, x86::xmm(rdx), x86::xmm(rs2x));
+			}
+			else {
+				as.movaps(x86::xmm15, x86::xmm(rs1x));
+				emit_fp_arith(arith, kind, x86::xmm15, x86::xmm(rs2x));
+				as.movaps(x86::xmm(rdx), x86::xmm15);
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_fma(decode_type &dec, int kind, bool neg_product, int arith)
+		{
+			/* match the interpreter which rounds the product and the sum separately */
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = fp_use(dec.rs1, kind), rs2x = fp_use(dec.rs2, kind);
+			int rs3x = fp_use(dec.rs3, kind);
+			int rdx = fp_def(dec.rd, kind);
+			as.movaps(x86::xmm15, x86::xmm(rs1x));
+			emit_fp_arith(fp_arith_mul, kind, x86::xmm15, x86::xmm(rs2x));
+			if (neg_product) {
+				if (kind == fp_kind_s) {
+					as.movd(x86::eax, x86::xmm15);
+					as.xor_(x86::eax, Imm(0x80000000));
+					as.movd(x86::xmm15, x86::eax);
+				} else {
+					as.movq(x86::rax, x86::xmm15);
+					as.btc(x86::rax, Imm(63));
+					as.movq(x86::xmm15, x86::rax);
+				}
+			}
+			emit_fp_arith(arith, kind, x86::xmm15, x86::xmm(rs3x));
+			as.movaps(x86::xmm(rdx), x86::xmm15);
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_sgnj(decode_type &dec, int kind, int sgnj)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = fp_use(dec.rs1, kind), rs2x = fp_use(dec.rs2, kind);
+			int rdx = fp_def(dec.rd, kind);
+			if (kind == fp_kind_s) {
+				as.movd(x86::eax, x86::xmm(rs1x));
+				as.movd(x86::ecx, x86::xmm(rs2x));
+				if (sgnj == fp_sgnj_jn) as.not_(x86::ecx);
+				as.and_(x86::ecx, Imm(0x80000000));
+				if (sgnj != fp_sgnj_jx) as.and_(x86::eax, Imm(0x7fffffff));
+				as.xor_(x86::eax, x86::ecx);
+				as.movd(x86::xmm(rdx), x86::eax);
+			} else {
+				as.movq(x86::rax, x86::xmm(rs1x));
+				as.movq(x86::rcx, x86::xmm(rs2x));
+				if (sgnj == fp_sgnj_jn) as.not_(x86::rcx);
+				as.shr(x86::rcx, Imm(63));
+				as.shl(x86::rcx, Imm(63));
+				if (sgnj != fp_sgnj_jx) as.btr(x86::rax, Imm(63));
+				as.xor_(x86::rax, x86::rcx);
+				as.movq(x86::xmm(rdx), x86::rax);
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_sqrt(decode_type &dec, int kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = fp_use(dec.rs1, kind);
+			int rdx = fp_def(dec.rd, kind);
+			if (kind == fp_kind_s) {
+				as.sqrtss(x86::xmm(rdx), x86::xmm(rs1x));
+			} else {
+				as.sqrtsd(x86::xmm(rdx), x86::xmm(rs1x));
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_cvt_fp(decode_type &dec, int rd_kind, int rs1_kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = fp_use(dec.rs1, rs1_kind);
+			int rdx = fp_def(dec.rd, rd_kind);
+			if (rd_kind == fp_kind_s) {
+				as.cvtsd2ss(x86::xmm(rdx), x86::xmm(rs1x));
+			} else {
+				as.cvtss2sd(x86::xmm(rdx), x86::xmm(rs1x));
+			}
+			fp_unlock();
+			return true;
+		}
+
+		void emit_rd_rax(decode_type &dec)
+		{
+			int rdx = x86_reg(dec.rd);
+			if (dec.rd == rv_ireg_zero) return;
+			if (rdx > 0) {
+				as.mov(x86::gpq(rdx), x86::rax);
+			} else {
+				as.mov(rbp_reg_q(dec.rd), x86::rax);
+			}
+		}
+
+		bool emit_fp_cmp(decode_type &dec, int kind, int cmp)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (dec.rd == rv_ireg_zero) {
+				// nop
+			} else {
+				int rs1x = fp_use(dec.rs1, kind), rs2x = fp_use(dec.rs2, kind);
+				if (cmp == fp_cmp_eq) {
+					/* quiet compare, unordered is not equal */
+					if (kind == fp_kind_s) {
+						as.ucomiss(x86::xmm(rs1x), x86::xmm(rs2x));
+					} else {
+						as.ucomisd(x86::xmm(rs1x), x86::xmm(rs2x));
+					}
+					as.sete(x86::al);
+					as.setnp(x86::cl);
+					as.and_(x86::al, x86::cl);
+				} else {
+					/* signalling compare with swapped operands, unordered sets CF */
+					if (kind == fp_kind_s) {
+						as.comiss(x86::xmm(rs2x), x86::xmm(rs1x));
+					} else {
+						as.comisd(x86::xmm(rs2x), x86::xmm(rs1x));
+					}
+					if (cmp == fp_cmp_lt) {
+						as.seta(x86::al);
+					} else {
+						as.setae(x86::al);
+					}
+				}
+				as.movzx(x86::eax, x86::al);
+				emit_rd_rax(dec);
+				fp_unlock();
+			}
+			return true;
+		}
+
+		bool emit_fp_cvt_int(decode_type &dec, int kind, bool word)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (dec.rd == rv_ireg_zero) {
+				// nop
+			} else {
+				/* truncate, saturating NaN and positive overflow like riscv::fcvt_w and fcvt_l */
+				int rs1x = fp_use(dec.rs1, kind);
+				auto okay = as.newLabel();
+				auto sat = as.newLabel();
+				X86Gp r = word ? x86::eax : x86::rax;
+				if (kind == fp_kind_s) {
+					as.cvttss2si(r, x86::xmm(rs1x));
+				} else {
+					as.cvttsd2si(r, x86::xmm(rs1x));
+				}
+				as.cmp(r, Imm(1));
+				as.jno(okay);
+				as.xorps(x86::xmm15, x86::xmm15);
+				if (kind == fp_kind_s) {
+					as.ucomiss(x86::xmm(rs1x), x86::xmm15);
+				} else {
+					as.ucomisd(x86::xmm(rs1x), x86::xmm15);
+				}
+				as.jp(sat);
+				as.jbe(okay);
+				as.bind(sat);
+				if (word) {
+					as.mov(x86::eax, Imm(std::numeric_limits<s32>::max()));
+				} else {
+					as.mov(x86::rax, Imm(std::numeric_limits<s64>::max()));
+				}
+				as.bind(okay);
+				if (word) {
+					as.movsxd(x86::rax, x86::eax);
+				}
+				emit_rd_rax(dec);
+				fp_unlock();
+			}
+			return true;
+		}
+
+		bool emit_fp_cvt_from_int(decode_type &dec, int kind, int width, bool is_unsigned)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = x86_reg(dec.rs1);
+			X86Gp r = x86::rax;
+			if (dec.rs1 == rv_ireg_zero) {
+				as.xor_(x86::eax, x86::eax);
+			} else if (width == 32 && is_unsigned) {
+				/* zero extend and convert as a 64-bit signed value */
+				if (rs1x > 0) {
+					as.mov(x86::eax, x86::gpd(rs1x));
+				} else {
+					as.mov(x86::eax, rbp_reg_d(dec.rs1));
+				}
+			} else if (rs1x > 0) {
+				r = width == 32 ? x86::gpd(rs1x) : x86::gpq(rs1x);
+			} else if (width == 32) {
+				as.mov(x86::eax, rbp_reg_d(dec.rs1));
+				r = x86::eax;
+			} else {
+				as.mov(x86::rax, rbp_reg_q(dec.rs1));
+			}
+			int rdx = fp_def(dec.rd, kind);
+			if (kind == fp_kind_s) {
+				as.cvtsi2ss(x86::xmm(rdx), r);
+			} else {
+				as.cvtsi2sd(x86::xmm(rdx), r);
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_fp_mv_x(decode_type &dec, int kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (dec.rd == rv_ireg_zero) {
+				// nop
+			} else {
+				/* canonicalize NaN like the interpreter without raising invalid */
+				int rs1x = fp_use(dec.rs1, kind);
+				auto okay = as.newLabel();
+				if (kind == fp_kind_s) {
+					as.movd(x86::eax, x86::xmm(rs1x));
+					as.mov(x86::ecx, x86::eax);
+					as.and_(x86::ecx, Imm(0x7fffffff));
+					as.cmp(x86::ecx, Imm(0x7f800000));
+					as.jbe(okay);
+					as.mov(x86::eax, Imm(0x7fc00000));
+					as.bind(okay);
+					as.movsxd(x86::rax, x86::eax);
+				} else {
+					auto nan = as.newLabel();
+					as.movq(x86::rax, x86::xmm(rs1x));
+					as.mov(x86::rcx, x86::rax);
+					as.shl(x86::rcx, Imm(1));
+					as.shr(x86::rcx, Imm(53));
+					as.cmp(x86::ecx, Imm(0x7ff));
+					as.jne(okay);
+					as.mov(x86::rcx, x86::rax);
+					as.shl(x86::rcx, Imm(12));
+					as.jz(okay);
+					as.bind(nan);
+					as.mov(x86::rax, Imm(0x7ff8000000000000ULL));
+					as.bind(okay);
+				}
+				emit_rd_rax(dec);
+				fp_unlock();
+			}
+			return true;
+		}
+
+		bool emit_fp_mv_f(decode_type &dec, int kind)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			int rs1x = x86_reg(dec.rs1);
+			int rdx = fp_def(dec.rd, kind);
+			if (dec.rs1 == rv_ireg_zero) {
+				as.xorps(x86::xmm(rdx), x86::xmm(rdx));
+			} else if (kind == fp_kind_s) {
+				if (rs1x > 0) {
+					as.movd(x86::xmm(rdx), x86::gpd(rs1x));
+				} else {
+					as.movd(x86::xmm(rdx), rbp_reg_d(dec.rs1));
+				}
+			} else {
+				if (rs1x > 0) {
+					as.movq(x86::xmm(rdx), x86::gpq(rs1x));
+				} else {
+					as.movq(x86::xmm(rdx), rbp_reg_q(dec.rs1));
+				}
+			}
+			fp_unlock();
+			return true;
+		}
+
+		bool emit_flw(decode_type &dec) { return emit_fp_load(dec, fp_kind_s); }
+		bool emit_fsw(decode_type &dec) { return emit_fp_store(dec, fp_kind_s); }
+		bool emit_fmadd_s(decode_type &dec) { return emit_fp_fma(dec, fp_kind_s, false, fp_arith_add); }
+		bool emit_fmsub_s(decode_type &dec) { return emit_fp_fma(dec, fp_kind_s, false, fp_arith_sub); }
+		bool emit_fnmsub_s(decode_type &dec) { return emit_fp_fma(dec, fp_kind_s, true, fp_arith_add); }
+		bool emit_fnmadd_s(decode_type &dec) { return emit_fp_fma(dec, fp_kind_s, true, fp_arith_sub); }
+		bool emit_fadd_s(decode_type &dec) { return emit_fp_binop(dec, fp_kind_s, fp_arith_add); }
+		bool emit_fsub_s(decode_type &dec) { return emit_fp_binop(dec, fp_kind_s, fp_arith_sub); }
+		bool emit_fmul_s(decode_type &dec) { return emit_fp_binop(dec, fp_kind_s, fp_arith_mul); }
+		bool emit_fdiv_s(decode_type &dec) { return emit_fp_binop(dec, fp_kind_s, fp_arith_div); }
+		bool emit_fsgnj_s(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_s, fp_sgnj_j); }
+		bool emit_fsgnjn_s(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_s, fp_sgnj_jn); }
+		bool emit_fsgnjx_s(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_s, fp_sgnj_jx); }
+		bool emit_fsqrt_s(decode_type &dec) { return emit_fp_sqrt(dec, fp_kind_s); }
+		bool emit_fle_s(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_s, fp_cmp_le); }
+		bool emit_flt_s(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_s, fp_cmp_lt); }
+		bool emit_feq_s(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_s, fp_cmp_eq); }
+		bool emit_fcvt_w_s(decode_type &dec) { return emit_fp_cvt_int(dec, fp_kind_s, true); }
+		bool emit_fcvt_s_w(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_s, 32, false); }
+		bool emit_fcvt_s_wu(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_s, 32, true); }
+		bool emit_fmv_x_s(decode_type &dec) { return emit_fp_mv_x(dec, fp_kind_s); }
+		bool emit_fmv_s_x(decode_type &dec) { return emit_fp_mv_f(dec, fp_kind_s); }
+		bool emit_fcvt_l_s(decode_type &dec) { return emit_fp_cvt_int(dec, fp_kind_s, false); }
+		bool emit_fcvt_s_l(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_s, 64, false); }
+		bool emit_fld(decode_type &dec) { return emit_fp_load(dec, fp_kind_d); }
+		bool emit_fsd(decode_type &dec) { return emit_fp_store(dec, fp_kind_d); }
+		bool emit_fmadd_d(decode_type &dec) { return emit_fp_fma(dec, fp_kind_d, false, fp_arith_add); }
+		bool emit_fmsub_d(decode_type &dec) { return emit_fp_fma(dec, fp_kind_d, false, fp_arith_sub); }
+		bool emit_fnmsub_d(decode_type &dec) { return emit_fp_fma(dec, fp_kind_d, true, fp_arith_add); }
+		bool emit_fnmadd_d(decode_type &dec) { return emit_fp_fma(dec, fp_kind_d, true, fp_arith_sub); }
+		bool emit_fadd_d(decode_type &dec) { return emit_fp_binop(dec, fp_kind_d, fp_arith_add); }
+		bool emit_fsub_d(decode_type &dec) { return emit_fp_binop(dec, fp_kind_d, fp_arith_sub); }
+		bool emit_fmul_d(decode_type &dec) { return emit_fp_binop(dec, fp_kind_d, fp_arith_mul); }
+		bool emit_fdiv_d(decode_type &dec) { return emit_fp_binop(dec, fp_kind_d, fp_arith_div); }
+		bool emit_fsgnj_d(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_d, fp_sgnj_j); }
+		bool emit_fsgnjn_d(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_d, fp_sgnj_jn); }
+		bool emit_fsgnjx_d(decode_type &dec) { return emit_fp_sgnj(dec, fp_kind_d, fp_sgnj_jx); }
+		bool emit_fcvt_s_d(decode_type &dec) { return emit_fp_cvt_fp(dec, fp_kind_s, fp_kind_d); }
+		bool emit_fcvt_d_s(decode_type &dec) { return emit_fp_cvt_fp(dec, fp_kind_d, fp_kind_s); }
+		bool emit_fsqrt_d(decode_type &dec) { return emit_fp_sqrt(dec, fp_kind_d); }
+		bool emit_fle_d(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_d, fp_cmp_le); }
+		bool emit_flt_d(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_d, fp_cmp_lt); }
+		bool emit_feq_d(decode_type &dec) { return emit_fp_cmp(dec, fp_kind_d, fp_cmp_eq); }
+		bool emit_fcvt_w_d(decode_type &dec) { return emit_fp_cvt_int(dec, fp_kind_d, true); }
+		bool emit_fcvt_d_w(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_d, 32, false); }
+		bool emit_fcvt_d_wu(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_d, 32, true); }
+		bool emit_fcvt_l_d(decode_type &dec) { return emit_fp_cvt_int(dec, fp_kind_d, false); }
+		bool emit_fmv_x_d(decode_type &dec) { return emit_fp_mv_x(dec, fp_kind_d); }
+		bool emit_fcvt_d_l(decode_type &dec) { return emit_fp_cvt_from_int(dec, fp_kind_d, 64, false); }
+		bool emit_fmv_d_x(decode_type &dec) { return emit_fp_mv_f(dec, fp_kind_d); }
+
+		X86Gp amo_base(decode_type &dec, bool &spill)
+		{
+			/* use rs1 if it is in a host register, otherwise borrow rdx or rsi via the red zone */
+			int rs1x = x86_reg(dec.rs1), rs2x = x86_reg(dec.rs2);
+			spill = false;
+			if (rs1x > 0) {
+				return x86::gpq(rs1x);
+			}
+			X86Gp base = rs2x == 2 ? x86::rsi : x86::rdx;
+			as.mov(x86::qword_ptr(x86::rsp, -8), base);
+			as.mov(base, rbp_reg_q(dec.rs1));
+			spill = true;
+			return base;
+		}
+
+		void amo_restore(const X86Gp &base, bool spill)
+		{
+			if (spill) {
+				as.mov(base, x86::qword_ptr(x86::rsp, -8));
+			}
+		}
+
+		void amo_addr_rax(decode_type &dec)
+		{
+			int rs1x = x86_reg(dec.rs1);
+			if (rs1x > 0) {
+				as.mov(x86::rax, x86::gpq(rs1x));
+			} else {
+				as.mov(x86::rax, rbp_reg_q(dec.rs1));
+			}
+		}
+
+		template <typename S>
+		void emit_amo_fn(int op, const X86Gp &a, const X86Gp &c, const S &s)
+		{
+			switch (op) {
+				case amoswap: as.mov(c, s); break;
+				case amoadd:  as.mov(c, a); as.add(c, s); break;
+				case amoxor:  as.mov(c, a); as.xor_(c, s); break;
+				case amoor:   as.mov(c, a); as.or_(c, s); break;
+				case amoand:  as.mov(c, a); as.and_(c, s); break;
+				case amomin:  as.mov(c, a); as.cmp(c, s); as.cmovg(c, s); break;
+				case amomax:  as.mov(c, a); as.cmp(c, s); as.cmovl(c, s); break;
+				case amominu: as.mov(c, a); as.cmp(c, s); as.cmova(c, s); break;
+				case amomaxu: as.mov(c, a); as.cmp(c, s); as.cmovb(c, s); break;
+			}
+		}
+
+		void emit_amo_fn(decode_type &dec, int op, bool word)
+		{
+			/* rcx = op(rax, rs2) */
+			int rs2x = x86_reg(dec.rs2);
+			X86Gp a = word ? x86::eax : x86::rax;
+			X86Gp c = word ? x86::ecx : x86::rcx;
+			if (rs2x > 0) {
+				emit_amo_fn(op, a, c, word ? x86::gpd(rs2x) : x86::gpq(rs2x));
+			} else {
+				emit_amo_fn(op, a, c, word ? rbp_reg_d(dec.rs2) : rbp_reg_q(dec.rs2));
+			}
+		}
+
+		bool emit_amo(decode_type &dec, int op, bool word)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (use_mmu) {
+				/* keep the address and old value on the stack across the helper calls */
+				auto fault = as.newLabel();
+				auto done = as.newLabel();
+				as.sub(x86::rsp, Imm(16));
+				amo_addr_rax(dec);
+				as.mov(x86::qword_ptr(x86::rsp), x86::rax);
+				as.call(Imm(word ? func_address(ops.lw) : func_address(ops.ld)));
+				as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
+				as.jne(fault);
+				as.mov(x86::qword_ptr(x86::rsp, 8), x86::rax);
+				emit_amo_fn(dec, op, word);
+				as.mov(x86::rax, x86::qword_ptr(x86::rsp));
+				as.call(Imm(word ? func_address(ops.sw) : func_address(ops.sd)));
+				as.cmp(x86::qword_ptr(x86::rbp, proc_offset(cause)), Imm(0));
+				as.jne(fault);
+				as.mov(x86::rax, x86::qword_ptr(x86::rsp, 8));
+				as.add(x86::rsp, Imm(16));
+				as.jmp(done);
+				as.bind(fault);
+				as.add(x86::rsp, Imm(16));
+				as.jmp(fault_exit(dec));
+				as.bind(done);
+			} else {
+				bool spill;
+				X86Gp base = amo_base(dec, spill);
+				X86Mem mem = word ? x86::dword_ptr(base) : x86::qword_ptr(base);
+				if (op == amoswap) {
+					emit_amo_fn(dec, amoswap, word);
+					as.xchg(mem, word ? x86::ecx : x86::rcx);
+					as.mov(x86::rax, x86::rcx);
+				}
+				else if (op == amoadd) {
+					emit_amo_fn(dec, amoswap, word);
+					as.lock().xadd(mem, word ? x86::ecx : x86::rcx);
+					as.mov(x86::rax, x86::rcx);
+				}
+				else {
+					auto retry = as.newLabel();
+					as.mov(word ? x86::eax : x86::rax, mem);
+					as.bind(retry);
+					emit_amo_fn(dec, op, word);
+					as.lock().cmpxchg(mem, word ? x86::ecx : x86::rcx);
+					as.jne(retry);
+				}
+				amo_restore(base, spill);
+			}
+			if (word) {
+				as.movsxd(x86::rax, x86::eax);
+			}
+			emit_rd_rax(dec);
+			return true;
+		}
+
+		bool emit_lr(decode_type &dec, bool word)
+		{
+			/*
+			 * The reservation is the address in lr plus the loaded value in
+			 * lr_val which the store conditional uses as its cmpxchg operand.
+			 */
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			if (use_mmu) {
+				amo_addr_rax(dec);
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(lr)), x86::rax);
+				as.call(Imm(word ? func_address(ops.lw) : func_address(ops.ld)));
+				emit_mmu_check(dec);
+				if (word) {
+					as.movsxd(x86::rax, x86::eax);
+				}
+			} else {
+				int rs1x = x86_reg(dec.rs1);
+				X86Gp base = x86::rcx;
+				if (rs1x > 0) {
+					base = x86::gpq(rs1x);
+				} else {
+					as.mov(x86::rcx, rbp_reg_q(dec.rs1));
+				}
+				as.mov(x86::qword_ptr(x86::rbp, proc_offset(lr)), base);
+				if (word) {
+					as.movsxd(x86::rax, x86::dword_ptr(base));
+				} else {
+					as.mov(x86::rax, x86::qword_ptr(base));
+				}
+			}
+			as.mov(x86::qword_ptr(x86::rbp, proc_offset(lr_val)), x86::rax);
+			emit_rd_rax(dec);
+			return true;
+		}
+
+		bool emit_sc(decode_type &dec, bool word)
+		{
+			log_trace("\t# 0x%016llx\t%s", dec.pc, disasm_inst_simple(dec).c_str());
+			term_pc = dec.pc + inst_length(dec.inst);
+			auto fail = as.newLabel();
+			auto done = as.newLabel();
+			if (use_mmu) {
+				amo_addr_rax(dec);
+				as.cmp(x86::qword_ptr(x86::rbp, proc_offset(lr)), x86::rax);
+				as.jne(fail);
+				emit_amo_fn(dec, amoswap, word);
+				as.call(Imm(word ? func_address(ops.sw) : func_address(ops.sd)));
+				emit_mmu_check(dec);
+				as.xor_(x86::eax, x86::eax);
+				as.jmp(done);
+				as.bind(fail);
+				as.mov(x86::eax, Imm(1));
+				as.bind(done);
+			} else {
+				bool spill;
+				X86Gp base = amo_base(dec, spill);
+				as.cmp(x86::qword_ptr(x86::rbp, proc_offset(lr)), base);
+				as.jne(fail);
+				emit_amo_fn(dec, amoswap, word);
+				if (word) {
+					as.mov(x86::eax, x86::dword_ptr(x86::rbp, proc_offset(lr_val)));
+					as.lock().cmpxchg(x86::dword_ptr(base), x86::ecx);
+				} else {
+					as.mov(x86::rax, x86::qword_ptr(x86::rbp, proc_offset(lr_val)));
+					as.lock().cmpxchg(x86::qword_ptr(base), x86::rcx);
+				}
+				as.jne(fail);
+				as.xor_(x86::eax, x86::eax);
+				as.jmp(done);
+				as.bind(fail);
+				as.mov(x86::eax, Imm(1));
+				as.bind(done);
+				amo_restore(base, spill);
+			}
+			emit_rd_rax(dec);
+			return true;
+		}
+
+		bool emit_lr_w(decode_type &dec) { return emit_lr(dec, true); }
+		bool emit_sc_w(decode_type &dec) { return emit_sc(dec, true); }
+		bool emit_amoswap_w(decode_type &dec) { return emit_amo(dec, amoswap, true); }
+		bool emit_amoadd_w(decode_type &dec) { return emit_amo(dec, amoadd, true); }
+		bool emit_amoxor_w(decode_type &dec) { return emit_amo(dec, amoxor, true); }
+		bool emit_amoor_w(decode_type &dec) { return emit_amo(dec, amoor, true); }
+		bool emit_amoand_w(decode_type &dec) { return emit_amo(dec, amoand, true); }
+		bool emit_amomin_w(decode_type &dec) { return emit_amo(dec, amomin, true); }
+		bool emit_amomax_w(decode_type &dec) { return emit_amo(dec, amomax, true); }
+		bool emit_amominu_w(decode_type &dec) { return emit_amo(dec, amominu, true); }
+		bool emit_amomaxu_w(decode_type &dec) { return emit_amo(dec, amomaxu, true); }
+		bool emit_lr_d(decode_type &dec) { return emit_lr(dec, false); }
+		bool emit_sc_d(decode_type &dec) { return emit_sc(dec, false); }
+		bool emit_amoswap_d(decode_type &dec) { return emit_amo(dec, amoswap, false); }
+		bool emit_amoadd_d(decode_type &dec) { return emit_amo(dec, amoadd, false); }
+		bool emit_amoxor_d(decode_type &dec) { return emit_amo(dec, amoxor, false); }
+		bool emit_amoor_d(decode_type &dec) { return emit_amo(dec, amoor, false); }
+		bool emit_amoand_d(decode_type &dec) { return emit_amo(dec, amoand, false); }
+		bool emit_amomin_d(decode_type &dec) { return emit_amo(dec, amomin, false); }
+		bool emit_amomax_d(decode_type &dec) { return emit_amo(dec, amomax, false); }
+		bool emit_amominu_d(decode_type &dec) { return emit_amo(dec, amominu, false); }
+		bool emit_amomaxu_d(decode_type &dec) { return emit_amo(dec, amomaxu, false); }
+
+		bool emit(decode_type &dec)
+		{
+			auto li = labels.find(dec.pc);
+			if (li != labels.end()) {
+				return false; /* trace complete */
+			}
+			if (dec.seg) {
+				/* end the previous segment and bind the side exit label */
+				end_segment();
+				callstack.clear();
+				Label l = segment_labels[dec.pc];
+				labels[dec.pc] = l;
+				as.bind(l);
+			}
+			else if (dec.brt) {
+				commit_instret();
+				fp_sync();
+				Label l = as.newLabel();
+				labels[dec.pc] = l;
+				as.bind(l);
+			}
+			if (proc.trace_budget && (dec.seg || dec.brt)) {
+				/* loops return to the emulator when the budget is spent */
+				emit_budget_check(budget_exit(dec.pc));
+			}
+			if (entry_pc == -1) {
+				entry_pc = dec.pc;
+			}
+			instret_base = instret;
+			if (use_mmu && mmu_call_op(dec)) {
+				/* load store helpers clobber the xmm registers */
+				fp_sync();
+			}
+			switch(dec.op) {
+				case rv_op_auipc:     instret++;    return emit_auipc(dec);
+				case rv_op_add:       instret++;    return emit_add(dec);
+				case rv_op_sub:       instret++;    return emit_sub(dec);
+				case rv_op_mul:       instret++;    return emit_mul(dec);
+				case rv_op_mulh:      instret++;    return emit_mulh(dec);
+				case rv_op_mulhu:     instret++;    return emit_mulhu(dec);
+				case rv_op_mulhsu:    instret++;    return emit_mulhsu(dec);
+				case rv_op_div:       instret++;    return emit_div(dec);
+				case rv_op_rem:       instret++;    return emit_rem(dec);
+				case rv_op_divu:      instret++;    return emit_divu(dec);
+				case rv_op_remu:      instret++;    return emit_remu(dec);
+				case rv_op_slt:       instret++;    return emit_slt(dec);
+				case rv_op_sltu:      instret++;    return emit_sltu(dec);
+				case rv_op_and:       instret++;    return emit_and(dec);
+				case rv_op_or:        instret++;    return emit_or(dec);
+				case rv_op_xor:       instret++;    return emit_xor(dec);
+				case rv_op_sll:       instret++;    return emit_sll(dec);
+				case rv_op_srl:       instret++;    return emit_srl(dec);
+				case rv_op_sra:       instret++;    return emit_sra(dec);
+				case rv_op_addw:      instret++;    return emit_addw(dec);
+				case rv_op_subw:      instret++;    return emit_subw(dec);
+				case rv_op_mulw:      instret++;    return emit_mulw(dec);
+				case rv_op_divw:      instret++;    return emit_divw(dec);
+				case rv_op_remw:      instret++;    return emit_remw(dec);
+				case rv_op_divuw:     instret++;    return emit_divuw(dec);
+				case rv_op_remuw:     instret++;    return emit_remuw(dec);
+				case rv_op_sllw:      instret++;    return emit_sllw(dec);
+				case rv_op_srlw:      instret++;    return emit_srlw(dec);
+				case rv_op_sraw:      instret++;    return emit_sraw(dec);
+				case rv_op_addi:      instret++;    return emit_addi(dec);
+				case rv_op_slti:      instret++;    return emit_slti(dec);
+				case rv_op_sltiu:     instret++;    return emit_sltiu(dec);
+				case rv_op_andi:      instret++;    return emit_andi(dec);
+				case rv_op_ori:       instret++;    return emit_ori(dec);
+				case rv_op_xori:      instret++;    return emit_xori(dec);
+				case rv_op_slli:      instret++;    return emit_slli(dec);
+				case rv_op_srli:      instret++;    return emit_srli(dec);
+				case rv_op_srai:      instret++;    return emit_srai(dec);
+				case rv_op_addiw:     instret++;    return emit_addiw(dec);
+				case rv_op_slliw:     instret++;    return emit_slliw(dec);
+				case rv_op_srliw:     instret++;    return emit_srliw(dec);
+				case rv_op_sraiw:     instret++;    return emit_sraiw(dec);
+				case rv_op_bne:       instret++;    return emit_bne(dec);
+				case rv_op_beq:       instret++;    return emit_beq(dec);
+				case rv_op_blt:       instret++;    return emit_blt(dec);
+				case rv_op_bge:       instret++;    return emit_bge(dec);
+				case rv_op_bltu:      instret++;    return emit_bltu(dec);
+				case rv_op_bgeu:      instret++;    return emit_bgeu(dec);
+				case rv_op_ld:        instret++;    return emit_ld(dec);
+				case rv_op_lw:        instret++;    return emit_lw(dec);
+				case rv_op_lwu:       instret++;    return emit_lwu(dec);
+				case rv_op_lh:        instret++;    return emit_lh(dec);
+				case rv_op_lhu:       instret++;    return emit_lhu(dec);
+				case rv_op_lb:        instret++;    return emit_lb(dec);
+				case rv_op_lbu:       instret++;    return emit_lbu(dec);
+				case rv_op_sd:        instret++;    return emit_sd(dec);
+				case rv_op_sw:        instret++;    return emit_sw(dec);
+				case rv_op_sh:        instret++;    return emit_sh(dec);
+				case rv_op_sb:        instret++;    return emit_sb(dec);
+				case rv_op_lui:       instret++;    return emit_lui(dec);
+				case rv_op_jal:       instret++;    return emit_jal(dec);
+				case rv_op_jalr:      instret++;    return emit_jalr(dec);
+				case jit_op_la:       instret += 2; return emit_la(dec);
+				case jit_op_call:     instret += 2; return emit_call(dec);
+				case jit_op_zextw:    instret += 2; return emit_zextw(dec);
+				case jit_op_addiwz:   instret += 3; return emit_addiwz(dec);
+				case jit_op_rorwi_rr: instret += 3; return emit_rorwi_rr(dec);
+				case jit_op_rorwi_lr: instret += 3; return emit_rorwi_lr(dec);
+				case jit_op_rordi_rr: instret += 3; return emit_rordi_rr(dec);
+				case jit_op_rordi_lr: instret += 3; return emit_rordi_lr(dec);
+				case jit_op_auipc_lw: instret += 2; return emit_auipc_lw(dec);
+				case jit_op_auipc_ld: instret += 2; return emit_auipc_ld(dec);
+				case jit_op_li:       instret += 2; return emit_li(dec);
+				case jit_op_li_slli:  instret += 3; return emit_li_slli(dec);
+				case jit_op_slt_bnez: instret += 2; return emit_slt_branch(dec, x86::kCondL, x86::kCondL, x86::kCondGE);
+				case jit_op_slt_beqz: instret += 2; return emit_slt_branch(dec, x86::kCondL, x86::kCondGE, x86::kCondL);
+				case jit_op_sltu_bnez: instret += 2; return emit_slt_branch(dec, x86::kCondB, x86::kCondB, x86::kCondAE);
+				case jit_op_sltu_beqz: instret += 2; return emit_slt_branch(dec, x86::kCondB, x86::kCondAE, x86::kCondB);
+				case jit_op_mulh_mul: instret += 2; return emit_mulh_mul(dec, true);
+				case jit_op_mulhu_mul: instret += 2; return emit_mulh_mul(dec, false);
+				case jit_op_div_rem:  instret += 2; return emit_div_rem(dec);
+				case jit_op_divu_remu: instret += 2; return emit_divu_remu(dec);
+				case jit_op_lea:      instret += 2; return emit_lea(dec);
+				case jit_op_load_pair: instret += 2; return emit_load_pair(dec);
+				case jit_op_store_pair: instret += 2; return emit_store_pair(dec);
+				case jit_op_native:   instret++;    return emit_native(dec);
+				case rv_op_flw:       instret++;    return emit_flw(dec);
+				case rv_op_fsw:       instret++;    return emit_fsw(dec);
+				case rv_op_fmadd_s:   instret++;    return emit_fmadd_s(dec);
+				case rv_op_fmsub_s:   instret++;    return emit_fmsub_s(dec);
+				case rv_op_fnmsub_s:  instret++;    return emit_fnmsub_s(dec);
+				case rv_op_fnmadd_s:  instret++;    return emit_fnmadd_s(dec);
+				case rv_op_fadd_s:    instret++;    return emit_fadd_s(dec);
+				case rv_op_fsub_s:    instret++;    return emit_fsub_s(dec);
+				case rv_op_fmul_s:    instret++;    return emit_fmul_s(dec);
+				case rv_op_fdiv_s:    instret++;    return emit_fdiv_s(dec);
+				case rv_op_fsgnj_s:   instret++;    return emit_fsgnj_s(dec);
+				case rv_op_fsgnjn_s:  instret++;    return emit_fsgnjn_s(dec);
+				case rv_op_fsgnjx_s:  instret++;    return emit_fsgnjx_s(dec);
+				case rv_op_fsqrt_s:   instret++;    return emit_fsqrt_s(dec);
+				case rv_op_fle_s:     instret++;    return emit_fle_s(dec);
+				case rv_op_flt_s:     instret++;    return emit_flt_s(dec);
+				case rv_op_feq_s:     instret++;    return emit_feq_s(dec);
+				case rv_op_fcvt_w_s:  instret++;    return emit_fcvt_w_s(dec);
+				case rv_op_fcvt_s_w:  instret++;    return emit_fcvt_s_w(dec);
+				case rv_op_fcvt_s_wu: instret++;    return emit_fcvt_s_wu(dec);
+				case rv_op_fmv_x_s:   instret++;    return emit_fmv_x_s(dec);
+				case rv_op_fmv_s_x:   instret++;    return emit_fmv_s_x(dec);
+				case rv_op_fcvt_l_s:  instret++;    return emit_fcvt_l_s(dec);
+				case rv_op_fcvt_s_l:  instret++;    return emit_fcvt_s_l(dec);
+				case rv_op_fld:       instret++;    return emit_fld(dec);
+				case rv_op_fsd:       instret++;    return emit_fsd(dec);
+				case rv_op_fmadd_d:   instret++;    return emit_fmadd_d(dec);
+				case rv_op_fmsub_d:   instret++;    return emit_fmsub_d(dec);
+				case rv_op_fnmsub_d:  instret++;    return emit_fnmsub_d(dec);
+				case rv_op_fnmadd_d:  instret++;    return emit_fnmadd_d(dec);
+				case rv_op_fadd_d:    instret++;    return emit_fadd_d(dec);
+				case rv_op_fsub_d:    instret++;    return emit_fsub_d(dec);
+				case rv_op_fmul_d:    instret++;    return emit_fmul_d(dec);
+				case rv_op_fdiv_d:    instret++;    return emit_fdiv_d(dec);
+				case rv_op_fsgnj_d:   instret++;    return emit_fsgnj_d(dec);
+				case rv_op_fsgnjn_d:  instret++;    return emit_fsgnjn_d(dec);
+				case rv_op_fsgnjx_d:  instret++;    return emit_fsgnjx_d(dec);
+				case rv_op_fcvt_s_d:  instret++;    return emit_fcvt_s_d(dec);
+				case rv_op_fcvt_d_s:  instret++;    return emit_fcvt_d_s(dec);
+				case rv_op_fsqrt_d:   instret++;    return emit_fsqrt_d(dec);
+				case rv_op_fle_d:     instret++;    return emit_fle_d(dec);
+				case rv_op_flt_d:     instret++;    return emit_flt_d(dec);
+				case rv_op_feq_d:     instret++;    return emit_feq_d(dec);
+				case rv_op_fcvt_w_d:  instret++;    return emit_fcvt_w_d(dec);
+				case rv_op_fcvt_d_w:  instret++;    return emit_fcvt_d_w(dec);
+				case rv_op_fcvt_d_wu: instret++;    return emit_fcvt_d_wu(dec);
+				case rv_op_fcvt_l_d:  instret++;    return emit_fcvt_l_d(dec);
+				case rv_op_fmv_x_d:   instret++;    return emit_fmv_x_d(dec);
+				case rv_op_fcvt_d_l:  instret++;    return emit_fcvt_d_l(dec);
+				case rv_op_fmv_d_x:   instret++;    return emit_fmv_d_x(dec);
+				case rv_op_lr_w:      instret++;    return emit_lr_w(dec);
+				case rv_op_sc_w:      instret++;    return emit_sc_w(dec);
+				case rv_op_amoswap_w: instret++;    return emit_amoswap_w(dec);
+				case rv_op_amoadd_w:  instret++;    return emit_amoadd_w(dec);
+				case rv_op_amoxor_w:  instret++;    return emit_amoxor_w(dec);
+				case rv_op_amoor_w:   instret++;    return emit_amoor_w(dec);
+				case rv_op_amoand_w:  instret++;    return emit_amoand_w(dec);
+				case rv_op_amomin_w:  instret++;    return emit_amomin_w(dec);
+				case rv_op_amomax_w:  instret++;    return emit_amomax_w(dec);
+				case rv_op_amominu_w: instret++;    return emit_amominu_w(dec);
+				case rv_op_amomaxu_w: instret++;    return emit_amomaxu_w(dec);
+				case rv_op_lr_d:      instret++;    return emit_lr_d(dec);
+				case rv_op_sc_d:      instret++;    return emit_sc_d(dec);
+				case rv_op_amoswap_d: instret++;    return emit_amoswap_d(dec);
+				case rv_op_amoadd_d:  instret++;    return emit_amoadd_d(dec);
+				case rv_op_amoxor_d:  instret++;    return emit_amoxor_d(dec);
+				case rv_op_amoor_d:   instret++;    return emit_amoor_d(dec);
+				case rv_op_amoand_d:  instret++;    return emit_amoand_d(dec);
+				case rv_op_amomin_d:  instret++;    return emit_amomin_d(dec);
+				case rv_op_amomax_d:  instret++;    return emit_amomax_d(dec);
+				case rv_op_amominu_d: instret++;    return emit_amominu_d(dec);
+				case rv_op_amomaxu_d: instret++;    return emit_amomaxu_d(dec);
+			}
+			return false;
+		}
+	};
+
+	#pragma GCC diagnostic pop
 
 }
 
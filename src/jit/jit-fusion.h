@@ -12,6 +12,8 @@ namespace riscv {
 	{
 		typedef typename E::processor_type::decode_type decode_type;
 
+		enum { xlen = E::processor_type::xlen };
+
 		enum match_state {
 			match_state_none,
 			match_state_auipc,
@@ -23,7 +25,15 @@ namespace riscv {
 			match_state_rotw_or,
 			match_state_rotd_slli,
 			match_state_rotd_srli,
-			match_state_rotd_or
+			match_state_rotd_or,
+			match_state_lui,
+			match_state_li,
+			match_state_slt,
+			match_state_slli_add,
+			match_state_mulh,
+			match_state_div,
+			match_state_load,
+			match_state_store
 		};
 
 		s64 imm;
@@ -32,12 +42,14 @@ namespace riscv {
 		int rs2;
 		int rs3;
 		size_t sz;
+		u16 first_op;
 		addr_t pseudo_pc;
 		match_state state;
 		std::vector<decode_type> queue;
 
 		jit_fusion(typename E::processor_type &proc)
-			: E(proc), imm(0), rd(0), rs1(0), rs2(0), rs3(0), state(match_state_none) {}
+			: E(proc), imm(0), rd(0), rs1(0), rs2(0), rs3(0), sz(0), first_op(0), pseudo_pc(0),
+			  state(match_state_none) {}
 
 		void emit_queue()
 		{
@@ -54,6 +66,24 @@ namespace riscv {
 			queue.clear();
 		}
 
+		void emit_li()
+		{
+			/* lui and addi materialise a constant that fits in 32 bits */
+			jit_decode pseudo(pseudo_pc, queue.back().inst, jit_op_li, rd, s32(imm));
+			pseudo.sz = sz;
+			clear_queue();
+			E::emit(pseudo);
+		}
+
+		void flush()
+		{
+			if (state == match_state_li) {
+				emit_li();
+			} else {
+				emit_queue();
+			}
+		}
+
 		void begin()
 		{
 			E::begin();
@@ -61,12 +91,33 @@ namespace riscv {
 
 		void end()
 		{
-			emit_queue();
+			flush();
 			E::end();
 		}
 
+		void match(decode_type &dec, match_state next)
+		{
+			pseudo_pc = dec.pc;
+			sz = inst_length(dec.inst);
+			first_op = dec.op;
+			state = next;
+			queue.push_back(dec);
+		}
+
+		static bool mul_div_regs(decode_type &dec)
+		{
+			/* the mul and div sequences use rdx which holds ra */
+			return dec.rd != rv_ireg_zero && dec.rd != dec.rs1 && dec.rd != dec.rs2 &&
+				dec.rd != rv_ireg_ra && dec.rs1 != rv_ireg_ra && dec.rs2 != rv_ireg_ra;
+		}
+
 		bool emit(decode_type &dec)
 		{
+			if (this->labels.find(dec.pc) != this->labels.end()) {
+				/* the trace is complete */
+				flush();
+				return E::emit(dec);
+			}
 			switch(state) {
 				case match_state_none:
 					switch (dec.op) {
@@ -123,6 +174,13 @@ namespace riscv {
 								queue.push_back(dec);
 								return true;
 							}
+							if (dec.rd != 0 && dec.imm >= 1 && dec.imm <= 3) {
+								rd = dec.rd;
+								rs1 = dec.rs1;
+								imm = dec.imm;
+								match(dec, match_state_slli_add);
+								return true;
+							}
 							if (dec.rd != 0 && dec.rd != dec.rs1) {
 								rs2 = dec.rd;
 								rs1 = dec.rs1;
@@ -146,10 +204,226 @@ namespace riscv {
 								return true;
 							}
 							break;
+						case rv_op_lui:
+							if (dec.rd != 0) {
+								rd = dec.rd;
+								imm = dec.imm;
+								match(dec, match_state_lui);
+								return true;
+							}
+							break;
+						case rv_op_slt:
+						case rv_op_sltu:
+							if (dec.rd != 0) {
+								rd = dec.rd;
+								rs1 = dec.rs1;
+								rs2 = dec.rs2;
+								match(dec, match_state_slt);
+								return true;
+							}
+							break;
+						case rv_op_mulh:
+						case rv_op_mulhu:
+							if (mul_div_regs(dec)) {
+								rd = dec.rd;
+								rs1 = dec.rs1;
+								rs2 = dec.rs2;
+								match(dec, match_state_mulh);
+								return true;
+							}
+							break;
+						case rv_op_div:
+						case rv_op_divu:
+							if (mul_div_regs(dec)) {
+								rd = dec.rd;
+								rs1 = dec.rs1;
+								rs2 = dec.rs2;
+								match(dec, match_state_div);
+								return true;
+							}
+							break;
+						case rv_op_lw:
+						case rv_op_ld:
+							if (dec.op == (xlen == 64 ? rv_op_ld : rv_op_lw) && dec.rd != 0 && dec.rd != dec.rs1) {
+								rd = dec.rd;
+								rs1 = dec.rs1;
+								imm = dec.imm;
+								match(dec, match_state_load);
+								return true;
+							}
+							break;
+						case rv_op_sw:
+						case rv_op_sd:
+							if (dec.op == (xlen == 64 ? rv_op_sd : rv_op_sw)) {
+								rs1 = dec.rs1;
+								rs2 = dec.rs2;
+								imm = dec.imm;
+								match(dec, match_state_store);
+								return true;
+							}
+							break;
 						default:
 							break;
 					}
 					break;
+				case match_state_lui:
+					switch (dec.op) {
+						case rv_op_addi:
+						case rv_op_addiw:
+							if (rd == dec.rd && rd == dec.rs1) {
+								s64 val = dec.op == rv_op_addiw || xlen == 32 ?
+									s64(s32(u32(imm) + u32(dec.imm))) : imm + dec.imm;
+								if (val != s64(s32(val))) break;
+								imm = val;
+								sz += inst_length(dec.inst);
+								state = match_state_li;
+								queue.push_back(dec);
+								return true;
+							}
+							break;
+						default:
+							break;
+					}
+					flush();
+					return emit(dec);
+				case match_state_li:
+					switch (dec.op) {
+						case rv_op_slli:
+							if (rd == dec.rd && rd == dec.rs1) {
+								queue.push_back(dec);
+								clear_queue();
+								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_li_slli, rd, s32(imm));
+								pseudo.rm = u8(dec.imm);
+								pseudo.sz = sz + inst_length(dec.inst);
+								return E::emit(pseudo);
+							}
+							break;
+						default:
+							break;
+					}
+					flush();
+					return emit(dec);
+				case match_state_slt:
+					switch (dec.op) {
+						case rv_op_bne:
+						case rv_op_beq:
+							if ((dec.rs1 == rd && dec.rs2 == rv_ireg_zero) ||
+								(dec.rs1 == rv_ireg_zero && dec.rs2 == rd)) {
+								/* the branch tests the flags from the compare */
+								bool nez = dec.op == rv_op_bne;
+								bool val = this->proc.ireg[rd].r.x.val != 0;
+								u16 op = first_op == rv_op_slt ?
+									(nez ? jit_op_slt_bnez : jit_op_slt_beqz) :
+									(nez ? jit_op_sltu_bnez : jit_op_sltu_beqz);
+								queue.push_back(dec);
+								clear_queue();
+								jit_decode pseudo(pseudo_pc, dec.inst, op, rd, rs1, rs2,
+									s32(dec.pc + dec.imm - pseudo_pc));
+								pseudo.brc = nez ? val : !val;
+								pseudo.sz = sz + inst_length(dec.inst);
+								return E::emit(pseudo);
+							}
+							break;
+						default:
+							break;
+					}
+					flush();
+					return emit(dec);
+				case match_state_slli_add:
+					switch (dec.op) {
+						case rv_op_add:
+							if (dec.rd == rd && (dec.rs1 == rd) != (dec.rs2 == rd) &&
+								dec.rs1 != rv_ireg_zero && dec.rs2 != rv_ireg_zero) {
+								/* rd = base + (index << shamt) */
+								u8 base = dec.rs1 == rd ? dec.rs2 : dec.rs1;
+								queue.push_back(dec);
+								clear_queue();
+								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_lea, rd, rs1, base, 0);
+								pseudo.rm = u8(imm);
+								pseudo.sz = sz + inst_length(dec.inst);
+								return E::emit(pseudo);
+							}
+							break;
+						default:
+							break;
+					}
+					if (rd != rs1) {
+						/* not an lea, the slli may still start a rotate */
+						rs2 = rd;
+						imm = 64 - imm;
+						state = match_state_rotd_srli;
+						return emit(dec);
+					}
+					flush();
+					return emit(dec);
+				case match_state_mulh:
+					switch (dec.op) {
+						case rv_op_mul:
+							if (dec.rd != rv_ireg_zero && dec.rd != rd && dec.rd != rv_ireg_ra &&
+								((dec.rs1 == rs1 && dec.rs2 == rs2) || (dec.rs1 == rs2 && dec.rs2 == rs1))) {
+								/* rs3 = high, rd = low */
+								queue.push_back(dec);
+								clear_queue();
+								jit_decode pseudo(pseudo_pc, dec.inst,
+									first_op == rv_op_mulh ? jit_op_mulh_mul : jit_op_mulhu_mul,
+									dec.rd, rs1, rs2, 0);
+								pseudo.rs3 = rd;
+								pseudo.sz = sz + inst_length(dec.inst);
+								return E::emit(pseudo);
+							}
+							break;
+						default:
+							break;
+					}
+					flush();
+					return emit(dec);
+				case match_state_div:
+					switch (dec.op) {
+						case rv_op_rem:
+						case rv_op_remu:
+							if (dec.op == (first_op == rv_op_div ? rv_op_rem : rv_op_remu) &&
+								dec.rs1 == rs1 && dec.rs2 == rs2 && dec.rd != rv_ireg_zero &&
+								dec.rd != rd && dec.rd != rv_ireg_ra) {
+								/* rd = quotient, rs3 = remainder */
+								queue.push_back(dec);
+								clear_queue();
+								jit_decode pseudo(pseudo_pc, dec.inst,
+									first_op == rv_op_div ? jit_op_div_rem : jit_op_divu_remu,
+									rd, rs1, rs2, 0);
+								pseudo.rs3 = dec.rd;
+								pseudo.sz = sz + inst_length(dec.inst);
+								return E::emit(pseudo);
+							}
+							break;
+						default:
+							break;
+					}
+					flush();
+					return emit(dec);
+				case match_state_load:
+					if (dec.op == first_op && dec.rs1 == rs1 && dec.rd != rv_ireg_zero &&
+						dec.rd != rd && dec.imm == imm + xlen / 8) {
+						/* rd = first, rs2 = second */
+						queue.push_back(dec);
+						clear_queue();
+						jit_decode pseudo(pseudo_pc, dec.inst, jit_op_load_pair, rd, rs1, dec.rd, s32(imm));
+						pseudo.sz = sz + inst_length(dec.inst);
+						return E::emit(pseudo);
+					}
+					flush();
+					return emit(dec);
+				case match_state_store:
+					if (dec.op == first_op && dec.rs1 == rs1 && dec.imm == imm + xlen / 8) {
+						/* rs2 = first, rs3 = second */
+						queue.push_back(dec);
+						clear_queue();
+						jit_decode pseudo(pseudo_pc, dec.inst, jit_op_store_pair, 0, rs1, rs2, s32(imm));
+						pseudo.rs3 = dec.rs2;
+						pseudo.sz = sz + inst_length(dec.inst);
+						return E::emit(pseudo);
+					}
+					flush();
+					return emit(dec);
 				case match_state_addiw:
 					switch (dec.op) {
 						case rv_op_slli:
@@ -181,8 +455,7 @@ namespace riscv {
 								clear_queue();
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_addiwz, rd, imm);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 						default:
 							break;
@@ -198,8 +471,7 @@ namespace riscv {
 								imm += dec.imm;
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_la, dec.rs1, imm);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 							break;
 						case rv_op_jalr:
@@ -209,8 +481,7 @@ namespace riscv {
 								imm += dec.imm;
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_call, dec.rs1, imm);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 							break;
 						case rv_op_lw:
@@ -220,8 +491,7 @@ namespace riscv {
 								imm += dec.imm;
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_auipc_lw, rd, imm);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 							break;
 						case rv_op_ld:
@@ -231,8 +501,7 @@ namespace riscv {
 								imm += dec.imm;
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_auipc_ld, rd, imm);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 							break;
 						default:
@@ -248,8 +517,7 @@ namespace riscv {
 								clear_queue();
 								jit_decode pseudo(pseudo_pc, dec.inst, jit_op_zextw, rd, rs1, 0);
 								pseudo.sz = sz + inst_length(dec.inst);
-								E::emit(pseudo);
-								return true;
+								return E::emit(pseudo);
 							}
 						default:
 							break;
@@ -0,0 +1,149 @@
+//
+//  jit-native.h
+//
+
+#ifndef rv_jit_native_h
+#define rv_jit_native_h
+
+namespace riscv {
+
+	/*
+	 * Native library routines
+	 *
+	 * Guest libc entry points found in the ELF symbol table are
+	 * translated as a call to the host C library, whose memory and
+	 * string routines are vectorised. Routines take their arguments
+	 * from a0 to a2 and return their result in a0, other registers
+	 * are left untouched which satisfies the RISC-V calling convention.
+	 * The code of each routine is hashed when the symbols are scanned
+	 * and again before it is translated so a routine that has been
+	 * patched at run time is translated normally. Guest addresses are
+	 * dereferenced directly so this is only used with the proxy MMU.
+	 */
+
+	enum jit_native_op
+	{
+		jit_native_memcpy,
+		jit_native_memmove,
+		jit_native_memset,
+		jit_native_memcmp,
+		jit_native_strlen,
+		jit_native_strcmp
+	};
+
+	struct jit_native_routine
+	{
+		const char *name;
+		jit_native_op op;
+		addr_t pc;                                 /* guest entry */
+		size_t size;                               /* guest code size */
+		u64 hash;                                  /* guest code hash when scanned */
+		bool disabled;                             /* code changed since scanned */
+		size_t calls;
+		size_t mismatches;                         /* audit failures */
+	};
+
+	struct jit_native
+	{
+		std::vector<jit_native_routine> routines;
+		std::map<addr_t,size_t> entries;           /* guest entry pc to routine index */
+		bool audit;
+
+		jit_native() : audit(false) {}
+
+		static u64 hash(addr_t pc, size_t size)
+		{
+			/* FNV-1a */
+			const u8 *p = (const u8*)pc;
+			u64 h = 0xcbf29ce484222325ULL;
+			for (size_t i = 0; i < size; i++) {
+				h = (h ^ p[i]) * 0x100000001b3ULL;
+			}
+			return h;
+		}
+
+		/* find the routines in the symbol table of a loaded image */
+		void scan(elf_file &elf)
+		{
+			static const struct { const char *name; jit_native_op op; } names[] = {
+				{ "memcpy",  jit_native_memcpy },
+				{ "memmove", jit_native_memmove },
+				{ "memset",  jit_native_memset },
+				{ "memcmp",  jit_native_memcmp },
+				{ "strlen",  jit_native_strlen },
+				{ "strcmp",  jit_native_strcmp }
+			};
+			for (auto &n : names) {
+				auto si = elf.name_symbol_map.find(n.name);
+				if (si == elf.name_symbol_map.end()) continue;
+				auto &sym = elf.symbols[si->second];
+				if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_size == 0) continue;
+				if (!in_text(elf, sym.st_value, sym.st_size)) continue;
+				entries[addr_t(sym.st_value)] = routines.size();
+				routines.push_back(jit_native_routine{ n.name, n.op, addr_t(sym.st_value),
+					size_t(sym.st_size), hash(addr_t(sym.st_value), sym.st_size), false, 0, 0 });
+			}
+		}
+
+		static bool in_text(elf_file &elf, Elf64_Addr addr, Elf64_Xword size)
+		{
+			for (auto &phdr : elf.phdrs) {
+				if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) &&
+					addr >= phdr.p_vaddr && addr + size <= phdr.p_vaddr + phdr.p_filesz) return true;
+			}
+			return false;
+		}
+
+		/* routine index for a guest entry pc whose code is unchanged or -1 */
+		ssize_t find(addr_t pc)
+		{
+			auto ei = entries.find(pc);
+			if (ei == entries.end()) return -1;
+			auto &r = routines[ei->second];
+			if (r.disabled) return -1;
+			if (hash(r.pc, r.size) != r.hash) {
+				debug("jit-native: %s at 0x%llx has changed, translating guest code", r.name, (u64)r.pc);
+				r.disabled = true;
+				return -1;
+			}
+			return ssize_t(ei->second);
+		}
+
+		/* memcpy, memmove and memset write a2 bytes at a0 */
+		static size_t write_size(jit_native_op op, u64 a2)
+		{
+			switch (op) {
+				case jit_native_memcpy:
+				case jit_native_memmove:
+				case jit_native_memset: return size_t(a2);
+				default: return 0;
+			}
+		}
+
+		/* comparisons only define the sign of their result */
+		static bool result_match(jit_native_op op, s64 guest, s64 host)
+		{
+			switch (op) {
+				case jit_native_memcmp:
+				case jit_native_strcmp: return (guest > 0) == (host > 0) && (guest < 0) == (host < 0);
+				default: return guest == host;
+			}
+		}
+
+		static u64 call(jit_native_op op, u64 a0, u64 a1, u64 a2)
+		{
+			switch (op) {
+				case jit_native_memcpy:  memcpy((void*)a0, (const void*)a1, size_t(a2)); return a0;
+				case jit_native_memmove: memmove((void*)a0, (const void*)a1, size_t(a2)); return a0;
+				case jit_native_memset:  memset((void*)a0, int(a1), size_t(a2)); return a0;
+				case jit_native_memcmp:  return u64(s64(memcmp((const void*)a0, (const void*)a1, size_t(a2))));
+				case jit_native_strlen:  return u64(strlen((const char*)a0));
+				case jit_native_strcmp:  return u64(s64(strcmp((const char*)a0, (const char*)a1)));
+			}
+			return 0;
+		}
+	};
+
+}
+
+#endif
@@ -0,0 +1,621 @@
+//
+//  jit-optimize.h
+//
+
+#ifndef rv_jit_optimize_h
+#define rv_jit_optimize_h
+
+namespace riscv {
+
+	/*
+	 * Trace optimizer
+	 *
+	 * Runs on a copy of the trace between the tracer and the emitter.
+	 * A forward pass gives every value held in an integer register a
+	 * value number within each basic block, which makes the block SSA
+	 * in all but name, and uses them for constant folding, copy
+	 * propagation, common subexpression elimination and redundant load
+	 * elimination. Loop invariant instructions at the head of loops
+	 * closed by a backward branch or jump are hoisted into a preheader
+	 * and a backward pass removes register writes that are overwritten
+	 * before they are read or the trace can exit.
+	 *
+	 * Instructions are rewritten in place as addi forms (li, mv or nop)
+	 * and dead fused constants lose their destination register, so pcs,
+	 * branch target labels and instret counts are unchanged and the
+	 * emitter needs no new lowering. Hoisted instructions keep the pc of
+	 * the instruction they replace and are not branch targets.
+	 *
+	 * Loads are only reused with reuse_loads set, which the caller
+	 * clears when a load may reach a device through the MMU, and not
+	 * across a fence, which orders them against other threads' stores.
+	 */
+
+	template <typename P>
+	struct jit_optimizer
+	{
+		typedef typename P::decode_type decode_type;
+
+		struct jit_value
+		{
+			bool is_const;
+			s64 val;
+		};
+
+		struct jit_expr
+		{
+			u32 op;
+			u32 a;
+			u32 b;
+			s64 imm;
+
+			bool operator<(const jit_expr &o) const {
+				if (op != o.op) return op < o.op;
+				if (a != o.a) return a < o.a;
+				if (b != o.b) return b < o.b;
+				return imm < o.imm;
+			}
+		};
+
+		std::vector<jit_value> values;
+		std::map<s64,u32> consts;
+		std::map<jit_expr,u32> exprs;
+		std::map<jit_expr,u32> loads;
+		u32 reg_vn[P::ireg_count];
+
+		size_t folded;
+		size_t copies;
+		size_t cse;
+		size_t rle;
+		size_t dead;
+		size_t hoisted;
+		bool reuse_loads;
+
+		jit_optimizer(bool reuse_loads = true) : folded(0), copies(0), cse(0), rle(0), dead(0), hoisted(0),
+			reuse_loads(reuse_loads) {}
+
+		static s64 sx(s64 v) { return P::xlen == 32 ? s64(s32(v)) : v; }
+		static u64 ux(s64 v) { return P::xlen == 32 ? u64(u32(v)) : u64(v); }
+		static bool fits(s64 v) { return v == s64(s32(v)); }
+
+		u32 new_value(bool is_const = false, s64 val = 0)
+		{
+			values.push_back(jit_value{ is_const, val });
+			return u32(values.size() - 1);
+		}
+
+		u32 const_value(s64 val)
+		{
+			auto ci = consts.find(val);
+			if (ci != consts.end()) return ci->second;
+			return consts[val] = new_value(true, val);
+		}
+
+		void reset()
+		{
+			/* register values are unknown at block entry */
+			values.clear();
+			consts.clear();
+			exprs.clear();
+			loads.clear();
+			new_value();
+			for (size_t i = 0; i < P::ireg_count; i++) {
+				reg_vn[i] = new_value();
+			}
+			reg_vn[rv_ireg_zero] = const_value(0);
+		}
+
+		int holder(u32 vn)
+		{
+			for (size_t i = 0; i < P::ireg_count; i++) {
+				if (reg_vn[i] == vn) return int(i);
+			}
+			return -1;
+		}
+
+		void define(u8 rd, u32 vn)
+		{
+			if (rd != rv_ireg_zero) reg_vn[rd] = vn;
+		}
+
+		void propagate(u8 &reg)
+		{
+			/* read the oldest register holding the same value */
+			int r = holder(reg_vn[reg]);
+			if (r >= 0 && r != reg) {
+				reg = u8(r);
+				copies++;
+			}
+		}
+
+		static void rewrite(decode_type &dec, u8 rd, u8 rs1, s32 imm)
+		{
+			dec.op = rv_op_addi;
+			dec.codec = rv_inst_codec[rv_op_addi];
+			dec.rd = rd;
+			dec.rs1 = rs1;
+			dec.rs2 = rv_ireg_zero;
+			dec.imm = imm;
+		}
+
+		static bool is_alu_imm(u16 op)
+		{
+			switch (op) {
+				case rv_op_addi: case rv_op_slti: case rv_op_sltiu:
+				case rv_op_andi: case rv_op_ori: case rv_op_xori:
+				case rv_op_slli: case rv_op_srli: case rv_op_srai:
+				case rv_op_addiw: case rv_op_slliw: case rv_op_srliw: case rv_op_sraiw:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool is_alu_reg(u16 op)
+		{
+			switch (op) {
+				case rv_op_add: case rv_op_sub: case rv_op_slt: case rv_op_sltu:
+				case rv_op_and: case rv_op_or: case rv_op_xor:
+				case rv_op_sll: case rv_op_srl: case rv_op_sra:
+				case rv_op_addw: case rv_op_subw: case rv_op_sllw: case rv_op_srlw: case rv_op_sraw:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool is_alu(u16 op)
+		{
+			return op == rv_op_lui || op == rv_op_auipc || is_alu_imm(op) || is_alu_reg(op);
+		}
+
+		static bool is_li(u16 op)
+		{
+			return op == jit_op_li || op == jit_op_li_slli;
+		}
+
+		static bool is_pure(u16 op)
+		{
+			return is_alu(op) || is_li(op);
+		}
+
+		static bool is_fused_branch(u16 op)
+		{
+			switch (op) {
+				case jit_op_slt_bnez: case jit_op_slt_beqz:
+				case jit_op_sltu_bnez: case jit_op_sltu_beqz:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static s64 li_value(decode_type &dec)
+		{
+			return dec.op == jit_op_li ? s64(dec.imm) : sx(s64(u64(s64(dec.imm)) << dec.rm));
+		}
+
+		static void kill(decode_type &dec)
+		{
+			/* fused constants keep their size so the next pc is unchanged */
+			if (is_li(dec.op)) {
+				dec.rd = rv_ireg_zero;
+			} else {
+				rewrite(dec, rv_ireg_zero, rv_ireg_zero, 0);
+			}
+		}
+
+		static bool is_load(u16 op)
+		{
+			switch (op) {
+				case rv_op_lb: case rv_op_lh: case rv_op_lw: case rv_op_ld:
+				case rv_op_lbu: case rv_op_lhu: case rv_op_lwu:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool is_store(u16 op)
+		{
+			switch (op) {
+				case rv_op_sb: case rv_op_sh: case rv_op_sw: case rv_op_sd:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool is_branch(u16 op)
+		{
+			switch (op) {
+				case rv_op_beq: case rv_op_bne: case rv_op_blt:
+				case rv_op_bge: case rv_op_bltu: case rv_op_bgeu:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool writes_memory(u16 op)
+		{
+			switch (op) {
+				case rv_op_fsw: case rv_op_fsd:
+				case rv_op_lr_w: case rv_op_sc_w: case rv_op_lr_d: case rv_op_sc_d:
+				case rv_op_amoswap_w: case rv_op_amoadd_w: case rv_op_amoxor_w:
+				case rv_op_amoor_w: case rv_op_amoand_w: case rv_op_amomin_w:
+				case rv_op_amomax_w: case rv_op_amominu_w: case rv_op_amomaxu_w:
+				case rv_op_amoswap_d: case rv_op_amoadd_d: case rv_op_amoxor_d:
+				case rv_op_amoor_d: case rv_op_amoand_d: case rv_op_amomin_d:
+				case rv_op_amomax_d: case rv_op_amominu_d: case rv_op_amomaxu_d:
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		static bool eval(decode_type &dec, s64 a, s64 b, s64 &r)
+		{
+			const int sh = P::xlen - 1;
+			switch (dec.op) {
+				case rv_op_lui:   r = dec.imm; break;
+				case rv_op_auipc: r = sx(s64(dec.pc + u64(s64(dec.imm)))); break;
+				case rv_op_addi:  r = sx(s64(u64(a) + u64(s64(dec.imm)))); break;
+				case rv_op_slti:  r = a < s64(dec.imm); break;
+				case rv_op_sltiu: r = ux(a) < ux(dec.imm); break;
+				case rv_op_andi:  r = a & s64(dec.imm); break;
+				case rv_op_ori:   r = a | s64(dec.imm); break;
+				case rv_op_xori:  r = a ^ s64(dec.imm); break;
+				case rv_op_slli:  r = sx(u64(a) << (dec.imm & sh)); break;
+				case rv_op_srli:  r = sx(ux(a) >> (dec.imm & sh)); break;
+				case rv_op_srai:  r = sx(a >> (dec.imm & sh)); break;
+				case rv_op_add:   r = sx(s64(u64(a) + u64(b))); break;
+				case rv_op_sub:   r = sx(s64(u64(a) - u64(b))); break;
+				case rv_op_slt:   r = a < b; break;
+				case rv_op_sltu:  r = ux(a) < ux(b); break;
+				case rv_op_and:   r = a & b; break;
+				case rv_op_or:    r = a | b; break;
+				case rv_op_xor:   r = a ^ b; break;
+				case rv_op_sll:   r = sx(u64(a) << (b & sh)); break;
+				case rv_op_srl:   r = sx(ux(a) >> (b & sh)); break;
+				case rv_op_sra:   r = sx(a >> (b & sh)); break;
+				case rv_op_addiw: r = s32(u32(a) + u32(dec.imm)); break;
+				case rv_op_slliw: r = s32(u32(a) << (dec.imm & 31)); break;
+				case rv_op_srliw: r = s32(u32(a) >> (dec.imm & 31)); break;
+				case rv_op_sraiw: r = s32(a) >> (dec.imm & 31); break;
+				case rv_op_addw:  r = s32(u32(a) + u32(b)); break;
+				case rv_op_subw:  r = s32(u32(a) - u32(b)); break;
+				case rv_op_sllw:  r = s32(u32(a) << (b & 31)); break;
+				case rv_op_srlw:  r = s32(u32(a) >> (b & 31)); break;
+				case rv_op_sraw:  r = s32(a) >> (b & 31); break;
+				default: return false;
+			}
+			return true;
+		}
+
+		static bool imm_form(decode_type &dec, s64 c)
+		{
+			/* register operand with a known value becomes an immediate */
+			const int sh = P::xlen - 1;
+			u16 op;
+			s64 imm = c;
+			switch (dec.op) {
+				case rv_op_add:  op = rv_op_addi; break;
+				case rv_op_sub:  op = rv_op_addi; imm = -c; break;
+				case rv_op_slt:  op = rv_op_slti; break;
+				case rv_op_sltu: op = rv_op_sltiu; break;
+				case rv_op_and:  op = rv_op_andi; break;
+				case rv_op_or:   op = rv_op_ori; break;
+				case rv_op_xor:  op = rv_op_xori; break;
+				case rv_op_sll:  op = rv_op_slli; imm = c & sh; break;
+				case rv_op_srl:  op = rv_op_srli; imm = c & sh; break;
+				case rv_op_sra:  op = rv_op_srai; imm = c & sh; break;
+				case rv_op_addw: op = rv_op_addiw; break;
+				case rv_op_subw: op = rv_op_addiw; imm = -c; break;
+				case rv_op_sllw: op = rv_op_slliw; imm = c & 31; break;
+				case rv_op_srlw: op = rv_op_srliw; imm = c & 31; break;
+				case rv_op_sraw: op = rv_op_sraiw; imm = c & 31; break;
+				default: return false;
+			}
+			if (!fits(imm)) return false;
+			dec.op = op;
+			dec.codec = rv_inst_codec[op];
+			dec.rs2 = rv_ireg_zero;
+			dec.imm = s32(imm);
+			return true;
+		}
+
+		static bool identity(decode_type &dec)
+		{
+			switch (dec.op) {
+				case rv_op_addi: case rv_op_ori: case rv_op_xori:
+					return dec.imm == 0;
+				case rv_op_slli: case rv_op_srli: case rv_op_srai:
+					return (dec.imm & (P::xlen - 1)) == 0;
+				default:
+					return false;
+			}
+		}
+
+		void alu(decode_type &dec)
+		{
+			bool reg = is_alu_reg(dec.op);
+			bool src = dec.op != rv_op_lui && dec.op != rv_op_auipc;
+			if (src) propagate(dec.rs1);
+			if (reg) propagate(dec.rs2);
+			u32 a = src ? reg_vn[dec.rs1] : 0, b = reg ? reg_vn[dec.rs2] : 0;
+
+			/* constant folding */
+			s64 r;
+			if ((!src || values[a].is_const) && (!reg || values[b].is_const) &&
+				eval(dec, values[a].val, values[b].val, r) && fits(r))
+			{
+				if (!(dec.op == rv_op_addi && dec.rs1 == rv_ireg_zero && dec.imm == r)) {
+					rewrite(dec, dec.rd, rv_ireg_zero, s32(r));
+					folded++;
+				}
+				define(dec.rd, const_value(r));
+				return;
+			}
+			if (reg && values[b].is_const && imm_form(dec, values[b].val)) {
+				reg = false;
+				b = 0;
+			}
+
+			/* copies keep the value number of their source */
+			if (identity(dec)) {
+				rewrite(dec, dec.rd, dec.rs1, 0);
+				define(dec.rd, a);
+				return;
+			}
+
+			/* common subexpressions */
+			jit_expr e = { dec.op, a, b, reg ? 0 : dec.imm };
+			auto ei = exprs.find(e);
+			int r1 = ei != exprs.end() ? holder(ei->second) : -1;
+			if (r1 >= 0) {
+				rewrite(dec, dec.rd, u8(r1), 0);
+				define(dec.rd, ei->second);
+				cse++;
+				return;
+			}
+			u32 vn = new_value();
+			exprs[e] = vn;
+			define(dec.rd, vn);
+		}
+
+		void load(decode_type &dec)
+		{
+			propagate(dec.rs1);
+			jit_expr e = { dec.op, reg_vn[dec.rs1], 0, dec.imm };
+			auto li = loads.find(e);
+			int r1 = li != loads.end() ? holder(li->second) : -1;
+			if (r1 >= 0 && dec.rd != rv_ireg_zero) {
+				rewrite(dec, dec.rd, u8(r1), 0);
+				define(dec.rd, li->second);
+				rle++;
+				return;
+			}
+			u32 vn = new_value();
+			if (reuse_loads) loads[e] = vn;
+			define(dec.rd, vn);
+		}
+
+		void store(decode_type &dec)
+		{
+			propagate(dec.rs1);
+			propagate(dec.rs2);
+			loads.clear();
+
+			/* forward a full width store to a later load */
+			if (!reuse_loads) return;
+			if (dec.op == rv_op_sd && P::xlen == 64) {
+				loads[jit_expr{ rv_op_ld, reg_vn[dec.rs1], 0, dec.imm }] = reg_vn[dec.rs2];
+			} else if (dec.op == rv_op_sw && P::xlen == 32) {
+				loads[jit_expr{ rv_op_lw, reg_vn[dec.rs1], 0, dec.imm }] = reg_vn[dec.rs2];
+			}
+		}
+
+		void other(decode_type &dec)
+		{
+			if (is_li(dec.op)) {
+				define(dec.rd, const_value(li_value(dec)));
+				return;
+			}
+			if (dec.op == jit_op_store_pair) {
+				loads.clear();
+				return;
+			}
+			if (dec.op >= jit_op_la) {
+				/* other fused pseudo ops write the registers they name */
+				u32 mask = writes(dec);
+				if (mask == ~0U) {
+					reset();
+					return;
+				}
+				for (size_t r = 1; r < P::ireg_count; r++) {
+					if (mask & (1U << r)) define(u8(r), new_value());
+				}
+				return;
+			}
+			if (writes_memory(dec.op) || dec.op == rv_op_fence) {
+				loads.clear();
+			}
+			const rv_operand_data *od = rv_inst_operand_data[dec.op];
+			for (; od && od->operand_name != rv_operand_name_none; od++) {
+				if (od->operand_name == rv_operand_name_rd) {
+					define(dec.rd, new_value());
+				}
+			}
+		}
+
+		u32 uses(decode_type &dec)
+		{
+			u32 mask = 0;
+			if (dec.op != rv_op_lui && dec.op != rv_op_auipc) mask |= 1U << dec.rs1;
+			if (is_alu_reg(dec.op)) mask |= 1U << dec.rs2;
+			return mask;
+		}
+
+		static u32 writes(decode_type &dec)
+		{
+			switch (dec.op) {
+				case jit_op_li: case jit_op_li_slli: case jit_op_lea:
+				case jit_op_slt_bnez: case jit_op_slt_beqz:
+				case jit_op_sltu_bnez: case jit_op_sltu_beqz:
+					return (1U << dec.rd) & ~1U;
+				case jit_op_mulh_mul: case jit_op_mulhu_mul:
+				case jit_op_div_rem: case jit_op_divu_remu:
+					return ((1U << dec.rd) | (1U << dec.rs3)) & ~1U;
+				case jit_op_load_pair:
+					return ((1U << dec.rd) | (1U << dec.rs2)) & ~1U;
+				case jit_op_store_pair:
+					return 0;
+				default:
+					break;
+			}
+			if (dec.op >= jit_op_la) return ~0U;
+			u32 mask = 0;
+			const rv_operand_data *od = rv_inst_operand_data[dec.op];
+			for (; od && od->operand_name != rv_operand_name_none; od++) {
+				if (od->operand_name == rv_operand_name_rd) mask |= 1U << dec.rd;
+			}
+			return mask & ~1U;
+		}
+
+		static bool jump_target(decode_type &dec, addr_t &target)
+		{
+			if (!is_branch(dec.op) && !is_fused_branch(dec.op) && dec.op != rv_op_jal) return false;
+			target = dec.pc + dec.imm;
+			return true;
+		}
+
+		static bool falls_through(decode_type &dec)
+		{
+			return dec.op < jit_op_la && !is_branch(dec.op) &&
+				dec.op != rv_op_jal && dec.op != rv_op_jalr;
+		}
+
+		void hoist(std::vector<decode_type> &trace, size_t h)
+		{
+			/* the loop is closed by jumps from its body back to the head */
+			addr_t head = trace[h].pc, target;
+			auto &last = trace.back();
+			size_t tail = h;
+			bool loop = false;
+			for (size_t j = h; j < trace.size(); j++) {
+				if (jump_target(trace[j], target) && target == head) {
+					tail = j;
+					loop = true;
+				}
+			}
+			if (falls_through(last) && addr_t(last.pc + inst_length(last.inst)) == head) {
+				tail = trace.size() - 1;
+				loop = true;
+			}
+			if (!loop) return;
+
+			/* and is only entered by falling into the head */
+			std::map<addr_t,size_t> body;
+			for (size_t k = h; k <= tail; k++) body[trace[k].pc] = k;
+			for (size_t j = 0; j < trace.size(); j++) {
+				if (j >= h && j <= tail) continue;
+				if (jump_target(trace[j], target) && body.find(target) != body.end()) return;
+			}
+			if (tail < trace.size() - 1 && falls_through(last) &&
+				body.find(addr_t(last.pc + inst_length(last.inst))) != body.end()) return;
+
+			u8 ndefs[P::ireg_count] = { 0 };
+			for (size_t k = h; k <= tail; k++) {
+				u32 mask = writes(trace[k]);
+				if (mask == ~0U) return;
+				for (size_t r = 1; r < P::ireg_count; r++) {
+					if ((mask & (1U << r)) && ndefs[r] < 2) ndefs[r]++;
+				}
+			}
+			u32 defs = 0;
+			for (size_t r = 1; r < P::ireg_count; r++) {
+				if (ndefs[r]) defs |= 1U << r;
+			}
+
+			/*
+			 * Instructions in the leading run of ALU instructions whose
+			 * sources are not written in the loop and whose destination is
+			 * written once and not read before it compute the same value in
+			 * every iteration and no exit can observe the early write.
+			 */
+			std::vector<decode_type> preheader;
+			u32 read = 0;
+			for (size_t k = h; k <= tail && is_pure(trace[k].op); k++) {
+				auto &dec = trace[k];
+				u32 src = uses(dec) & ~1U;
+				if (dec.rd != rv_ireg_zero && !(src & defs) &&
+					!(read & (1U << dec.rd)) && ndefs[dec.rd] == 1)
+				{
+					decode_type copy = dec;
+					copy.brt = 0;
+					preheader.push_back(copy);
+					kill(dec);
+					defs &= ~(1U << copy.rd);
+					hoisted++;
+				}
+				read |= src;
+			}
+			trace.insert(trace.begin() + h, preheader.begin(), preheader.end());
+		}
+
+		void optimize_loops(std::vector<decode_type> &trace)
+		{
+			/* segments of trace trees and fused calls can enter a loop head from outside */
+			for (auto &dec : trace) {
+				if (dec.seg || dec.op == jit_op_call) return;
+			}
+			for (size_t h = 0; h < trace.size(); h++) {
+				if (!trace[h].brt) continue;
+				size_t n = trace.size();
+				hoist(trace, h);
+				h += trace.size() - n;
+			}
+		}
+
+		void optimize(std::vector<decode_type> &trace, bool loops = true)
+		{
+			/* forward pass, value numbering per basic block */
+			reset();
+			for (auto &dec : trace) {
+				if (dec.brt || dec.seg) reset();
+				if (is_alu(dec.op) && dec.rd != rv_ireg_zero) alu(dec);
+				else if (is_load(dec.op)) load(dec);
+				else if (is_store(dec.op)) store(dec);
+				else if (is_branch(dec.op)) {
+					propagate(dec.rs1);
+					propagate(dec.rs2);
+				}
+				else if (!is_alu(dec.op)) other(dec);
+			}
+
+			if (loops) optimize_loops(trace);
+
+			/* backward pass, registers are live at every possible exit */
+			u32 live = ~0U;
+			for (auto di = trace.rbegin(); di != trace.rend(); di++) {
+				auto &dec = *di;
+				if (is_pure(dec.op)) {
+					if (dec.rd != rv_ireg_zero && !(live & (1U << dec.rd))) {
+						kill(dec);
+						dead++;
+					} else if (dec.rd != rv_ireg_zero) {
+						live &= ~(1U << dec.rd);
+						live |= uses(dec);
+					}
+				} else {
+					live = ~0U;
+				}
+				if (dec.seg) live = ~0U;
+			}
+		}
+	};
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+//
+//  jit-perfmap.h
+//
+
+#ifndef rv_jit_perfmap_h
+#define rv_jit_perfmap_h
+
+namespace riscv {
+
+	/*
+	 * Profiler symbol maps
+	 *
+	 * Translated code is described to Linux perf with /tmp/perf-<pid>.map
+	 * lines and with JIT_CODE_LOAD records in a jitdump file which
+	 * `perf inject --jit` turns into per symbol ELF images. A trace is
+	 * split into host code ranges by the guest function of each
+	 * instruction so code inlined from another function is attributed
+	 * to it. Symbols are named from the guest ELF symbol table.
+	 */
+
+	struct jit_dump_header
+	{
+		u32    magic;                              /* 'JiTD' */
+		u32    version;                            /* jitdump version 1 */
+		u32    total_size;                         /* size of this header */
+		u32    elf_mach;                           /* host ELF machine */
+		u32    pad1;
+		u32    pid;
+		u64    timestamp;                          /* CLOCK_MONOTONIC ns */
+		u64    flags;
+	};
+
+	struct jit_dump_code_load
+	{
+		u32    id;                                 /* JIT_CODE_LOAD */
+		u32    total_size;                         /* including name and code */
+		u64    timestamp;
+		u32    pid;
+		u32    tid;
+		u64    vma;
+		u64    code_addr;
+		u64    code_size;
+		u64    code_index;
+	};
+
+	struct jit_perfmap
+	{
+		enum {
+			jit_dump_magic = 0x4A695444,
+			jit_dump_version = 1,
+			jit_code_load = 0
+		};
+
+		elf_file *elf;
+		FILE *map_file;
+		int dump_fd;
+		void *dump_marker;
+		u64 code_index;
+
+		jit_perfmap() : elf(nullptr), map_file(nullptr), dump_fd(-1),
+			dump_marker(nullptr), code_index(0) {}
+		~jit_perfmap() { close(); }
+
+		jit_perfmap(const jit_perfmap&) = delete;
+		jit_perfmap& operator=(const jit_perfmap&) = delete;
+
+		bool is_open() { return map_file != nullptr || dump_fd >= 0; }
+
+		static u64 timestamp()
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return u64(ts.tv_sec) * 1000000000ULL + u64(ts.tv_nsec);
+		}
+
+		bool open_map()
+		{
+			std::string filename = format_string("/tmp/perf-%d.map", getpid());
+			map_file = fopen(filename.c_str(), "w");
+			if (!map_file) {
+				debug("jit-perfmap: error: fopen: %s: %s", filename.c_str(), strerror(errno));
+				return false;
+			}
+			return true;
+		}
+
+		/* perf finds the dump through the executable mapping of its first page */
+		bool open_dump()
+		{
+			std::string filename = format_string("jit-%d.dump", getpid());
+			dump_fd = ::open(filename.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+			if (dump_fd < 0) {
+				debug("jit-perfmap: error: open: %s: %s", filename.c_str(), strerror(errno));
+				return false;
+			}
+			dump_marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, dump_fd, 0);
+			if (dump_marker == MAP_FAILED) {
+				debug("jit-perfmap: error: mmap: %s: %s", filename.c_str(), strerror(errno));
+				dump_marker = nullptr;
+				::close(dump_fd);
+				dump_fd = -1;
+				return false;
+			}
+			jit_dump_header hdr = {
+				jit_dump_magic, jit_dump_version, sizeof(jit_dump_header),
+				EM_X86_64, 0, u32(getpid()), timestamp(), 0
+			};
+			if (::write(dump_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+				debug("jit-perfmap: error: write: %s: %s", filename.c_str(), strerror(errno));
+			}
+			return true;
+		}
+
+		void close()
+		{
+			if (map_file) {
+				fclose(map_file);
+				map_file = nullptr;
+			}
+			if (dump_marker) {
+				munmap(dump_marker, sysconf(_SC_PAGESIZE));
+				dump_marker = nullptr;
+			}
+			if (dump_fd >= 0) {
+				::close(dump_fd);
+				dump_fd = -1;
+			}
+		}
+
+		const Elf64_Sym* function(addr_t pc)
+		{
+			return elf ? elf->sym_by_nearest_addr(Elf64_Addr(pc)) : nullptr;
+		}
+
+		std::string symbol(addr_t pc)
+		{
+			auto sym = function(pc);
+			if (!sym) return format_string("0x%llx", (u64)pc);
+			u64 offset = u64(pc) - sym->st_value;
+			return offset ? format_string("%s+0x%llx", elf->sym_name(sym), offset) :
+				std::string(elf->sym_name(sym));
+		}
+
+		void add(std::string name, uintptr_t addr, size_t size)
+		{
+			if (size == 0) return;
+			if (map_file) {
+				fprintf(map_file, "%llx %zx %s\n", (u64)addr, size, name.c_str());
+				fflush(map_file);
+			}
+			if (dump_fd >= 0) {
+				jit_dump_code_load rec = {
+					jit_code_load, u32(sizeof(rec) + name.size() + 1 + size), timestamp(),
+					u32(getpid()), u32(syscall(SYS_gettid)), u64(addr), u64(addr), u64(size), code_index++
+				};
+				struct iovec iov[3] = {
+					{ &rec, sizeof(rec) },
+					{ (void*)name.c_str(), name.size() + 1 },
+					{ (void*)addr, size }
+				};
+				if (::writev(dump_fd, iov, 3) < 0) {
+					debug("jit-perfmap: error: writev: %s", strerror(errno));
+				}
+			}
+		}
+
+		/* name each run of host code whose guest instructions share a function */
+		void add_trace(addr_t pc, uintptr_t addr, size_t size, std::vector<std::pair<addr_t,intptr_t>> &pc_addrs)
+		{
+			std::string trace_name = symbol(pc);
+			auto trace_fn = function(pc);
+			auto run_fn = trace_fn;
+			addr_t run_pc = pc;
+			uintptr_t run_start = addr, end = addr + size;
+			auto run_name = [&]() {
+				return run_fn == trace_fn ? symbol(run_pc) :
+					symbol(run_pc) + " [inlined in " + trace_name + "]";
+			};
+			for (auto &pa : pc_addrs) {
+				auto fn = function(pa.first);
+				if (fn == run_fn) continue;
+				if (uintptr_t(pa.second) > run_start) {
+					add(run_name(), run_start, uintptr_t(pa.second) - run_start);
+					run_start = pa.second;
+				}
+				run_fn = fn;
+				run_pc = pa.first;
+			}
+			add(run_name(), run_start, end - run_start);
+		}
+	};
+
+}
+
+#endif
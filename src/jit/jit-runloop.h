@@ -9,10 +9,10 @@ namespace riscv {
 
 	struct jit_singleton
 	{
-		static jit_singleton *current;
+		static thread_local jit_singleton *current;
 	};
 
-	jit_singleton* jit_singleton::current = nullptr;
+	thread_local jit_singleton* jit_singleton::current = nullptr;
 
 	struct jit_logger : Logger
 	{
@@ -23,6 +23,13 @@ namespace riscv {
 		}
 	};
 
+	enum jit_tier_policy
+	{
+		jit_tier_traces,      /* interpret until hot then record optimized traces */
+		jit_tier_tiered,      /* baseline blocks on first execution, traces when hot */
+		jit_tier_blocks       /* baseline blocks only */
+	};
+
 	template <typename P, typename T, typename J>
 	struct jit_runloop : jit_singleton, ErrorHandler, P
 	{
@@ -30,6 +37,7 @@ namespace riscv {
 		typedef J jit_emitter;
 
 		static const size_t inst_cache_size = 8191;
+		static const size_t hot_count_size = 4096;
 		static const int inst_step = 100000;
 
 		struct rv_inst_cache_ent
@@ -38,28 +46,503 @@ namespace riscv {
 			typename P::decode_type dec;
 		};
 
-		JitRuntime rt;
-		google::dense_hash_map<addr_t,TraceFunc> trace_cache_prolog;
-		google::dense_hash_map<addr_t,TraceFunc> trace_cache_entry;
+		struct jit_compile_job
+		{
+			addr_t pc;
+			u64 ctx;
+			u64 gen;
+			std::vector<typename P::decode_type> trace;
+		};
+
+		struct jit_compile_result
+		{
+			addr_t pc;
+			u64 ctx;
+			TraceFunc fn;
+			intptr_t entry_addr;
+			size_t size;
+			std::vector<std::pair<addr_t,intptr_t>> fixups;
+			std::vector<intptr_t> ic_sites;
+			u8 *data;
+			u8 *referenced;
+			u64 *exit_counts;
+			std::vector<addr_t> exit_pcs;
+			std::vector<u8> image;
+			std::vector<std::pair<addr_t,intptr_t>> pc_addrs;
+			std::vector<typename P::decode_type> trace;
+			u64 compile_ns;
+		};
+
+		struct jit_trace_ent
+		{
+			size_t size;                                     /* emitted code size */
+			u64 ctx;                                         /* translation context */
+			u8 *referenced;                                  /* second chance byte set on entry */
+			std::vector<std::pair<addr_t,intptr_t>> fixups;  /* jump sites in this trace */
+			std::vector<intptr_t> ic_sites;                  /* indirect jump inline caches */
+			int tier;                                        /* 1 baseline block, 2 optimized trace */
+			u8 *data;                                        /* counters written by the trace */
+			u64 *exit_counts;                                /* entry count then the count of each exit */
+			std::vector<addr_t> exit_pcs;                    /* guest pc of each counted exit */
+			std::vector<addr_t> pages;                       /* guest code pages covered */
+			std::vector<typename P::decode_type> trace;      /* instructions for tree growth */
+		};
+
+		struct jit_page_ent
+		{
+			std::vector<addr_t> traces;                      /* traces with code on this page */
+			u64 ctx;                                         /* translation context */
+			addr_t mpa;                                      /* physical page at translation */
+			bool prot;                                       /* host page is write protected */
+			bool dirty;                                      /* written since translation */
+		};
+
+		struct jit_link_ent
+		{
+			intptr_t site;                                   /* address after the rel32 */
+			int disp;                                        /* original rel32 to the jump trampoline */
+		};
+
+		/*
+		 * Shared translation state
+		 *
+		 * Guest threads share one jit_shared holding the code cache,
+		 * its indexes, the compile thread and the translation options.
+		 * The runloop members below are references into it so each
+		 * group is described where it is used; the rest of the runloop
+		 * is per thread.
+		 */
+		struct jit_shared
+		{
+			JitRuntime rt;
+			jit_code_arena arena;
+			google::dense_hash_map<addr_t,TraceFunc> trace_cache_prolog;
+			google::dense_hash_map<addr_t,TraceFunc> trace_cache_entry;
+			std::map<addr_t,std::vector<intptr_t>> jmp_fixup_addrs;
+			jit_cachefile<typename P::decode_type> cachefile;
+			jit_cachefile<typename P::decode_type> aotfile;
+			std::map<addr_t,std::vector<typename P::decode_type>> aot_index;
+			jit_perfmap perfmap;
+			jit_native native;
+			u16 hot_counts[hot_count_size];
+			google::dense_hash_map<addr_t,bool> hot_skip;
+			bool async_compile;
+			std::thread compile_thread;
+			std::mutex compile_lock;
+			std::condition_variable compile_cond;
+			std::deque<jit_compile_job> compile_queue;
+			std::vector<jit_compile_result> compile_done;
+			std::vector<addr_t> compile_pending;
+			std::atomic<bool> compile_ready;
+			bool compile_exit;
+			u64 compile_gen;
+			std::map<addr_t,jit_trace_ent> trace_info;
+			std::map<addr_t,std::vector<jit_link_ent>> jmp_link_addrs;
+			size_t code_cache_size;
+			size_t code_cache_used;
+			size_t code_cache_peak;
+			size_t code_cache_evictions;
+			size_t code_cache_evicted_bytes;
+			std::deque<addr_t> trace_clock;
+			bool code_protect;
+			volatile sig_atomic_t code_dirty;
+			std::map<addr_t,jit_page_ent> code_pages;
+			std::vector<std::pair<addr_t,addr_t>> text_segments;
+			size_t code_invalidations;
+			bool trace_opt;
+			bool trace_trees;
+			size_t trace_tree_limit;
+			size_t trace_tree_segments;
+			std::map<addr_t,addr_t> tree_exits;
+			int trace_tiers;
+			size_t tier_blocks;
+			size_t tier_promotions;
+			size_t aot_blocks;
+			int exit_ratio;
+			size_t exit_retranslations;
+			std::map<addr_t,size_t> retranslations;
+			size_t code_arena_size;
+			bool code_huge_pages;
+			bool code_wx;
+			size_t stat_traces;
+			size_t stat_bytes;
+			size_t stat_compiles;
+			u64 stat_compile_ns;
+			u64 stat_compile_max_ns;
+			size_t stat_fixups;
+			jit_threads threads;
+			jit_singleton *primary;
+			std::set<jit_singleton*> clones;       /* cloned threads that have not exited, under threads.lock */
+			std::atomic<u64> flush_gen;
+			std::mutex ic_lock;
+			std::mutex syscall_lock;
+
+			jit_shared() : hot_counts(), async_compile(false), compile_ready(false), compile_exit(false), compile_gen(0),
+			  code_cache_size(0), code_cache_used(0), code_cache_peak(0),
+			  code_cache_evictions(0), code_cache_evicted_bytes(0),
+			  code_protect(false), code_dirty(0), code_invalidations(0),
+			  trace_opt(true), trace_trees(true), trace_tree_limit(1024), trace_tree_segments(0),
+			  trace_tiers(jit_tier_traces), tier_blocks(0), tier_promotions(0), aot_blocks(0),
+			  exit_ratio(90), exit_retranslations(0),
+			  code_arena_size(256 << 20), code_huge_pages(false), code_wx(false),
+			  stat_traces(0), stat_bytes(0), stat_compiles(0), stat_compile_ns(0), stat_compile_max_ns(0),
+			  stat_fixups(0), primary(nullptr), flush_gen(0)
+			{
+				trace_cache_prolog.set_empty_key(0);
+				trace_cache_prolog.set_deleted_key(-1);
+				trace_cache_entry.set_empty_key(0);
+				trace_cache_entry.set_deleted_key(-1);
+				hot_skip.set_empty_key(0);
+				hot_skip.set_deleted_key(-1);
+			}
+		};
+
+		std::shared_ptr<jit_shared> shared;
+		JitRuntime &rt = shared->rt;
+		jit_code_arena &arena = shared->arena;
+		google::dense_hash_map<addr_t,TraceFunc> &trace_cache_prolog = shared->trace_cache_prolog;
+		google::dense_hash_map<addr_t,TraceFunc> &trace_cache_entry = shared->trace_cache_entry;
 		google::dense_hash_map<addr_t,TraceFunc> audit_trace_cache_prolog;
-		std::map<addr_t,std::vector<intptr_t>> jmp_fixup_addrs;
+		std::map<addr_t,std::vector<intptr_t>> &jmp_fixup_addrs = shared->jmp_fixup_addrs;
 		std::shared_ptr<debug_cli<P>> cli;
+		jit_cachefile<typename P::decode_type> &cachefile = shared->cachefile;
+		jit_cachefile<typename P::decode_type> &aotfile = shared->aotfile;
+		std::map<addr_t,std::vector<typename P::decode_type>> &aot_index = shared->aot_index;
+		jit_perfmap &perfmap = shared->perfmap;
+		jit_native &native = shared->native;
 		rv_inst_cache_ent inst_cache[inst_cache_size];
+
+		/*
+		 * Hotspot detection
+		 *
+		 * Execution counts are only kept for control flow targets, the
+		 * pc following a taken branch, jump, trap or trace exit, in a
+		 * direct mapped array of saturating counters. Aliasing pcs share
+		 * a counter which at worst traces a block early. Traces that can
+		 * not be recorded or are queued for compilation are kept out of
+		 * the counters with hot_skip. The pc histogram is only recorded
+		 * when requested with proc_log_hist_pc.
+		 */
+		u16 (&hot_counts)[hot_count_size] = shared->hot_counts;
+		google::dense_hash_map<addr_t,bool> &hot_skip = shared->hot_skip;
+		bool hot_target;
+		int jit_frm;
 		TraceLookup lookup_trace_fast;
 		mmu_ops ops;
 
+		/*
+		 * Indirect jump inline caches
+		 *
+		 * Each indirect jump site compares its target with up to
+		 * jit_ic_ways cached targets and jumps straight to their trace
+		 * entries. Misses in installed traces go to lookup_trace_ic which
+		 * fills an empty way with the target's trace. With all ways full,
+		 * each review replaces the coldest way with the most frequent
+		 * missing target when it outvotes the way's hits, and a site
+		 * whose ways were hit less often than it missed is left to the
+		 * lookup stub. While other threads run, a filled way is only
+		 * replaced with them parked, after the trace has returned. Ways
+		 * pointing into a removed trace are emptied.
+		 */
+		struct jit_ic_pending
+		{
+			jit_ic_site *site;
+			size_t way;
+			addr_t pc;
+			uintptr_t entry;
+			u64 gen;                                         /* flush_gen when the review ran */
+		};
+
+		TraceLookup lookup_trace_ic;
+		jit_ic_pending ic_pending;
+
+		/*
+		 * Background compilation
+		 *
+		 * Traces are recorded on the guest thread and queued for the
+		 * compile thread which emits and relocates them. Finished traces
+		 * are published by the guest thread between instructions so the
+		 * trace maps, L1 lookup table and jump fixups are only modified
+		 * while no translated code is running. compile_lock guards the
+		 * queues and the JitRuntime.
+		 */
+		bool &async_compile = shared->async_compile;
+		std::thread &compile_thread = shared->compile_thread;
+		std::mutex &compile_lock = shared->compile_lock;
+		std::condition_variable &compile_cond = shared->compile_cond;
+		std::deque<jit_compile_job> &compile_queue = shared->compile_queue;
+		std::vector<jit_compile_result> &compile_done = shared->compile_done;
+		std::vector<addr_t> &compile_pending = shared->compile_pending;
+		std::atomic<bool> &compile_ready = shared->compile_ready;
+		bool &compile_exit = shared->compile_exit;
+		u64 &compile_gen = shared->compile_gen;
+
+		/*
+		 * Trace removal
+		 *
+		 * Traces are linked only through jump fixups so every direct jump
+		 * into a trace is recorded in jmp_link_addrs and can be pointed
+		 * back at its trampoline when the trace is evicted or invalidated.
+		 */
+		std::map<addr_t,jit_trace_ent> &trace_info = shared->trace_info;
+		std::map<addr_t,std::vector<jit_link_ent>> &jmp_link_addrs = shared->jmp_link_addrs;
+
+		/*
+		 * Bounded code cache
+		 *
+		 * When code_cache_size is set, traces are queued in creation order
+		 * and evicted with a second chance sweep: traces entered since the
+		 * last sweep move to the young end of the queue. Traces set a
+		 * reference byte in their trace data at their entry label, so
+		 * entries through links, inline caches and the lookup stub are
+		 * seen as well as entries from the emulator.
+		 */
+		size_t &code_cache_size = shared->code_cache_size;
+		size_t &code_cache_used = shared->code_cache_used;
+		size_t &code_cache_peak = shared->code_cache_peak;
+		size_t &code_cache_evictions = shared->code_cache_evictions;
+		size_t &code_cache_evicted_bytes = shared->code_cache_evicted_bytes;
+		std::deque<addr_t> &trace_clock = shared->trace_clock;
+
+		/*
+		 * Self-modifying code detection
+		 *
+		 * Translated traces are indexed by the guest pages they cover.
+		 * With code_protect set, writable pages holding translated code are
+		 * write protected; a write fault unprotects the page and marks it
+		 * dirty, and the traces on dirty pages are dropped at the next
+		 * instruction boundary or fence.i. Read only ELF text segments
+		 * are never protected.
+		 */
+		bool &code_protect = shared->code_protect;
+		volatile sig_atomic_t &code_dirty = shared->code_dirty;
+		std::map<addr_t,jit_page_ent> &code_pages = shared->code_pages;
+		std::vector<std::pair<addr_t,addr_t>> &text_segments = shared->text_segments;
+		size_t &code_invalidations = shared->code_invalidations;
+
+		/*
+		 * Translation contexts
+		 *
+		 * Trace maps, lookup tables, hotspot counters and the page index
+		 * are keyed by the guest pc xored with the translation context
+		 * so the same virtual address in different privilege modes maps
+		 * to different traces. Code pages record the physical page they
+		 * were translated from and are revalidated when the address
+		 * space changes, dropping traces whose mapping has moved.
+		 */
+
+		/*
+		 * Trace lookup tables
+		 *
+		 * The lookup stub probes a direct mapped L1 indexed by pc, then
+		 * a set associative L2 whose cache line sized sets each hold
+		 * trace_l2_ways pc fn pairs, before calling lookup_trace. The
+		 * stub fills the L1 and traces are added to the L2 when they are
+		 * installed. trace_cache_entry remains the authoritative map so
+		 * L2 sets can evict entries when full.
+		 */
+		u64 trace_l2_victim;
+
+		/*
+		 * Data TLB
+		 *
+		 * With trace_mmu set, translated loads and stores probe the
+		 * direct mapped P::trace_tlb inline. Each 32 byte entry holds a
+		 * load tag, a store tag and the host address of the page; a tag
+		 * is the guest page address and is only set by the load store
+		 * helpers for whole pages of host backed RAM the current mode may
+		 * access, so misses, faults, misaligned accesses and MMIO take
+		 * the out-of-line path. Invalid tags select a different entry
+		 * than their own so they never match. The table is flushed when
+		 * the privilege mode, mstatus translation bits or page table
+		 * root change, after traps and on sfence.vm.
+		 */
+		u64 tlb_space;
+		u64 tlb_data_space;
+
+		/*
+		 * Trace trees
+		 *
+		 * Side exits of installed traces are recorded in tree_exits. When
+		 * a side exit target becomes hot, the path from it is recorded as
+		 * a segment appended to the trace and the whole tree is emitted
+		 * again as one unit so the exit becomes a direct jump.
+		 */
+		bool &trace_opt = shared->trace_opt;
+		bool &trace_trees = shared->trace_trees;
+		size_t &trace_tree_limit = shared->trace_tree_limit;
+		size_t &trace_tree_segments = shared->trace_tree_segments;
+		std::map<addr_t,addr_t> &tree_exits = shared->tree_exits;
+
+		/*
+		 * Tiered translation
+		 *
+		 * With jit_tier_tiered or jit_tier_blocks, control flow targets
+		 * are translated on first execution as baseline blocks: the
+		 * tracer stops after the first control transfer, the optimizer is
+		 * skipped and the block end links to the next block. Tiered
+		 * blocks count their entries and return with trace_tier_up set
+		 * after trace_iters, an optimized trace is then recorded from the
+		 * block entry and replaces it. Side exits of optimized traces are
+		 * still counted by the emulator so they grow the trace tree.
+		 * Blocks from an ahead-of-time sidecar are indexed at startup,
+		 * which switches jit_tier_traces to jit_tier_tiered, and each is
+		 * emitted the first time its pc misses the trace lookup. The
+		 * index is not changed after startup so it is read without the
+		 * exclusive lock, and evicted blocks are emitted again from it.
+		 */
+		int &trace_tiers = shared->trace_tiers;
+		size_t &tier_blocks = shared->tier_blocks;
+		size_t &tier_promotions = shared->tier_promotions;
+		size_t &aot_blocks = shared->aot_blocks;
+
+		/*
+		 * Side exit profiling
+		 *
+		 * Optimized traces count their entries and exits in their trace
+		 * data. A trace recorded along the rare direction of a branch
+		 * leaves through the same exit on most entries; when an exit
+		 * reaches exit_ratio percent of the trace entries the trace is
+		 * removed so it is recorded again from the current branch
+		 * directions. Each trace is retranslated at most
+		 * retranslate_limit times.
+		 */
+		static const size_t retranslate_limit = 4;
+		static const size_t exit_hot_spots = 16;
+		static const size_t native_audit_limit = 1 << 28;
+		int &exit_ratio = shared->exit_ratio;
+		size_t &exit_retranslations = shared->exit_retranslations;
+		std::map<addr_t,size_t> &retranslations = shared->retranslations;
+
+		/*
+		 * Code arena
+		 *
+		 * Traces are placed in arena, optimized traces at the hot end.
+		 * The asmjit runtime holds the lookup and load store stubs and
+		 * traces that do not fit. With code_wx the compile thread only
+		 * relocates into a buffer which is copied into the arena when
+		 * published.
+		 */
+		size_t &code_arena_size = shared->code_arena_size;
+		bool &code_huge_pages = shared->code_huge_pages;
+		bool &code_wx = shared->code_wx;
+
+		/*
+		 * Runtime statistics
+		 *
+		 * Lookup stub and trace exit counters are kept by translated code
+		 * in P::trace_stat, the rest are counted by the emulator. Native
+		 * instructions are the instret retired inside translated code so
+		 * the native share is only known with update_instret. Statistics
+		 * are printed at exit and on SIGUSR1 when translated code next
+		 * returns, and saved as jit-stats.json in the stats directory.
+		 * Counters updated while guest code runs are kept per thread and
+		 * added to the first thread's when a guest thread exits.
+		 */
+		size_t &stat_traces = shared->stat_traces;
+		size_t &stat_bytes = shared->stat_bytes;
+		size_t &stat_compiles = shared->stat_compiles;
+		u64 &stat_compile_ns = shared->stat_compile_ns;
+		u64 &stat_compile_max_ns = shared->stat_compile_max_ns;
+		size_t stat_lookup_calls;
+		size_t stat_lookup_misses;
+		size_t stat_trace_entries;
+		size_t stat_trap_exits;
+		size_t &stat_fixups = shared->stat_fixups;
+		u64 stat_native_insts;
+		u64 stat_interp_insts;
+		bool stat_in_trace;
+		volatile sig_atomic_t stat_dump;
+
+		/*
+		 * Guest threads
+		 *
+		 * With proxy_threads set, clone creates a runloop sharing this
+		 * one's jit_shared and runs it on a new host thread; futex is
+		 * passed to the host as guest addresses are host addresses.
+		 * The first clone flushes the code cache and enables budget
+		 * checks so that all translated code can be stopped. Lookup
+		 * tables, the shadow return stack and inline cache fills stay
+		 * lock free; a thread that removed traces bumps flush_gen and
+		 * the others clear their own tables before running again.
+		 */
+		jit_threads &threads = shared->threads;
+		bool proxy_threads;
+		int tid;
+		addr_t clear_tid;
+		bool thread_exited;
+		int exclusive_depth;
+		bool exclusive_stopped;
+		u64 flush_seen;
+
+		struct jit_exclusive
+		{
+			jit_runloop &proc;
+			jit_exclusive(jit_runloop &proc) : proc(proc) { proc.exclusive_begin(); }
+			~jit_exclusive() { proc.exclusive_end(); }
+		};
+
 		jit_runloop() : jit_runloop(std::make_shared<debug_cli<P>>()) {}
-		jit_runloop(std::shared_ptr<debug_cli<P>> cli) : cli(cli), inst_cache(), ops{
+		jit_runloop(std::shared_ptr<debug_cli<P>> cli) : shared(std::make_shared<jit_shared>()), cli(cli), inst_cache(),
+		  hot_target(true), jit_frm(-1), ops{
 			.lb = mmu_lb, .lh = mmu_lh, .lw = mmu_lw, .ld = mmu_ld,
 			.sb = mmu_sb, .sh = mmu_sh, .sw = mmu_sw, .sd = mmu_sd
+		}, ic_pending(), trace_l2_victim(0), tlb_space(0), tlb_data_space(0),
+		  stat_lookup_calls(0), stat_lookup_misses(0), stat_trace_entries(0), stat_trap_exits(0),
+		  stat_native_insts(0), stat_interp_insts(0), stat_in_trace(false), stat_dump(0),
+		  proxy_threads(false), tid(abi_main_tid), clear_tid(0), thread_exited(false),
+		  exclusive_depth(0), exclusive_stopped(false), flush_seen(0)
+		{
+			audit_trace_cache_prolog.set_empty_key(0);
+			audit_trace_cache_prolog.set_deleted_key(-1);
+			alloc_thread_tables(P::trace_l1_size, P::trace_l2_size);
 		}
+
+		/* a guest thread starting with a copy of the parent's processor state */
+		jit_runloop(jit_runloop &parent) : jit_singleton(), ErrorHandler(), P(parent),
+		  shared(parent.shared), cli(parent.cli), inst_cache(),
+		  hot_target(true), jit_frm(-1), lookup_trace_fast(parent.lookup_trace_fast), ops(parent.ops),
+		  lookup_trace_ic(parent.lookup_trace_ic), ic_pending(), trace_l2_victim(0), tlb_space(0), tlb_data_space(0),
+		  stat_lookup_calls(0), stat_lookup_misses(0), stat_trace_entries(0), stat_trap_exits(0),
+		  stat_native_insts(0), stat_interp_insts(0), stat_in_trace(false), stat_dump(0),
+		  proxy_threads(parent.proxy_threads), tid(0), clear_tid(0), thread_exited(false),
+		  exclusive_depth(0), exclusive_stopped(false), flush_seen(parent.shared->flush_gen)
 		{
-			trace_cache_prolog.set_empty_key(0);
-			trace_cache_prolog.set_deleted_key(-1);
-			trace_cache_entry.set_empty_key(0);
-			trace_cache_entry.set_deleted_key(-1);
 			audit_trace_cache_prolog.set_empty_key(0);
 			audit_trace_cache_prolog.set_deleted_key(-1);
+			P::trace_l1 = P::trace_l2 = P::trace_tlb = P::trace_rstack = nullptr;
+			memset(P::trace_stat, 0, sizeof(P::trace_stat));
+			P::trace_exit_key = 0;
+			P::trace_tier_up = 0;
+			alloc_thread_tables(parent.trace_l1_mask + 1, (parent.trace_l2_mask + 1) * P::trace_l2_ways);
+		}
+
+		void alloc_thread_tables(size_t l1_size, size_t l2_size)
+		{
+			alloc_trace_tables(l1_size, l2_size);
+			void *tlb = nullptr;
+			if (posix_memalign(&tlb, 64, P::trace_tlb_size * sizeof(u64) * 4) != 0) {
+				panic("can't allocate trace data TLB: %s", strerror(errno));
+			}
+			P::trace_tlb = (u64*)tlb;
+			clear_trace_tlb();
+			void *rstack = nullptr;
+			if (posix_memalign(&rstack, 64, P::trace_rstack_size * sizeof(u64) * 2) != 0) {
+				panic("can't allocate shadow return stack: %s", strerror(errno));
+			}
+			P::trace_rstack = (u64*)rstack;
+			clear_trace_rstack();
+		}
+
+		~jit_runloop()
+		{
+			if (tid == abi_main_tid) {
+				stop_compile_thread();
+			}
+			free(P::trace_l1);
+			free(P::trace_l2);
+			free(P::trace_tlb);
+			free(P::trace_rstack);
 		}
 
 		virtual bool handleError(Error err, const char* message, CodeEmitter* origin)
@@ -68,27 +551,1568 @@ namespace riscv {
 			return false;
 		}
 
-		static void signal_handler(int signum, siginfo_t *info, void *)
+		static void signal_handler(int signum, siginfo_t *info, void *)
+		{
+			static_cast<jit_runloop<P,T,J>*>
+				(jit_singleton::current)->signal_dispatch(signum, info);
+		}
+
+		void signal_dispatch(int signum, siginfo_t *info)
+		{
+			/* resume writes to protected code pages */
+			if (signum == SIGSEGV && code_write_fault(addr_t(info->si_addr))) {
+				return;
+			}
+
+			/* print statistics at the next step, also while a trace is being recorded */
+			if (signum == SIGUSR1) {
+				stat_dump = 1;
+				return;
+			}
+
+			printf("SIGNAL   :%s pc:0x%0llx si_addr:0x%0llx\n",
+				signal_name(signum), (addr_t)P::pc, (addr_t)info->si_addr);
+
+			/* let the processor longjmp */
+			P::signal(signum, info);
+		}
+
+		void init()
+		{
+			// block signals before so we don't deadlock in signal handlers
+			sigset_t set;
+			sigemptyset(&set);
+			sigaddset(&set, SIGSEGV);
+			sigaddset(&set, SIGTERM);
+			sigaddset(&set, SIGQUIT);
+			sigaddset(&set, SIGINT);
+			sigaddset(&set, SIGHUP);
+			sigaddset(&set, SIGUSR1);
+			if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+				panic("can't set thread signal mask: %s", strerror(errno));
+			}
+
+			// disable unwanted signals
+			sigset_t sigpipe_set;
+			sigemptyset(&sigpipe_set);
+			sigaddset(&sigpipe_set, SIGPIPE);
+			sigprocmask(SIG_BLOCK, &sigpipe_set, nullptr);
+
+			// install signal handler
+			struct sigaction sigaction_handler;
+			memset(&sigaction_handler, 0, sizeof(sigaction_handler));
+			sigaction_handler.sa_sigaction = &jit_runloop<P,T,J>::signal_handler;
+			sigaction_handler.sa_flags = SA_SIGINFO;
+			sigaction(SIGSEGV, &sigaction_handler, nullptr);
+			sigaction(SIGTERM, &sigaction_handler, nullptr);
+			sigaction(SIGQUIT, &sigaction_handler, nullptr);
+			sigaction(SIGINT, &sigaction_handler, nullptr);
+			sigaction(SIGHUP, &sigaction_handler, nullptr);
+			sigaction(SIGUSR1, &sigaction_handler, nullptr);
+			jit_singleton::current = this;
+
+			/* unblock signals */
+			if (pthread_sigmask(SIG_UNBLOCK, &set, NULL) != 0) {
+				panic("can't set thread signal mask: %s", strerror(errno));
+			}
+
+			/* processor initialization */
+			P::init();
+
+			/* reserve the code arena */
+			if (code_arena_size > 0) {
+				arena.create(code_arena_size, code_huge_pages, code_wx);
+			}
+			if (arena.is_open() && arena.wx && (code_cache_size == 0 || code_cache_size > arena.size)) {
+				/* the eviction clock keeps W^X code within the arena */
+				code_cache_size = arena.size;
+			}
+
+			/* create trace lookup and load store functions */
+			create_trace_lookup();
+			create_load_store();
+
+			/* translate blocks found ahead of time then traces saved by previous runs */
+			if (aotfile.filename.size() > 0) {
+				load_aot();
+			}
+			if (cachefile.filename.size() > 0) {
+				load_trace_cache();
+			}
+
+			/* report code cache statistics at exit */
+			if ((P::log & proc_log_jit_trap) && (P::log & (proc_log_exit_log_stats | proc_log_exit_save_stats))) {
+				atexit(exit_handler);
+			}
+
+			/* start background trace compiler */
+			if (async_compile) {
+				compile_thread = std::thread(&jit_runloop<P,T,J>::compile_loop, this);
+			}
+		}
+
+		void stop_compile_thread()
+		{
+			if (!compile_thread.joinable()) return;
+			{
+				std::lock_guard<std::mutex> lock(compile_lock);
+				compile_exit = true;
+			}
+			compile_cond.notify_one();
+			compile_thread.join();
+		}
+
+		void compile_loop()
+		{
+			block_async_signals();
+			std::unique_lock<std::mutex> lock(compile_lock);
+			for (;;) {
+				compile_cond.wait(lock, [&] { return compile_exit || compile_queue.size() > 0; });
+				if (compile_exit) break;
+				jit_compile_job job = std::move(compile_queue.front());
+				compile_queue.pop_front();
+				lock.unlock();
+
+				/* emit without the lock */
+				CodeHolder code;
+				jit_logger logger;
+				logger.addOptions(Logger::kOptionBinaryForm | Logger::kOptionHexDisplacement | Logger::kOptionHexImmediate);
+				code.init(rt.getCodeInfo());
+				code.setErrorHandler(this);
+				if (P::log & proc_log_jit_trace) {
+					code.setLogger(&logger);
+				}
+				jit_emitter emitter(*this, code, ops, lookup_trace_none, lookup_trace_fast);
+				u64 compile_start = host_cpu::get_instance().get_time_ns();
+				jit_emit(emitter, job.trace, job.pc);
+
+				lock.lock();
+				if (job.gen != compile_gen) continue; /* invalidated by fence.i */
+				/* code is copied into the arena when published */
+				jit_compile_result res;
+				TraceFunc fn = nullptr;
+				if (arena.is_open()) {
+					fn = (TraceFunc)arena.relocate(res.image, &code, true);
+				}
+				res.pc = job.pc;
+				res.ctx = job.ctx;
+				res.fn = fn;
+				if (!fn && (arena.wx || rt.add(&fn, &code))) {
+					/* no room, the publisher evicts and lets the trace become hot again */
+					res.data = nullptr;
+					compile_done.push_back(std::move(res));
+					compile_ready.store(true, std::memory_order_release);
+					continue;
+				}
+				union { intptr_t i; TraceFunc fn; } r = { .fn = fn };
+				res.fn = fn;
+				res.entry_addr = r.i + code.getLabelOffset(emitter.start);
+				res.size = code.getCodeSize();
+				for (auto &jfl : emitter.jmp_fixup_labels) {
+					for (auto &label : jfl.second) {
+						res.fixups.push_back(std::pair<addr_t,intptr_t>(jfl.first,
+							r.i + code.getLabelOffset(label)));
+					}
+				}
+				res.data = emitter.take_data();
+				for (auto offset : emitter.ic_sites) {
+					res.ic_sites.push_back(intptr_t(res.data + offset));
+				}
+				res.referenced = emitter.ref_mark ? res.data + emitter.ref_offset : nullptr;
+				res.exit_counts = emitter.exit_prof ? (u64*)(res.data + emitter.exit_counts_offset) : nullptr;
+				res.exit_pcs = emitter.exit_pcs;
+				for (auto &pl : emitter.pc_labels) {
+					res.pc_addrs.push_back(std::pair<addr_t,intptr_t>(pl.first, r.i + code.getLabelOffset(pl.second)));
+				}
+				res.trace = std::move(job.trace);
+				res.compile_ns = host_cpu::get_instance().get_time_ns() - compile_start;
+				compile_done.push_back(std::move(res));
+				compile_ready.store(true, std::memory_order_release);
+			}
+		}
+
+		void compile_publish()
+		{
+			jit_exclusive exclusive(*this);
+			std::lock_guard<std::mutex> lock(compile_lock);
+			compile_ready.store(false, std::memory_order_relaxed);
+			for (auto &res : compile_done) {
+				auto pi = std::find(compile_pending.begin(), compile_pending.end(), res.pc);
+				if (pi != compile_pending.end()) compile_pending.erase(pi);
+				if (!res.fn) {
+					hotspot_reset(res.pc);
+					code_cache_evict();
+					continue;
+				}
+				if (trace_cache_prolog.find(res.pc) != trace_cache_prolog.end()) {
+					auto ii = trace_info.find(res.pc);
+					if (ii == trace_info.end() || (ii->second.tier > 1 && ii->second.trace.size() >= res.trace.size())) {
+						jit_release(res.fn);
+						free(res.data);
+						continue;
+					}
+					remove_trace(res.pc); /* replaced by a grown trace tree or a promoted block */
+				}
+				if (res.image.size() > 0) {
+					arena.install((void*)res.fn, res.image);
+				}
+				/* the compile thread only emits optimized traces */
+				jit_install(res.pc, res.ctx, res.fn, res.entry_addr, res.size, res.fixups, res.ic_sites,
+					res.data, res.referenced, res.exit_counts, res.exit_pcs, res.trace, 2);
+				stat_compile(res.compile_ns);
+				if (perfmap.is_open()) {
+					perfmap.add_trace(res.pc ^ addr_t(res.ctx), func_address(res.fn), res.size, res.pc_addrs);
+				}
+				save_trace_cache(res.pc, res.trace);
+			}
+			compile_done.clear();
+		}
+
+		void create_trace_lookup()
+		{
+			CodeHolder code;
+			code.init(rt.getCodeInfo());
+			code.setErrorHandler(this);
+			jit_emitter emitter(*this, code, ops, lookup_trace, nullptr);
+			lookup_trace_fast = emitter.create_trace_lookup(rt);
+
+			CodeHolder ic_code;
+			ic_code.init(rt.getCodeInfo());
+			ic_code.setErrorHandler(this);
+			jit_emitter ic_emitter(*this, ic_code, ops, lookup_trace_site, nullptr);
+			lookup_trace_ic = ic_emitter.create_trace_lookup_ic(rt);
+		}
+
+		void create_load_store()
+		{
+			CodeHolder code;
+			code.init(rt.getCodeInfo());
+			code.setErrorHandler(this);
+			jit_emitter emitter(*this, code, ops, lookup_trace, nullptr);
+			ops = emitter.create_load_store(rt);
+		}
+
+		/* hash the guest code of a trace, false if it can't be read or no longer decodes as saved */
+		bool trace_code_hash(std::vector<typename P::decode_type> &trace, u32 &hash)
+		{
+			hash = 2166136261U;
+			for (auto &dec : trace) {
+				addr_t end = addr_t(dec.pc) + (dec.sz ? dec.sz : inst_length(dec.inst));
+				for (addr_t pc = addr_t(dec.pc); pc < end; ) {
+					typename P::ux pc_offset;
+					inst_t inst = 0;
+					if (jit_guard([&] { inst = P::mmu.inst_fetch(*this, pc, pc_offset); }) || pc_offset == 0) return false;
+					if (!dec.sz && inst != dec.inst) return false;
+					for (size_t i = 0; i < size_t(pc_offset); i++) {
+						hash = (hash ^ u8(inst >> (i << 3))) * 16777619U;
+					}
+					pc += pc_offset;
+				}
+			}
+			return true;
+		}
+
+		void save_trace_cache(addr_t pc, std::vector<typename P::decode_type> &trace)
+		{
+			u32 hash;
+			if (cachefile.is_open() && trace_code_hash(trace, hash)) {
+				cachefile.save(pc, trace, hash);
+			}
+		}
+
+		void load_trace_cache()
+		{
+			size_t stale = 0;
+			size_t count = cachefile.load([&](addr_t pc, std::vector<typename P::decode_type> &trace, u32 saved_hash) {
+				/* text patched at run time is translated again */
+				u32 hash;
+				if (!trace_code_hash(trace, hash) || hash != saved_hash) {
+					stale++;
+					return;
+				}
+				CodeHolder code;
+				code.init(rt.getCodeInfo());
+				code.setErrorHandler(this);
+				jit_emitter emitter(*this, code, ops, lookup_trace_none, lookup_trace_fast);
+				if (trace_cache_prolog.find(pc) != trace_cache_prolog.end()) {
+					/* trace trees are saved again each time they grow */
+					remove_trace(pc);
+				}
+				u64 compile_start = host_cpu::get_instance().get_time_ns();
+				jit_emit(emitter, trace, pc);
+				jit_cache(emitter, code, pc, P::trace_ctx, trace, 2);
+				stat_compile(host_cpu::get_instance().get_time_ns() - compile_start);
+			});
+			if (P::log & proc_log_jit_trace) {
+				printf("jit-cache-load  %s traces=%zu stale=%zu\n", cachefile.filename.c_str(), count - stale, stale);
+			}
+		}
+
+		void load_aot()
+		{
+			/* promote the blocks to traces when hot */
+			if (trace_tiers == jit_tier_traces) {
+				trace_tiers = jit_tier_tiered;
+			}
+			size_t count = aotfile.load([&](addr_t pc, std::vector<typename P::decode_type> &source, u32) {
+				aot_index[pc] = source;
+			}, false);
+			if (P::log & proc_log_jit_trace) {
+				printf("jit-aot-load    %s records=%zu blocks=%zu\n", aotfile.filename.c_str(), count, aot_index.size());
+			}
+		}
+
+		/* emit the sidecar block for pc, false if there is none or the code has changed */
+		bool aot_emit(addr_t pc)
+		{
+			auto ai = aot_index.find(pc);
+			if (ai == aot_index.end()) return false;
+			jit_exclusive exclusive(*this);
+			addr_t key = trace_key(pc);
+			if (trace_cache_prolog.find(key) != trace_cache_prolog.end()) return true;
+			for (auto &dec : ai->second) {
+				typename P::ux pc_offset;
+				inst_t inst = 0;
+				if (jit_guard([&] { inst = P::mmu.inst_fetch(*this, dec.pc, pc_offset); }) || inst != dec.inst) {
+					return false;
+				}
+			}
+
+			/* fuse and end the block as the tracer would when it is executed */
+			jit_tracer tracer(*this);
+			tracer.block = true;
+			tracer.begin();
+			for (auto dec : ai->second) {
+				if (tracer.emit(dec) == false) break;
+			}
+			tracer.end();
+			if (tracer.trace.size() == 0) return false;
+
+			CodeHolder code;
+			code.init(rt.getCodeInfo());
+			code.setErrorHandler(this);
+			jit_emitter emitter(*this, code, ops, lookup_trace_none, lookup_trace_fast);
+			u64 compile_start = host_cpu::get_instance().get_time_ns();
+			jit_emit(emitter, tracer.trace, key, 1);
+			jit_cache(emitter, code, key, P::trace_ctx, tracer.trace, 1);
+			stat_compile(host_cpu::get_instance().get_time_ns() - compile_start);
+			tier_blocks++;
+			aot_blocks++;
+			return trace_cache_prolog.find(key) != trace_cache_prolog.end();
+		}
+
+		void run(exit_cause ex = exit_cause_continue)
+		{
+			u32 logsave = P::log;
+			size_t count = inst_step;
+			for (;;) {
+				switch (ex) {
+					case exit_cause_continue:
+						break;
+					case exit_cause_cli:
+						P::debugging = true;
+						count = cli->run(this);
+						if (count == size_t(-1)) {
+							P::debugging = false;
+							P::log = logsave;
+							count = inst_step;
+						} else {
+							P::log |= (proc_log_inst | proc_log_operands | proc_log_trap);
+						}
+						break;
+					case exit_cause_poweroff:
+						if (threads.active && tid == abi_main_tid) {
+							/* guest threads stay parked while the process exits */
+							exclusive_begin();
+						}
+						return;
+				}
+				if (threads.active) {
+					thread_safepoint();
+				}
+				ex = step(count);
+				if (P::debugging && ex == exit_cause_continue) {
+					ex = exit_cause_cli;
+				}
+			}
+		}
+
+		typename P::ux inst_fence_i(typename P::decode_type &dec, typename P::ux pc_offset)
+		{
+			switch(dec.op) {
+				case rv_op_fence:
+					/* nop */
+					return pc_offset;
+				case rv_op_fence_i:
+					if (code_protect) {
+						invalidate_dirty_pages();
+					} else {
+						clear_trace_cache_prolog();
+					}
+					return pc_offset;
+				default: break;
+			}
+			return -1; /* illegal instruction */
+		}
+
+		void clear_trace_cache_prolog()
+		{
+			jit_exclusive exclusive(*this);
+			std::lock_guard<std::mutex> lock(compile_lock);
+			shared->flush_gen++;
+			for (auto ent : trace_cache_prolog) {
+				jit_release(ent.second);
+			}
+			for (auto &ent : trace_info) {
+				free(ent.second.data);
+			}
+			trace_cache_prolog.clear_no_resize();
+			trace_cache_entry.clear_no_resize();
+			jmp_fixup_addrs.clear();
+			jmp_link_addrs.clear();
+			trace_info.clear();
+			tree_exits.clear();
+			trace_clock.clear();
+			code_cache_used = 0;
+			clear_trace_tables();
+			clear_trace_rstack();
+			for (auto &pent : code_pages) {
+				unprotect_page(pent.first, pent.second);
+			}
+			code_pages.clear();
+			code_dirty = 0;
+			discard_compiles();
+		}
+
+		void discard_compiles()
+		{
+			/* discard queued and finished background compiles, called with compile_lock held */
+			for (auto &res : compile_done) {
+				if (res.fn) jit_release(res.fn);
+				free(res.data);
+			}
+			for (auto pc : compile_pending) {
+				hotspot_reset(pc);
+			}
+			compile_gen++;
+			compile_queue.clear();
+			compile_done.clear();
+			compile_pending.clear();
+			compile_ready.store(false, std::memory_order_relaxed);
+		}
+
+		static size_t pow2_ceil(size_t n)
+		{
+			size_t p = 1;
+			while (p < n) p <<= 1;
+			return p;
+		}
+
+		void alloc_trace_tables(size_t l1_size, size_t l2_size)
+		{
+			/* sizes are in entries, rounded up to powers of two */
+			size_t l1_ents = pow2_ceil(std::max(l1_size, size_t(1)));
+			size_t l2_sets = pow2_ceil(std::max(l2_size / P::trace_l2_ways, size_t(1)));
+			void *l1 = nullptr, *l2 = nullptr;
+			if (posix_memalign(&l1, 64, l1_ents * sizeof(u64) * 2) != 0 ||
+				posix_memalign(&l2, 64, l2_sets * sizeof(u64) * 2 * P::trace_l2_ways) != 0) {
+				panic("can't allocate trace lookup tables: %s", strerror(errno));
+			}
+			free(P::trace_l1);
+			free(P::trace_l2);
+			P::trace_l1 = (u64*)l1;
+			P::trace_l1_mask = l1_ents - 1;
+			P::trace_l2 = (u64*)l2;
+			P::trace_l2_mask = l2_sets - 1;
+			clear_trace_tables();
+
+			/* repopulate the L2 with installed traces */
+			for (auto &ent : trace_cache_entry) {
+				trace_table_insert(ent.first, func_address(ent.second));
+			}
+		}
+
+		void clear_trace_tables()
+		{
+			memset(P::trace_l1, 0, (P::trace_l1_mask + 1) * sizeof(u64) * 2);
+			memset(P::trace_l2, 0, (P::trace_l2_mask + 1) * sizeof(u64) * 2 * P::trace_l2_ways);
+		}
+
+		void clear_trace_tlb()
+		{
+			for (size_t i = 0; i < P::trace_tlb_size; i++) {
+				u64 *ent = P::trace_tlb + (i << 2);
+				ent[0] = ent[1] = u64(i ^ 1) << page_shift;
+				ent[2] = ent[3] = 0;
+			}
+		}
+
+		/* return stubs live in traces so the stack is emptied when any trace goes away */
+		void clear_trace_rstack()
+		{
+			for (size_t i = 0; i < P::trace_rstack_size; i++) {
+				P::trace_rstack[i << 1] = jit_ic_empty;
+				P::trace_rstack[(i << 1) + 1] = 0;
+			}
+			P::trace_rsp = 0;
+		}
+
+		/* flush the data TLB if the translation of data addresses may have changed */
+		void sync_trace_tlb(bool force)
+		{
+			u64 space = P::trace_space(), data_space = P::trace_data_space();
+			if (force || space != tlb_space || data_space != tlb_data_space) {
+				tlb_space = space;
+				tlb_data_space = data_space;
+				clear_trace_tlb();
+			}
+		}
+
+		/* called by the load store helpers after an access completes */
+		void fill_trace_tlb(addr_t va, bool store)
+		{
+			if (P::cause) return;
+			addr_t host = P::trace_data_page(va, store);
+			if (!host) return;
+			size_t i = (va >> page_shift) & (P::trace_tlb_size - 1);
+			u64 *ent = P::trace_tlb + (i << 2);
+			if (ent[2] != u64(host)) {
+				ent[store ? 0 : 1] = u64(i ^ 1) << page_shift;
+				ent[2] = host;
+			}
+			ent[store ? 1 : 0] = va & ~addr_t(page_size - 1);
+		}
+
+		u64* trace_l1_ent(addr_t pc)
+		{
+			return P::trace_l1 + (((u64(pc) >> 1) & P::trace_l1_mask) << 1);
+		}
+
+		u64* trace_l2_set(addr_t pc)
+		{
+			size_t set = ((u64(pc) * P::trace_l2_hash) >> P::trace_l2_shift) & P::trace_l2_mask;
+			return P::trace_l2 + set * P::trace_l2_ways * 2;
+		}
+
+		void trace_table_insert(addr_t pc, uintptr_t fn)
+		{
+			/* use a matching or empty way, otherwise evict round robin */
+			u64 *set = trace_l2_set(pc), *way = nullptr;
+			for (size_t i = 0; i < P::trace_l2_ways; i++) {
+				if (set[i << 1] == u64(pc)) {
+					way = set + (i << 1);
+					break;
+				}
+				if (!way && set[(i << 1) + 1] == 0) way = set + (i << 1);
+			}
+			if (!way) way = set + ((trace_l2_victim++ % P::trace_l2_ways) << 1);
+			way[0] = u64(pc);
+			way[1] = fn;
+		}
+
+		void trace_table_erase(addr_t pc)
+		{
+			u64 *ent = trace_l1_ent(pc);
+			if (ent[0] == u64(pc)) {
+				ent[0] = ent[1] = 0;
+			}
+			u64 *set = trace_l2_set(pc);
+			for (size_t i = 0; i < P::trace_l2_ways; i++) {
+				if (set[i << 1] == u64(pc)) {
+					set[i << 1] = set[(i << 1) + 1] = 0;
+				}
+			}
+		}
+
+		uintptr_t trace_table_find(addr_t pc)
+		{
+			u64 *ent = trace_l1_ent(pc);
+			if (ent[0] == u64(pc) && ent[1]) return ent[1];
+			u64 *set = trace_l2_set(pc);
+			for (size_t i = 0; i < P::trace_l2_ways; i++) {
+				if (set[i << 1] == u64(pc) && set[(i << 1) + 1]) return set[(i << 1) + 1];
+			}
+			return 0;
+		}
+
+		static uintptr_t lookup_trace(uintptr_t pc)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			auto ti = proc->trace_cache_entry.find(pc);
+			uintptr_t fn = func_address(ti != proc->trace_cache_entry.end() ? ti->second : nullptr);
+			proc->stat_lookup_calls++;
+			if (!fn) proc->stat_lookup_misses++;
+			if (fn && proc->threads.active) {
+				/* traces installed by other threads are only in their L2 */
+				proc->trace_table_insert(pc, fn);
+			}
+			return fn;
+		}
+
+		/* inline cache miss, the target pc is in the register file */
+		static uintptr_t lookup_trace_site(uintptr_t site)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			uintptr_t fn = lookup_trace(proc->trace_key(proc->pc));
+			if (fn && proc->ic_miss(reinterpret_cast<jit_ic_site*>(site), proc->pc, fn)) {
+				/* return to the emulator which replaces the way */
+				return 0;
+			}
+			return fn;
+		}
+
+		/* returns true when a filled way is to be replaced by ic_replace_pending */
+		bool ic_miss(jit_ic_site *site, addr_t pc, uintptr_t entry)
+		{
+			std::unique_lock<std::mutex> lock(shared->ic_lock, std::defer_lock);
+			if (threads.active) lock.lock();
+			for (size_t i = 0; i < jit_ic_ways; i++) {
+				if (site->ent[i].pc == jit_ic_empty) {
+					ic_set_way(site, i, pc, entry);
+					return false;
+				}
+			}
+			if (site->votes == 0) {
+				site->candidate = pc;
+				site->votes = 1;
+			} else if (site->candidate == u64(pc)) {
+				site->votes++;
+			} else {
+				site->votes--;
+			}
+			if (++site->misses < jit_ic_review) return false;
+			return ic_review(site);
+		}
+
+		bool ic_review(jit_ic_site *site)
+		{
+			size_t coldest = 0;
+			u64 hits = 0;
+			for (size_t i = 0; i < jit_ic_ways; i++) {
+				hits += site->hits[i];
+				if (site->hits[i] < site->hits[coldest]) coldest = i;
+			}
+
+			/* a missing target that outvotes the hits of the coldest way replaces it */
+			uintptr_t entry = 0;
+			if (site->votes >= jit_ic_review / 4 && site->votes > site->hits[coldest]) {
+				auto ti = trace_cache_entry.find(trace_key(site->candidate));
+				if (ti != trace_cache_entry.end()) entry = func_address(ti->second);
+			}
+
+			/* the cached targets are not worth the misses when none of them dominates */
+			if (!entry && hits < site->misses) {
+				site->miss = func_address(lookup_trace_fast);
+			}
+
+			addr_t pc = site->candidate;
+			for (auto &h : site->hits) h >>= 1;
+			site->misses = site->votes = 0;
+			if (!entry) return false;
+			if (threads.active) {
+				/* other threads may have compared the old pc and not yet loaded the entry */
+				ic_pending = jit_ic_pending{ site, coldest, pc, entry, shared->flush_gen.load() };
+				return true;
+			}
+			ic_set_way(site, coldest, pc, entry);
+			return false;
+		}
+
+		void ic_set_way(jit_ic_site *site, size_t way, addr_t pc, uintptr_t entry)
+		{
+			/* sites compare pc first so the entry is written before it */
+			site->ent[way].pc = jit_ic_empty;
+			std::atomic_signal_fence(std::memory_order_release);
+			site->ent[way].entry = entry;
+			site->hits[way] = 0;
+			std::atomic_signal_fence(std::memory_order_release);
+			site->ent[way].pc = pc;
+		}
+
+		void ic_replace_pending()
+		{
+			jit_exclusive exclusive(*this);
+			jit_ic_pending pending = ic_pending;
+			ic_pending.site = nullptr;
+			/* the site or its new target may be gone if traces were removed meanwhile */
+			if (shared->flush_gen.load() != pending.gen) return;
+			ic_set_way(pending.site, pending.way, pending.pc, pending.entry);
+		}
+
+		/* empty the ways of every installed site that enter a removed trace */
+		void ic_unlink(uintptr_t entry)
+		{
+			for (auto &ii : trace_info) {
+				for (auto site : ii.second.ic_sites) {
+					auto ic = reinterpret_cast<jit_ic_site*>(site);
+					for (size_t i = 0; i < jit_ic_ways; i++) {
+						if (ic->ent[i].entry == entry) {
+							ic->ent[i].pc = jit_ic_empty;
+							ic->ent[i].entry = 0;
+							ic->hits[i] = 0;
+						}
+					}
+				}
+			}
+		}
+
+		static uintptr_t lookup_trace_none(uintptr_t pc)
+		{
+			/* traces link with jump fixups so the links can be undone */
+			return 0;
+		}
+
+		static u8 mmu_lb(uintptr_t addr)
+		{
+			u8 val;
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template load<P,u8>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, false);
+			return val;
+		}
+
+		static u16 mmu_lh(uintptr_t addr)
+		{
+			u16 val;
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template load<P,u16>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, false);
+			return val;
+		}
+
+		static u32 mmu_lw(uintptr_t addr)
+		{
+			u32 val;
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template load<P,u32>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, false);
+			return val;
+		}
+
+		static u64 mmu_ld(uintptr_t addr)
+		{
+			u64 val;
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template load<P,u64>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, false);
+			return val;
+		}
+
+		static void mmu_sb(uintptr_t addr, u8 val)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template store<P,u8>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, true);
+		}
+
+		static void mmu_sh(uintptr_t addr, u16 val)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template store<P,u16>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, true);
+		}
+
+		static void mmu_sw(uintptr_t addr, u32 val)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template store<P,u32>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, true);
+		}
+
+		static void mmu_sd(uintptr_t addr, u64 val)
+		{
+			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			proc->mmu.template store<P,u64>(*proc, addr, val);
+			proc->fill_trace_tlb(addr, true);
+		}
+
+		void jit_patch(addr_t pc, intptr_t fixup_addr, intptr_t entry_addr)
+		{
+			jmp_link_addrs[pc].push_back(jit_link_ent{ fixup_addr, *(int*)(fixup_addr - 4) });
+			arena.store((void*)(fixup_addr - 4), (int)(entry_addr - fixup_addr));
+			stat_fixups++;
+		}
+
+		void jit_apply_fixups(addr_t pc, intptr_t entry_addr)
+		{
+			auto jfa = jmp_fixup_addrs.find(pc);
+			if (jfa != jmp_fixup_addrs.end()) {
+				for (auto fixup_addr : jfa->second) {
+					jit_patch(pc, fixup_addr, entry_addr);
+				}
+				jmp_fixup_addrs.erase(jfa);
+			}
+		}
+
+		void jit_install(addr_t pc, u64 ctx, TraceFunc fn, intptr_t entry_addr, size_t size,
+			std::vector<std::pair<addr_t,intptr_t>> &fixups, std::vector<intptr_t> &ic_sites,
+			u8 *data, u8 *referenced, u64 *exit_counts, std::vector<addr_t> &exit_pcs,
+			std::vector<typename P::decode_type> &trace, int tier)
+		{
+			union { intptr_t i; TraceFunc fn; } r = { .i = entry_addr };
+			for (auto &fixup : fixups) {
+				fixup.first ^= addr_t(ctx); /* jump targets are guest pcs */
+			}
+			trace_cache_prolog[pc] = fn;
+			trace_cache_entry[pc] = r.fn;
+			trace_table_insert(pc, entry_addr);
+			jit_apply_fixups(pc, entry_addr);
+
+			/* link jumps to existing traces, stash the rest until their target is translated */
+			for (auto &fixup : fixups) {
+				auto ti = trace_cache_entry.find(fixup.first);
+				if (ti != trace_cache_entry.end()) {
+					jit_patch(fixup.first, fixup.second, func_address(ti->second));
+				} else {
+					jmp_fixup_addrs[fixup.first].push_back(fixup.second);
+				}
+			}
+
+			auto &ent = trace_info[pc];
+			ent.size = size;
+			ent.ctx = ctx;
+			ent.referenced = referenced;
+			ent.fixups = fixups;
+			ent.ic_sites = ic_sites;
+			ent.tier = tier;
+			ent.data = data;
+			ent.exit_counts = exit_counts;
+			ent.exit_pcs = exit_pcs;
+			for (auto site : ic_sites) {
+				reinterpret_cast<jit_ic_site*>(site)->miss = func_address(lookup_trace_ic);
+			}
+			ent.pages = trace_pages(trace, ctx);
+			if (trace_trees && tier > 1) {
+				ent.trace = trace;
+				for (auto &fixup : fixups) {
+					tree_exits[fixup.first] = pc;
+				}
+			}
+			for (auto page : ent.pages) {
+				index_code_page(page, ctx, pc);
+			}
+			code_cache_used += size;
+			code_cache_peak = std::max(code_cache_peak, code_cache_used);
+			stat_traces++;
+			stat_bytes += size;
+
+			if (code_cache_size) {
+				trace_clock.push_back(pc);
+				while (code_cache_used > code_cache_size && trace_info.size() > 1) {
+					if (!code_cache_evict()) break;
+				}
+			}
+		}
+
+		Error jit_add(TraceFunc *fn, CodeHolder &code, bool hot)
+		{
+			if (arena.is_open()) {
+				/* W^X code has nowhere else to go, evict until the arena has room */
+				Error err;
+				while ((err = arena.add(fn, &code, hot)) != kErrorOk && arena.wx && code_cache_evict()) {}
+				if (err == kErrorOk || arena.wx) return err;
+			}
+			return rt.add(fn, &code);
+		}
+
+		void jit_release(TraceFunc fn)
+		{
+			if (arena.contains((void*)fn)) {
+				arena.release((void*)fn);
+			} else {
+				rt.release(fn);
+			}
+		}
+
+		void jit_cache(jit_emitter &emitter, CodeHolder &code, addr_t pc, u64 ctx,
+			std::vector<typename P::decode_type> &trace, int tier)
+		{
+			TraceFunc fn = nullptr;
+			size_t size = code.getCodeSize();
+			Error err = jit_add(&fn, code, tier > 1);
+			if (!err) {
+				intptr_t prolog_addr = func_address(fn);
+				intptr_t entry_addr = prolog_addr + code.getLabelOffset(emitter.start);
+				std::vector<std::pair<addr_t,intptr_t>> fixups;
+				for (auto &jfl : emitter.jmp_fixup_labels) {
+					for (auto &label : jfl.second) {
+						fixups.push_back(std::pair<addr_t,intptr_t>(jfl.first,
+							prolog_addr + code.getLabelOffset(label)));
+					}
+				}
+				u8 *data = emitter.take_data();
+				std::vector<intptr_t> ic_sites;
+				for (auto offset : emitter.ic_sites) {
+					ic_sites.push_back(intptr_t(data + offset));
+				}
+				u8 *referenced = emitter.ref_mark ? data + emitter.ref_offset : nullptr;
+				u64 *exit_counts = emitter.exit_prof ? (u64*)(data + emitter.exit_counts_offset) : nullptr;
+				jit_install(pc, ctx, fn, entry_addr, size, fixups, ic_sites,
+					data, referenced, exit_counts, emitter.exit_pcs, trace, tier);
+				if (perfmap.is_open()) {
+					std::vector<std::pair<addr_t,intptr_t>> pc_addrs;
+					for (auto &pl : emitter.pc_labels) {
+						pc_addrs.push_back(std::pair<addr_t,intptr_t>(pl.first, prolog_addr + code.getLabelOffset(pl.second)));
+					}
+					perfmap.add_trace(pc ^ addr_t(ctx), prolog_addr, size, pc_addrs);
+				}
+			}
+		}
+
+		bool code_cache_evict()
+		{
+			while (trace_clock.size() > 0) {
+				addr_t pc = trace_clock.front();
+				trace_clock.pop_front();
+				auto ii = trace_info.find(pc);
+				if (ii == trace_info.end()) continue;
+				u8 *referenced = ii->second.referenced;
+				if (referenced && __atomic_load_n(referenced, __ATOMIC_RELAXED)) {
+					__atomic_store_n(referenced, 0, __ATOMIC_RELAXED);
+					trace_clock.push_back(pc);
+					continue;
+				}
+				code_cache_evictions++;
+				code_cache_evicted_bytes += ii->second.size;
+				if (P::log & proc_log_jit_trace) {
+					printf("jit-evict       pc=0x%016llx size=%zu used=%zu\n",
+						(u64)pc, ii->second.size, code_cache_used - ii->second.size);
+				}
+				remove_trace(pc);
+				return true;
+			}
+			return false;
+		}
+
+		template <typename V, typename F>
+		static void erase_if(std::map<addr_t,V> &m, addr_t pc, F pred)
+		{
+			auto mi = m.find(pc);
+			if (mi == m.end()) return;
+			auto &v = mi->second;
+			v.erase(std::remove_if(v.begin(), v.end(), pred), v.end());
+			if (v.size() == 0) m.erase(mi);
+		}
+
+		void remove_trace(addr_t pc)
+		{
+			auto ii = trace_info.find(pc);
+			if (ii == trace_info.end()) return;
+			auto &ent = ii->second;
+			if (P::log & proc_log_jit_trace) {
+				log_exit_profile(pc, ent);
+			}
+			shared->flush_gen++;
+
+			/* point jumps from other traces back at their trampolines */
+			auto li = jmp_link_addrs.find(pc);
+			if (li != jmp_link_addrs.end()) {
+				for (auto &link : li->second) {
+					arena.store((void*)(link.site - 4), link.disp);
+					jmp_fixup_addrs[pc].push_back(link.site);
+				}
+				jmp_link_addrs.erase(li);
+			}
+
+			/* forget jump sites inside the removed code */
+			for (auto &fixup : ent.fixups) {
+				intptr_t site = fixup.second;
+				erase_if(jmp_fixup_addrs, fixup.first, [&](intptr_t s) { return s == site; });
+				erase_if(jmp_link_addrs, fixup.first, [&](jit_link_ent &l) { return l.site == site; });
+			}
+
+			/* remove the trace from the lookup tables and inline caches */
+			trace_table_erase(pc);
+			ic_unlink(func_address(trace_cache_entry[pc]));
+			clear_trace_rstack();
+			jit_release(trace_cache_prolog[pc]);
+			free(ent.data);
+			trace_cache_prolog.erase(pc);
+			trace_cache_entry.erase(pc);
+
+			/* drop the trace from the page index */
+			for (auto page : ent.pages) {
+				auto pi = code_pages.find(page);
+				if (pi == code_pages.end()) continue;
+				auto &traces = pi->second.traces;
+				traces.erase(std::remove(traces.begin(), traces.end(), pc), traces.end());
+				if (traces.size() == 0 && !pi->second.dirty) {
+					unprotect_page(page, pi->second);
+					code_pages.erase(pi);
+				}
+			}
+
+			/* let the trace and its segments become hot again */
+			hotspot_reset(pc);
+			for (auto &dec : ent.trace) {
+				if (dec.seg) hotspot_reset(dec.pc ^ addr_t(ent.ctx));
+			}
+
+			code_cache_used -= ent.size;
+			trace_info.erase(ii);
+		}
+
+		/* a write to the page drops the trace at pc */
+		void index_code_page(addr_t page, u64 ctx, addr_t pc)
+		{
+			auto &pent = code_pages[page];
+			if (pent.traces.size() == 0) {
+				pent.ctx = ctx;
+				pent.mpa = P::trace_code_page(page ^ addr_t(ctx), ctx);
+			}
+			pent.traces.push_back(pc);
+			protect_page(page, pent);
+		}
+
+		std::vector<addr_t> trace_pages(std::vector<typename P::decode_type> &trace, u64 ctx)
+		{
+			std::vector<addr_t> pages;
+			for (auto &dec : trace) {
+				addr_t len = dec.sz ? dec.sz : inst_length(dec.inst);
+				addr_t first = addr_t(dec.pc & page_mask), last = addr_t((dec.pc + len - 1) & page_mask);
+				for (addr_t page : { first ^ addr_t(ctx), last ^ addr_t(ctx) }) {
+					if (std::find(pages.begin(), pages.end(), page) == pages.end()) {
+						pages.push_back(page);
+					}
+				}
+			}
+			return pages;
+		}
+
+		bool in_text_segment(addr_t page)
+		{
+			for (auto &seg : text_segments) {
+				if (page >= seg.first && page + addr_t(page_size) <= seg.second) return true;
+			}
+			return false;
+		}
+
+		void protect_page(addr_t page, jit_page_ent &pent)
+		{
+			if (!code_protect || pent.prot || in_text_segment(page)) return;
+			if (mprotect((void*)page, page_size, PROT_READ) == 0) {
+				pent.prot = true;
+			}
+		}
+
+		void unprotect_page(addr_t page, jit_page_ent &pent)
+		{
+			if (!pent.prot) return;
+			mprotect((void*)page, page_size, PROT_READ | PROT_WRITE);
+			pent.prot = false;
+		}
+
+		/* called from the SIGSEGV handler, must not allocate */
+		bool code_write_fault(addr_t addr)
+		{
+			auto pi = code_pages.find(addr & page_mask);
+			if (pi == code_pages.end() || !pi->second.prot) return false;
+			unprotect_page(pi->first, pi->second);
+			pi->second.dirty = true;
+			code_dirty = 1;
+			return true;
+		}
+
+		/* drop traces on pages written since they were translated */
+		void invalidate_dirty_pages()
+		{
+			jit_exclusive exclusive(*this);
+			std::lock_guard<std::mutex> lock(compile_lock);
+			code_dirty = 0;
+			std::vector<addr_t> dirty;
+			for (auto &pent : code_pages) {
+				if (pent.second.dirty) dirty.push_back(pent.first);
+			}
+			invalidate_code_pages(dirty);
+		}
+
+		/* drop traces on pages whose physical page has changed */
+		void revalidate_code_pages()
+		{
+			jit_exclusive exclusive(*this);
+			std::lock_guard<std::mutex> lock(compile_lock);
+			std::vector<addr_t> stale;
+			for (auto &pent : code_pages) {
+				auto &ent = pent.second;
+				if (ent.traces.size() > 0 &&
+					P::trace_code_page(pent.first ^ addr_t(ent.ctx), ent.ctx) != ent.mpa)
+				{
+					stale.push_back(pent.first);
+				}
+			}
+			invalidate_code_pages(stale);
+		}
+
+		/* called with compile_lock held */
+		void invalidate_code_pages(std::vector<addr_t> &pages)
+		{
+			for (auto page : pages) {
+				std::vector<addr_t> traces = code_pages[page].traces;
+				for (auto pc : traces) {
+					remove_trace(pc);
+					code_invalidations++;
+					if (P::log & proc_log_jit_trace) {
+						printf("jit-invalidate  pc=0x%016llx page=0x%016llx\n", (u64)pc, (u64)page);
+					}
+				}
+				code_pages.erase(page);
+			}
+			if (pages.size() > 0) {
+				discard_compiles();
+			}
+		}
+
+		void print_code_cache_stats()
+		{
+			printf("\n");
+			printf("jit code cache\n");
+			printf("~~~~~~~~~~~~~~\n");
+			printf("limit          : %zu\n", code_cache_size);
+			printf("used           : %zu\n", code_cache_used);
+			printf("peak           : %zu\n", code_cache_peak);
+			printf("traces         : %zu\n", trace_info.size());
+			printf("evictions      : %zu\n", code_cache_evictions);
+			printf("evicted bytes  : %zu\n", code_cache_evicted_bytes);
+			printf("invalidations  : %zu\n", code_invalidations);
+			printf("tree segments  : %zu\n", trace_tree_segments);
+			printf("tier blocks    : %zu\n", tier_blocks);
+			printf("tier promotions: %zu\n", tier_promotions);
+			printf("aot blocks     : %zu\n", aot_blocks);
+			printf("retranslations : %zu\n", exit_retranslations);
+			if (threads.active) {
+				printf("guest threads  : %d\n", threads.next_tid - abi_main_tid);
+			}
+			print_jit_stats();
+			print_exit_hot_spots();
+			if (arena.is_open()) {
+				arena.print_stats();
+			}
+		}
+
+		void stat_compile(u64 ns)
+		{
+			stat_compiles++;
+			stat_compile_ns += ns;
+			stat_compile_max_ns = std::max(stat_compile_max_ns, ns);
+		}
+
+		struct jit_stat_ent
+		{
+			const char *key;                                 /* JSON name */
+			const char *label;                               /* printed name */
+			u64 value;
+		};
+
+		std::vector<jit_stat_ent> jit_stats()
+		{
+			u64 *ts = P::trace_stat;
+			return std::vector<jit_stat_ent>{
+				{ "traces_compiled",  "traces compiled", stat_traces },
+				{ "bytes_emitted",    "bytes emitted",   stat_bytes },
+				{ "compile_ns",       "compile ns",      stat_compile_ns },
+				{ "compile_mean_ns",  "compile mean ns", stat_compiles ? stat_compile_ns / stat_compiles : 0 },
+				{ "compile_max_ns",   "compile max ns",  stat_compile_max_ns },
+				{ "trace_entries",    "trace entries",   stat_trace_entries },
+				{ "lookups",          "lookups",         ts[P::trace_stat_lookups] },
+				{ "l1_hits",          "l1 hits",         ts[P::trace_stat_lookups] - ts[P::trace_stat_l1_misses] },
+				{ "l2_hits",          "l2 hits",         ts[P::trace_stat_l1_misses] - ts[P::trace_stat_l2_misses] },
+				{ "lookup_slow",      "lookup slow",     stat_lookup_calls },
+				{ "lookup_misses",    "lookup misses",   stat_lookup_misses },
+				{ "exit_tramp",       "exit tramp",      ts[P::trace_stat_exit_tramp] },
+				{ "jump_tramp",       "jump tramp",      ts[P::trace_stat_jmp_tramp] },
+				{ "trace_end",        "trace end",       ts[P::trace_stat_trace_end] },
+				{ "budget_exits",     "budget exits",    ts[P::trace_stat_budget] },
+				{ "trap_exits",       "trap exits",      stat_trap_exits },
+				{ "fixups",           "fixups",          stat_fixups },
+				{ "native_insts",     "native insts",    stat_native_insts },
+				{ "interp_insts",     "interp insts",    stat_interp_insts },
+				{ "native_calls",     "native calls",    native_calls() }
+			};
+		}
+
+		u64 native_calls()
+		{
+			u64 calls = 0;
+			for (auto &r : native.routines) calls += r.calls;
+			return calls;
+		}
+
+		static double stat_percent(u64 n, u64 d)
+		{
+			return d ? n * 100.0 / d : 0.0;
+		}
+
+		void print_jit_stats()
+		{
+			u64 *ts = P::trace_stat;
+			printf("\n");
+			printf("jit statistics\n");
+			printf("~~~~~~~~~~~~~~\n");
+			for (auto &ent : jit_stats()) {
+				printf("%-15s: %llu\n", ent.label, ent.value);
+			}
+			printf("l1 hit rate    : %.1f%%\n", stat_percent(ts[P::trace_stat_lookups] -
+				ts[P::trace_stat_l1_misses], ts[P::trace_stat_lookups]));
+			if (P::update_instret) {
+				printf("native share   : %.1f%%\n", stat_percent(stat_native_insts,
+					stat_native_insts + stat_interp_insts));
+			} else {
+				printf("native share   : n/a (needs update_instret)\n");
+			}
+			for (auto &r : native.routines) {
+				if (r.calls == 0) continue;
+				printf("native %-8s: %zu calls%s\n", r.name, r.calls, native.audit ?
+					format_string(", %zu mismatches", r.mismatches).c_str() : "");
+			}
+		}
+
+		void save_jit_stats()
+		{
+			u64 *ts = P::trace_stat;
+			std::string filename = P::stats_dirname + "/" + "jit-stats.json";
+			FILE *file = fopen(filename.c_str(), "w");
+			if (!file) {
+				debug("jit-stats: error: fopen: %s: %s", filename.c_str(), strerror(errno));
+				return;
+			}
+			fprintf(file, "{\n");
+			for (auto &ent : jit_stats()) {
+				fprintf(file, "\t\"%s\": %llu,\n", ent.key, ent.value);
+			}
+			fprintf(file, "\t\"l1_hit_rate\": %.3f,\n", stat_percent(ts[P::trace_stat_lookups] -
+				ts[P::trace_stat_l1_misses], ts[P::trace_stat_lookups]));
+			if (P::update_instret) {
+				fprintf(file, "\t\"native_share\": %.3f\n", stat_percent(stat_native_insts,
+					stat_native_insts + stat_interp_insts));
+			} else {
+				fprintf(file, "\t\"native_share\": null\n");
+			}
+			fprintf(file, "}\n");
+			fclose(file);
+		}
+
+		struct exit_hot_spot
+		{
+			addr_t trace_pc;
+			addr_t exit_pc;
+			u64 exits;
+			u64 entries;
+		};
+
+		void print_exit_hot_spots()
+		{
+			std::vector<exit_hot_spot> spots;
+			for (auto &ti : trace_info) {
+				auto &ent = ti.second;
+				if (!ent.exit_counts) continue;
+				for (size_t i = 0; i < ent.exit_pcs.size(); i++) {
+					if (ent.exit_counts[i + 1] == 0) continue;
+					spots.push_back(exit_hot_spot{ ti.first ^ addr_t(ent.ctx), ent.exit_pcs[i],
+						ent.exit_counts[i + 1], ent.exit_counts[0] });
+				}
+			}
+			if (spots.size() == 0) return;
+			std::sort(spots.begin(), spots.end(), [](const exit_hot_spot &a, const exit_hot_spot &b) {
+				return a.exits > b.exits;
+			});
+			if (spots.size() > exit_hot_spots) spots.resize(exit_hot_spots);
+			printf("\n");
+			printf("jit exit hot spots\n");
+			printf("~~~~~~~~~~~~~~~~~~\n");
+			for (auto &spot : spots) {
+				printf("trace=0x%016llx exit=0x%016llx exits=%-10llu entries=%-10llu ratio=%3llu%%\n",
+					(u64)spot.trace_pc, (u64)spot.exit_pc, spot.exits, spot.entries,
+					spot.entries ? spot.exits * 100 / spot.entries : 0);
+			}
+		}
+
+		void log_exit_profile(addr_t pc, jit_trace_ent &ent)
+		{
+			if (!ent.exit_counts || ent.exit_counts[0] == 0) return;
+			printf("jit-exits       pc=0x%016llx entries=%llu\n", (u64)(pc ^ addr_t(ent.ctx)), ent.exit_counts[0]);
+			for (size_t i = 0; i < ent.exit_pcs.size(); i++) {
+				if (ent.exit_counts[i + 1] == 0) continue;
+				printf("jit-exit        pc=0x%016llx exits=%llu\n", (u64)ent.exit_pcs[i], ent.exit_counts[i + 1]);
+			}
+		}
+
+		void exit_profile_check()
+		{
+			/* retranslate a trace that leaves through one exit on most entries */
+			jit_exclusive exclusive(*this);
+			addr_t key = addr_t(P::trace_exit_key);
+			P::trace_exit_key = 0;
+			auto ii = trace_info.find(key);
+			if (ii == trace_info.end() || !ii->second.exit_counts) return;
+			auto &ent = ii->second;
+			u64 entries = ent.exit_counts[0];
+			for (size_t i = 0; i < ent.exit_pcs.size(); i++) {
+				u64 exits = ent.exit_counts[i + 1];
+				if (exits * 100 < entries * u64(exit_ratio)) continue;
+				size_t &count = retranslations[key];
+				if (count >= retranslate_limit) return;
+				count++;
+				exit_retranslations++;
+				if (P::log & proc_log_jit_trace) {
+					printf("jit-retranslate pc=0x%016llx exit=0x%016llx exits=%llu entries=%llu\n",
+						(u64)(key ^ addr_t(ent.ctx)), (u64)ent.exit_pcs[i], exits, entries);
+				}
+				remove_trace(key);
+				return;
+			}
+		}
+
+		static void native_call(uintptr_t index)
+		{
+			static_cast<jit_runloop<P,T,J>*>(jit_singleton::current)->native_exec(index);
+		}
+
+		void native_exec(size_t index)
+		{
+			auto &r = native.routines[index];
+			r.calls++;
+			if (native.audit) {
+				native_audit(r);
+			} else {
+				native_run(r);
+			}
+		}
+
+		void native_run(jit_native_routine &r)
+		{
+			P::ireg[rv_ireg_a0].r.xu.val = typename P::ux(jit_native::call(r.op,
+				P::ireg[rv_ireg_a0].r.xu.val, P::ireg[rv_ireg_a1].r.xu.val, P::ireg[rv_ireg_a2].r.xu.val));
+		}
+
+		/* interpret the guest routine until it returns to ra with the same sp */
+		bool native_interp(jit_native_routine &r)
+		{
+			typename P::ux ra = P::ireg[rv_ireg_ra].r.xu.val, sp = P::ireg[rv_ireg_sp].r.xu.val;
+			P::pc = r.pc;
+			for (size_t n = 0; n < native_audit_limit; n++) {
+				if (P::pc == ra && P::ireg[rv_ireg_sp].r.xu.val == sp) return true;
+				typename P::decode_type dec;
+				typename P::ux pc_offset, new_offset;
+				inst_t inst = 0;
+				if (jit_guard([&] { inst = P::mmu.inst_fetch(*this, P::pc, pc_offset); })) return false;
+				P::inst_decode(dec, inst);
+				if (jit_guard([&] { new_offset = P::inst_exec(dec, pc_offset); })) return false;
+				if (new_offset == typename P::ux(-1)) return false;
+				P::pc += new_offset;
+			}
+			return false;
+		}
+
+		/* run the guest routine then the host routine on the same inputs and compare */
+		void native_audit(jit_native_routine &r)
+		{
+			typename P::ux regs[P::ireg_count];
+			for (size_t i = 0; i < P::ireg_count; i++) {
+				regs[i] = P::ireg[i].r.xu.val;
+			}
+			typename P::ux pc = P::pc;
+			u64 instret = P::instret;
+			u8 *dst = (u8*)addr_t(regs[rv_ireg_a0]);
+			std::vector<u8> before(jit_native::write_size(r.op, regs[rv_ireg_a2]));
+			memcpy(before.data(), dst, before.size());
+
+			bool returned = native_interp(r);
+			typename P::ux guest_a0 = P::ireg[rv_ireg_a0].r.xu.val;
+			std::vector<u8> guest_mem(dst, dst + before.size());
+
+			for (size_t i = 0; i < P::ireg_count; i++) {
+				P::ireg[i].r.xu.val = regs[i];
+			}
+			P::pc = pc;
+			P::instret = instret;
+			memcpy(dst, before.data(), before.size());
+			native_run(r);
+
+			typename P::ux host_a0 = P::ireg[rv_ireg_a0].r.xu.val;
+			if (!returned) {
+				printf("ERROR native-%s pc=0x%016llx guest routine did not return\n", r.name, (u64)r.pc);
+				r.mismatches++;
+			} else if (!jit_native::result_match(r.op, s64(typename P::sx(guest_a0)), s64(typename P::sx(host_a0))) ||
+				memcmp(guest_mem.data(), dst, guest_mem.size()) != 0)
+			{
+				printf("ERROR native-%s pc=0x%016llx guest-a0=0x%016llx host-a0=0x%016llx memory=%s\n",
+					r.name, (u64)r.pc, (u64)guest_a0, (u64)host_a0,
+					memcmp(guest_mem.data(), dst, guest_mem.size()) ? "differs" : "matches");
+				r.mismatches++;
+			}
+		}
+
+		static void exit_handler()
+		{
+			/* the exiting thread keeps the others parked while their counters are added */
+			auto *current = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
+			auto *proc = current->shared->primary ?
+				static_cast<jit_runloop<P,T,J>*>(current->shared->primary) : current;
+			{
+				std::lock_guard<std::mutex> guard(proc->threads.lock);
+				for (auto *clone : proc->shared->clones) {
+					static_cast<jit_runloop<P,T,J>*>(clone)->fold_thread_stats(*proc);
+				}
+			}
+			if (proc->log & proc_log_exit_log_stats) {
+				proc->print_code_cache_stats();
+			}
+			if (proc->log & proc_log_exit_save_stats) {
+				proc->save_jit_stats();
+			}
+		}
+
+		/*
+		 * LR is interpreted here so lr_val is the value it loaded. Loading
+		 * again after the LR would let another thread's store in between
+		 * and a later SC would compare and exchange against the new value.
+		 */
+		typename P::ux jit_load_reserved(typename P::decode_type &dec, typename P::ux pc_offset)
+		{
+			switch (dec.op) {
+				case rv_op_lr_w: {
+					s32 t;
+					P::lr = P::ireg[dec.rs1];
+					P::mmu.template load<P,s32>(*this, P::ireg[dec.rs1], t);
+					P::lr_val = t;
+					if (dec.rd != 0) P::ireg[dec.rd] = t;
+					return pc_offset;
+				}
+				case rv_op_lr_d: {
+					s64 t;
+					P::lr = P::ireg[dec.rs1];
+					P::mmu.template load<P,s64>(*this, P::ireg[dec.rs1], t);
+					P::lr_val = t;
+					if (dec.rd != 0) P::ireg[dec.rd] = t;
+					return pc_offset;
+				}
+				default:
+					return -1;
+			}
+		}
+
+		void jit_setrm()
+		{
+			/* translated FP code uses the host rounding mode set from fcsr.frm */
+			int frm = (P::fcsr >> 5) & 0b111;
+			if (frm != jit_frm) {
+				fenv_setrm(frm);
+				jit_frm = frm;
+			}
+		}
+
+		bool hotspot_count(addr_t pc, u64 threshold)
+		{
+			u16 &count = hot_counts[(u64(pc) >> 1) & (hot_count_size - 1)];
+			if (count < std::numeric_limits<u16>::max()) count++;
+			if (count < std::min(threshold, u64(std::numeric_limits<u16>::max()))) return false;
+			if (hot_skip.size() > 0 && hot_skip.find(pc) != hot_skip.end()) return false;
+			count = 0;
+			return true;
+		}
+
+		void hotspot_skip(addr_t pc)
+		{
+			hot_skip[pc] = true;
+		}
+
+		void hotspot_reset(addr_t pc)
+		{
+			hot_skip.erase(pc);
+			hot_counts[(u64(pc) >> 1) & (hot_count_size - 1)] = 0;
+		}
+
+		/* library routines are translated as host calls on their first call */
+		bool native_entry(addr_t pc)
+		{
+			return native.entries.size() > 0 && native.entries.find(pc) != native.entries.end();
+		}
+
+		int hotspot_tier(addr_t pc)
+		{
+			/* side exits of optimized traces grow their tree, other targets start as blocks */
+			if (trace_tiers == jit_tier_traces || (trace_tiers == jit_tier_tiered && tree_root(pc) != pc)) return 2;
+			return 1;
+		}
+
+		addr_t trace_key(addr_t pc)
+		{
+			return pc ^ addr_t(P::trace_ctx);
+		}
+
+		bool jit_exec(P &proc, addr_t key)
+		{
+			auto ti = trace_cache_prolog.find(key);
+			if (ti != trace_cache_prolog.end()) {
+				jit_setrm();
+				u64 instret = P::instret;
+				stat_trace_entries++;
+				stat_in_trace = true;
+				if (P::trace_mmu) {
+					/* faults set cause and return from the trace at the faulting pc */
+					bool exceptions = P::exceptions;
+					P::exceptions = false;
+					ti->second(static_cast<typename P::processor_type *>(&proc));
+					P::exceptions = exceptions;
+				} else {
+					ti->second(static_cast<typename P::processor_type *>(&proc));
+				}
+				stat_in_trace = false;
+				stat_native_insts += P::instret - instret;
+				if (ic_pending.site) {
+					ic_replace_pending();
+				}
+				return true;
+			}
+			return false;
+		}
+
+		template <typename F>
+		int jit_guard(F fn)
+		{
+			/* catch a fault raised by fn, returns the setjmp cause or zero */
+			jmp_buf env;
+			int cause;
+			memcpy(env, P::env, sizeof(jmp_buf));
+			if ((cause = setjmp(P::env)) == 0) {
+				fn();
+			}
+			memcpy(P::env, env, sizeof(jmp_buf));
+			return cause;
+		}
+
+		typename P::ux jit_inst_priv(typename P::decode_type &dec, typename P::ux pc_offset)
 		{
-			static_cast<jit_runloop<P,T,J>*>
-				(jit_singleton::current)->signal_dispatch(signum, info);
+			/* guest threads make their own system calls */
+			if (proxy_threads && dec.op == rv_op_ecall) {
+				return jit_syscall(dec, pc_offset);
+			}
+
+			/* traces on remapped code pages are dropped when the address space changes */
+			u64 space = P::trace_space();
+			typename P::ux new_offset = P::inst_priv(dec, pc_offset);
+			if (new_offset != typename P::ux(-1) &&
+				(dec.op == rv_op_sfence_vm || P::trace_space() != space))
+			{
+				revalidate_code_pages();
+			}
+			if (new_offset != typename P::ux(-1)) {
+				sync_trace_tlb(dec.op == rv_op_sfence_vm);
+			}
+			return new_offset;
 		}
 
-		void signal_dispatch(int signum, siginfo_t *info)
+		/* trace_stop is zeroed by a thread stopping the others */
+		u64 budget_stop()
 		{
-			printf("SIGNAL   :%s pc:0x%0llx si_addr:0x%0llx\n",
-				signal_name(signum), (addr_t)P::pc, (addr_t)info->si_addr);
-
-			/* let the processor longjmp */
-			P::signal(signum, info);
+			return __atomic_load_n(&this->trace_stop, __ATOMIC_RELAXED);
 		}
 
-		void init()
+		static void block_async_signals()
 		{
-			// block signals before so we don't deadlock in signal handlers
+			/* asynchronous signals are taken by the first guest thread */
 			sigset_t set;
 			sigemptyset(&set);
-			sigaddset(&set, SIGSEGV);
 			sigaddset(&set, SIGTERM);
 			sigaddset(&set, SIGQUIT);
 			sigaddset(&set, SIGINT);
@@ -97,227 +2121,402 @@ namespace riscv {
 			if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
 				panic("can't set thread signal mask: %s", strerror(errno));
 			}
+		}
 
-			// disable unwanted signals
-			sigset_t sigpipe_set;
-			sigemptyset(&sigpipe_set);
-			sigaddset(&sigpipe_set, SIGPIPE);
-			sigprocmask(SIG_BLOCK, &sigpipe_set, nullptr);
-
-			// install signal handler
-			struct sigaction sigaction_handler;
-			memset(&sigaction_handler, 0, sizeof(sigaction_handler));
-			sigaction_handler.sa_sigaction = &jit_runloop<P,T,J>::signal_handler;
-			sigaction_handler.sa_flags = SA_SIGINFO;
-			sigaction(SIGSEGV, &sigaction_handler, nullptr);
-			sigaction(SIGTERM, &sigaction_handler, nullptr);
-			sigaction(SIGQUIT, &sigaction_handler, nullptr);
-			sigaction(SIGINT, &sigaction_handler, nullptr);
-			sigaction(SIGHUP, &sigaction_handler, nullptr);
-			sigaction(SIGUSR1, &sigaction_handler, nullptr);
-			jit_singleton::current = this;
-
-			/* unblock signals */
-			if (pthread_sigmask(SIG_UNBLOCK, &set, NULL) != 0) {
-				panic("can't set thread signal mask: %s", strerror(errno));
-			}
-
-			/* processor initialization */
-			P::init();
-
-			/* create trace lookup and load store functions */
-			create_trace_lookup();
-			create_load_store();
+		/* exclusive sections nest and park the other guest threads */
+		void exclusive_begin()
+		{
+			if (exclusive_depth++ > 0 || !threads.active) return;
+			threads.stop_begin();
+			exclusive_stopped = true;
+			sync_thread_tables();
 		}
 
-		void create_trace_lookup()
+		void exclusive_end()
 		{
-			CodeHolder code;
-			code.init(rt.getCodeInfo());
-			code.setErrorHandler(this);
-			jit_emitter emitter(*this, code, ops, lookup_trace, nullptr);
-			lookup_trace_fast = emitter.create_trace_lookup(rt);
+			if (--exclusive_depth > 0 || !exclusive_stopped) return;
+			exclusive_stopped = false;
+			threads.stop_end();
 		}
 
-		void create_load_store()
+		/* lookup tables and return stubs may point into traces removed by another thread */
+		void sync_thread_tables()
 		{
-			CodeHolder code;
-			code.init(rt.getCodeInfo());
-			code.setErrorHandler(this);
-			jit_emitter emitter(*this, code, ops, lookup_trace, nullptr);
-			ops = emitter.create_load_store(rt);
+			u64 gen = shared->flush_gen.load(std::memory_order_acquire);
+			if (flush_seen == gen) return;
+			flush_seen = gen;
+			clear_trace_tables();
+			clear_trace_rstack();
 		}
 
-		void run(exit_cause ex = exit_cause_continue)
+		void thread_safepoint()
 		{
-			u32 logsave = P::log;
-			size_t count = inst_step;
-			for (;;) {
-				switch (ex) {
-					case exit_cause_continue:
-						break;
-					case exit_cause_cli:
-						P::debugging = true;
-						count = cli->run(this);
-						if (count == size_t(-1)) {
-							P::debugging = false;
-							P::log = logsave;
-							count = inst_step;
-						} else {
-							P::log |= (proc_log_inst | proc_log_operands | proc_log_trap);
-						}
-						break;
-					case exit_cause_poweroff:
-						return;
-				}
-				ex = step(count);
-				if (P::debugging && ex == exit_cause_continue) {
-					ex = exit_cause_cli;
-				}
-			}
+			threads.safepoint();
+			sync_thread_tables();
 		}
 
-		typename P::ux inst_fence_i(typename P::decode_type &dec, typename P::ux pc_offset)
+		typename P::ux jit_syscall(typename P::decode_type &dec, typename P::ux pc_offset)
 		{
-			switch(dec.op) {
-				case rv_op_fence:
-					/* nop */
-					return pc_offset;
-				case rv_op_fence_i:
-					clear_trace_cache_prolog();
-					return pc_offset;
-				default: break;
+			s64 ret;
+			switch (P::ireg[rv_ireg_a7].r.xu.val) {
+				case abi_syscall_clone:
+					ret = thread_clone(pc_offset);
+					break;
+				case abi_syscall_futex:
+					ret = thread_futex();
+					break;
+				case abi_syscall_set_tid_address:
+					clear_tid = addr_t(P::ireg[rv_ireg_a0].r.xu.val);
+					ret = tid;
+					break;
+				case abi_syscall_gettid:
+					ret = tid;
+					break;
+				case abi_syscall_mprotect:
+					return thread_mprotect(dec, pc_offset);
+				case abi_syscall_exit:
+				case abi_syscall_exit_group:
+					if (P::ireg[rv_ireg_a7].r.xu.val == abi_syscall_exit && tid != abi_main_tid) {
+						/* other threads leave the process running */
+						thread_exited = true;
+						P::raise(P::internal_cause_poweroff, P::pc);
+					}
+					/* other threads stay parked while the process exits */
+					exclusive_begin();
+					return P::inst_priv(dec, pc_offset);
+				default:
+					return thread_syscall(dec, pc_offset);
 			}
-			return -1; /* illegal instruction */
+			P::ireg[rv_ireg_a0].r.xu.val = typename P::ux(ret);
+			return pc_offset;
 		}
 
-		void clear_trace_cache_prolog()
+		/* proxy system calls may block so the thread leaves the running set */
+		typename P::ux thread_syscall(typename P::decode_type &dec, typename P::ux pc_offset)
 		{
-			for (auto ent : trace_cache_prolog) {
-				rt.release(ent.second);
+			if (!threads.active) {
+				return P::inst_priv(dec, pc_offset);
 			}
-			trace_cache_prolog.clear_no_resize();
-			trace_cache_entry.clear_no_resize();
+			typename P::ux new_offset;
+			threads.leave();
+			switch (P::ireg[rv_ireg_a7].r.xu.val) {
+				case abi_syscall_brk:
+				case abi_syscall_munmap:
+				case abi_syscall_mmap:
+				case abi_syscall_mprotect:
+				case abi_syscall_madvise: {
+					/* the proxy memory map is shared */
+					std::lock_guard<std::mutex> lock(shared->syscall_lock);
+					new_offset = P::inst_priv(dec, pc_offset);
+					break;
+				}
+				default:
+					new_offset = P::inst_priv(dec, pc_offset);
+					break;
+			}
+			threads.enter();
+			sync_thread_tables();
+			return new_offset;
 		}
 
-		static uintptr_t lookup_trace(uintptr_t pc)
+		/*
+		 * A guest mprotect adding write permission lifts the protection on
+		 * translated code pages, so their traces are dropped before any
+		 * thread can write. Other threads stay parked until they are.
+		 */
+		typename P::ux thread_mprotect(typename P::decode_type &dec, typename P::ux pc_offset)
 		{
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			auto ti = proc->trace_cache_entry.find(pc);
-			uintptr_t fn = func_address(ti != proc->trace_cache_entry.end() ? ti->second : nullptr);
-			return fn;
+			addr_t start = addr_t(P::ireg[rv_ireg_a0].r.xu.val) & page_mask;
+			addr_t end = addr_t(P::ireg[rv_ireg_a0].r.xu.val + P::ireg[rv_ireg_a1].r.xu.val);
+			bool writable = (P::ireg[rv_ireg_a2].r.xu.val & abi_mmap_PROT_WRITE) != 0;
+			jit_exclusive exclusive(*this);
+			std::lock_guard<std::mutex> syscall(shared->syscall_lock);
+			std::lock_guard<std::mutex> lock(compile_lock);
+			typename P::ux new_offset = P::inst_priv(dec, pc_offset);
+			if (!writable || typename P::sx(P::ireg[rv_ireg_a0].r.xu.val) < 0) {
+				return new_offset;
+			}
+			std::vector<addr_t> pages;
+			for (auto pi = code_pages.lower_bound(start); pi != code_pages.end() && pi->first < end; pi++) {
+				pages.push_back(pi->first);
+			}
+			invalidate_code_pages(pages);
+			return new_offset;
 		}
 
-		static u8 mmu_lb(uintptr_t addr)
+		void thread_activate()
 		{
-			u8 val;
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template load<P,u8>(*proc, addr, val);
-			return val;
+			tid = threads.add(&this->trace_stop);
+			shared->primary = this;
+			threads.active = true;
+			if (!P::trace_budget) {
+				/* translated code without budget checks can not be stopped */
+				P::trace_budget = true;
+				clear_trace_cache_prolog();
+			}
 		}
 
-		static u16 mmu_lh(uintptr_t addr)
+		s64 thread_clone(typename P::ux pc_offset)
 		{
-			u16 val;
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template load<P,u16>(*proc, addr, val);
-			return val;
+			u64 flags = P::ireg[rv_ireg_a0].r.xu.val;
+			addr_t sp = addr_t(P::ireg[rv_ireg_a1].r.xu.val);
+			addr_t ptid = addr_t(P::ireg[rv_ireg_a2].r.xu.val);
+			addr_t tls = addr_t(P::ireg[rv_ireg_a3].r.xu.val);
+			addr_t ctid = addr_t(P::ireg[rv_ireg_a4].r.xu.val);
+
+			/* only threads sharing this address space, not processes */
+			if ((flags & (CLONE_VM | CLONE_THREAD)) != (CLONE_VM | CLONE_THREAD) ||
+				!std::is_copy_constructible<P>::value)
+			{
+				return -ENOSYS;
+			}
+			if (!threads.active) {
+				thread_activate();
+			}
+
+			/* the child returns zero from clone on its own stack */
+			auto *child = thread_create();
+			child->pc = P::pc + pc_offset;
+			child->ireg[rv_ireg_a0] = 0;
+			if (sp) child->ireg[rv_ireg_sp] = sp;
+			if (flags & CLONE_SETTLS) child->ireg[rv_ireg_tp] = tls;
+			if (flags & CLONE_CHILD_CLEARTID) child->clear_tid = ctid;
+			int child_tid = child->tid = threads.add(&child->trace_stop);
+			{
+				std::lock_guard<std::mutex> guard(threads.lock);
+				shared->clones.insert(child);
+			}
+			if (flags & CLONE_PARENT_SETTID) *(s32*)ptid = child_tid;
+			if (flags & CLONE_CHILD_SETTID) *(s32*)ctid = child_tid;
+			if (P::log & proc_log_jit_trace) {
+				printf("jit-thread      tid=%d pc=0x%016llx sp=0x%016llx\n",
+					child_tid, (u64)child->pc, (u64)sp);
+			}
+			std::thread(&jit_runloop<P,T,J>::thread_main, child).detach();
+			return child_tid;
 		}
 
-		static u32 mmu_lw(uintptr_t addr)
+		/* processors holding devices can not be copied and run one thread */
+		template <typename Q = P>
+		typename std::enable_if<std::is_copy_constructible<Q>::value, jit_runloop<P,T,J>*>::type thread_create()
 		{
-			u32 val;
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template load<P,u32>(*proc, addr, val);
-			return val;
+			return new jit_runloop<P,T,J>(*this);
 		}
 
-		static u64 mmu_ld(uintptr_t addr)
+		template <typename Q = P>
+		typename std::enable_if<!std::is_copy_constructible<Q>::value, jit_runloop<P,T,J>*>::type thread_create()
 		{
-			u64 val;
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template load<P,u64>(*proc, addr, val);
-			return val;
+			panic("jit-thread: processor state can not be copied");
+			return nullptr;
 		}
 
-		static void mmu_sb(uintptr_t addr, u8 val)
+		s64 thread_futex()
 		{
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template store<P,u8>(*proc, addr, val);
+			struct { typename P::long_t tv_sec, tv_nsec; } *abi_ts;
+			struct timespec ts, *timeout = nullptr;
+			addr_t uaddr = addr_t(P::ireg[rv_ireg_a0].r.xu.val);
+			int op = int(P::ireg[rv_ireg_a1].r.xu.val);
+			u32 val = u32(P::ireg[rv_ireg_a2].r.xu.val);
+			addr_t arg = addr_t(P::ireg[rv_ireg_a3].r.xu.val);
+			addr_t uaddr2 = addr_t(P::ireg[rv_ireg_a4].r.xu.val);
+			u32 val3 = u32(P::ireg[rv_ireg_a5].r.xu.val);
+			switch (op & FUTEX_CMD_MASK) {
+				case FUTEX_WAIT:
+				case FUTEX_WAIT_BITSET:
+					if (arg) {
+						abi_ts = decltype(abi_ts)(arg);
+						ts.tv_sec = abi_ts->tv_sec;
+						ts.tv_nsec = abi_ts->tv_nsec;
+						timeout = &ts;
+					}
+					break;
+				case FUTEX_WAKE:
+				case FUTEX_WAKE_BITSET:
+				case FUTEX_REQUEUE:
+				case FUTEX_CMP_REQUEUE:
+				case FUTEX_WAKE_OP:
+					/* the count of threads to requeue is passed as the timeout */
+					timeout = (struct timespec*)arg;
+					break;
+				default:
+					/* priority inheritance futexes hold host thread ids */
+					return -ENOSYS;
+			}
+			if (threads.active) threads.leave();
+			long ret = syscall(SYS_futex, (void*)uaddr, op, val, timeout, (void*)uaddr2, val3);
+			int err = errno;
+			if (threads.active) {
+				threads.enter();
+				sync_thread_tables();
+			}
+			return ret < 0 ? -err : ret;
 		}
 
-		static void mmu_sh(uintptr_t addr, u16 val)
+		void thread_main()
 		{
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template store<P,u16>(*proc, addr, val);
+			jit_singleton::current = this;
+			block_async_signals();
+			run();
+
+			/* a trap in a guest thread ends the process as it would the first thread */
+			if (!thread_exited) {
+				exclusive_begin();
+				::exit(1);
+			}
+			thread_exit();
+			delete this;
 		}
 
-		static void mmu_sw(uintptr_t addr, u32 val)
+		/* move the counters of a cloned thread to proc so they are counted once */
+		void fold_thread_stats(jit_runloop<P,T,J> &proc)
 		{
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template store<P,u32>(*proc, addr, val);
+			proc.stat_lookup_calls += stat_lookup_calls;
+			proc.stat_lookup_misses += stat_lookup_misses;
+			proc.stat_trace_entries += stat_trace_entries;
+			proc.stat_trap_exits += stat_trap_exits;
+			proc.stat_native_insts += stat_native_insts;
+			proc.stat_interp_insts += stat_interp_insts;
+			stat_lookup_calls = stat_lookup_misses = stat_trace_entries = 0;
+			stat_trap_exits = stat_native_insts = stat_interp_insts = 0;
+			for (size_t i = 0; i < P::trace_stat_count; i++) {
+				proc.trace_stat[i] += P::trace_stat[i];
+				P::trace_stat[i] = 0;
+			}
 		}
 
-		static void mmu_sd(uintptr_t addr, u64 val)
+		void thread_exit()
 		{
-			auto *proc = static_cast<jit_runloop<P,T,J>*>(jit_singleton::current);
-			proc->mmu.template store<P,u64>(*proc, addr, val);
+			/* add the counters of this thread to the first thread's */
+			{
+				jit_exclusive exclusive(*this);
+				std::lock_guard<std::mutex> guard(threads.lock);
+				fold_thread_stats(*static_cast<jit_runloop<P,T,J>*>(shared->primary));
+				shared->clones.erase(this);
+			}
+
+			/* wake a thread joining this one */
+			if (clear_tid) {
+				__atomic_store_n((s32*)clear_tid, 0, __ATOMIC_SEQ_CST);
+				syscall(SYS_futex, (void*)clear_tid, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+				syscall(SYS_futex, (void*)clear_tid, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+			}
+			if (P::log & proc_log_jit_trace) {
+				printf("jit-thread-exit tid=%d\n", tid);
+			}
+			threads.remove(tid);
 		}
 
-		void jit_apply_fixups(jit_emitter &emitter, addr_t pc, intptr_t entry_addr)
+		/*
+		 * The interpreter stores conditionally with a plain store, another
+		 * thread's store between LR and SC must make the SC fail as it does
+		 * in translated code which compares and exchanges with lr_val.
+		 */
+		typename P::ux jit_store_conditional(typename P::decode_type &dec, typename P::ux pc_offset)
 		{
-			auto jfa = jmp_fixup_addrs.find(pc);
-			if (jfa != jmp_fixup_addrs.end()) {
-				for (auto fixup_addr : jfa->second) {
-					*(int*)(fixup_addr - 4) = (int)(entry_addr - fixup_addr);
+			if ((dec.op != rv_op_sc_w && dec.op != rv_op_sc_d) || !threads.active) return -1;
+			bool stored = false;
+			if (typename P::ux(P::lr) == P::ireg[dec.rs1].r.xu.val) {
+				if (dec.op == rv_op_sc_w) {
+					s32 expected = s32(P::lr_val);
+					stored = __atomic_compare_exchange_n((s32*)addr_t(P::lr), &expected,
+						s32(P::ireg[dec.rs2].r.w.val), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				} else {
+					s64 expected = s64(P::lr_val);
+					stored = __atomic_compare_exchange_n((s64*)addr_t(P::lr), &expected,
+						s64(P::ireg[dec.rs2].r.xu.val), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 				}
-				jmp_fixup_addrs.erase(jfa);
 			}
+			if (dec.rd != 0) P::ireg[dec.rd] = stored ? 0 : 1;
+			return pc_offset;
 		}
 
-		void jit_stash_fixups(jit_emitter &emitter, CodeHolder &code, intptr_t prolog_addr)
+		void jit_emit(jit_emitter &emitter, std::vector<typename P::decode_type> &source, addr_t key, int tier = 2)
 		{
-			for (auto &jfl : emitter.jmp_fixup_labels) {
-				addr_t fixup_pc = jfl.first;
-				for (auto &label : jfl.second) {
-					auto jfa = jmp_fixup_addrs.find(fixup_pc);
-					if (jfa == jmp_fixup_addrs.end()) {
-						jfa = jmp_fixup_addrs.insert(jmp_fixup_addrs.end(),
-							std::pair<addr_t,std::vector<intptr_t>>(fixup_pc, std::vector<intptr_t>()));
-					}
-					jfa->second.push_back(prolog_addr + code.getLabelOffset(label));
+			/* baseline blocks link their exit and count entries until promoted */
+			bool optimize = trace_opt && tier > 1;
+			if (tier == 1) {
+				emitter.link_term = true;
+				if (trace_tiers == jit_tier_tiered) {
+					emitter.tier_iters = u32(P::trace_iters);
 				}
 			}
-		}
 
-		void jit_cache(jit_emitter &emitter, CodeHolder &code, addr_t pc)
-		{
-			TraceFunc fn = nullptr;
-			Error err = rt.add(&fn, &code);
-			if (!err) {
-				union { intptr_t i; TraceFunc fn; } r = { .fn = fn };
-				intptr_t prolog_addr = r.i;
-				r.i += code.getLabelOffset(emitter.start);
-				intptr_t entry_addr = r.i;
-				trace_cache_prolog[pc] = fn;
-				trace_cache_entry[pc] = r.fn;
-				jit_apply_fixups(emitter, pc, entry_addr);
-				jit_stash_fixups(emitter, code, prolog_addr);
+			/* traces ended by a call to a library routine link to the routine stub */
+			if (source.size() > 0) {
+				auto &last = source.back();
+				if ((last.op == rv_op_jal || last.op == jit_op_call) && native_entry(last.pc + last.imm)) {
+					emitter.link_term = true;
+				}
+			}
+
+			/* traces mark themselves referenced on entry for the eviction sweep */
+			emitter.ref_mark = code_cache_size > 0;
+
+			/* optimized traces count their exits for the statistics and retranslation */
+			if (tier > 1 && (exit_ratio > 0 || (P::log & (proc_log_jit_trace | proc_log_exit_log_stats)))) {
+				emitter.exit_prof = true;
+				emitter.exit_check = exit_ratio > 0;
+				emitter.exit_key = key;
+			}
+
+			/* optimize a copy so the recorded trace can still grow and be saved */
+			std::vector<typename P::decode_type> opt_trace;
+			if (optimize) {
+				/* repeated loads through the MMU may read device registers */
+				jit_optimizer<P> opt(!emitter.use_mmu);
+				opt_trace = source;
+				/* hoisted instructions would be counted twice by instret */
+				opt.optimize(opt_trace, !P::update_instret);
+				if (P::log & proc_log_jit_trace) {
+					printf("jit-optimize    folded=%zu copies=%zu cse=%zu rle=%zu dead=%zu hoisted=%zu\n",
+						opt.folded, opt.copies, opt.cse, opt.rle, opt.dead, opt.hoisted);
+				}
+			}
+			auto &trace = optimize ? opt_trace : source;
+			emitter.alloc_regs(trace);
+			emitter.label_segments(trace);
+			emitter.label_calls(trace);
+			emitter.pc_map = perfmap.is_open();
+			emitter.emit_prolog();
+			emitter.begin();
+			for (auto &dec : trace) {
+				emitter.mark_pc(dec.pc);
+				emitter.emit(dec);
 			}
+			emitter.end();
+			emitter.emit_epilog();
 		}
 
-		bool jit_exec(P &proc, addr_t pc)
+		addr_t tree_root(addr_t pc)
 		{
-			auto ti = trace_cache_prolog.find(pc);
-			if (ti != trace_cache_prolog.end()) {
-				ti->second(static_cast<typename P::processor_type *>(&proc));
-				return true;
+			/* find a trace with a side exit to pc that can still grow */
+			if (!trace_trees) return pc;
+			auto ei = tree_exits.find(pc);
+			if (ei == tree_exits.end()) return pc;
+			auto ii = trace_info.find(ei->second);
+			if (ii == trace_info.end() || ii->second.trace.size() >= trace_tree_limit ||
+				std::find(compile_pending.begin(), compile_pending.end(), ei->second) != compile_pending.end())
+			{
+				return pc;
 			}
-			return false;
+			for (auto &fixup : ii->second.fixups) {
+				if (fixup.first == pc) return ei->second;
+			}
+			return pc;
 		}
 
-		void jit_trace()
+		int jit_trace(int tier)
 		{
+			/* other threads stay parked while the trace is recorded and installed */
+			jit_exclusive exclusive(*this);
+			if (threads.active) {
+				/* another thread may have translated pc while this one waited */
+				addr_t pc_key = trace_key(P::pc);
+				auto ii = trace_info.find(pc_key);
+				if ((ii != trace_info.end() && ii->second.tier >= tier) ||
+					hot_skip.find(pc_key) != hot_skip.end()) return 0;
+			}
+
 			CodeHolder code;
 			jit_logger logger;
 			logger.addOptions(Logger::kOptionBinaryForm | Logger::kOptionHexDisplacement | Logger::kOptionHexImmediate);
@@ -325,47 +2524,74 @@ namespace riscv {
 			code.setErrorHandler(this);
 
 			jit_tracer tracer(*this);
-			jit_emitter emitter(*this, code, ops, lookup_trace, lookup_trace_fast);
+			jit_emitter emitter(*this, code, ops, lookup_trace_none, lookup_trace_fast);
+			tracer.block = (tier == 1);
+			tracer.native_entries = &native.entries;
+
+			/* recognised libc routines call the host implementation */
+			ssize_t routine = native.find(P::pc);
+			if (routine >= 0) {
+				jit_native_trace(size_t(routine));
+				return 0;
+			}
 
+			/* baseline blocks are always emitted on the guest thread */
+			bool queue = async_compile && tier > 1;
 			typename P::ux trace_pc = P::pc;
 			typename P::ux trace_instret = P::instret;
+			u64 trace_ctx = P::trace_ctx;
+			addr_t key = trace_key(trace_pc);
+			addr_t unit_key = tree_root(key);
 
 			/* log start of trace */
 			if (P::log & proc_log_jit_trace) {
 				if (P::xlen == 32) {
-					printf("jit-trace-begin pc=0x%08x\n", (u32)P::pc);
+					printf("jit-trace-begin pc=0x%08x tier=%d\n", (u32)P::pc, tier);
 				} else if (P::xlen == 64) {
-					printf("jit-trace-begin pc=0x%016llx\n", (u64)P::pc);
+					printf("jit-trace-begin pc=0x%016llx tier=%d\n", (u64)P::pc, tier);
+				}
+				if (unit_key != key) {
+					printf("jit-tree-grow   pc=0x%016llx root=0x%016llx\n", (u64)trace_pc, (u64)(unit_key ^ trace_ctx));
 				}
 	 			code.setLogger(&logger);
 			}
 
-			/* trace code and accumlate trace buffer */
+			/* grow the trace tree rooted at unit_key from this side exit */
+			if (unit_key != key) {
+				tracer.begin_segment(trace_info[unit_key].trace);
+			}
+
+			/* trace code and accumlate trace buffer, a fault ends the trace */
+			int fault = 0;
 			P::log &= ~proc_log_jit_trap;
 			tracer.begin();
 			for(;;) {
 				typename P::decode_type dec;
 				typename P::ux pc_offset, new_offset;
-				inst_t inst = P::mmu.inst_fetch(*this, P::pc, pc_offset);
+				inst_t inst = 0;
+				if ((fault = jit_guard([&] { inst = P::mmu.inst_fetch(*this, P::pc, pc_offset); }))) break;
 				P::inst_decode(dec, inst);
 				dec.pc = P::pc;
 				dec.inst = inst;
 				if (tracer.emit(dec) == false) break;
-				if ((new_offset = P::inst_exec(dec, pc_offset)) == typename P::ux(-1)) break;
+				if ((fault = jit_guard([&] {
+					if ((new_offset = jit_load_reserved(dec, pc_offset)) == typename P::ux(-1)) {
+						new_offset = P::inst_exec(dec, pc_offset);
+					}
+				}))) break;
+				if (new_offset == typename P::ux(-1)) break;
 				P::pc += new_offset;
 				P::instret++;
 			}
 			tracer.end();
 			P::log |= proc_log_jit_trap;
+			stat_interp_insts += P::instret - trace_instret;
 
-			/* emit trace buffer as native code */
-			emitter.emit_prolog();
-			emitter.begin();
-			for (auto &dec : tracer.trace) {
-				emitter.emit(dec);
+			/* emit trace buffer as native code unless queued for the compile thread */
+			u64 compile_start = host_cpu::get_instance().get_time_ns();
+			if (!queue) {
+				jit_emit(emitter, tracer.trace, unit_key, tier);
 			}
-			emitter.end();
-			emitter.emit_epilog();
 
 			/* log end of trace */
 			if (P::log & proc_log_jit_trace) {
@@ -376,11 +2602,95 @@ namespace riscv {
 				}
 			}
 
+			/* a fault on the first instruction is taken and the pc traced again */
 			if (P::instret == trace_instret) {
-				P::histogram_set_pc(trace_pc, P::hostspot_trace_skip);
+				if (!fault) hotspot_skip(key);
+			}
+			else if (queue) {
+				hotspot_skip(key);
+				compile_pending.push_back(unit_key);
+				for (auto page : trace_pages(tracer.trace, trace_ctx)) {
+					protect_page(page, code_pages[page]);
+				}
+				if (unit_key != key) {
+					trace_tree_segments++;
+				}
+				{
+					std::lock_guard<std::mutex> lock(compile_lock);
+					compile_queue.push_back(jit_compile_job{ unit_key, trace_ctx, compile_gen, std::move(tracer.trace) });
+				}
+				compile_cond.notify_one();
 			}
 			else {
-				jit_cache(emitter, code, trace_pc);
+				/* a grown tree or a promoted block replaces the previous code */
+				remove_trace(unit_key);
+				if (unit_key != key) {
+					trace_tree_segments++;
+				}
+				jit_cache(emitter, code, unit_key, trace_ctx, tracer.trace, tier);
+				stat_compile(host_cpu::get_instance().get_time_ns() - compile_start);
+				if (tier == 1) {
+					tier_blocks++;
+				} else {
+					save_trace_cache(unit_key, tracer.trace);
+				}
+			}
+			return fault;
+		}
+
+		void jit_native_trace(size_t index)
+		{
+			CodeHolder code;
+			jit_logger logger;
+			logger.addOptions(Logger::kOptionBinaryForm | Logger::kOptionHexDisplacement | Logger::kOptionHexImmediate);
+			code.init(rt.getCodeInfo());
+			code.setErrorHandler(this);
+			auto &r = native.routines[index];
+			if (P::log & proc_log_jit_trace) {
+				printf("jit-native      pc=0x%016llx %s\n", (u64)r.pc, r.name);
+				code.setLogger(&logger);
+			}
+
+			/* call the routine then return to ra as the guest routine would */
+			std::vector<typename P::decode_type> trace(2);
+			trace[0].pc = trace[1].pc = r.pc;
+			trace[0].op = jit_op_native;
+			trace[0].rd = trace[0].rs1 = rv_ireg_a0;
+			trace[0].rs2 = rv_ireg_a1;
+			trace[0].rs3 = rv_ireg_a2;
+			trace[0].imm = s32(index);
+			trace[1].op = rv_op_jalr;
+			trace[1].inst = 0x00008067; /* jalr zero, 0(ra) */
+			trace[1].rs1 = rv_ireg_ra;
+
+			jit_emitter emitter(*this, code, ops, lookup_trace_none, lookup_trace_fast);
+			emitter.native_call = func_address(native_call);
+			emitter.alloc_regs(trace);
+			emitter.ref_mark = code_cache_size > 0;
+			emitter.pc_map = perfmap.is_open();
+			u64 compile_start = host_cpu::get_instance().get_time_ns();
+			emitter.emit_prolog();
+			emitter.begin();
+			for (auto &dec : trace) {
+				emitter.mark_pc(dec.pc);
+				emitter.emit(dec);
+			}
+			emitter.end();
+			emitter.emit_epilog();
+			addr_t key = trace_key(r.pc);
+			remove_trace(key);
+			jit_cache(emitter, code, key, P::trace_ctx, trace, 2);
+			stat_compile(host_cpu::get_instance().get_time_ns() - compile_start);
+
+			/* the trace only covers the entry, a write anywhere in the routine drops it */
+			auto ii = trace_info.find(key);
+			if (ii == trace_info.end()) return;
+			auto &pages = ii->second.pages;
+			for (addr_t page = addr_t(r.pc) & page_mask; page < addr_t(r.pc + r.size); page += page_size) {
+				addr_t cpage = page ^ addr_t(P::trace_ctx);
+				if (std::find(pages.begin(), pages.end(), cpage) != pages.end()) continue;
+				pages.push_back(cpage);
+				index_code_page(cpage, P::trace_ctx, key);
 			}
 		}
 
@@ -416,6 +2726,7 @@ namespace riscv {
 			auto ti = audit_trace_cache_prolog.find(P::pc);
 			if (ti != audit_trace_cache_prolog.end()) {
 				copy_reg(&pre_jit, this);
+				jit_setrm();
 				ti->second(static_cast<typename P::processor_type *>(this));
 				copy_reg(&post_jit, this);
 				copy_reg(this, &pre_jit);
@@ -434,10 +2745,13 @@ namespace riscv {
 					Error err = rt.add(&fn, &code);
 					if (!err) {
 						copy_reg(&pre_jit, this);
+						jit_setrm();
 						fn(static_cast<typename P::processor_type*>(this));
 						copy_reg(&post_jit, this);
 						copy_reg(this, &pre_jit);
 						audited = true;
+						/* audit code is never released so neither is its data */
+						emitter.take_data();
 						audit_trace_cache_prolog[P::pc] = fn;
 					}
 				}
@@ -445,7 +2759,8 @@ namespace riscv {
 
 			/* interpret instruction */
 			typename P::ux new_offset;
-			if ((new_offset = P::inst_exec(dec, pc_offset)) != typename P::ux(-1) ||
+			if ((new_offset = jit_load_reserved(dec, pc_offset)) != typename P::ux(-1) ||
+				(new_offset = P::inst_exec(dec, pc_offset)) != typename P::ux(-1) ||
 				(new_offset = P::inst_priv(dec, pc_offset)) != typename P::ux(-1))
 			{
 				if (P::log) P::print_log(dec, inst);
@@ -472,6 +2787,14 @@ namespace riscv {
 						}
 					}
 				}
+				for (size_t i = 0; i < P::freg_count; i++) {
+					if (post_jit.freg[i].r.xu.val != P::freg[i].r.xu.val) {
+						pass = false;
+						printf("ERROR interp-%s=0x%016llx jit-%s=0x%016llx\n",
+							rv_freg_name_sym[i], (u64)P::freg[i].r.xu.val,
+							rv_freg_name_sym[i], (u64)post_jit.freg[i].r.xu.val);
+					}
+				}
 				if (post_jit.pc != P::pc) {
 					if (P::xlen == 32) {
 						printf("ERROR interp-pc=0x%08x jit-pc=0x%08x\n",
@@ -491,18 +2814,24 @@ namespace riscv {
 		exit_cause step(size_t count)
 		{
 			typename P::decode_type dec;
-			typename P::ux inststop = P::instret + count;
+			u64 inststop = P::instret + count;
 			typename P::ux pc_offset, new_offset;
 			inst_t inst = 0, inst_cache_key;
 
 			/* interrupt service routine */
 			P::time = cpu_cycle_clock();
 			P::isr();
+			sync_trace_tlb(false);
 
 			/* trap return path */
 			int cause;
 			if (unlikely((cause = setjmp(P::env)) > 0)) {
 				cause -= P::internal_cause_offset;
+				if (stat_in_trace) {
+					/* raised by a helper called from translated code */
+					stat_in_trace = false;
+					stat_trap_exits++;
+				}
 				switch(cause) {
 					case P::internal_cause_cli:
 						return exit_cause_cli;
@@ -512,19 +2841,76 @@ namespace riscv {
 						return exit_cause_poweroff;
 					case P::internal_cause_poweroff:
 						return exit_cause_poweroff;
-					case P::internal_cause_hotspot:
-						jit_trace();
-						return exit_cause_continue;
 				}
 				P::trap(dec, cause);
+				sync_trace_tlb(false);
 				if (!P::running) return exit_cause_poweroff;
+				hot_target = true;
 			}
 
-			/* step the processor */
-			while (P::instret != inststop) {
-				if ((P::log & proc_log_jit_trap) && jit_exec(*this, P::pc)) {
-					continue;
+			/* step the processor, traces return when the budget is spent */
+			P::trace_stop = inststop;
+			while (P::instret < budget_stop()) {
+				if (async_compile && compile_ready.load(std::memory_order_acquire)) {
+					compile_publish();
+				}
+				if (code_dirty) {
+					invalidate_dirty_pages();
+				}
+				if (unlikely(stat_dump)) {
+					stat_dump = 0;
+					print_code_cache_stats();
+				}
+				if (P::log & proc_log_jit_trap) {
+					u64 ctx = P::trace_context();
+					if (ctx != P::trace_ctx) {
+						/* return stubs belong to traces of the previous context */
+						P::trace_ctx = ctx;
+						clear_trace_rstack();
+					}
+					addr_t key = trace_key(P::pc);
+					if (jit_exec(*this, key)) {
+						hot_target = true;
+						if (unlikely(P::cause != 0)) {
+							/* take the fault recorded by translated code */
+							stat_trap_exits++;
+							cause = P::cause;
+							P::cause = 0;
+							dec = typename P::decode_type();
+							P::raise(cause, P::badaddr);
+						}
+						if (unlikely(P::trace_exit_key)) {
+							exit_profile_check();
+						}
+						if (unlikely(P::trace_tier_up)) {
+							/* a baseline block ran hot, replace it with an optimized trace */
+							P::trace_tier_up = 0;
+							if (hot_skip.find(key) == hot_skip.end()) {
+								hot_target = false;
+								tier_promotions++;
+								if ((cause = jit_trace(2)) > 0) {
+									dec = typename P::decode_type();
+									longjmp(P::env, cause);
+								}
+								return exit_cause_continue;
+							}
+						}
+						continue;
+					}
+					if (hot_target && aot_index.size() > 0 && aot_emit(P::pc)) {
+						continue;
+					}
+					int tier = hot_target ? hotspot_tier(key) : 0;
+					if (tier && hotspot_count(key, tier == 1 || native_entry(P::pc) ? 1 : P::trace_iters)) {
+						hot_target = false;
+						if ((cause = jit_trace(tier)) > 0) {
+							dec = typename P::decode_type();
+							longjmp(P::env, cause);
+						}
+						return exit_cause_continue;
+					}
 				}
+				hot_target = false;
 				if (P::pc == P::breakpoint && P::breakpoint != 0) {
 					return exit_cause_cli;
 				}
@@ -540,13 +2926,17 @@ namespace riscv {
 				if (P::log & proc_log_jit_audit) {
 					jit_audit(dec, inst, pc_offset);
 				}
-				else if ((new_offset = P::inst_exec(dec, pc_offset)) != typename P::ux(-1) ||
+				else if ((new_offset = jit_store_conditional(dec, pc_offset)) != typename P::ux(-1) ||
+						 (new_offset = jit_load_reserved(dec, pc_offset)) != typename P::ux(-1) ||
+						 (new_offset = P::inst_exec(dec, pc_offset)) != typename P::ux(-1) ||
 						 (new_offset = inst_fence_i(dec, pc_offset)) != typename P::ux(-1) ||
-						 (new_offset = P::inst_priv(dec, pc_offset)) != typename P::ux(-1))
+						 (new_offset = jit_inst_priv(dec, pc_offset)) != typename P::ux(-1))
 				{
 					if (P::log & ~(proc_log_hist_pc | proc_log_jit_trap)) P::print_log(dec, inst);
+					hot_target = (new_offset != pc_offset);
 					P::pc += new_offset;
 					P::instret++;
+					stat_interp_insts++;
 				} else {
 					P::raise(rv_cause_illegal_instruction, P::pc);
 				}
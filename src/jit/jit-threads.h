@@ -0,0 +1,106 @@
+//
+//  jit-threads.h
+//
+
+#ifndef rv_jit_threads_h
+#define rv_jit_threads_h
+
+namespace riscv {
+
+	/*
+	 * Guest threads
+	 *
+	 * Each guest thread runs on its own host thread with its own
+	 * processor state. Translated code and the trace maps are shared
+	 * and are only modified while every other guest thread is parked:
+	 * a thread that compiles, publishes or removes traces stops the
+	 * others by setting their trace_stop to zero, which makes
+	 * translated code return at its next budget check and the step
+	 * loop return to a safepoint. Threads blocked in host system calls
+	 * leave the running set so they never hold up a stop.
+	 */
+
+	struct jit_threads
+	{
+		std::mutex lock;
+		std::condition_variable cond;
+		std::map<int,u64*> stops;                  /* trace_stop of each guest thread */
+		std::atomic<bool> active;                  /* a guest thread has been cloned */
+		std::atomic<bool> stopping;                /* a thread wants the others parked */
+		int running;                               /* threads that are not parked */
+		int next_tid;
+
+		jit_threads() : active(false), stopping(false), running(1), next_tid(abi_main_tid + 1) {}
+
+		/* register a thread, it counts as running until its first safepoint */
+		int add(u64 *stop)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			int tid = stops.size() == 0 ? abi_main_tid : next_tid++;
+			stops[tid] = stop;
+			if (tid != abi_main_tid) running++;
+			return tid;
+		}
+
+		void remove(int tid)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stops.erase(tid);
+			running--;
+			cond.notify_all();
+		}
+
+		/* park while another thread has the world stopped */
+		void safepoint()
+		{
+			if (!stopping.load(std::memory_order_acquire)) return;
+			std::unique_lock<std::mutex> guard(lock);
+			running--;
+			cond.notify_all();
+			cond.wait(guard, [&] { return !stopping; });
+			running++;
+		}
+
+		/* called around host system calls that may block */
+		void leave()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running--;
+			cond.notify_all();
+		}
+
+		void enter()
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [&] { return !stopping; });
+			running++;
+		}
+
+		/* wait for every other thread to park, stops are repeated until they have */
+		void stop_begin()
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			running--;
+			cond.notify_all();
+			cond.wait(guard, [&] { return !stopping; });
+			stopping = true;
+			while (running > 0) {
+				for (auto &ent : stops) {
+					__atomic_store_n(ent.second, 0, __ATOMIC_RELAXED);
+				}
+				cond.wait_for(guard, std::chrono::milliseconds(1));
+			}
+		}
+
+		void stop_end()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = false;
+			running++;
+			cond.notify_all();
+		}
+	};
+
+}
+
+#endif
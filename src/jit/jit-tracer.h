@@ -18,9 +18,12 @@ namespace riscv {
 		std::vector<addr_t> callstack;
 		std::vector<decode_type> trace;
 		size_t inst_num;
+		size_t seg_start;
+		bool block;
+		const std::map<addr_t,size_t> *native_entries;
 
 		jit_tracer(P &proc)
-			: proc(proc), inst_num(0) {}
+			: proc(proc), inst_num(0), seg_start(0), block(false), native_entries(nullptr) {}
 
 		bool supported_op(decode_type &dec)
 		{
@@ -30,12 +33,41 @@ namespace riscv {
 
 		void begin() {}
 
-		void end() {}
+		/* calls to host library routines end the trace and link to the routine stub */
+		bool native_target(addr_t pc)
+		{
+			return native_entries && native_entries->find(pc) != native_entries->end();
+		}
+
+		void end()
+		{
+			/* label the entry of a trace tree segment */
+			if (seg_start > 0 && trace.size() > seg_start) {
+				trace[seg_start].seg = true;
+				trace[seg_start].brt = true;
+			}
+		}
+
+		void begin_segment(std::vector<decode_type> &unit)
+		{
+			/* grow an existing trace from one of its side exits */
+			trace = unit;
+			labels.clear();
+			for (size_t i = 0; i < trace.size(); i++) {
+				labels[trace[i].pc] = i;
+			}
+			inst_num = trace.size();
+			seg_start = trace.size();
+			callstack.clear();
+		}
 
+		/* in block mode the trace ends after its first control transfer */
 		bool emit(decode_type &dec)
 		{
 			auto li = labels.find(dec.pc);
 			if (li != labels.end()) {
+				/* loops and segments rejoin the trace with a direct jump */
+				trace[li->second].brt = true;
 				return false;
 			}
 			labels[dec.pc] = inst_num++;
@@ -47,7 +79,7 @@ namespace riscv {
 					addr_t link_addr = dec.pc + dec.sz;
 					callstack.push_back(link_addr);
 					trace.push_back(dec);
-					return true;
+					return !block && !native_target(dec.pc + dec.imm);
 				}
 				case rv_op_jal: {
 					/* follow jump */
@@ -56,7 +88,7 @@ namespace riscv {
 						callstack.push_back(link_addr);
 					}
 					trace.push_back(dec);
-					return true;
+					return !block && !native_target(dec.pc + dec.imm);
 				}
 				case rv_op_jalr: {
 					if (dec.rd == rv_ireg_zero && dec.rs1 == rv_ireg_ra && callstack.size() > 0) {
@@ -113,7 +145,19 @@ namespace riscv {
 					if (branch_i != labels.end()) trace[branch_i->second].brt = true;
 					if (cont_i != labels.end()) trace[cont_i->second].brt = true;
 					trace.push_back(dec);
-					return true;
+					return !block;
+				}
+				case jit_op_slt_bnez:
+				case jit_op_slt_beqz:
+				case jit_op_sltu_bnez:
+				case jit_op_sltu_beqz: {
+					/* label basic blocks of fused compare and branch */
+					auto branch_i = labels.find(dec.pc + dec.imm);
+					auto cont_i = labels.find(dec.pc + dec.sz);
+					if (branch_i != labels.end()) trace[branch_i->second].brt = true;
+					if (cont_i != labels.end()) trace[cont_i->second].brt = true;
+					trace.push_back(dec);
+					return !block;
 				}
 				default: {
 					/* save supported instruction */
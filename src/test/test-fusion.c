@@ -1,5 +1,13 @@
 #include <stdio.h>
 
+#if __riscv_xlen == 64
+#define LOAD "ld"
+#define STORE "sd"
+#else
+#define LOAD "lw"
+#define STORE "sw"
+#endif
+
 size_t add(size_t a, size_t b)
 {
 	return a + b;
@@ -8,6 +16,7 @@ size_t add(size_t a, size_t b)
 int main()
 {
 	size_t total = 0;
+	size_t pair[2] = { 0, 0 };
 	for (size_t i = 0; i < 1000; i++) {
 #if defined (MACRO_FUSION)
 		__asm__ __volatile__(
@@ -40,6 +49,136 @@ int main()
 			: "=r"(total)
 			: "r"(total), "r"(i)
 		);
+#elif defined (MACRO_LI)
+		__asm__ __volatile__(
+			"	lui t0, %%hi(0x12345678)\n"
+			"	addi t0, t0, %%lo(0x12345678)\n"
+			"	add %0, %1, t0\n"
+			: "=r"(total)
+			: "r"(total)
+			: "t0"
+		);
+#elif defined (MACRO_LI_SLLI)
+		__asm__ __volatile__(
+			"	lui t0, 0x12345\n"
+			"	addi t0, t0, 0x678\n"
+			"	slli t0, t0, 12\n"
+			"	add %0, %1, t0\n"
+			: "=r"(total)
+			: "r"(total)
+			: "t0"
+		);
+#elif defined (MACRO_SLT_BRANCH)
+		__asm__ __volatile__(
+			"	mv %0, %1\n"
+			"	slt t0, %2, %3\n"
+			"	bnez t0, 1f\n"
+			"	addi %0, %0, 1\n"
+			"1:\n"
+			: "=&r"(total)
+			: "r"(total), "r"(i), "r"(500)
+			: "t0"
+		);
+#elif defined (MACRO_SLTU_BRANCH)
+		__asm__ __volatile__(
+			"	mv %0, %1\n"
+			"	sltu t0, %2, %3\n"
+			"	beqz t0, 1f\n"
+			"	addi %0, %0, 1\n"
+			"1:\n"
+			: "=&r"(total)
+			: "r"(total), "r"(i), "r"(500)
+			: "t0"
+		);
+#elif defined (MACRO_MULH_MUL)
+		__asm__ __volatile__(
+			"	mulh t0, %2, %3\n"
+			"	mul t1, %2, %3\n"
+			"	add %0, %1, t0\n"
+			"	add %0, %0, t1\n"
+			: "=&r"(total)
+			: "r"(total), "r"(i - 500), "r"((size_t)-0x12345679)
+			: "t0", "t1"
+		);
+#elif defined (MACRO_MULHU_MUL)
+		__asm__ __volatile__(
+			"	mulhu t0, %2, %3\n"
+			"	mul t1, %2, %3\n"
+			"	add %0, %1, t0\n"
+			"	add %0, %0, t1\n"
+			: "=&r"(total)
+			: "r"(total), "r"(i), "r"((size_t)-0x12345679)
+			: "t0", "t1"
+		);
+#elif defined (MACRO_DIV_REM)
+		__asm__ __volatile__(
+			"	div t0, %2, %3\n"
+			"	rem t1, %2, %3\n"
+			"	add %0, %1, t0\n"
+			"	add %0, %0, t1\n"
+			: "=&r"(total)
+			: "r"(total), "r"(-100000 - i), "r"(i % 7 - 3)
+			: "t0", "t1"
+		);
+#elif defined (MACRO_DIVU_REMU)
+		__asm__ __volatile__(
+			"	divu t0, %2, %3\n"
+			"	remu t1, %2, %3\n"
+			"	add %0, %1, t0\n"
+			"	add %0, %0, t1\n"
+			: "=&r"(total)
+			: "r"(total), "r"(100000 + i), "r"(i % 7)
+			: "t0", "t1"
+		);
+#elif defined (MACRO_LEA)
+		__asm__ __volatile__(
+			"	slli t0, %2, 3\n"
+			"	add t0, t0, %1\n"
+			"	mv %0, t0\n"
+			: "=r"(total)
+			: "r"(total), "r"(i)
+			: "t0"
+		);
+#elif defined (MACRO_LOAD_PAIR)
+		pair[0] = i;
+		pair[1] = i * 3;
+		__asm__ __volatile__(
+			"	" LOAD " t0, 0(%2)\n"
+			"	" LOAD " t1, %3(%2)\n"
+			"	add %0, %1, t0\n"
+			"	add %0, %0, t1\n"
+			: "=&r"(total)
+			: "r"(total), "r"(pair), "i"(sizeof(size_t))
+			: "t0", "t1", "memory"
+		);
+#elif defined (MACRO_STORE_PAIR)
+		__asm__ __volatile__(
+			"	" STORE " %1, 0(%0)\n"
+			"	" STORE " %2, %3(%0)\n"
+			:
+			: "r"(pair), "r"(i), "r"(i * 3), "i"(sizeof(size_t))
+			: "memory"
+		);
+		total += pair[0] + pair[1];
+#elif defined (MACRO_ROTATE)
+		__asm__ __volatile__(
+			"	slli t0, %2, 1\n"
+			"	srli t1, %2, %3\n"
+			"	or t0, t0, t1\n"
+			"	add %0, %1, t0\n"
+			"	slli t0, %2, 2\n"
+			"	srli t1, %2, %4\n"
+			"	or t0, t0, t1\n"
+			"	add %0, %0, t0\n"
+			"	slli t0, %2, 3\n"
+			"	srli t1, %2, %5\n"
+			"	or t0, t1, t0\n"
+			"	add %0, %0, t0\n"
+			: "=&r"(total)
+			: "r"(total), "r"(i | ((size_t)-1 << (__riscv_xlen - 4))),
+			  "i"(__riscv_xlen - 1), "i"(__riscv_xlen - 2), "i"(__riscv_xlen - 3)
+			: "t0", "t1"
+		);
 #else
 		total = add(total, i);
 #endif
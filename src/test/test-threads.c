@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Worker threads are cloned with raw system calls, wait on a futex
+ * gate, then add to a shared counter with lr/sc and call a function
+ * in a code buffer. The main thread rewrites the buffer and issues
+ * fence.i while they run so translated code is dropped under them,
+ * then joins each worker on the child tid cleared when it exits.
+ */
+
+#define NTHREADS 4
+#define ITERS 100000
+#define PATCHES 64
+#define STACK_SIZE 65536
+
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_THREAD         0x00010000
+#define CLONE_SYSVSEM        0x00040000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+
+#define SYS_futex  98
+#define SYS_gettid 178
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+/* clone(flags, stack, ptid, tls, ctid) then fn(arg) and exit in the child */
+long thread_clone(long flags, void *stack, int *ptid, void *tls, int *ctid,
+	int (*fn)(void *), void *arg);
+
+__asm__(
+	"	.text\n"
+	"	.globl thread_clone\n"
+	"thread_clone:\n"
+	"	mv t0, a5\n"
+	"	mv t1, a6\n"
+	"	li a7, 220\n"
+	"	ecall\n"
+	"	bnez a0, 1f\n"
+	"	mv a0, t1\n"
+	"	jalr t0\n"
+	"	li a7, 93\n"
+	"	ecall\n"
+	"1:	ret\n"
+);
+
+static long sys3(long n, long a0, long a1, long a2)
+{
+	register long r_a0 __asm__("a0") = a0;
+	register long r_a1 __asm__("a1") = a1;
+	register long r_a2 __asm__("a2") = a2;
+	register long r_a3 __asm__("a3") = 0;
+	register long r_a7 __asm__("a7") = n;
+	__asm__ __volatile__("ecall"
+		: "+r"(r_a0)
+		: "r"(r_a1), "r"(r_a2), "r"(r_a3), "r"(r_a7)
+		: "memory");
+	return r_a0;
+}
+
+static volatile int gate;
+static volatile int counter;
+static volatile int ctids[NTHREADS];
+static int ptids[NTHREADS];
+static int tids[NTHREADS];
+
+/* addi a0, a0, imm; ret */
+static unsigned int code[2] __attribute__((aligned(64)));
+
+static unsigned int addi_a0(int imm)
+{
+	return ((unsigned int)(imm & 0xfff) << 20) | (10 << 15) | (10 << 7) | 0x13;
+}
+
+static void lrsc_add(volatile int *p, int v)
+{
+	int tmp, fail;
+	__asm__ __volatile__(
+		"1:	lr.w %0, (%2)\n"
+		"	add %0, %0, %3\n"
+		"	sc.w %1, %0, (%2)\n"
+		"	bnez %1, 1b\n"
+		: "=&r"(tmp), "=&r"(fail)
+		: "r"(p), "r"(v)
+		: "memory"
+	);
+}
+
+static int worker(void *arg)
+{
+	int (*fn)(int) = (int (*)(int))(void *)code;
+	long n = (long)arg;
+	volatile int sum = 0;
+	tids[n] = (int)sys3(SYS_gettid, 0, 0, 0);
+	while (gate == 0) {
+		sys3(SYS_futex, (long)&gate, FUTEX_WAIT, 0);
+	}
+	for (int i = 0; i < ITERS; i++) {
+		lrsc_add(&counter, 1);
+		sum += fn(i);
+	}
+	return 0;
+}
+
+int main()
+{
+	int (*fn)(int) = (int (*)(int))(void *)code;
+	long flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |
+		CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+	int fail = 0;
+
+	code[0] = addi_a0(0);
+	code[1] = 0x00008067;
+	__asm__ __volatile__("fence.i" ::: "memory");
+
+	for (long n = 0; n < NTHREADS; n++) {
+		char *stack = malloc(STACK_SIZE);
+		ctids[n] = -1;
+		long tid = thread_clone(flags, stack + STACK_SIZE, &ptids[n], 0,
+			(int *)&ctids[n], worker, (void *)n);
+		if (tid <= 0) {
+			printf("clone failed: %ld\n", tid);
+			return 1;
+		}
+	}
+
+	/* open the gate then patch the code buffer while the workers run */
+	gate = 1;
+	sys3(SYS_futex, (long)&gate, FUTEX_WAKE, NTHREADS);
+	for (int i = 1; i <= PATCHES; i++) {
+		code[0] = addi_a0(i);
+		__asm__ __volatile__("fence.i" ::: "memory");
+		if (fn(1000) != 1000 + i) {
+			printf("patch %d not seen\n", i);
+			fail = 1;
+		}
+	}
+
+	/* join the workers on their child tids */
+	for (int n = 0; n < NTHREADS; n++) {
+		int t;
+		while ((t = ctids[n]) != 0) {
+			sys3(SYS_futex, (long)&ctids[n], FUTEX_WAIT, t);
+		}
+		if (tids[n] != ptids[n] || tids[n] == (int)sys3(SYS_gettid, 0, 0, 0)) {
+			printf("thread %d tid %d parent saw %d\n", n, tids[n], ptids[n]);
+			fail = 1;
+		}
+	}
+
+	if (counter != NTHREADS * ITERS) {
+		printf("counter %d expected %d\n", counter, NTHREADS * ITERS);
+		fail = 1;
+	}
+	printf("%s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
@@ -72,6 +72,18 @@ PROGRAMS = \
 	$(BIN_DIR)/test-fusion-macro \
 	$(BIN_DIR)/test-fusion-indirect \
 	$(BIN_DIR)/test-fusion-vanilla \
+	$(BIN_DIR)/test-fusion-li \
+	$(BIN_DIR)/test-fusion-li-slli \
+	$(BIN_DIR)/test-fusion-slt-branch \
+	$(BIN_DIR)/test-fusion-sltu-branch \
+	$(BIN_DIR)/test-fusion-mulh-mul \
+	$(BIN_DIR)/test-fusion-mulhu-mul \
+	$(BIN_DIR)/test-fusion-div-rem \
+	$(BIN_DIR)/test-fusion-divu-remu \
+	$(BIN_DIR)/test-fusion-lea \
+	$(BIN_DIR)/test-fusion-load-pair \
+	$(BIN_DIR)/test-fusion-store-pair \
+	$(BIN_DIR)/test-fusion-rotate \
 	$(BIN_DIR)/test-open \
 	$(BIN_DIR)/test-malloc \
 	$(BIN_DIR)/test-nbody \
@@ -85,7 +97,8 @@ PROGRAMS = \
 	$(BIN_DIR)/test-large-imm \
 	$(BIN_DIR)/test-reloc-imm \
 	$(BIN_DIR)/test-sbi-info \
-	$(BIN_DIR)/test-sbi-timer
+	$(BIN_DIR)/test-sbi-timer \
+	$(BIN_DIR)/test-threads
 
 HOST_PROGRAMS = \
 	$(HOST_BIN_DIR)/test-aes \
@@ -133,6 +146,21 @@ test-sys: all
 	$(EMULATOR) $(BIN_DIR)/test-m-mmio-timer
 	$(EMULATOR) $(BIN_DIR)/test-m-sv39
 
+# round trip rv-bin aot sidecars through rv-jit, the output must match a run without one
+test-aot: all
+	for t in hello-world-libc test-primes test-qsort test-jump-tables-yes; do \
+		$(AOT) -o $(BIN_DIR)/$$t.aot $(BIN_DIR)/$$t && \
+		$(JIT) $(BIN_DIR)/$$t 11 > $(BIN_DIR)/$$t.jit.out && \
+		$(JIT) -Z $(BIN_DIR)/$$t.aot $(BIN_DIR)/$$t 11 > $(BIN_DIR)/$$t.aot.out && \
+		cmp $(BIN_DIR)/$$t.jit.out $(BIN_DIR)/$$t.aot.out || exit 1; \
+	done
+
+# guest threads under rv-jit, with background compilation and with the W^X arena
+test-threads: all
+	$(JIT) $(BIN_DIR)/test-threads
+	$(JIT) -c $(BIN_DIR)/test-threads
+	$(JIT) -W $(BIN_DIR)/test-threads
+
 # host benchmarks
 
 $(HOST_OBJ_DIR)/test-aes.o: $(SRC_DIR)/test-aes.c ; cc -O3 -c $^ -o $@
@@ -226,6 +254,42 @@ $(BIN_DIR)/test-fusion-elision: $(OBJ_DIR)/test-fusion-elision.o ; $(CC) $(CFLAG
 $(OBJ_DIR)/test-fusion-indirect.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_INDIRECT $(CFLAGS) -c $^ -o $@
 $(BIN_DIR)/test-fusion-indirect: $(OBJ_DIR)/test-fusion-indirect.o ; $(CC) $(CFLAGS) $^ -o $@
 
+$(OBJ_DIR)/test-fusion-li.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_LI $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-li: $(OBJ_DIR)/test-fusion-li.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-li-slli.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_LI_SLLI $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-li-slli: $(OBJ_DIR)/test-fusion-li-slli.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-slt-branch.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_SLT_BRANCH $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-slt-branch: $(OBJ_DIR)/test-fusion-slt-branch.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-sltu-branch.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_SLTU_BRANCH $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-sltu-branch: $(OBJ_DIR)/test-fusion-sltu-branch.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-mulh-mul.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_MULH_MUL $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-mulh-mul: $(OBJ_DIR)/test-fusion-mulh-mul.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-mulhu-mul.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_MULHU_MUL $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-mulhu-mul: $(OBJ_DIR)/test-fusion-mulhu-mul.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-div-rem.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_DIV_REM $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-div-rem: $(OBJ_DIR)/test-fusion-div-rem.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-divu-remu.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_DIVU_REMU $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-divu-remu: $(OBJ_DIR)/test-fusion-divu-remu.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-lea.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_LEA $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-lea: $(OBJ_DIR)/test-fusion-lea.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-load-pair.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_LOAD_PAIR $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-load-pair: $(OBJ_DIR)/test-fusion-load-pair.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-store-pair.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_STORE_PAIR $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-store-pair: $(OBJ_DIR)/test-fusion-store-pair.o ; $(CC) $(CFLAGS) $^ -o $@
+
+$(OBJ_DIR)/test-fusion-rotate.o: $(SRC_DIR)/test-fusion.c ; $(CC) -DMACRO_ROTATE $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-fusion-rotate: $(OBJ_DIR)/test-fusion-rotate.o ; $(CC) $(CFLAGS) $^ -o $@
+
 $(OBJ_DIR)/test-open.o: $(SRC_DIR)/test-open.c ; $(CC) $(CFLAGS) -c $^ -o $@
 $(BIN_DIR)/test-open: $(OBJ_DIR)/test-open.o ; $(CC) $(CFLAGS) $^ -o $@
 
@@ -250,6 +314,8 @@ $(BIN_DIR)/test-infinite-loop: $(OBJ_DIR)/test-infinite-loop.o ; $(LD) $^ -o $@
 
 $(OBJ_DIR)/test-int-fib.o: $(SRC_DIR)/test-int-fib.c ; $(CC) $(CFLAGS) -c $^ -o $@
 $(BIN_DIR)/test-int-fib: $(OBJ_DIR)/test-int-fib.o ; $(CC) $(CFLAGS) $^ -o $@
+$(OBJ_DIR)/test-threads.o: $(SRC_DIR)/test-threads.c ; $(CC) $(CFLAGS) -c $^ -o $@
+$(BIN_DIR)/test-threads: $(OBJ_DIR)/test-threads.o ; $(CC) $(CFLAGS) $^ -o $@
 
 $(OBJ_DIR)/test-int-mul.o: $(SRC_DIR)/test-int-mul.c ; $(CC) $(CFLAGS) -c $^ -o $@
 $(BIN_DIR)/test-int-mul: $(OBJ_DIR)/test-int-mul.o ; $(CC) $(CFLAGS) $^ -o $@